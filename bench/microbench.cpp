@@ -0,0 +1,329 @@
+#include "../includes/webserv.hpp"
+
+#define WARMUP_US 50000UL
+#define MIN_REPETITION_US 20000UL
+#define REPETITIONS 5
+#define MAX_LOCATIONS 1000
+#define COOKIE_HEADERS 12
+#define COOKIE_SIZE 4096
+
+bool run = true;
+bool reopenLogs = false;
+bool upgradeBinary = false;
+bool drainConnections = false;
+const std::map<StatusCode, std::string> STATUS_MESSAGES;
+const std::map<std::string, std::string> MIME_TYPES;
+const std::set<std::string> CGI_NO_TRANSMISSION;
+Metrics metrics;
+
+static volatile size_t sink = 0;
+
+static const char* const SIMD_LEVEL_NAMES[] = {"scalar", "sse2", "avx2"};
+
+static const char* REQUEST =
+	"GET /images/clippy.jpg?size=large&theme=dark HTTP/1.1\r\n"
+	"Host: static.bench:8480\r\n"
+	"User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:109.0) Gecko/20100101 Firefox/115.0\r\n"
+	"Accept: text/html,application/xhtml+xml,application/xml;q=0.9,image/avif,image/webp,*/*;"
+	"q=0.8\r\n"
+	"Accept-Language: en-US,en;q=0.5\r\n"
+	"Accept-Encoding: gzip, deflate, br\r\n"
+	"Referer: http://static.bench:8480/index.html\r\n"
+	"Connection: keep-alive\r\n"
+	"Cookie: session=6f1c1b0e2a7d4c3f9e8b5a4d3c2b1a0f; theme=dark; cart=3\r\n"
+	"Upgrade-Insecure-Requests: 1\r\n"
+	"Sec-Fetch-Dest: document\r\n"
+	"Sec-Fetch-Mode: navigate\r\n"
+	"Sec-Fetch-Site: same-origin\r\n"
+	"Sec-Fetch-User: ?1\r\n"
+	"\r\n";
+
+// the small request followed by cookie headers, about 48 KiB of head in total
+static std::string buildCookieRequest() {
+	std::string request(REQUEST, std::strlen(REQUEST) - 2);
+	for (int i = 0; i < COOKIE_HEADERS; ++i) {
+		std::string cookie = "Cookie: ";
+		while (cookie.size() < COOKIE_SIZE) {
+			cookie += "tracking_" + toString(cookie.size()) + "=6f1c1b0e2a7d4c3f9e8b5a4d; ";
+		}
+		request += cookie + "last=1\r\n";
+	}
+	return request + "\r\n";
+}
+
+static const char* CGI_OUTPUT = "Content-Type: text/html; charset=utf-8\r\n"
+								"Status: 200 OK\r\n"
+								"Cache-Control: no-cache\r\n"
+								"Set-Cookie: session=6f1c1b0e2a7d4c3f; Path=/; HttpOnly\r\n"
+								"X-Powered-By: Python/3.11\r\n"
+								"\r\n"
+								"<!DOCTYPE html>\n<html><body><h1>Hello</h1></body></html>\n";
+
+class Benchmark {
+public:
+	Benchmark(const std::string& name) : _name(name) {}
+	virtual ~Benchmark() {}
+	virtual void run() = 0;
+	const std::string& getName() const { return _name; }
+
+private:
+	std::string _name;
+};
+
+class ResponseBench {
+public:
+	static void translateCgiResponse(Response& response, RequestParsingResult& request,
+									 const std::string& output) {
+		response._headers.clear();
+		response._setCookies.clear();
+		response.translateCgiResponse(request, output);
+		sink += response._body.size();
+	}
+};
+
+class ParseBench : public Benchmark {
+public:
+	ParseBench(const std::string& name, std::vector<VirtualServer*>& servers, size_t slice,
+			   const std::string& request = REQUEST)
+		: Benchmark(name), _servers(servers), _ip(htonl(INADDR_LOOPBACK)), _port(htons(8480)),
+		  _slice(slice), _request(request) {}
+
+	virtual void run() {
+		{
+			Request request(_servers, _ip, _port, &_arena);
+			for (size_t i = 0; i < _request.size(); i += _slice) {
+				RequestParsingResult result =
+					request.parse(_request.c_str() + i, std::min(_slice, _request.size() - i));
+				sink += result.result;
+			}
+		}
+		_arena.reset();
+	}
+
+private:
+	std::vector<VirtualServer*>& _servers;
+	in_addr_t _ip;
+	in_port_t _port;
+	size_t _slice;
+	std::string _request;
+	Arena _arena;
+};
+
+class LocationBench : public Benchmark {
+public:
+	LocationBench(const std::string& name, size_t locations) : Benchmark(name) {
+		std::ostringstream config;
+		config << "\tlisten 127.0.0.1:8480\n\troot /www/fullstatic\n";
+		for (size_t i = 0; i < locations; ++i) {
+			config << "\tlocation /section" << i << "/ {\n\t\troot /www/fullstatic\n\t}\n";
+		}
+		config << "}\n";
+		std::istringstream iss(config.str());
+		_server.init(iss);
+		_uri = "/section" + toString(locations / 2) + "/images/clippy.jpg";
+	}
+
+	virtual void run() { sink += _server.findMatchingLocation(_uri) != NULL; }
+
+private:
+	VirtualServer _server;
+	std::string _uri;
+};
+
+class FinalUriBench : public Benchmark {
+public:
+	FinalUriBench(VirtualServer& server)
+		: Benchmark("findFinalUri"), _server(server), _uri("/images/clippy.jpg") {
+		_location = _server.findMatchingLocation(_uri);
+	}
+
+	virtual void run() {
+		sink += findFinalUri(_uri, _location ? _location->getRootDir() : _server.getRootDir(),
+							 _location)
+					.size();
+	}
+
+private:
+	VirtualServer& _server;
+	std::string _uri;
+	Location* _location;
+};
+
+class DecodeUriBench : public Benchmark {
+public:
+	DecodeUriBench()
+		: Benchmark("decodeUri"), _uri("/there%20are%20whitespaces.html?name=J%C3%A9r%C3%B4me+D") {
+	}
+
+	virtual void run() { sink += decodeUri(_uri).size(); }
+
+private:
+	std::string _uri;
+};
+
+class ValidateUriBench : public Benchmark {
+public:
+	ValidateUriBench()
+		: Benchmark("validateUri"), _uri("/static/assets/javascript/vendor/jquery-3.7.0.min.js") {}
+
+	virtual void run() { sink += validateUri(_uri); }
+
+private:
+	std::string _uri;
+};
+
+class MetavariablifyBench : public Benchmark {
+public:
+	MetavariablifyBench() : Benchmark("metavariablify"), _header("upgrade-insecure-requests") {}
+
+	virtual void run() { sink += metavariablify(_header).size(); }
+
+private:
+	std::string _header;
+};
+
+// walks the request line by line as the parser does, lowercasing every header name
+class ScanBench : public Benchmark {
+public:
+	ScanBench(const std::string& name = "scanPrintable+lowercaseAscii",
+			  const std::string& request = REQUEST)
+		: Benchmark(name), _request(request) {}
+
+	virtual void run() {
+		const char* s = _request.data();
+		for (size_t i = 0; i < _request.size();) {
+			const size_t run = scanPrintable(s + i, _request.size() - i);
+			const char* colon = static_cast<const char*>(std::memchr(s + i, ':', run));
+			if (colon != NULL) {
+				lowercaseAscii(_name, s + i, colon - s - i);
+			}
+			i += run + 2;
+		}
+		sink += _name[0];
+	}
+
+private:
+	std::string _request;
+	char _name[MAX_HEADER_SIZE];
+};
+
+// runs another benchmark with the kernels of a given level
+class SimdBench : public Benchmark {
+public:
+	SimdBench(Benchmark* benchmark, SimdLevelEnum level)
+		: Benchmark(benchmark->getName() + "/" + SIMD_LEVEL_NAMES[level]), _benchmark(benchmark),
+		  _level(level) {}
+	virtual ~SimdBench() { delete _benchmark; }
+
+	virtual void run() {
+		const SimdLevelEnum detected = getSimdLevel();
+		getSimdLevel() = _level;
+		_benchmark->run();
+		getSimdLevel() = detected;
+	}
+
+private:
+	Benchmark* _benchmark;
+	SimdLevelEnum _level;
+};
+
+class TranslateCgiBench : public Benchmark {
+public:
+	TranslateCgiBench(VirtualServer& server)
+		: Benchmark("translateCgiResponse"),
+		  _response(GET, server.getRootDir(), false, server.getErrorPages(),
+					server.getIndexPages()),
+		  _output(CGI_OUTPUT) {
+		_request.result = REQUEST_PARSING_SUCCESS;
+		_request.virtualServer = &server;
+		_request.location = NULL;
+	}
+
+	virtual void run() { ResponseBench::translateCgiResponse(_response, _request, _output); }
+
+private:
+	Response _response;
+	RequestParsingResult _request;
+	std::string _output;
+};
+
+static unsigned long runIterations(Benchmark& benchmark, unsigned long iterations) {
+	const unsigned long start = getMicroseconds();
+	for (unsigned long i = 0; i < iterations; ++i) {
+		benchmark.run();
+	}
+	return getMicroseconds() - start;
+}
+
+static void measure(Benchmark& benchmark) {
+	unsigned long iterations = 1;
+	for (unsigned long start = getMicroseconds(); getMicroseconds() - start < WARMUP_US;) {
+		benchmark.run();
+	}
+	while (runIterations(benchmark, iterations) < MIN_REPETITION_US) {
+		iterations *= 2;
+	}
+	std::vector<double> nsPerOp;
+	double allocsPerOp = 0;
+	for (int i = 0; i < REPETITIONS; ++i) {
+		const unsigned long allocationsBefore = getAllocationCount();
+		const unsigned long elapsed = runIterations(benchmark, iterations);
+		allocsPerOp = static_cast<double>(getAllocationCount() - allocationsBefore) / iterations;
+		nsPerOp.push_back(elapsed * 1000.0 / iterations);
+	}
+	std::sort(nsPerOp.begin(), nsPerOp.end());
+	std::cout << std::left << std::setw(44) << benchmark.getName() << std::right << std::fixed
+			  << std::setprecision(1) << std::setw(14) << nsPerOp[REPETITIONS / 2]
+			  << std::setw(14) << nsPerOp[0] << std::setw(14) << allocsPerOp << '\n';
+}
+
+int main(int argc, char* argv[]) {
+	const std::string filter = argc > 1 ? argv[1] : "";
+	initGlobals();
+	Server server;
+	if (!server.parseConfig("conf/valid/bench.conf")) {
+		return EXIT_FAILURE;
+	}
+	std::vector<VirtualServer*> servers;
+	servers.push_back(&server.getVirtualServers()[0]);
+	VirtualServer& vs = *servers[0];
+
+	std::vector<Benchmark*> benchmarks;
+	benchmarks.push_back(new ParseBench("Request::parse/1B", servers, 1));
+	benchmarks.push_back(new ParseBench("Request::parse/1KiB", servers, 1024));
+	benchmarks.push_back(new ParseBench("Request::parse/16KiB", servers, 16384));
+	const std::string cookies = buildCookieRequest();
+	benchmarks.push_back(new ParseBench("Request::parse/cookies/1KiB", servers, 1024, cookies));
+	benchmarks.push_back(new ParseBench("Request::parse/cookies/16KiB", servers, 16384, cookies));
+	benchmarks.push_back(new LocationBench("findMatchingLocation/10", 10));
+	benchmarks.push_back(new LocationBench("findMatchingLocation/100", 100));
+	benchmarks.push_back(new LocationBench("findMatchingLocation/1000", MAX_LOCATIONS));
+	benchmarks.push_back(new FinalUriBench(vs));
+	benchmarks.push_back(new DecodeUriBench());
+	benchmarks.push_back(new ValidateUriBench());
+	benchmarks.push_back(new MetavariablifyBench());
+	benchmarks.push_back(new TranslateCgiBench(vs));
+	for (int level = SIMD_SCALAR; level <= getSupportedSimdLevel(); ++level) {
+		const SimdLevelEnum simd = static_cast<SimdLevelEnum>(level);
+		benchmarks.push_back(new SimdBench(new ScanBench(), simd));
+		benchmarks.push_back(
+			new SimdBench(new ScanBench("scanPrintable+lowercaseAscii/cookies", cookies), simd));
+		benchmarks.push_back(
+			new SimdBench(new ParseBench("Request::parse/16KiB", servers, 16384), simd));
+		benchmarks.push_back(new SimdBench(
+			new ParseBench("Request::parse/cookies/16KiB", servers, 16384, cookies), simd));
+		benchmarks.push_back(new SimdBench(new DecodeUriBench(), simd));
+		benchmarks.push_back(new SimdBench(new ValidateUriBench(), simd));
+	}
+
+	std::cout << std::left << std::setw(44) << "benchmark" << std::right << std::setw(14)
+			  << "median ns/op" << std::setw(14) << "min ns/op" << std::setw(14) << "allocs/op"
+			  << '\n';
+	for (size_t i = 0; i < benchmarks.size(); ++i) {
+		if (benchmarks[i]->getName().find(filter) != std::string::npos) {
+			measure(*benchmarks[i]);
+		}
+		delete benchmarks[i];
+	}
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,423 @@
+#include <algorithm>
+#include <arpa/inet.h>
+#include <cerrno>
+#include <csignal>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <fcntl.h>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <netinet/in.h>
+#include <sstream>
+#include <string>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include <vector>
+
+#define DEFAULT_CONFIG "conf/valid/bench.conf"
+#define DEFAULT_DURATION 5.0
+#define DEFAULT_CONCURRENCY 32
+#define DEFAULT_IDLE_CONNECTIONS 1000
+#define DEFAULT_TOLERANCE 0.3
+#define STARTUP_TIMEOUT 5.0
+#define MAX_EVENTS 256
+#define RECV_SIZE 65536
+
+typedef struct Scenario {
+	const char* name;
+	int port;
+	const char* uri;
+	int expectedStatus;
+	bool idleConnections;
+} Scenario;
+
+typedef struct Result {
+	std::string name;
+	unsigned long requests;
+	unsigned long errors;
+	double duration;
+	double rps;
+	double p50;
+	double p99;
+	double p999;
+} Result;
+
+typedef struct Options {
+	std::string config;
+	std::string output;
+	std::string baseline;
+	std::string only;
+	double duration;
+	int concurrency;
+	int idleConnections;
+	double tolerance;
+} Options;
+
+typedef struct Connection {
+	int fd;
+	size_t sent;
+	unsigned long start;
+	std::string head;
+} Connection;
+
+static const Scenario SCENARIOS[] = {
+	{"small_file", 8480, "/about.html", 200, false},
+	{"large_file", 8480, "/full/tczarnia.png", 200, false},
+	{"not_found", 8480, "/does_not_exist.html", 404, false},
+	{"autoindex", 8480, "/autoindex_on/", 200, false},
+	{"cgi", 8481, "/cgi-bin/environment.py", 200, false},
+	{"idle_connections", 8480, "/about.html", 200, true},
+};
+
+static unsigned long now() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+static int openConnection(int port) {
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd == -1) {
+		return -1;
+	}
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1 && errno != EINPROGRESS) {
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+static bool waitForPort(int port) {
+	const unsigned long deadline = now() + STARTUP_TIMEOUT * 1000000;
+	while (now() < deadline) {
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		struct sockaddr_in addr;
+		std::memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(port);
+		addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+		bool ok = connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0;
+		close(fd);
+		if (ok) {
+			return true;
+		}
+		usleep(20000);
+	}
+	return false;
+}
+
+static pid_t startServer(const std::string& config) {
+	pid_t pid = fork();
+	if (pid == 0) {
+		int devnull = open("/dev/null", O_WRONLY);
+		dup2(devnull, STDOUT_FILENO);
+		dup2(devnull, STDERR_FILENO);
+		execl("./webserv", "./webserv", config.c_str(), (char*)NULL);
+		std::exit(EXIT_FAILURE);
+	}
+	return pid;
+}
+
+static void stopServer(pid_t pid) {
+	kill(pid, SIGINT);
+	waitpid(pid, NULL, 0);
+}
+
+static double percentile(const std::vector<unsigned long>& sorted, double q) {
+	if (sorted.empty()) {
+		return 0;
+	}
+	size_t idx = std::min(sorted.size() - 1, static_cast<size_t>(sorted.size() * q));
+	return sorted[idx] / 1000.0;
+}
+
+class LoadGenerator {
+public:
+	LoadGenerator(const Scenario& scenario, const Options& options)
+		: _scenario(scenario), _options(options), _errors(0) {
+		std::ostringstream request;
+		request << "GET " << scenario.uri << " HTTP/1.1\r\nHost: localhost:" << scenario.port
+				<< "\r\nUser-Agent: webbench\r\nAccept: */*\r\n\r\n";
+		_request = request.str();
+		_epollFd = epoll_create1(EPOLL_CLOEXEC);
+	}
+
+	~LoadGenerator() {
+		for (size_t i = 0; i < _connections.size(); ++i) {
+			if (_connections[i].fd != -1) {
+				close(_connections[i].fd);
+			}
+		}
+		for (size_t i = 0; i < _idle.size(); ++i) {
+			close(_idle[i]);
+		}
+		close(_epollFd);
+	}
+
+	Result run() {
+		if (_scenario.idleConnections) {
+			openIdleConnections();
+		}
+		_connections.resize(_options.concurrency);
+		const unsigned long start = now();
+		const unsigned long deadline = start + _options.duration * 1000000;
+		for (size_t i = 0; i < _connections.size(); ++i) {
+			_connections[i].fd = -1;
+			startRequest(i);
+		}
+		struct epoll_event events[MAX_EVENTS];
+		while (now() < deadline) {
+			int n = epoll_wait(_epollFd, events, MAX_EVENTS, 100);
+			for (int i = 0; i < n; ++i) {
+				handleEvent(events[i].data.u32, events[i].events, deadline);
+			}
+		}
+		return summarize((now() - start) / 1e6);
+	}
+
+private:
+	const Scenario& _scenario;
+	const Options& _options;
+	std::string _request;
+	int _epollFd;
+	std::vector<Connection> _connections;
+	std::vector<int> _idle;
+	std::vector<unsigned long> _latencies;
+	unsigned long _errors;
+
+	void openIdleConnections() {
+		for (int i = 0; i < _options.idleConnections; ++i) {
+			int fd = openConnection(_scenario.port);
+			if (fd != -1) {
+				_idle.push_back(fd);
+			}
+		}
+	}
+
+	void startRequest(size_t idx) {
+		Connection& c = _connections[idx];
+		c.fd = openConnection(_scenario.port);
+		c.sent = 0;
+		c.start = now();
+		c.head.clear();
+		if (c.fd == -1) {
+			++_errors;
+			return;
+		}
+		struct epoll_event event;
+		event.events = EPOLLOUT;
+		event.data.u32 = idx;
+		epoll_ctl(_epollFd, EPOLL_CTL_ADD, c.fd, &event);
+	}
+
+	void finishRequest(size_t idx, bool ok, unsigned long deadline) {
+		Connection& c = _connections[idx];
+		close(c.fd);
+		c.fd = -1;
+		if (ok) {
+			_latencies.push_back(now() - c.start);
+		} else {
+			++_errors;
+		}
+		if (now() < deadline) {
+			startRequest(idx);
+		}
+	}
+
+	void handleEvent(size_t idx, unsigned int events, unsigned long deadline) {
+		Connection& c = _connections[idx];
+		if (events & EPOLLOUT) {
+			ssize_t ret = send(c.fd, _request.c_str() + c.sent, _request.size() - c.sent,
+							   MSG_NOSIGNAL);
+			if (ret < 0) {
+				return finishRequest(idx, false, deadline);
+			}
+			c.sent += ret;
+			if (c.sent == _request.size()) {
+				struct epoll_event event;
+				event.events = EPOLLIN;
+				event.data.u32 = idx;
+				epoll_ctl(_epollFd, EPOLL_CTL_MOD, c.fd, &event);
+			}
+			return;
+		}
+		char buffer[RECV_SIZE];
+		while (true) {
+			ssize_t ret = recv(c.fd, buffer, sizeof(buffer), 0);
+			if (ret > 0) {
+				if (c.head.size() < 12) {
+					c.head.append(buffer, std::min<size_t>(ret, 12 - c.head.size()));
+				}
+				continue;
+			}
+			if (ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return;
+			}
+			if (ret < 0 || c.head.size() < 12) {
+				return finishRequest(idx, false, deadline);
+			}
+			return finishRequest(idx, std::atoi(c.head.c_str() + 9) == _scenario.expectedStatus,
+								 deadline);
+		}
+	}
+
+	Result summarize(double duration) {
+		std::sort(_latencies.begin(), _latencies.end());
+		Result result;
+		result.name = _scenario.name;
+		result.requests = _latencies.size();
+		result.errors = _errors;
+		result.duration = duration;
+		result.rps = duration > 0 ? _latencies.size() / duration : 0;
+		result.p50 = percentile(_latencies, 0.5);
+		result.p99 = percentile(_latencies, 0.99);
+		result.p999 = percentile(_latencies, 0.999);
+		return result;
+	}
+};
+
+static std::string toJson(const std::vector<Result>& results, const Options& options) {
+	std::ostringstream oss;
+	oss << std::fixed << std::setprecision(3);
+	oss << "{\n\t\"config\": \"" << options.config << "\",\n\t\"concurrency\": "
+		<< options.concurrency << ",\n\t\"duration\": " << options.duration
+		<< ",\n\t\"scenarios\": [\n";
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& r = results[i];
+		oss << "\t\t{\"name\": \"" << r.name << "\", \"requests\": " << r.requests
+			<< ", \"errors\": " << r.errors << ", \"rps\": " << r.rps << ", \"p50_ms\": " << r.p50
+			<< ", \"p99_ms\": " << r.p99 << ", \"p999_ms\": " << r.p999 << "}"
+			<< (i + 1 == results.size() ? "\n" : ",\n");
+	}
+	oss << "\t]\n}\n";
+	return oss.str();
+}
+
+static bool findBaselineValue(const std::string& json, const std::string& name,
+							  const std::string& key, double& value) {
+	size_t pos = json.find("\"name\": \"" + name + "\"");
+	if (pos == std::string::npos) {
+		return false;
+	}
+	size_t end = json.find('}', pos);
+	pos = json.find("\"" + key + "\": ", pos);
+	if (pos == std::string::npos || pos > end) {
+		return false;
+	}
+	value = std::strtod(json.c_str() + pos + key.size() + 4, NULL);
+	return true;
+}
+
+static bool compareWithBaseline(const std::vector<Result>& results, const Options& options) {
+	std::ifstream ifs(options.baseline.c_str());
+	if (!ifs.good()) {
+		std::cerr << "Cannot open baseline " << options.baseline << '\n';
+		return true;
+	}
+	std::stringstream buffer;
+	buffer << ifs.rdbuf();
+	const std::string json = buffer.str();
+	bool ok = true;
+	std::cerr << std::fixed << std::setprecision(1);
+	for (size_t i = 0; i < results.size(); ++i) {
+		const Result& r = results[i];
+		double rps, p99;
+		if (!findBaselineValue(json, r.name, "rps", rps) ||
+			!findBaselineValue(json, r.name, "p99_ms", p99)) {
+			continue;
+		}
+		const bool slower = rps > 0 && r.rps < rps * (1 - options.tolerance);
+		const bool laggier = p99 > 0 && r.p99 > p99 * (1 + options.tolerance);
+		std::cerr << r.name << ": rps " << (rps > 0 ? (r.rps / rps - 1) * 100 : 0)
+				  << "%, p99 " << (p99 > 0 ? (r.p99 / p99 - 1) * 100 : 0) << "%"
+				  << (slower || laggier ? " REGRESSION" : "") << '\n';
+		ok = ok && !slower && !laggier;
+	}
+	return ok;
+}
+
+static bool parseOptions(int argc, char* argv[], Options& options) {
+	options.config = DEFAULT_CONFIG;
+	options.duration = DEFAULT_DURATION;
+	options.concurrency = DEFAULT_CONCURRENCY;
+	options.idleConnections = DEFAULT_IDLE_CONNECTIONS;
+	options.tolerance = DEFAULT_TOLERANCE;
+	for (int i = 1; i < argc; ++i) {
+		const std::string arg = argv[i];
+		if (i + 1 == argc) {
+			return false;
+		}
+		const char* value = argv[++i];
+		if (arg == "--config") {
+			options.config = value;
+		} else if (arg == "--output") {
+			options.output = value;
+		} else if (arg == "--baseline") {
+			options.baseline = value;
+		} else if (arg == "--scenario") {
+			options.only = value;
+		} else if (arg == "--duration") {
+			options.duration = std::strtod(value, NULL);
+		} else if (arg == "--concurrency") {
+			options.concurrency = std::atoi(value);
+		} else if (arg == "--idle") {
+			options.idleConnections = std::atoi(value);
+		} else if (arg == "--tolerance") {
+			options.tolerance = std::strtod(value, NULL);
+		} else {
+			return false;
+		}
+	}
+	return options.duration > 0 && options.concurrency > 0 && options.idleConnections >= 0;
+}
+
+int main(int argc, char* argv[]) {
+	Options options;
+	if (!parseOptions(argc, argv, options)) {
+		std::cerr << "Usage: " << argv[0]
+				  << " [--config file.conf] [--duration seconds] [--concurrency n] [--idle n]"
+					 " [--scenario name] [--output file.json] [--baseline file.json]"
+					 " [--tolerance ratio]\n";
+		return EXIT_FAILURE;
+	}
+	std::signal(SIGPIPE, SIG_IGN);
+	pid_t server = startServer(options.config);
+	const size_t count = sizeof(SCENARIOS) / sizeof(SCENARIOS[0]);
+	for (size_t i = 0; i < count; ++i) {
+		if (!waitForPort(SCENARIOS[i].port)) {
+			std::cerr << "webserv did not start listening on port " << SCENARIOS[i].port << '\n';
+			stopServer(server);
+			return EXIT_FAILURE;
+		}
+	}
+	std::vector<Result> results;
+	for (size_t i = 0; i < count; ++i) {
+		if (!options.only.empty() && options.only != SCENARIOS[i].name) {
+			continue;
+		}
+		std::cerr << "Running " << SCENARIOS[i].name << "...\n";
+		LoadGenerator generator(SCENARIOS[i], options);
+		results.push_back(generator.run());
+	}
+	stopServer(server);
+	const std::string json = toJson(results, options);
+	std::cout << json;
+	if (!options.output.empty()) {
+		std::ofstream ofs(options.output.c_str());
+		ofs << json;
+	}
+	if (!options.baseline.empty() && !compareWithBaseline(results, options)) {
+		return EXIT_FAILURE;
+	}
+	return EXIT_SUCCESS;
+}
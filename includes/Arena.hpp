@@ -0,0 +1,131 @@
+#pragma once
+
+#include "webserv.hpp"
+
+class Arena {
+public:
+	Arena() : _chunkCount(0), _used(ARENA_CHUNK_SIZE) {}
+
+	Arena(const Arena&) : _chunkCount(0), _used(ARENA_CHUNK_SIZE) {}
+
+	~Arena() { reset(); }
+
+	Arena& operator=(const Arena& other) {
+		if (this != &other) {
+			reset();
+		}
+		return *this;
+	}
+
+	void* allocate(size_t size) {
+		size = (size + ARENA_ALIGNMENT - 1) & ~static_cast<size_t>(ARENA_ALIGNMENT - 1);
+		if (size > ARENA_CHUNK_SIZE / 4 ||
+			(_used + size > ARENA_CHUNK_SIZE && _chunkCount == ARENA_MAX_CHUNKS)) {
+			_largeBlocks.push_back(static_cast<char*>(::operator new(size)));
+			return _largeBlocks.back();
+		}
+		if (_used + size > ARENA_CHUNK_SIZE) {
+			_chunks[_chunkCount++] = acquireChunk();
+			_used = 0;
+		}
+		void* p = _chunks[_chunkCount - 1] + _used;
+		_used += size;
+		return p;
+	}
+
+	void reset() {
+		for (size_t i = 0; i < _chunkCount; ++i) {
+			releaseChunk(_chunks[i]);
+		}
+		for (size_t i = 0; i < _largeBlocks.size(); ++i) {
+			::operator delete(_largeBlocks[i]);
+		}
+		_largeBlocks.clear();
+		_chunkCount = 0;
+		_used = ARENA_CHUNK_SIZE;
+	}
+
+private:
+	char* _chunks[ARENA_MAX_CHUNKS];
+	size_t _chunkCount;
+	size_t _used;
+	std::vector<char*> _largeBlocks;
+
+	static std::vector<char*>& getChunkPool() {
+		static std::vector<char*> pool;
+		return pool;
+	}
+
+	static char* acquireChunk() {
+		std::vector<char*>& pool = getChunkPool();
+		if (pool.empty()) {
+			return new char[ARENA_CHUNK_SIZE];
+		}
+		char* chunk = pool.back();
+		pool.pop_back();
+		return chunk;
+	}
+
+	static void releaseChunk(char* chunk) {
+		std::vector<char*>& pool = getChunkPool();
+		if (pool.size() < ARENA_POOL_SIZE) {
+			pool.push_back(chunk);
+		} else {
+			delete[] chunk;
+		}
+	}
+};
+
+template <typename T>
+class ArenaAllocator {
+public:
+	typedef T value_type;
+	typedef T* pointer;
+	typedef const T* const_pointer;
+	typedef T& reference;
+	typedef const T& const_reference;
+	typedef size_t size_type;
+	typedef ptrdiff_t difference_type;
+
+	template <typename U>
+	struct rebind {
+		typedef ArenaAllocator<U> other;
+	};
+
+	explicit ArenaAllocator(Arena* arena = NULL) : _arena(arena) {}
+
+	template <typename U>
+	ArenaAllocator(const ArenaAllocator<U>& other) : _arena(other.getArena()) {}
+
+	pointer address(reference x) const { return &x; }
+	const_pointer address(const_reference x) const { return &x; }
+
+	pointer allocate(size_type n, const void* = NULL) {
+		return static_cast<pointer>(_arena ? _arena->allocate(n * sizeof(T))
+										   : ::operator new(n * sizeof(T)));
+	}
+
+	void deallocate(pointer p, size_type) {
+		if (!_arena) {
+			::operator delete(p);
+		}
+	}
+
+	size_type max_size() const { return static_cast<size_type>(-1) / sizeof(T); }
+	void construct(pointer p, const T& value) { new (p) T(value); }
+	void destroy(pointer p) { p->~T(); }
+	Arena* getArena() const { return _arena; }
+
+private:
+	Arena* _arena;
+};
+
+template <typename T, typename U>
+bool operator==(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+	return a.getArena() == b.getArena();
+}
+
+template <typename T, typename U>
+bool operator!=(const ArenaAllocator<T>& a, const ArenaAllocator<U>& b) {
+	return a.getArena() != b.getArena();
+}
@@ -0,0 +1,233 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Raw CGI output keyed by method, host, uri and query, evicted least recently used first.
+// Scripts run synchronously, so concurrent misses on a key are already serialized; stale
+// entries are served while a single background run per key refreshes them. Refresh pipes
+// are watched by the event backend, and a run still going when its entry stops being
+// servable is killed along with the entry.
+class CgiCache {
+public:
+	CgiCache() : _size(0), _limit(DEFAULT_CGI_CACHE_SIZE) {}
+
+	~CgiCache() {
+		for (std::map<std::string, Entry>::iterator it = _entries.begin(); it != _entries.end();
+			 ++it) {
+			if (it->second.refreshFd != -1) {
+				close(it->second.refreshFd);
+			}
+		}
+	}
+
+	static std::string makeKey(const RequestParsingSuccess& request) {
+		const char* host = request.headers.get(HEADER_HOST);
+		return toString(request.method) + " " + (host ? host : "") + " " + request.uri + "?" +
+			   request.query;
+	}
+
+	const std::string* lookup(const std::string& key, CgiCacheStatusEnum& status) {
+		std::map<std::string, Entry>::iterator it = _entries.find(key);
+		if (it == _entries.end()) {
+			status = CGI_CACHE_MISS;
+			return NULL;
+		}
+		Entry& entry = it->second;
+		const unsigned long now = getMicroseconds() / 1000;
+		if (now >= entry.staleUntil) {
+			if (entry.refreshFd != -1) {
+				stopRefresh(entry, true);
+			}
+			erase(it);
+			status = CGI_CACHE_MISS;
+			return NULL;
+		}
+		status = now < entry.expires		? CGI_CACHE_HIT
+				 : entry.refreshFd != -1 ? CGI_CACHE_UPDATING
+										 : CGI_CACHE_STALE;
+		_lru.splice(_lru.begin(), _lru, entry.lru);
+		return &entry.output;
+	}
+
+	void store(const std::string& key, const std::string& output, unsigned long ttl,
+			   unsigned long stale) {
+		std::map<std::string, Entry>::iterator it = _entries.find(key);
+		if (!getTtl(output, ttl) || key.size() + output.size() > _limit / 8) {
+			if (it != _entries.end() && it->second.refreshFd == -1) {
+				erase(it);
+			}
+			return;
+		}
+		if (it == _entries.end()) {
+			_lru.push_front(key);
+			it = _entries.insert(std::make_pair(key, Entry())).first;
+			it->second.lru = _lru.begin();
+			it->second.refreshFd = -1;
+			_size += key.size();
+		} else {
+			_size -= it->second.output.size();
+			_lru.splice(_lru.begin(), _lru, it->second.lru);
+		}
+		Entry& entry = it->second;
+		const unsigned long now = getMicroseconds() / 1000;
+		entry.output = output;
+		entry.ttl = ttl;
+		entry.stale = stale;
+		entry.expires = now + ttl;
+		entry.staleUntil = entry.expires + stale;
+		_size += output.size();
+		evict();
+	}
+
+	void startRefresh(const std::string& key, pid_t pid, int fd) {
+		Entry& entry = _entries.find(key)->second;
+		entry.refreshPid = pid;
+		entry.refreshFd = fd;
+		entry.refreshOutput.clear();
+		_refreshing[fd] = key;
+		EventBackend::getActive()->add(fd, EPOLLIN);
+	}
+
+	bool isRefreshing(int fd) const { return _refreshing.count(fd) != 0; }
+
+	// stores the output once the script closed its end of the pipe
+	void handleRefresh(int fd) {
+		std::map<int, std::string>::iterator it = _refreshing.find(fd);
+		Entry& entry = _entries.find(it->second)->second;
+		if (!drain(entry)) {
+			return;
+		}
+		const std::string key = it->second;
+		if (stopRefresh(entry, false) == 0) {
+			std::string output;
+			output.swap(entry.refreshOutput);
+			store(key, output, entry.ttl, entry.stale);
+		}
+	}
+
+	// runs past the stale window of their entry are killed, the entry goes with them
+	void expireRefreshes() {
+		const unsigned long now = getMicroseconds() / 1000;
+		for (std::map<int, std::string>::iterator it = _refreshing.begin();
+			 it != _refreshing.end();) {
+			std::map<std::string, Entry>::iterator entry = _entries.find((it++)->second);
+			if (now >= entry->second.staleUntil) {
+				stopRefresh(entry->second, true);
+				erase(entry);
+			}
+		}
+	}
+
+	unsigned long getRefreshDeadline() const {
+		unsigned long deadline = 0;
+		for (std::map<int, std::string>::const_iterator it = _refreshing.begin();
+			 it != _refreshing.end(); ++it) {
+			const unsigned long staleUntil = _entries.find(it->second)->second.staleUntil;
+			deadline = deadline == 0 ? staleUntil : std::min(deadline, staleUntil);
+		}
+		return deadline;
+	}
+
+	size_t& getLimit() { return _limit; }
+
+	static CgiCache& get() {
+		static CgiCache cache;
+		return cache;
+	}
+
+private:
+	typedef struct Entry {
+		std::string output;
+		unsigned long ttl;
+		unsigned long stale;
+		unsigned long expires;
+		unsigned long staleUntil;
+		std::list<std::string>::iterator lru;
+		pid_t refreshPid;
+		int refreshFd;
+		std::string refreshOutput;
+	} Entry;
+
+	std::map<std::string, Entry> _entries;
+	std::list<std::string> _lru;
+	std::map<int, std::string> _refreshing;
+	size_t _size;
+	size_t _limit;
+
+	CgiCache(const CgiCache&);
+	CgiCache& operator=(const CgiCache&);
+
+	void erase(std::map<std::string, Entry>::iterator it) {
+		_size -= it->first.size() + it->second.output.size();
+		_lru.erase(it->second.lru);
+		_entries.erase(it);
+	}
+
+	// entries being refreshed stay until their run is reaped
+	void evict() {
+		std::list<std::string>::iterator it = _lru.end();
+		while (_size > _limit && it != _lru.begin()) {
+			std::map<std::string, Entry>::iterator entry = _entries.find(*--it);
+			if (entry->second.refreshFd == -1) {
+				it = _lru.erase(it);
+				_size -= entry->first.size() + entry->second.output.size();
+				_entries.erase(entry);
+			}
+		}
+	}
+
+	// returns the exit code of the run, killed first when its output is no longer wanted
+	int stopRefresh(Entry& entry, bool abort) {
+		if (EventBackend::getActive() != NULL) {
+			EventBackend::getActive()->remove(entry.refreshFd);
+		}
+		close(entry.refreshFd);
+		_refreshing.erase(entry.refreshFd);
+		entry.refreshFd = -1;
+		if (abort) {
+			kill(entry.refreshPid, SIGKILL);
+		}
+		return getExitCode(entry.refreshPid);
+	}
+
+	// true once the script closed its output
+	static bool drain(Entry& entry) {
+		char buffer[BUFFER_SIZE];
+		for (;;) {
+			ssize_t bytesRead = read(entry.refreshFd, buffer, sizeof(buffer));
+			if (bytesRead > 0) {
+				entry.refreshOutput.append(buffer, bytesRead);
+			} else {
+				return bytesRead == 0 || (errno != EAGAIN && errno != EWOULDBLOCK);
+			}
+		}
+	}
+
+	// only 200 responses without cookies are kept, max-age overrides the configured ttl
+	static bool getTtl(const std::string& output, unsigned long& ttl) {
+		std::istringstream iss(output);
+		std::string line;
+		while (std::getline(iss, line) && !line.empty() && line != "\r") {
+			const size_t colon = line.find(':');
+			if (colon == std::string::npos) {
+				continue;
+			}
+			const std::string name = strlower(strtrim(line.substr(0, colon), SPACES));
+			const std::string value = strlower(strtrim(line.substr(colon + 1), SPACES));
+			if (name == "set-cookie" || (name == "status" && !startswith(value, "200"))) {
+				return false;
+			} else if (name == "cache-control") {
+				if (value.find("no-store") != std::string::npos ||
+					value.find("no-cache") != std::string::npos ||
+					value.find("private") != std::string::npos) {
+					return false;
+				}
+				const size_t maxAge = value.find("max-age=");
+				if (maxAge != std::string::npos) {
+					ttl = std::strtoul(value.c_str() + maxAge + 8, NULL, 10) * 1000;
+				}
+			}
+		}
+		return ttl != 0;
+	}
+};
@@ -2,103 +2,558 @@
 
 #include "webserv.hpp"
 
+extern Metrics metrics;
+
 class Client {
 public:
-	Client() : _addressLen(sizeof(_address)), _currentRequest(NULL), _currentResponse(NULL) {
+	Client()
+		: _associatedServers(NULL), _currentRequest(NULL), _currentResponse(NULL),
+		  _logServer(NULL), _readable(false), _writable(false), _corked(false), _resumeTime(0),
+		  _http2(NULL), _upstreamStream(0), _limiter(NULL), _phase(PHASE_IDLE) {
 		std::memset(&_address, 0, sizeof(_address));
 	};
 
 	~Client() {
+		metrics.phaseChanged(_phase, PHASE_IDLE);
 		if (_currentRequest != NULL) {
-			delete _currentRequest;
+			_currentRequest->~Request();
 		}
 		if (_currentResponse != NULL) {
-			delete _currentResponse;
+			_currentResponse->~Response();
+		}
+		for (std::map<uint32_t, Exchange>::iterator it = _exchanges.begin();
+			 it != _exchanges.end(); ++it) {
+			destroyResponse(it->second.response);
+		}
+		delete _http2;
+		for (size_t i = 0; i < _connectionLimiters.size(); ++i) {
+			_connectionLimiters[i]->releaseConnection(_address.sin_addr.s_addr);
 		}
 	};
 
 	ResponseStatusEnum handleRequest() {
+		if (isReceivingUpload()) {
+			return receiveUpload();
+		}
 		char buffer[BUFFER_SIZE];
-		ssize_t bytesRead = recv(_fd, buffer, BUFFER_SIZE, 0);
+		ssize_t bytesRead = EventBackend::receiveFrom(_fd, buffer, BUFFER_SIZE);
+		if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+			_readable = false;
+			return RESPONSE_PENDING;
+		}
 		if (bytesRead <= 0) {
 			return RESPONSE_FAILURE;
 		}
+		metrics.bytesReceived(bytesRead);
+		if (_http2 == NULL && _currentRequest == NULL &&
+			Http2Connection::isPreface(buffer, bytesRead)) {
+			startHttp2();
+		}
+		if (_http2 != NULL) {
+			return receiveHttp2(buffer, bytesRead);
+		}
 		if (DEBUG) {
 			std::cout << YELLOW << "=== REQUEST START ===\n"
 					  << std::endl
 					  << strtrim(buffer, "\r\n") << "\n=== REQUEST END ===" << RESET << '\n';
 		}
 		if (_currentRequest == NULL) {
-			_currentRequest = new Request(_associatedServers, _ip, _port);
+			_currentRequest = new (_arena.allocate(sizeof(Request)))
+				Request(*_associatedServers, _ip, _port, &_arena);
 			_startTime = std::time(NULL);
+			_requestStart = getMicroseconds();
+			setPhase(PHASE_READING);
 		}
 		RequestParsingResult result = _currentRequest->parse(buffer, bytesRead);
 		if (result.result == REQUEST_PARSING_PROCESSING) {
 			if (std::difftime(std::time(NULL), _startTime) > TIMEOUT) {
 				result.result = REQUEST_PARSING_FAILURE;
 				result.statusCode = STATUS_REQUEST_TIMEOUT;
+			} else if (_currentRequest->getMissingBodySize() >= SPLICE_UPLOAD_THRESHOLD &&
+					   result.location &&
+					   (result.location->getProxyConfig() != NULL ||
+						(result.location->storesUploads() && EventBackend::canSplice()))) {
+				result = _currentRequest->detachHead();
 			} else {
 				return RESPONSE_PENDING;
 			}
 		}
-		RequestMethod method =
-			result.result == REQUEST_PARSING_SUCCESS ? result.success.method : NO_METHOD;
-		_currentResponse =
-			result.location
-				? new Response(method, result.location->getRootDir(),
-							   result.location->getUploadDir(), result.location->getAutoIndex(),
-							   result.virtualServer->getErrorPages(),
-							   result.location->getErrorPages(), result.location->getIndexPages(),
-							   result.location->getUri(), result.location->getReturn(),
-							   result.location->getAllowedMethods(), result.location->getCgiExec())
-				: new Response(method, result.virtualServer->getRootDir(),
-							   result.virtualServer->getAutoIndex(),
-							   result.virtualServer->getErrorPages(),
-							   result.virtualServer->getIndexPages());
-		_currentResponse->buildResponse(result);
-		delete _currentRequest;
-		_currentRequest = NULL;
-		return RESPONSE_SUCCESS;
+		if (Http2Connection::isUpgrade(result)) {
+			startHttp2();
+			_http2->upgrade(result);
+			setPhase(PHASE_IDLE);
+			startStream(1, result);
+			_currentRequest->~Request();
+			_currentRequest = NULL;
+			_arena.reset();
+			return RESPONSE_PENDING;
+		}
+		countRequest(result);
+		setPhase(PHASE_WRITING);
+		_logServer = result.virtualServer;
+		if (_logServer && _logServer->getAccessLog()) {
+			prepareLogEntry(result, _logEntry);
+		}
+		unsigned long delay = 0;
+		const StatusCode limitStatus = applyLimits(result, delay);
+		if (limitStatus != STATUS_NONE) {
+			result.result = REQUEST_PARSING_FAILURE;
+			result.statusCode = limitStatus;
+		} else if (delay != 0) {
+			_delayedResult = result;
+			_resumeTime = getMicroseconds() / 1000 + delay;
+			return RESPONSE_PENDING;
+		}
+		return buildResponse(result);
+	}
+
+	ResponseStatusEnum resume() {
+		_resumeTime = 0;
+		ResponseStatusEnum status = buildResponse(_delayedResult);
+		_delayedResult = RequestParsingResult();
+		return status;
 	}
 
+	unsigned long getResumeTime() const { return _resumeTime; }
+
 	ResponseStatusEnum pushResponse() {
+		if (_http2 != NULL) {
+			return pushHttp2();
+		}
+		if (!_corked && getTcpNoPush() && _currentResponse->hasFileBody()) {
+			setCork(true);
+		}
 		ResponseStatusEnum status = _currentResponse->pushResponseToClient(_fd);
+		if (status != RESPONSE_PENDING && _corked) {
+			setCork(false);
+		}
+		if (_currentResponse->wouldBlock()) {
+			_writable = false;
+		}
 		if (status != RESPONSE_PENDING) {
-			delete _currentResponse;
+			setPhase(PHASE_IDLE);
+			logResponse(_logServer, _logEntry, *_currentResponse, _requestStart);
+			_currentResponse->~Response();
 			_currentResponse = NULL;
+			_arena.reset();
 		}
 		return status;
 	}
 
-	void setInfo(int fd) {
+	ResponseStatusEnum handleEvents(uint32_t events) {
+		_readable = _readable || (events & EPOLLIN);
+		_writable = _writable || (events & EPOLLOUT);
+		while ((_currentResponse == NULL || _http2 != NULL || isReceivingUpload()) && _readable &&
+			   _resumeTime == 0 && (!isReceivingUpload() || _currentResponse->wantsUpload())) {
+			if (handleRequest() == RESPONSE_FAILURE) {
+				return RESPONSE_FAILURE;
+			}
+		}
+		if (isReceivingUpload()) {
+			return RESPONSE_PENDING;
+		}
+		if (_http2 != NULL) {
+			return _writable ? pushHttp2() : RESPONSE_PENDING;
+		}
+		return _currentResponse != NULL && _writable ? pushResponse() : RESPONSE_PENDING;
+	}
+
+	bool isReady() const {
+		if (_http2 != NULL) {
+			return _readable || (_writable && canPushHttp2());
+		}
+		if (_currentResponse == NULL || isReceivingUpload()) {
+			return _readable && _resumeTime == 0 &&
+				   (_currentResponse == NULL || _currentResponse->wantsUpload());
+		}
+		return _writable && _currentResponse->hasOutput();
+	}
+
+	uint32_t getEvents() const {
+		if (_http2 != NULL) {
+			return canPushHttp2() ? EPOLLIN | EPOLLOUT | EPOLLRDHUP : EPOLLIN | EPOLLRDHUP;
+		}
+		if (_currentResponse == NULL || isReceivingUpload()) {
+			const bool reading = _currentResponse == NULL || _currentResponse->wantsUpload();
+			return _resumeTime == 0 && reading ? EPOLLIN | EPOLLRDHUP : EPOLLRDHUP;
+		}
+		return _currentResponse->hasOutput() ? EPOLLOUT | EPOLLRDHUP : EPOLLRDHUP;
+	}
+
+	int getUpstreamFd() const {
+		Response* response = getUpstreamResponse();
+		return response ? response->getUpstreamFd() : -1;
+	}
+	uint32_t getUpstreamEvents() { return getUpstreamResponse()->getUpstreamEvents(); }
+	unsigned long getUpstreamDeadline() {
+		Response* response = getUpstreamResponse();
+		return response ? response->getUpstreamDeadline() : 0;
+	}
+	bool isUpstreamFinished() const {
+		Response* response = getUpstreamResponse();
+		return response && response->isUpstreamFinished();
+	}
+	// a request body paused on a full queue resumes once the upstream took some of it
+	void handleUpstreamEvents() {
+		getUpstreamResponse()->handleUpstreamEvents();
+		_readable = _readable || isReceivingUpload();
+	}
+	void failUpstream(StatusCode error) { getUpstreamResponse()->failUpstream(error); }
+
+	// the next deferred stream may take the upstream once the current one let it go
+	void releaseUpstream() {
+		Response* response = getUpstreamResponse();
+		response->releaseUpstream();
+		if (_http2 != NULL && response->getUpstreamFd() == -1) {
+			_upstreamStream = 0;
+			startDeferredStreams();
+		}
+	}
+
+	void setInfo(int fd, const struct sockaddr_in& address, const struct sockaddr_in& localAddress,
+				 std::vector<VirtualServer*>& associatedServers, ClientLimiter& limiter,
+				 const std::vector<ClientLimiter*>& connectionLimiters) {
 		_fd = fd;
-		struct sockaddr_in localAddr;
-		socklen_t localAddrLen = sizeof(localAddr);
-		syscall(getsockname(_fd, (struct sockaddr*)&localAddr, &localAddrLen), "getsockname");
-		_ip = localAddr.sin_addr.s_addr;
-		_port = localAddr.sin_port;
-	}
-
-	void findAssociatedServers(std::vector<VirtualServer>& vs) {
-		for (size_t i = 0; i < vs.size(); ++i) {
-			if (vs[i].getPort() == _port &&
-				(vs[i].getAddr() == _ip || vs[i].getAddr() == INADDR_ANY)) {
-				_associatedServers.push_back(&vs[i]);
+		_address = address;
+		_ip = localAddress.sin_addr.s_addr;
+		_port = localAddress.sin_port;
+		_associatedServers = &associatedServers;
+		_limiter = &limiter;
+		_connectionLimiters = connectionLimiters;
+	}
+
+	// true when the connection can be closed at once, an HTTP/2 one is told to go away
+	bool drain() {
+		if (_http2 != NULL) {
+			_http2->goAway();
+			return _http2->isFinished();
+		}
+		return _currentRequest == NULL && _currentResponse == NULL && _resumeTime == 0;
+	}
+
+	bool isStarved() const {
+		if (_http2 == NULL) {
+			return _currentResponse != NULL && _currentResponse->isStarved();
+		}
+		for (std::map<uint32_t, Exchange>::const_iterator it = _exchanges.begin();
+			 it != _exchanges.end(); ++it) {
+			if (it->second.response->isStarved()) {
+				return true;
 			}
 		}
+		return false;
 	}
 
-	struct sockaddr_in& getAddress() { return _address; }
-	socklen_t& getAddressLen() { return _addressLen; }
+	bool isWriting() const { return _http2 ? !_exchanges.empty() : _currentResponse != NULL; }
+	bool isHttp2() const { return _http2 != NULL; }
+
+	static bool& getTcpNoPush() {
+		static bool enabled = false;
+		return enabled;
+	}
 
 private:
-	std::vector<VirtualServer*> _associatedServers;
+	typedef struct Exchange {
+		Response* response;
+		VirtualServer* logServer;
+		AccessLogEntry logEntry;
+		unsigned long start;
+	} Exchange;
+
+	std::vector<VirtualServer*>* _associatedServers;
 	struct sockaddr_in _address;
-	socklen_t _addressLen;
 	in_addr_t _ip;
 	in_port_t _port;
 	int _fd;
 	Request* _currentRequest;
 	Response* _currentResponse;
 	time_t _startTime;
+	unsigned long _requestStart;
+	VirtualServer* _logServer;
+	AccessLogEntry _logEntry;
+	Arena _arena;
+	bool _readable;
+	bool _writable;
+	bool _corked;
+	std::vector<ClientLimiter*> _connectionLimiters;
+	RequestParsingResult _delayedResult;
+	unsigned long _resumeTime;
+	Http2Connection* _http2;
+	std::map<uint32_t, Exchange> _exchanges;
+	std::deque<std::pair<uint32_t, RequestParsingResult> > _deferred;
+	uint32_t _upstreamStream;
+	ClientLimiter* _limiter;
+	ConnectionPhaseEnum _phase;
+
+	static std::string findHeader(const RequestParsingResult& result, HeaderId id) {
+		const char* value = result.success.headers.get(id);
+		return value ? value : "";
+	}
+
+	ResponseStatusEnum buildResponse(RequestParsingResult& result) {
+		_currentResponse = createResponse(result, &_arena);
+		_currentRequest->~Request();
+		_currentRequest = NULL;
+		return RESPONSE_SUCCESS;
+	}
+
+	// HTTP/2 streams outlive the connection arena and are framed from memory
+	static Response* createResponse(RequestParsingResult& result, Arena* arena) {
+		RequestMethod method =
+			result.result == REQUEST_PARSING_SUCCESS ? result.success.method : NO_METHOD;
+		void* responseStorage =
+			arena ? arena->allocate(sizeof(Response)) : ::operator new(sizeof(Response));
+		Response* response =
+			result.location
+				? new (responseStorage)
+					  Response(method, result.location->getRootDir(),
+							   result.location->getUploadDir(), result.location->getAutoIndex(),
+							   result.virtualServer->getErrorPages(),
+							   result.location->getErrorPages(), result.location->getIndexPages(),
+							   result.location->getUri(), result.location->getReturn(),
+							   result.location->getAllowedMethods(),
+							   result.location->getCgiExec(), arena)
+				: new (responseStorage) Response(method, result.virtualServer->getRootDir(),
+												 result.virtualServer->getAutoIndex(),
+												 result.virtualServer->getErrorPages(),
+												 result.virtualServer->getIndexPages(), arena);
+		if (arena == NULL) {
+			response->bufferOutput();
+		}
+		response->buildResponse(result);
+		return response;
+	}
+
+	static void destroyResponse(Response* response) {
+		response->~Response();
+		::operator delete(response);
+	}
+
+	static void countRequest(const RequestParsingResult& result) {
+		metrics.requestReceived();
+		if (result.virtualServer) {
+			result.virtualServer->countRequest();
+		}
+		if (result.location) {
+			result.location->countRequest();
+		}
+	}
+
+	// a connection reads from the first byte of a request until it is dispatched, it then
+	// writes until the response is sent
+	void setPhase(ConnectionPhaseEnum phase) {
+		metrics.phaseChanged(_phase, phase);
+		_phase = phase;
+	}
+
+	// HTTP/2 connections write while any stream is dispatched, deferred ones included
+	void updateHttp2Phase() {
+		setPhase(_exchanges.empty() && _deferred.empty() ? PHASE_IDLE : PHASE_WRITING);
+	}
+
+	static void logResponse(VirtualServer* server, AccessLogEntry& entry, const Response& response,
+							unsigned long start) {
+		const unsigned long duration = getMicroseconds() - start;
+		metrics.responseSent(response.getStatusCode(), duration);
+		if (server && server->getAccessLog()) {
+			entry.statusCode = response.getStatusCode();
+			entry.bodyBytesSent = response.getBodyBytesSent();
+			entry.requestTime = duration / 1000;
+			server->getAccessLog()->write(server->getLogFormat()->render(entry));
+		}
+	}
+
+	bool isReceivingUpload() const {
+		return _currentResponse != NULL && _currentResponse->isReceivingUpload();
+	}
+
+	// large uploads skip the parser, the response moves their body straight to disk
+	ResponseStatusEnum receiveUpload() {
+		const ResponseStatusEnum status = _currentResponse->receiveUpload(_fd);
+		if (_currentResponse->wouldBlock()) {
+			_readable = false;
+		}
+		return status == RESPONSE_FAILURE ? RESPONSE_FAILURE : RESPONSE_PENDING;
+	}
+
+	// files go out corked, the head then shares its packet with the first body bytes
+	void setCork(bool enabled) {
+		const int value = enabled;
+		setsockopt(_fd, IPPROTO_TCP, TCP_CORK, &value, sizeof(value));
+		_corked = enabled;
+	}
+
+	// responses of several streams go out back to back, Nagle would hold all but the first
+	void startHttp2() {
+		size_t maxBodySize = 0;
+		for (size_t i = 0; i < _associatedServers->size(); ++i) {
+			maxBodySize = std::max(maxBodySize, (*_associatedServers)[i]->getBodySize());
+		}
+		_http2 = new Http2Connection(maxBodySize);
+		const int enabled = 1;
+		setsockopt(_fd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+	}
+
+	ResponseStatusEnum receiveHttp2(const char* data, size_t length) {
+		if (_http2->receive(data, length)) {
+			uint32_t id;
+			std::string message;
+			while (_http2->popRequest(id, message)) {
+				Request request(*_associatedServers, _ip, _port);
+				RequestParsingResult result = request.parse(message.data(), message.size());
+				if (result.result == REQUEST_PARSING_PROCESSING) {
+					result.result = REQUEST_PARSING_FAILURE;
+					result.statusCode = STATUS_BAD_REQUEST;
+				}
+				startStream(id, result);
+			}
+		}
+		return RESPONSE_PENDING;
+	}
+
+	// proxied streams take turns on the single upstream slot the server tracks per client
+	void startStream(uint32_t id, RequestParsingResult& result) {
+		countRequest(result);
+		setPhase(PHASE_WRITING);
+		if (result.location && result.location->getProxyConfig() &&
+			(_upstreamStream != 0 || !_deferred.empty())) {
+			_deferred.push_back(std::make_pair(id, result));
+		} else {
+			startExchange(id, result);
+		}
+		updateHttp2Phase();
+	}
+
+	void startDeferredStreams() {
+		while (_upstreamStream == 0 && !_deferred.empty()) {
+			if (_http2->isStreamOpen(_deferred.front().first)) {
+				startExchange(_deferred.front().first, _deferred.front().second);
+			}
+			_deferred.pop_front();
+		}
+		updateHttp2Phase();
+	}
+
+	// limit_req delays are not applied to streams, their rejections are
+	void startExchange(uint32_t id, RequestParsingResult& result) {
+		Exchange exchange;
+		exchange.logServer = result.virtualServer;
+		exchange.start = getMicroseconds();
+		if (exchange.logServer && exchange.logServer->getAccessLog()) {
+			prepareLogEntry(result, exchange.logEntry);
+		}
+		unsigned long delay = 0;
+		const StatusCode limitStatus = applyLimits(result, delay);
+		if (limitStatus != STATUS_NONE) {
+			result.result = REQUEST_PARSING_FAILURE;
+			result.statusCode = limitStatus;
+		}
+		exchange.response = createResponse(result, NULL);
+		_exchanges[id] = exchange;
+		if (exchange.response->getUpstreamFd() != -1) {
+			_upstreamStream = id;
+		}
+	}
+
+	void finishExchange(std::map<uint32_t, Exchange>::iterator it) {
+		logResponse(it->second.logServer, it->second.logEntry, *it->second.response,
+					it->second.start);
+		destroyResponse(it->second.response);
+		_exchanges.erase(it);
+		updateHttp2Phase();
+	}
+
+	// streams reset while proxied keep draining their upstream until it is released
+	ResponseStatusEnum pushHttp2() {
+		for (std::map<uint32_t, Exchange>::iterator it = _exchanges.begin();
+			 it != _exchanges.end();) {
+			std::map<uint32_t, Exchange>::iterator exchange = it++;
+			Response& response = *exchange->second.response;
+			const uint32_t id = exchange->first;
+			const bool open = _http2->isStreamOpen(id);
+			const size_t room = open ? _http2->getRoom(id) : HTTP2_OUTPUT_WATERMARK;
+			if (!open && id != _upstreamStream) {
+				finishExchange(exchange);
+				continue;
+			}
+			if (room == 0) {
+				continue;
+			}
+			std::string data;
+			const ResponseStatusEnum status = response.pushResponseToBuffer(data, room);
+			if (status == RESPONSE_FAILURE) {
+				_http2->resetStream(id, HTTP2_INTERNAL_ERROR);
+			} else if (!data.empty() || status == RESPONSE_SUCCESS) {
+				_http2->sendResponse(id, data, status == RESPONSE_SUCCESS);
+			}
+			if (status != RESPONSE_PENDING) {
+				finishExchange(exchange);
+			}
+		}
+		if (_http2->flush(_fd) < 0) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK) {
+				return RESPONSE_FAILURE;
+			}
+			_writable = false;
+		}
+		return _http2->isFinished() ? RESPONSE_SUCCESS : RESPONSE_PENDING;
+	}
+
+	bool canPushHttp2() const {
+		if (_http2->hasOutput()) {
+			return true;
+		}
+		for (std::map<uint32_t, Exchange>::const_iterator it = _exchanges.begin();
+			 it != _exchanges.end(); ++it) {
+			if (!_http2->isStreamOpen(it->first)
+					? it->first != _upstreamStream || it->second.response->hasOutput()
+					: it->second.response->hasOutput() && _http2->getRoom(it->first) > 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	Response* getUpstreamResponse() const {
+		if (_http2 == NULL) {
+			return _currentResponse;
+		}
+		std::map<uint32_t, Exchange>::const_iterator it = _exchanges.find(_upstreamStream);
+		return it == _exchanges.end() ? NULL : it->second.response;
+	}
+
+	StatusCode applyLimits(const RequestParsingResult& result, unsigned long& delay) {
+		ClientLimiter* limiters[2] = {_limiter,
+									  result.virtualServer ? &result.virtualServer->getLimiter()
+														   : NULL};
+		for (size_t i = 0; i < 2; ++i) {
+			if (limiters[i] == NULL) {
+				continue;
+			}
+			unsigned long limiterDelay;
+			const StatusCode status =
+				limiters[i]->checkRequest(_address.sin_addr.s_addr, limiterDelay);
+			if (status != STATUS_NONE) {
+				return status;
+			}
+			delay = std::max(delay, limiterDelay);
+		}
+		return STATUS_NONE;
+	}
+
+	void prepareLogEntry(const RequestParsingResult& result, AccessLogEntry& entry) {
+		const std::vector<std::string>& serverNames = result.virtualServer->getServerNames();
+		entry = AccessLogEntry();
+		entry.remoteAddr = _address.sin_addr.s_addr;
+		entry.serverName = serverNames.empty() ? "" : serverNames[0];
+		entry.method = NO_METHOD;
+		if (result.result == REQUEST_PARSING_SUCCESS) {
+			entry.method = result.success.method;
+			entry.uri = result.success.uri;
+			entry.query = result.success.query;
+			entry.host = findHeader(result, HEADER_HOST);
+			entry.referer = findHeader(result, HEADER_REFERER);
+			entry.userAgent = findHeader(result, HEADER_USER_AGENT);
+		}
+	}
 };
\ No newline at end of file
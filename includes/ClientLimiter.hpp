@@ -0,0 +1,193 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Per client IP connection counts and leaky buckets in a fixed-size, set-associative
+// table. Under a flood of unique addresses the least recently seen idle entry of a
+// set is recycled; when every entry of a set holds connections, the client is refused.
+class ClientLimiter {
+public:
+	ClientLimiter()
+		: _maxConnections(0), _rate(0), _burst(0), _nodelay(false),
+		  _connectionStatus(STATUS_SERVICE_UNAVAILABLE),
+		  _requestStatus(STATUS_SERVICE_UNAVAILABLE) {}
+
+	~ClientLimiter(){};
+
+	bool parse(const std::string& keyword, std::istringstream& iss) {
+		if (keyword == "limit_conn") {
+			return parseConnectionLimit(iss);
+		} else if (keyword == "limit_req") {
+			return parseRequestLimit(iss);
+		} else if (keyword == "limit_conn_status") {
+			return parseStatus(iss, _connectionStatus, keyword);
+		} else if (keyword == "limit_req_status") {
+			return parseStatus(iss, _requestStatus, keyword);
+		}
+		return configFileError("invalid keyword in configuration file: " + keyword);
+	}
+
+	StatusCode acquireConnection(in_addr_t ip) {
+		if (_maxConnections == 0) {
+			return STATUS_NONE;
+		}
+		Entry* entry = findEntry(ip, true);
+		if (entry == NULL || entry->connections >= _maxConnections) {
+			return _connectionStatus;
+		}
+		++entry->connections;
+		return STATUS_NONE;
+	}
+
+	void releaseConnection(in_addr_t ip) {
+		Entry* entry = findEntry(ip, false);
+		if (entry != NULL && entry->connections != 0) {
+			--entry->connections;
+		}
+	}
+
+	bool limitsConnections() const { return _maxConnections != 0; }
+
+	StatusCode checkRequest(in_addr_t ip, unsigned long& delay) {
+		delay = 0;
+		if (_rate == 0) {
+			return STATUS_NONE;
+		}
+		Entry* entry = findEntry(ip, true);
+		if (entry == NULL) {
+			return _requestStatus;
+		}
+		const unsigned long now = getMicroseconds() / 1000;
+		const unsigned long drained = _rate * (now - entry->last) / 1000;
+		const unsigned long excess =
+			entry->requests == 0 ? 0
+								 : (entry->excess > drained ? entry->excess - drained : 0) + 1000;
+		if (excess > _burst) {
+			return _requestStatus;
+		}
+		entry->excess = excess;
+		entry->last = now;
+		++entry->requests;
+		if (!_nodelay) {
+			delay = excess * 1000 / _rate;
+		}
+		return STATUS_NONE;
+	}
+
+private:
+	typedef struct Entry {
+		in_addr_t ip;
+		bool used;
+		unsigned long connections;
+		unsigned long requests;
+		unsigned long excess;
+		unsigned long last;
+	} Entry;
+
+	unsigned long _maxConnections;
+	unsigned long _rate;
+	unsigned long _burst;
+	bool _nodelay;
+	StatusCode _connectionStatus;
+	StatusCode _requestStatus;
+	std::vector<Entry> _entries;
+
+	Entry* findEntry(in_addr_t ip, bool create) {
+		if (_entries.empty()) {
+			if (!create) {
+				return NULL;
+			}
+			Entry unused;
+			std::memset(&unused, 0, sizeof(unused));
+			_entries.resize(LIMIT_TABLE_SIZE, unused);
+		}
+		const size_t sets = LIMIT_TABLE_SIZE / LIMIT_TABLE_WAYS;
+		Entry* set = &_entries[(static_cast<uint32_t>(ip) * 2654435761U) % sets * LIMIT_TABLE_WAYS];
+		Entry* victim = NULL;
+		for (size_t i = 0; i < LIMIT_TABLE_WAYS; ++i) {
+			if (!set[i].used) {
+				victim = &set[i];
+				break;
+			}
+			if (set[i].ip == ip) {
+				return &set[i];
+			}
+			if (set[i].connections == 0 && (victim == NULL || set[i].last < victim->last)) {
+				victim = &set[i];
+			}
+		}
+		if (!create || victim == NULL) {
+			return NULL;
+		}
+		std::memset(victim, 0, sizeof(*victim));
+		victim->ip = ip;
+		victim->used = true;
+		victim->last = getMicroseconds() / 1000;
+		return victim;
+	}
+
+	bool parseConnectionLimit(std::istringstream& iss) {
+		std::string value, extra;
+		if (!(iss >> value)) {
+			return configFileError("missing information after limit_conn keyword");
+		}
+		if (value.find_first_not_of("0123456789") != std::string::npos || value.size() > 9 ||
+			(_maxConnections = std::strtoul(value.c_str(), NULL, 10)) == 0) {
+			return configFileError("invalid number in limit_conn: " + value);
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after limit_conn keyword");
+		}
+		return true;
+	}
+
+	bool parseRequestLimit(std::istringstream& iss) {
+		std::string value;
+		while (iss >> value) {
+			if (startswith(value, "rate=")) {
+				const size_t unit = value.find("r/");
+				const std::string number = value.substr(5, unit - 5);
+				const std::string period = unit == std::string::npos ? "" : value.substr(unit + 2);
+				if (number.empty() || number.find_first_not_of("0123456789") != std::string::npos ||
+					number.size() > 6 || (period != "s" && period != "m")) {
+					return configFileError("invalid rate in limit_req: " + value);
+				}
+				_rate = std::strtoul(number.c_str(), NULL, 10) * 1000 / (period == "s" ? 1 : 60);
+				if (_rate == 0) {
+					return configFileError("invalid rate in limit_req: " + value);
+				}
+			} else if (startswith(value, "burst=")) {
+				const std::string number = value.substr(6);
+				if (number.empty() || number.find_first_not_of("0123456789") != std::string::npos ||
+					number.size() > 6) {
+					return configFileError("invalid burst in limit_req: " + value);
+				}
+				_burst = std::strtoul(number.c_str(), NULL, 10) * 1000;
+			} else if (value == "nodelay") {
+				_nodelay = true;
+			} else {
+				return configFileError("invalid parameter in limit_req: " + value);
+			}
+		}
+		if (_rate == 0) {
+			return configFileError("missing rate in limit_req");
+		}
+		return true;
+	}
+
+	static bool parseStatus(std::istringstream& iss, StatusCode& status,
+							const std::string& keyword) {
+		std::string value, extra;
+		if (!(iss >> value)) {
+			return configFileError("missing information after " + keyword + " keyword");
+		}
+		if (value != "429" && value != "503") {
+			return configFileError(keyword + " must be 429 or 503");
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after " + keyword + " keyword");
+		}
+		status = value == "429" ? STATUS_TOO_MANY_REQUESTS : STATUS_SERVICE_UNAVAILABLE;
+		return true;
+	}
+};
@@ -0,0 +1,170 @@
+#pragma once
+
+#include "webserv.hpp"
+
+extern const std::map<StatusCode, std::string> STATUS_MESSAGES;
+
+// A pre-rendered error response: the head is copied per response to patch its date in,
+// the body is shared by every response sending it.
+class ErrorPage {
+public:
+	ErrorPage() : _statusCode(STATUS_NONE), _body(NULL), _dateOffset(0), _checked(0) {
+		_mtime.tv_sec = 0;
+		_mtime.tv_nsec = 0;
+	}
+
+	ErrorPage(const ErrorPage& other) : _body(NULL) { *this = other; }
+
+	ErrorPage& operator=(const ErrorPage& other) {
+		if (this != &other) {
+			if (_body != NULL) {
+				_body->release();
+			}
+			_statusCode = other._statusCode;
+			_path = other._path;
+			_redirect = other._redirect;
+			_mtime = other._mtime;
+			_head = other._head;
+			_body = other._body != NULL ? other._body->acquire() : NULL;
+			_dateOffset = other._dateOffset;
+			_checked = other._checked;
+		}
+		return *this;
+	}
+
+	~ErrorPage() {
+		if (_body != NULL) {
+			_body->release();
+		}
+	};
+
+	bool render(StatusCode statusCode, const std::string& path, const std::string& redirect) {
+		std::map<StatusCode, std::string>::const_iterator message =
+			STATUS_MESSAGES.find(statusCode);
+		if (message == STATUS_MESSAGES.end()) {
+			return false;
+		}
+		_statusCode = statusCode;
+		_path = path;
+		_redirect = redirect;
+		std::string body;
+		std::string uri = path;
+		if (path.empty() || !readContent(uri, body)) {
+			body = renderBody(statusCode);
+		}
+		_mtime = getModificationTime(path);
+		_checked = getMicroseconds() / 1000;
+		_head.clear();
+		_head.reserve(RESPONSE_HEAD_SIZE);
+		_head += HTTP_VERSION " " + toString(statusCode) + " " + message->second + "\r\n";
+		if (!redirect.empty()) {
+			_head += "location: " + redirect + "\r\n";
+		}
+		_head += "content-type: text/html\r\ndate: ";
+		_dateOffset = _head.size();
+		_head += getDate();
+		_head += "\r\nserver: " SERVER_VERSION "\r\ncontent-length: " + toString(body.size()) +
+				 "\r\nconnection: close\r\n\r\n";
+		if (_body != NULL) {
+			_body->release();
+		}
+		_body = SharedBuffer::create(body);
+		return true;
+	}
+
+	// a page read from a file is rendered again when the file changed, checked at most
+	// once per interval
+	void refresh() {
+		const unsigned long now = getMicroseconds() / 1000;
+		if (_path.empty() || now - _checked < ERROR_PAGE_CHECK_INTERVAL) {
+			return;
+		}
+		_checked = now;
+		if (!isSameTime(getModificationTime(_path), _mtime)) {
+			render(_statusCode, _path, _redirect);
+		}
+	}
+
+	void copyHeadTo(std::string& out) const {
+		const std::string& date = getDate();
+		out = _head;
+		std::copy(date.begin(), date.end(), out.begin() + _dateOffset);
+	}
+
+	SharedBuffer* acquireBody() const { return _body->acquire(); }
+
+	bool isRendered() const { return _body != NULL; }
+	StatusCode getStatusCode() const { return _statusCode; }
+
+	static std::string renderBody(StatusCode statusCode) {
+		std::map<StatusCode, std::string>::const_iterator it = STATUS_MESSAGES.find(statusCode);
+		std::string codeString = toString(statusCode);
+		std::string title = it != STATUS_MESSAGES.end() ? codeString + " " + it->second
+														: "Unknown error " + codeString;
+		return "<!DOCTYPE html>\n"
+			   "<html lang=\"en\">\n"
+			   "\n"
+			   "<head>\n"
+			   "\t<meta charset=\"UTF-8\">\n"
+			   "\t<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
+			   "\t<title>" +
+			   title +
+			   "</title>\n"
+			   "\t<style>\n"
+			   "\t\tbody {\n"
+			   "\t\t\tbackground-color: #f0f0f0;\n"
+			   "\t\t\tfont-family: Arial, sans-serif;\n"
+			   "\t\t}\n"
+			   "\n"
+			   "\t\t.container {\n"
+			   "\t\t\twidth: 80%;\n"
+			   "\t\t\tmargin: auto;\n"
+			   "\t\t\ttext-align: center;\n"
+			   "\t\t\tpadding-top: 20%;\n"
+			   "\t\t}\n"
+			   "\n"
+			   "\t\th1 {\n"
+			   "\t\t\tcolor: #333;\n"
+			   "\t\t}\n"
+			   "\n"
+			   "\t\tp {\n"
+			   "\t\t\tcolor: #666;\n"
+			   "\t\t}\n"
+			   "\t</style>\n"
+			   "</head>\n"
+			   "\n"
+			   "<body>\n"
+			   "\t<div class=\"container\">\n"
+			   "\t\t<h1>" +
+			   title +
+			   "</h1>\n"
+			   "\t\t<a href=\"/\">Go back to root.</a>\n"
+			   "\t</div>\n"
+			   "</body>\n"
+			   "\n"
+			   "</html>";
+	}
+
+private:
+	StatusCode _statusCode;
+	std::string _path;
+	std::string _redirect;
+	struct timespec _mtime;
+	std::string _head;
+	SharedBuffer* _body;
+	size_t _dateOffset;
+	unsigned long _checked;
+
+	static struct timespec getModificationTime(const std::string& path) {
+		struct stat buf;
+		if (path.empty() || stat(path.c_str(), &buf) != 0) {
+			struct timespec none = {0, 0};
+			return none;
+		}
+		return buf.st_mtim;
+	}
+
+	static bool isSameTime(const struct timespec& a, const struct timespec& b) {
+		return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+	}
+};
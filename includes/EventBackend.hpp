@@ -0,0 +1,717 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Readiness backends leave the socket calls to the server, completion backends perform
+// accepts and reads themselves and hand out their results through these calls.
+class EventBackend {
+public:
+	virtual ~EventBackend() {}
+
+	virtual void add(int fd, uint32_t events) = 0;
+	virtual void modify(int fd, uint32_t events) = 0;
+	virtual void remove(int fd) = 0;
+	virtual void detach(int fd) = 0;
+	virtual int wait(struct epoll_event* events, int maxEvents, int timeout) = 0;
+	virtual const char* getName() const = 0;
+
+	virtual void addListener(int fd) { add(fd, EPOLLIN | EPOLLEXCLUSIVE); }
+
+	virtual int acceptClient(int listenFd, struct sockaddr_in& address) {
+		socklen_t addressLen = sizeof(address);
+		return accept4(listenFd, (struct sockaddr*)&address, &addressLen,
+					   SOCK_NONBLOCK | SOCK_CLOEXEC);
+	}
+
+	// the socket is then only read through receive
+	virtual void addReceiver(int) {}
+
+	virtual ssize_t receive(int fd, char* buffer, size_t length) {
+		return recv(fd, buffer, length, 0);
+	}
+
+	virtual bool readsSockets() const { return false; }
+
+	static EventBackend*& getActive() {
+		static EventBackend* active = NULL;
+		return active;
+	}
+
+	static ssize_t receiveFrom(int fd, char* buffer, size_t length) {
+		EventBackend* backend = getActive();
+		return backend ? backend->receive(fd, buffer, length) : recv(fd, buffer, length, 0);
+	}
+
+	// splicing would race the backend for the bytes of a socket it reads
+	static bool canSplice() { return getActive() == NULL || !getActive()->readsSockets(); }
+};
+
+class EpollBackend : public EventBackend {
+public:
+	EpollBackend() { syscall(_epollFd = epoll_create1(EPOLL_CLOEXEC), "epoll_create1"); }
+
+	virtual ~EpollBackend() { close(_epollFd); }
+
+	virtual void add(int fd, uint32_t events) {
+		syscallEpoll(_epollFd, EPOLL_CTL_ADD, fd, events, "EPOLL_CTL_ADD");
+	}
+
+	virtual void modify(int fd, uint32_t events) {
+		syscallEpoll(_epollFd, EPOLL_CTL_MOD, fd, events, "EPOLL_CTL_MOD");
+	}
+
+	// closing the descriptor removes it from the interest list
+	virtual void remove(int) {}
+
+	// for descriptors that stay open, such as pooled upstream connections
+	virtual void detach(int fd) {
+		syscallEpoll(_epollFd, EPOLL_CTL_DEL, fd, 0, "EPOLL_CTL_DEL");
+	}
+
+	virtual int wait(struct epoll_event* events, int maxEvents, int timeout) {
+		return epoll_wait(_epollFd, events, maxEvents, timeout);
+	}
+
+	virtual const char* getName() const { return "epoll"; }
+
+private:
+	int _epollFd;
+};
+
+
+// Listening sockets get a multishot accept and client sockets a multishot recv into a
+// ring of provided buffers, so connections and request bytes arrive as completions
+// without an accept or recv call per event. Readiness for everything else comes from
+// IORING_OP_POLL_ADD requests: one-shot polls re-armed before each wait give
+// level-triggered semantics, multishot polls edge-triggered ones. All arming and
+// cancellation is batched into the io_uring_enter call that waits.
+class IoUringBackend : public EventBackend {
+public:
+	IoUringBackend()
+		: _ringFd(-1), _sqRing(MAP_FAILED), _cqRing(MAP_FAILED), _sqes(NULL), _sqRingSize(0),
+		  _cqRingSize(0), _sqesSize(0), _sqTail(0), _submitted(0), _nextUserData(0),
+		  _bufferRing(MAP_FAILED), _buffers(NULL), _bufferTail(0), _freeBuffers(0) {}
+
+	virtual ~IoUringBackend() {
+		for (std::map<int, Registration>::iterator it = _registrations.begin();
+			 it != _registrations.end(); ++it) {
+			closeAccepted(it->second);
+		}
+		if (_sqes != NULL) {
+			munmap(_sqes, _sqesSize);
+		}
+		if (_cqRing != MAP_FAILED && _cqRing != _sqRing) {
+			munmap(_cqRing, _cqRingSize);
+		}
+		if (_sqRing != MAP_FAILED) {
+			munmap(_sqRing, _sqRingSize);
+		}
+		if (_ringFd != -1) {
+			close(_ringFd);
+		}
+		if (_bufferRing != MAP_FAILED) {
+			munmap(_bufferRing, IO_URING_BUFFERS * sizeof(struct io_uring_buf));
+		}
+		delete[] _buffers;
+	}
+
+	bool init() {
+		struct io_uring_params params;
+		std::memset(&params, 0, sizeof(params));
+		params.flags = IORING_SETUP_CQSIZE;
+		params.cq_entries = IO_URING_ENTRIES * 4;
+		_ringFd = ::syscall(__NR_io_uring_setup, IO_URING_ENTRIES, &params);
+		if (_ringFd < 0) {
+			_ringFd = -1;
+			return false;
+		}
+		// multishot recv came with linked files, in 6.0
+		if (!(params.features & IORING_FEAT_NODROP) || !(params.features & IORING_FEAT_EXT_ARG) ||
+			!(params.features & IORING_FEAT_LINKED_FILE)) {
+			errno = EOPNOTSUPP;
+			return false;
+		}
+		_sqRingSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+		_cqRingSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+		if (params.features & IORING_FEAT_SINGLE_MMAP) {
+			_sqRingSize = _cqRingSize = std::max(_sqRingSize, _cqRingSize);
+		}
+		_sqRing = mmap(NULL, _sqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+					   _ringFd, IORING_OFF_SQ_RING);
+		if (_sqRing == MAP_FAILED) {
+			return false;
+		}
+		_cqRing = params.features & IORING_FEAT_SINGLE_MMAP
+					  ? _sqRing
+					  : mmap(NULL, _cqRingSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+							 _ringFd, IORING_OFF_CQ_RING);
+		if (_cqRing == MAP_FAILED) {
+			return false;
+		}
+		_sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+		void* sqes = mmap(NULL, _sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+						  _ringFd, IORING_OFF_SQES);
+		if (sqes == MAP_FAILED) {
+			return false;
+		}
+		_sqes = static_cast<struct io_uring_sqe*>(sqes);
+		char* sq = static_cast<char*>(_sqRing);
+		char* cq = static_cast<char*>(_cqRing);
+		_sqHead = reinterpret_cast<unsigned*>(sq + params.sq_off.head);
+		_sqTailPtr = reinterpret_cast<unsigned*>(sq + params.sq_off.tail);
+		_sqMask = *reinterpret_cast<unsigned*>(sq + params.sq_off.ring_mask);
+		_sqEntries = params.sq_entries;
+		_cqHead = reinterpret_cast<unsigned*>(cq + params.cq_off.head);
+		_cqTail = reinterpret_cast<unsigned*>(cq + params.cq_off.tail);
+		_cqMask = *reinterpret_cast<unsigned*>(cq + params.cq_off.ring_mask);
+		_cqes = reinterpret_cast<struct io_uring_cqe*>(cq + params.cq_off.cqes);
+		unsigned* array = reinterpret_cast<unsigned*>(sq + params.sq_off.array);
+		for (unsigned i = 0; i < _sqEntries; ++i) {
+			array[i] = i;
+		}
+		_sqTail = *_sqTailPtr;
+		_submitted = _sqTail;
+		return initBufferRing();
+	}
+
+	virtual void add(int fd, uint32_t events) {
+		Registration& registration = _registrations[fd];
+		registration.events = events & ~(EPOLLET | EPOLLEXCLUSIVE);
+		registration.multishot = events & EPOLLET;
+		registration.pollData = 0;
+		if (needsPoll(registration)) {
+			armPoll(fd, registration);
+		}
+	}
+
+	virtual void modify(int fd, uint32_t events) {
+		cancelPoll(fd);
+		add(fd, events);
+	}
+
+	// queued bytes and connections of the descriptor go with it
+	virtual void remove(int fd) {
+		std::map<int, Registration>::iterator it = _registrations.find(fd);
+		if (it == _registrations.end()) {
+			return;
+		}
+		if (it->second.pollData != 0) {
+			cancel(it->second.pollData);
+		}
+		if (it->second.opData != 0) {
+			cancel(it->second.opData);
+			if (it->second.accepting) {
+				_retiredAccepts.insert(it->second.opData);
+			}
+		}
+		for (size_t i = 0; i < it->second.received.size(); ++i) {
+			recycleBuffer(it->second.received[i].id);
+		}
+		closeAccepted(it->second);
+		_unread.erase(fd);
+		_registrations.erase(it);
+	}
+
+	virtual void detach(int fd) { remove(fd); }
+
+	virtual void addListener(int fd) {
+		Registration& registration = _registrations[fd];
+		registration.events = EPOLLIN;
+		registration.accepting = true;
+		armAccept(fd, registration);
+	}
+
+	virtual int acceptClient(int listenFd, struct sockaddr_in& address) {
+		std::map<int, Registration>::iterator it = _registrations.find(listenFd);
+		if (it == _registrations.end() || !it->second.accepting) {
+			return EventBackend::acceptClient(listenFd, address);
+		}
+		Registration& registration = it->second;
+		if (registration.accepted.empty()) {
+			if (registration.error != 0) {
+				errno = registration.error;
+				registration.error = 0;
+				return -1;
+			}
+			_unread.erase(listenFd);
+			errno = EAGAIN;
+			return -1;
+		}
+		const int clientFd = registration.accepted.front();
+		registration.accepted.pop_front();
+		socklen_t addressLen = sizeof(address);
+		getpeername(clientFd, (struct sockaddr*)&address, &addressLen);
+		return clientFd;
+	}
+
+	virtual void addReceiver(int fd) {
+		Registration& registration = _registrations[fd];
+		registration.receiving = true;
+		armRecv(fd, registration);
+	}
+
+	virtual ssize_t receive(int fd, char* buffer, size_t length) {
+		std::map<int, Registration>::iterator it = _registrations.find(fd);
+		if (it == _registrations.end() || !it->second.receiving) {
+			return recv(fd, buffer, length, 0);
+		}
+		Registration& registration = it->second;
+		size_t total = 0;
+		while (total < length && !registration.received.empty()) {
+			Chunk& chunk = registration.received.front();
+			const size_t n = std::min(length - total, chunk.length - chunk.offset);
+			std::memcpy(buffer + total, _buffers + chunk.id * BUFFER_SIZE + chunk.offset, n);
+			total += n;
+			chunk.offset += n;
+			if (chunk.offset == chunk.length) {
+				recycleBuffer(chunk.id);
+				registration.received.pop_front();
+			}
+		}
+		if (registration.opData == 0) {
+			_disarmed.push_back(fd);
+		}
+		if (total != 0) {
+			return total;
+		} else if (registration.error != 0) {
+			errno = registration.error;
+			return -1;
+		} else if (registration.eof) {
+			return 0;
+		} else if (registration.opData == 0) {
+			// nothing armed, what is left waits in the socket
+			const ssize_t n = recv(fd, buffer, length, 0);
+			if (n >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+				return n;
+			}
+		}
+		_unread.erase(fd);
+		errno = EAGAIN;
+		return -1;
+	}
+
+	virtual bool readsSockets() const { return true; }
+
+	virtual int wait(struct epoll_event* events, int maxEvents, int timeout) {
+		std::vector<int> disarmed;
+		disarmed.swap(_disarmed);
+		for (size_t i = 0; i < disarmed.size(); ++i) {
+			std::map<int, Registration>::iterator it = _registrations.find(disarmed[i]);
+			if (it != _registrations.end()) {
+				rearm(it->first, it->second);
+			}
+		}
+		if (!hasCompletions() && !hasLevelEvents() && timeout != 0) {
+			struct __kernel_timespec ts;
+			struct io_uring_getevents_arg arg;
+			std::memset(&arg, 0, sizeof(arg));
+			if (timeout > 0) {
+				ts.tv_sec = timeout / 1000;
+				ts.tv_nsec = (timeout % 1000) * 1000000L;
+				arg.ts = reinterpret_cast<unsigned long>(&ts);
+			}
+			if (enter(1, IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG, &arg, sizeof(arg)) < 0) {
+				if (errno == EINTR) {
+					return -1;
+				}
+				if (errno != ETIME && errno != EBUSY && errno != EAGAIN) {
+					throw SystemError("io_uring_enter");
+				}
+			}
+		} else if (_submitted != _sqTail && enter(0, 0, NULL, 0) < 0 && errno != EINTR &&
+				   errno != EBUSY && errno != EAGAIN) {
+			throw SystemError("io_uring_enter");
+		}
+		std::map<int, int> slots;
+		int numEvents = reap(events, maxEvents, slots);
+		for (std::set<int>::iterator it = _unread.begin();
+			 it != _unread.end() && numEvents < maxEvents; ++it) {
+			const Registration& registration = _registrations[*it];
+			if (!registration.multishot && (registration.events & EPOLLIN)) {
+				report(events, numEvents, slots, *it, EPOLLIN);
+			}
+		}
+		return numEvents;
+	}
+
+	virtual const char* getName() const { return "io_uring"; }
+
+private:
+	typedef struct Chunk {
+		unsigned id;
+		size_t offset;
+		size_t length;
+	} Chunk;
+
+	// a descriptor has up to two requests in flight: a poll, and an accept or a recv
+	struct Registration {
+		uint32_t events;
+		bool multishot;
+		uint64_t pollData;
+		bool accepting;
+		bool receiving;
+		uint64_t opData;
+		bool cancelling;
+		std::deque<Chunk> received;
+		std::deque<int> accepted;
+		bool starved;
+		bool eof;
+		int error;
+
+		Registration()
+			: events(0), multishot(false), pollData(0), accepting(false), receiving(false),
+			  opData(0), cancelling(false), starved(false), eof(false), error(0) {}
+	};
+
+	int _ringFd;
+	void* _sqRing;
+	void* _cqRing;
+	struct io_uring_sqe* _sqes;
+	size_t _sqRingSize;
+	size_t _cqRingSize;
+	size_t _sqesSize;
+	unsigned* _sqHead;
+	unsigned* _sqTailPtr;
+	unsigned _sqMask;
+	unsigned _sqEntries;
+	unsigned* _cqHead;
+	unsigned* _cqTail;
+	unsigned _cqMask;
+	struct io_uring_cqe* _cqes;
+	unsigned _sqTail;
+	unsigned _submitted;
+	uint64_t _nextUserData;
+	void* _bufferRing;
+	char* _buffers;
+	unsigned short _bufferTail;
+	size_t _freeBuffers;
+	std::map<int, Registration> _registrations;
+	std::vector<int> _disarmed;
+	std::set<int> _unread;
+	std::set<uint64_t> _retiredAccepts;
+
+	bool initBufferRing() {
+		_buffers = new char[IO_URING_BUFFERS * BUFFER_SIZE];
+		_bufferRing = mmap(NULL, IO_URING_BUFFERS * sizeof(struct io_uring_buf),
+						   PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (_bufferRing == MAP_FAILED) {
+			return false;
+		}
+		struct io_uring_buf_reg reg;
+		std::memset(&reg, 0, sizeof(reg));
+		reg.ring_addr = reinterpret_cast<unsigned long>(_bufferRing);
+		reg.ring_entries = IO_URING_BUFFERS;
+		reg.bgid = IO_URING_BUFFER_GROUP;
+		if (::syscall(__NR_io_uring_register, _ringFd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0) {
+			return false;
+		}
+		for (unsigned i = 0; i < IO_URING_BUFFERS; ++i) {
+			recycleBuffer(i);
+		}
+		const int probed = probeBufferRing();
+		if (probed != -ENOBUFS) {
+			return probed >= 0;
+		}
+		// some kernels accept the ring but never take buffers from it, buffers are then
+		// provided one request at a time
+		::syscall(__NR_io_uring_register, _ringFd, IORING_UNREGISTER_PBUF_RING, &reg, 1);
+		munmap(_bufferRing, IO_URING_BUFFERS * sizeof(struct io_uring_buf));
+		_bufferRing = MAP_FAILED;
+		_freeBuffers = 0;
+		provideBuffers(0, IO_URING_BUFFERS);
+		return true;
+	}
+
+	// receives a byte from a socket pair through the ring
+	int probeBufferRing() {
+		int fds[2];
+		if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+			return -errno;
+		}
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fds[0];
+		sqe->len = 1;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = IO_URING_BUFFER_GROUP;
+		int res = write(fds[1], "", 1) == 1 ? enter(1, IORING_ENTER_GETEVENTS, NULL, 0) : -1;
+		close(fds[0]);
+		close(fds[1]);
+		if (res < 0) {
+			return -errno;
+		}
+		const struct io_uring_cqe& cqe = _cqes[*_cqHead & _cqMask];
+		res = cqe.res;
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			--_freeBuffers;
+			recycleBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+		}
+		__atomic_store_n(_cqHead, *_cqHead + 1, __ATOMIC_RELEASE);
+		return res;
+	}
+
+	void recycleBuffer(unsigned id) {
+		if (_bufferRing == MAP_FAILED) {
+			provideBuffers(id, 1);
+			return;
+		}
+		struct io_uring_buf_ring* ring = static_cast<struct io_uring_buf_ring*>(_bufferRing);
+		struct io_uring_buf& buf = ring->bufs[_bufferTail & (IO_URING_BUFFERS - 1)];
+		buf.addr = reinterpret_cast<unsigned long>(_buffers + id * BUFFER_SIZE);
+		buf.len = BUFFER_SIZE;
+		buf.bid = id;
+		__atomic_store_n(&ring->tail, ++_bufferTail, __ATOMIC_RELEASE);
+		++_freeBuffers;
+	}
+
+	void provideBuffers(unsigned id, unsigned count) {
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_PROVIDE_BUFFERS;
+		sqe->fd = count;
+		sqe->addr = reinterpret_cast<unsigned long>(_buffers + id * BUFFER_SIZE);
+		sqe->len = BUFFER_SIZE;
+		sqe->off = id;
+		sqe->buf_group = IO_URING_BUFFER_GROUP;
+		sqe->user_data = 0;
+		_freeBuffers += count;
+	}
+
+	int enter(unsigned minComplete, unsigned flags, void* arg, size_t argSize) {
+		__atomic_store_n(_sqTailPtr, _sqTail, __ATOMIC_RELEASE);
+		const unsigned toSubmit = _sqTail - _submitted;
+		int ret = ::syscall(__NR_io_uring_enter, _ringFd, toSubmit, minComplete, flags, arg,
+							argSize);
+		if (ret > 0) {
+			_submitted += ret;
+		}
+		return ret;
+	}
+
+	struct io_uring_sqe* getSqe() {
+		if (_sqTail - __atomic_load_n(_sqHead, __ATOMIC_ACQUIRE) == _sqEntries &&
+			enter(0, 0, NULL, 0) < 0) {
+			throw SystemError("io_uring_enter");
+		}
+		struct io_uring_sqe* sqe = &_sqes[_sqTail++ & _sqMask];
+		std::memset(sqe, 0, sizeof(*sqe));
+		return sqe;
+	}
+
+	// user data packs a serial with the descriptor so that completions for a closed
+	// and reused descriptor can be told apart
+	uint64_t nextUserData(int fd) { return (++_nextUserData << 32) | static_cast<uint32_t>(fd); }
+
+	// the recv delivers reads, so a receiving socket only polls for the other events
+	static bool needsPoll(const Registration& registration) {
+		return !registration.accepting &&
+			   (!registration.receiving || (registration.events & ~EPOLLIN) != 0);
+	}
+
+	void armPoll(int fd, Registration& registration) {
+		registration.pollData = nextUserData(fd);
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = registration.receiving ? registration.events & ~EPOLLIN
+													: registration.events;
+		sqe->len = registration.multishot ? IORING_POLL_ADD_MULTI : 0;
+		sqe->user_data = registration.pollData;
+	}
+
+	void armAccept(int fd, Registration& registration) {
+		registration.opData = nextUserData(fd);
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_ACCEPT;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+		sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+		sqe->user_data = registration.opData;
+	}
+
+	void armRecv(int fd, Registration& registration) {
+		registration.opData = nextUserData(fd);
+		registration.starved = false;
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_RECV;
+		sqe->fd = fd;
+		sqe->ioprio = IORING_RECV_MULTISHOT;
+		sqe->flags = IOSQE_BUFFER_SELECT;
+		sqe->buf_group = IO_URING_BUFFER_GROUP;
+		sqe->user_data = registration.opData;
+	}
+
+	// a reader that stopped reading is paused once it holds IO_URING_RECV_BACKLOG
+	// buffers, so that it cannot take the whole ring from the others
+	void rearm(int fd, Registration& registration) {
+		if (registration.pollData == 0 && needsPoll(registration)) {
+			armPoll(fd, registration);
+		}
+		if (registration.opData != 0) {
+			return;
+		} else if (registration.accepting) {
+			armAccept(fd, registration);
+		} else if (registration.receiving && !registration.eof && registration.error == 0 &&
+				   registration.received.size() < IO_URING_RECV_BACKLOG) {
+			if (_freeBuffers != 0) {
+				armRecv(fd, registration);
+			} else {
+				armWait(fd, registration);
+			}
+		}
+	}
+
+	// with the ring exhausted, a readiness poll stands in for the recv and the socket is
+	// read directly
+	void armWait(int fd, Registration& registration) {
+		registration.opData = nextUserData(fd);
+		registration.starved = true;
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_POLL_ADD;
+		sqe->fd = fd;
+		sqe->poll32_events = EPOLLIN | EPOLLRDHUP;
+		sqe->user_data = registration.opData;
+	}
+
+	// by user data rather than by descriptor, which may be closed and reused by then
+	void cancel(uint64_t userData) {
+		struct io_uring_sqe* sqe = getSqe();
+		sqe->opcode = IORING_OP_ASYNC_CANCEL;
+		sqe->fd = -1;
+		sqe->addr = userData;
+		sqe->user_data = 0;
+	}
+
+	void cancelPoll(int fd) {
+		std::map<int, Registration>::iterator it = _registrations.find(fd);
+		if (it != _registrations.end() && it->second.pollData != 0) {
+			cancel(it->second.pollData);
+			it->second.pollData = 0;
+		}
+	}
+
+	// completions keep coming until the cancellation lands, their bytes are kept
+	void pauseRecv(Registration& registration) {
+		cancel(registration.opData);
+		registration.cancelling = true;
+	}
+
+	static void closeAccepted(Registration& registration) {
+		for (size_t i = 0; i < registration.accepted.size(); ++i) {
+			close(registration.accepted[i]);
+		}
+		registration.accepted.clear();
+	}
+
+	bool hasCompletions() const {
+		return *_cqHead != __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+	}
+
+	bool hasLevelEvents() {
+		for (std::set<int>::iterator it = _unread.begin(); it != _unread.end(); ++it) {
+			const Registration& registration = _registrations[*it];
+			if (!registration.multishot && (registration.events & EPOLLIN)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static void report(struct epoll_event* events, int& numEvents, std::map<int, int>& slots,
+					   int fd, uint32_t flags) {
+		std::map<int, int>::iterator it = slots.find(fd);
+		if (it != slots.end()) {
+			events[it->second].events |= flags;
+			return;
+		}
+		slots[fd] = numEvents;
+		events[numEvents].data.fd = fd;
+		events[numEvents].events = flags;
+		++numEvents;
+	}
+
+	int reap(struct epoll_event* events, int maxEvents, std::map<int, int>& slots) {
+		unsigned head = *_cqHead;
+		const unsigned tail = __atomic_load_n(_cqTail, __ATOMIC_ACQUIRE);
+		int numEvents = 0;
+		for (; head != tail && numEvents < maxEvents; ++head) {
+			const struct io_uring_cqe& cqe = _cqes[head & _cqMask];
+			if (cqe.user_data == 0) {
+				continue;
+			}
+			const int fd = static_cast<int>(cqe.user_data & 0xffffffff);
+			std::map<int, Registration>::iterator it = _registrations.find(fd);
+			if (it != _registrations.end() && it->second.pollData == cqe.user_data) {
+				reapPoll(it->second, fd, cqe, events, numEvents, slots);
+			} else if (it != _registrations.end() && it->second.opData == cqe.user_data) {
+				reapOp(it->second, fd, cqe, events, numEvents, slots);
+			} else if (_retiredAccepts.count(cqe.user_data)) {
+				reapRetiredAccept(cqe);
+			} else if (cqe.flags & IORING_CQE_F_BUFFER) {
+				--_freeBuffers;
+				recycleBuffer(cqe.flags >> IORING_CQE_BUFFER_SHIFT);
+			}
+		}
+		__atomic_store_n(_cqHead, head, __ATOMIC_RELEASE);
+		return numEvents;
+	}
+
+	// connections accepted while the listener was being cancelled have nowhere to go
+	void reapRetiredAccept(const struct io_uring_cqe& cqe) {
+		if (cqe.res >= 0) {
+			close(cqe.res);
+		}
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			_retiredAccepts.erase(cqe.user_data);
+		}
+	}
+
+	void reapPoll(Registration& registration, int fd, const struct io_uring_cqe& cqe,
+				  struct epoll_event* events, int& numEvents, std::map<int, int>& slots) {
+		if (!registration.multishot || !(cqe.flags & IORING_CQE_F_MORE)) {
+			registration.pollData = 0;
+			_disarmed.push_back(fd);
+		}
+		if (cqe.res != -ECANCELED) {
+			report(events, numEvents, slots, fd,
+				   cqe.res < 0 ? static_cast<uint32_t>(EPOLLERR) : cqe.res);
+		}
+	}
+
+	void reapOp(Registration& registration, int fd, const struct io_uring_cqe& cqe,
+				struct epoll_event* events, int& numEvents, std::map<int, int>& slots) {
+		if (!(cqe.flags & IORING_CQE_F_MORE)) {
+			registration.opData = 0;
+			registration.cancelling = false;
+			_disarmed.push_back(fd);
+		}
+		if (cqe.flags & IORING_CQE_F_BUFFER) {
+			Chunk chunk = {cqe.flags >> IORING_CQE_BUFFER_SHIFT, 0,
+						   static_cast<size_t>(std::max(cqe.res, 0))};
+			--_freeBuffers;
+			if (chunk.length == 0) {
+				recycleBuffer(chunk.id);
+			} else {
+				registration.received.push_back(chunk);
+			}
+			if (registration.received.size() >= IO_URING_RECV_BACKLOG &&
+				registration.opData != 0 && !registration.cancelling) {
+				pauseRecv(registration);
+			}
+		}
+		if (cqe.res == -ECANCELED) {
+			return;
+		} else if (registration.starved || cqe.res == -ENOBUFS) {
+			registration.starved = true;
+		} else if (registration.accepting && cqe.res >= 0) {
+			registration.accepted.push_back(cqe.res);
+		} else if (cqe.res < 0) {
+			registration.error = -cqe.res;
+		} else if (cqe.res == 0) {
+			registration.eof = true;
+		}
+		_unread.insert(fd);
+		if (registration.events & EPOLLIN) {
+			report(events, numEvents, slots, fd, EPOLLIN);
+		}
+	}
+};
@@ -0,0 +1,126 @@
+#pragma once
+
+#include "webserv.hpp"
+
+class HeaderTable {
+public:
+	explicit HeaderTable(Arena* arena = NULL)
+		: _data(ArenaAllocator<char>(arena)), _entries(ArenaAllocator<Entry>(arena)) {
+		std::memset(_index, -1, sizeof(_index));
+	}
+
+	void add(const char* name, size_t nameLength, const char* value, size_t valueLength) {
+		if (_data.capacity() == 0) {
+			_data.reserve(HEADER_TABLE_SIZE);
+			_entries.reserve(HEADER_TABLE_ENTRIES);
+		}
+		Entry entry;
+		entry.nameOffset = _data.size();
+		entry.valueOffset = entry.nameOffset + nameLength + 1;
+		entry.valueLength = valueLength;
+		_data.resize(entry.valueOffset + valueLength + 1);
+		char* p = &_data[entry.nameOffset];
+		lowercaseAscii(p, name, nameLength);
+		p[nameLength] = '\0';
+		std::memcpy(p + nameLength + 1, value, valueLength);
+		p[nameLength + 1 + valueLength] = '\0';
+		entry.id = findHeaderId(p, nameLength);
+		const int existing = find(entry.id, p);
+		if (existing != -1) {
+			_entries[existing] = entry;
+			return;
+		}
+		if (entry.id != HEADER_OTHER) {
+			_index[entry.id] = _entries.size();
+		}
+		_entries.push_back(entry);
+	}
+
+	void set(HeaderId id, const std::string& value) {
+		const char* name = getHeaderName(id);
+		add(name, std::strlen(name), value.c_str(), value.size());
+	}
+
+	void set(const std::string& name, const std::string& value) {
+		add(name.c_str(), name.size(), value.c_str(), value.size());
+	}
+
+	bool has(HeaderId id) const { return _index[id] != -1; }
+
+	const char* get(HeaderId id) const {
+		return _index[id] == -1 ? NULL : &_data[_entries[_index[id]].valueOffset];
+	}
+
+	size_t size() const { return _entries.size(); }
+	HeaderId getId(size_t i) const { return _entries[i].id; }
+	const char* getName(size_t i) const { return &_data[_entries[i].nameOffset]; }
+	const char* getValue(size_t i) const { return &_data[_entries[i].valueOffset]; }
+	size_t getValueLength(size_t i) const { return _entries[i].valueLength; }
+
+	void serialize(std::string& out) const {
+		for (size_t i = 0; i < _entries.size(); ++i) {
+			out += getName(i);
+			out += ": ";
+			out.append(getValue(i), _entries[i].valueLength);
+			out += "\r\n";
+		}
+	}
+
+	void clear() {
+		_data.clear();
+		_entries.clear();
+		std::memset(_index, -1, sizeof(_index));
+	}
+
+	void swap(HeaderTable& other) {
+		_data.swap(other._data);
+		_entries.swap(other._entries);
+		std::swap_ranges(_index, _index + HEADER_OTHER, other._index);
+	}
+
+	static const char* getHeaderName(HeaderId id) {
+		static const char* names[HEADER_OTHER] = {
+			"accept",		 "accept-encoding",	  "accept-language", "authorization",
+			"cache-control", "connection",		  "content-length",	 "content-type",
+			"cookie",		 "date",			  "host",			 "location",
+			"range",		 "referer",			  "server",			 "status",
+			"transfer-encoding", "user-agent",
+		};
+		return id < HEADER_OTHER ? names[id] : "";
+	}
+
+	static HeaderId findHeaderId(const char* name, size_t length) {
+		for (int id = 0; id < HEADER_OTHER; ++id) {
+			const char* known = getHeaderName(static_cast<HeaderId>(id));
+			if (known[0] == name[0] && std::strlen(known) == length &&
+				std::memcmp(known, name, length) == 0) {
+				return static_cast<HeaderId>(id);
+			}
+		}
+		return HEADER_OTHER;
+	}
+
+private:
+	typedef struct Entry {
+		HeaderId id;
+		size_t nameOffset;
+		size_t valueOffset;
+		size_t valueLength;
+	} Entry;
+
+	std::vector<char, ArenaAllocator<char> > _data;
+	std::vector<Entry, ArenaAllocator<Entry> > _entries;
+	int _index[HEADER_OTHER];
+
+	int find(HeaderId id, const char* name) const {
+		if (id != HEADER_OTHER) {
+			return _index[id];
+		}
+		for (size_t i = 0; i < _entries.size(); ++i) {
+			if (_entries[i].id == HEADER_OTHER && std::strcmp(getName(i), name) == 0) {
+				return i;
+			}
+		}
+		return -1;
+	}
+};
@@ -0,0 +1,229 @@
+#pragma once
+
+#include "webserv.hpp"
+
+extern const char* const HPACK_STATIC_TABLE[HPACK_STATIC_TABLE_SIZE][2];
+extern const HpackCode HPACK_HUFFMAN_CODES[HPACK_HUFFMAN_SYMBOLS];
+
+// HPACK header compression for one HTTP/2 connection. Decoding keeps the dynamic table
+// the peer indexes into; encoding only refers to the static table and sends plain
+// literals, which every decoder accepts and which leaves no table state to track.
+class Hpack {
+public:
+	typedef std::vector<std::pair<std::string, std::string> > HeaderList;
+
+	Hpack() : _size(0), _maxSize(HTTP2_HEADER_TABLE_SIZE) {}
+
+	~Hpack(){};
+
+	bool decode(const std::string& block, HeaderList& fields, size_t maxListSize) {
+		size_t pos = 0;
+		size_t listSize = 0;
+		while (pos < block.size()) {
+			const unsigned char byte = block[pos];
+			size_t index;
+			if (byte & 0x80) {
+				if (!decodeInteger(block, pos, 7, index) || !getEntry(index, fields)) {
+					return false;
+				}
+			} else if ((byte & 0xe0) == 0x20) {
+				if (!fields.empty() || !decodeInteger(block, pos, 5, index) ||
+					index > HTTP2_HEADER_TABLE_SIZE) {
+					return false;
+				}
+				_maxSize = index;
+				evict(0);
+				continue;
+			} else {
+				const bool indexed = (byte & 0xc0) == 0x40;
+				if (!decodeInteger(block, pos, indexed ? 6 : 4, index)) {
+					return false;
+				}
+				std::string name, value;
+				if (index != 0) {
+					if (!getEntry(index, fields)) {
+						return false;
+					}
+					name = fields.back().first;
+					fields.pop_back();
+				} else if (!decodeString(block, pos, name)) {
+					return false;
+				}
+				if (!decodeString(block, pos, value)) {
+					return false;
+				}
+				fields.push_back(std::make_pair(name, value));
+				if (indexed) {
+					insert(name, value);
+				}
+			}
+			listSize += fields.back().first.size() + fields.back().second.size() + 32;
+			if (listSize > maxListSize) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	static void encode(const std::string& name, const std::string& value, std::string& out) {
+		size_t nameIndex = 0;
+		for (size_t i = 0; i < HPACK_STATIC_TABLE_SIZE; ++i) {
+			if (name != HPACK_STATIC_TABLE[i][0]) {
+				continue;
+			} else if (value == HPACK_STATIC_TABLE[i][1]) {
+				return encodeInteger(i + 1, 7, 0x80, out);
+			} else if (nameIndex == 0) {
+				nameIndex = i + 1;
+			}
+		}
+		encodeInteger(nameIndex, 4, 0x00, out);
+		if (nameIndex == 0) {
+			encodeString(name, out);
+		}
+		encodeString(value, out);
+	}
+
+private:
+	std::deque<std::pair<std::string, std::string> > _dynamic;
+	size_t _size;
+	size_t _maxSize;
+
+	static bool decodeInteger(const std::string& block, size_t& pos, int prefix,
+							  size_t& value) {
+		const size_t mask = (1 << prefix) - 1;
+		value = static_cast<unsigned char>(block[pos++]) & mask;
+		if (value < mask) {
+			return true;
+		}
+		for (int shift = 0; pos < block.size() && shift < 28; shift += 7) {
+			const unsigned char byte = block[pos++];
+			value += static_cast<size_t>(byte & 0x7f) << shift;
+			if ((byte & 0x80) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static void encodeInteger(size_t value, int prefix, unsigned char flags, std::string& out) {
+		const size_t mask = (1 << prefix) - 1;
+		if (value < mask) {
+			out += static_cast<char>(flags | value);
+			return;
+		}
+		out += static_cast<char>(flags | mask);
+		for (value -= mask; value >= 0x80; value >>= 7) {
+			out += static_cast<char>(0x80 | (value & 0x7f));
+		}
+		out += static_cast<char>(value);
+	}
+
+	static bool decodeString(const std::string& block, size_t& pos, std::string& out) {
+		if (pos >= block.size()) {
+			return false;
+		}
+		const bool huffman = block[pos] & 0x80;
+		size_t length;
+		if (!decodeInteger(block, pos, 7, length) || length > block.size() - pos) {
+			return false;
+		}
+		const size_t begin = pos;
+		pos += length;
+		if (!huffman) {
+			out.assign(block, begin, length);
+			return true;
+		}
+		return decodeHuffman(block.data() + begin, length, out);
+	}
+
+	static void encodeString(const std::string& value, std::string& out) {
+		encodeInteger(value.size(), 7, 0x00, out);
+		out += value;
+	}
+
+	// walks a binary tree of the canonical codes, leaves hold ~symbol
+	static bool decodeHuffman(const char* data, size_t length, std::string& out) {
+		const std::vector<int>& tree = getHuffmanTree();
+		out.clear();
+		out.reserve(length * 8 / 5);
+		int node = 0;
+		int depth = 0;
+		bool ones = true;
+		for (size_t i = 0; i < length; ++i) {
+			for (int bit = 7; bit >= 0; --bit) {
+				const int b = (data[i] >> bit) & 1;
+				node = tree[node * 2 + b];
+				++depth;
+				ones = ones && b == 1;
+				if (node < 0) {
+					if (~node == HPACK_HUFFMAN_SYMBOLS - 1) {
+						return false;
+					}
+					out += static_cast<char>(~node);
+					node = 0;
+					depth = 0;
+					ones = true;
+				} else if (node == 0) {
+					return false;
+				}
+			}
+		}
+		return depth < 8 && ones;
+	}
+
+	static const std::vector<int>& getHuffmanTree() {
+		static std::vector<int> tree;
+		if (!tree.empty()) {
+			return tree;
+		}
+		tree.resize(2, 0);
+		for (int symbol = 0; symbol < HPACK_HUFFMAN_SYMBOLS; ++symbol) {
+			const HpackCode& code = HPACK_HUFFMAN_CODES[symbol];
+			int node = 0;
+			for (int bit = code.length - 1; bit >= 0; --bit) {
+				const int slot = node * 2 + ((code.code >> bit) & 1);
+				if (bit == 0) {
+					tree[slot] = ~symbol;
+				} else {
+					if (tree[slot] == 0) {
+						tree[slot] = tree.size() / 2;
+						tree.resize(tree.size() + 2, 0);
+					}
+					node = tree[slot];
+				}
+			}
+		}
+		return tree;
+	}
+
+	bool getEntry(size_t index, HeaderList& fields) const {
+		if (index == 0) {
+			return false;
+		} else if (index <= HPACK_STATIC_TABLE_SIZE) {
+			fields.push_back(
+				std::make_pair(HPACK_STATIC_TABLE[index - 1][0], HPACK_STATIC_TABLE[index - 1][1]));
+			return true;
+		} else if (index - HPACK_STATIC_TABLE_SIZE > _dynamic.size()) {
+			return false;
+		}
+		fields.push_back(_dynamic[index - HPACK_STATIC_TABLE_SIZE - 1]);
+		return true;
+	}
+
+	// an entry larger than the whole table empties it and is not stored
+	void insert(const std::string& name, const std::string& value) {
+		const size_t size = name.size() + value.size() + 32;
+		evict(size);
+		if (size <= _maxSize) {
+			_dynamic.push_front(std::make_pair(name, value));
+			_size += size;
+		}
+	}
+
+	void evict(size_t incoming) {
+		while (!_dynamic.empty() && _size + incoming > _maxSize) {
+			_size -= _dynamic.back().first.size() + _dynamic.back().second.size() + 32;
+			_dynamic.pop_back();
+		}
+	}
+};
@@ -0,0 +1,838 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Framing, HPACK and flow control of one cleartext HTTP/2 connection. Complete requests are
+// handed out as HTTP/1.1 messages so that each stream goes through the regular request
+// parser and response builders; the HTTP/1.1 responses coming back are turned into
+// HEADERS and DATA frames, sent as far as the stream and connection windows allow.
+class Http2Connection {
+public:
+	explicit Http2Connection(size_t maxBodySize)
+		: _maxBodySize(maxBodySize), _prefaceReceived(0), _inputOffset(0), _outputOffset(0),
+		  _lastStreamId(0), _continuationStream(0), _sendWindow(HTTP2_DEFAULT_WINDOW),
+		  _initialWindow(HTTP2_DEFAULT_WINDOW), _closing(false), _goawaySent(false) {
+		queueSettings();
+	}
+
+	~Http2Connection() {
+		for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end();
+			 ++it) {
+			delete it->second;
+		}
+	}
+
+	static bool& isEnabled() {
+		static bool enabled = true;
+		return enabled;
+	}
+
+	static bool isPreface(const char* data, size_t length) {
+		return isEnabled() && length >= 4 &&
+			   std::memcmp(data, HTTP2_PREFACE, std::min<size_t>(length, HTTP2_PREFACE_SIZE)) == 0;
+	}
+
+	static bool isUpgrade(const RequestParsingResult& result) {
+		if (!isEnabled() || result.result != REQUEST_PARSING_SUCCESS ||
+			!result.success.body.empty()) {
+			return false;
+		}
+		const char* upgrade = findHeader(result.success.headers, "upgrade");
+		const char* connection = result.success.headers.get(HEADER_CONNECTION);
+		return upgrade != NULL && connection != NULL &&
+			   findHeader(result.success.headers, "http2-settings") != NULL &&
+			   strlower(upgrade).find("h2c") != std::string::npos &&
+			   strlower(connection).find("upgrade") != std::string::npos;
+	}
+
+	// the request that carried the upgrade becomes stream 1, already half-closed
+	void upgrade(const RequestParsingResult& result) {
+		std::string settings;
+		decodeBase64(findHeader(result.success.headers, "http2-settings"), settings);
+		const std::string preface = _output.substr(_outputOffset);
+		_output = "HTTP/1.1 101 Switching Protocols\r\nconnection: Upgrade\r\nupgrade: h2c\r\n\r\n";
+		_output += preface;
+		_outputOffset = 0;
+		applySettings(settings);
+		Stream* stream = openStream(1);
+		stream->remoteClosed = true;
+		_prefaceReceived = 0;
+	}
+
+	// false once the connection is beyond repair, a GOAWAY is then waiting to be sent
+	bool receive(const char* data, size_t length) {
+		if (_closing && _goawaySent) {
+			return false;
+		}
+		_input.append(data, length);
+		if (!receivePreface()) {
+			return false;
+		}
+		while (_input.size() - _inputOffset >= HTTP2_FRAME_HEADER_SIZE) {
+			const unsigned char* header =
+				reinterpret_cast<const unsigned char*>(_input.data() + _inputOffset);
+			const size_t frameLength = header[0] << 16 | header[1] << 8 | header[2];
+			if (frameLength > HTTP2_MAX_FRAME_SIZE) {
+				return connectionError(HTTP2_FRAME_SIZE_ERROR);
+			}
+			if (_input.size() - _inputOffset < HTTP2_FRAME_HEADER_SIZE + frameLength) {
+				break;
+			}
+			Frame frame;
+			frame.type = header[3];
+			frame.flags = header[4];
+			frame.streamId = readUint32(header + 5) & 0x7fffffff;
+			frame.payload.assign(_input, _inputOffset + HTTP2_FRAME_HEADER_SIZE, frameLength);
+			_inputOffset += HTTP2_FRAME_HEADER_SIZE + frameLength;
+			if (!handleFrame(frame)) {
+				return false;
+			}
+		}
+		_input.erase(0, _inputOffset);
+		_inputOffset = 0;
+		return true;
+	}
+
+	bool popRequest(uint32_t& id, std::string& request) {
+		while (!_ready.empty()) {
+			id = _ready.front();
+			_ready.pop_front();
+			std::map<uint32_t, Stream*>::iterator it = _streams.find(id);
+			if (it != _streams.end()) {
+				request.swap(it->second->request);
+				std::string().swap(it->second->request);
+				return true;
+			}
+		}
+		return false;
+	}
+
+	bool isStreamOpen(uint32_t id) const { return _streams.find(id) != _streams.end(); }
+
+	// bytes of HTTP/1.1 response a stream may hand over now, the head being exempt from
+	// flow control and the output buffer applying backpressure to every stream; after an
+	// upgrade, clients get only the 101 and settings until their preface arrived
+	size_t getRoom(uint32_t id) const {
+		std::map<uint32_t, Stream*>::const_iterator it = _streams.find(id);
+		const size_t buffered = _output.size() - _outputOffset;
+		if (it == _streams.end() || buffered >= HTTP2_OUTPUT_WATERMARK ||
+			_prefaceReceived < HTTP2_PREFACE_SIZE) {
+			return 0;
+		}
+		const Stream& stream = *it->second;
+		if (!stream.headSent) {
+			return HTTP2_HEAD_ROOM;
+		}
+		const long window = std::min<long>(std::min(_sendWindow, stream.sendWindow),
+										   HTTP2_OUTPUT_WATERMARK - buffered) -
+							stream.pending.size();
+		return window > 0 ? window : 0;
+	}
+
+	void sendResponse(uint32_t id, const std::string& data, bool end) {
+		std::map<uint32_t, Stream*>::iterator it = _streams.find(id);
+		if (it == _streams.end()) {
+			return;
+		}
+		Stream& stream = *it->second;
+		size_t pos = 0;
+		if (!stream.headSent) {
+			stream.head += data;
+			const size_t headEnd = stream.head.find("\r\n\r\n");
+			if (headEnd == std::string::npos) {
+				if (end || stream.head.size() > HTTP2_HEAD_ROOM) {
+					resetStream(id, HTTP2_INTERNAL_ERROR);
+				}
+				return;
+			}
+			pos = data.size() - (stream.head.size() - headEnd - 4);
+			stream.head.resize(headEnd + 2);
+			if (!sendHead(stream)) {
+				return resetStream(id, HTTP2_INTERNAL_ERROR);
+			}
+		}
+		if (stream.chunked) {
+			if (!dechunk(stream, data, pos)) {
+				return resetStream(id, HTTP2_INTERNAL_ERROR);
+			}
+		} else {
+			stream.pending.append(data, pos, std::string::npos);
+		}
+		stream.ending = stream.ending || end;
+		sendData(stream);
+	}
+
+	void resetStream(uint32_t id, Http2ErrorEnum error) {
+		std::map<uint32_t, Stream*>::iterator it = _streams.find(id);
+		if (it == _streams.end()) {
+			return;
+		}
+		std::string payload;
+		appendUint32(payload, error);
+		queueFrame(HTTP2_RST_STREAM, 0, id, payload);
+		closeStream(it);
+	}
+
+	bool hasOutput() const { return _outputOffset < _output.size(); }
+
+	ssize_t flush(int fd) {
+		if (!hasOutput()) {
+			return 0;
+		}
+		ssize_t sent = send(fd, _output.data() + _outputOffset, _output.size() - _outputOffset,
+							MSG_NOSIGNAL);
+		if (sent > 0) {
+			_outputOffset += sent;
+			if (_outputOffset == _output.size() || _outputOffset >= HTTP2_OUTPUT_WATERMARK) {
+				_output.erase(0, _outputOffset);
+				_outputOffset = 0;
+			}
+		}
+		return sent;
+	}
+
+	// graceful shutdown, streams already opened by the peer still get their responses
+	void goAway() {
+		if (!_closing) {
+			std::string payload;
+			appendUint32(payload, _lastStreamId);
+			appendUint32(payload, HTTP2_NO_ERROR);
+			queueFrame(HTTP2_GOAWAY, 0, 0, payload);
+			_closing = true;
+		}
+	}
+
+	// a closing connection is done once its streams are finished and its output sent
+	bool isFinished() const { return _closing && _streams.empty() && !hasOutput(); }
+
+private:
+	typedef struct Frame {
+		unsigned char type;
+		unsigned char flags;
+		uint32_t streamId;
+		std::string payload;
+	} Frame;
+
+	typedef enum ChunkStateEnum {
+		CHUNK_SIZE,
+		CHUNK_EXTENSION,
+		CHUNK_DATA,
+		CHUNK_DATA_END,
+		CHUNK_TRAILER,
+	} ChunkStateEnum;
+
+	typedef struct Stream {
+		uint32_t id;
+		std::string headerBlock;
+		bool headersReceived;
+		bool remoteClosed;
+		std::string request;
+		size_t headLength;
+		std::string declaredLength;
+		size_t bodyLength;
+		long sendWindow;
+		std::string head;
+		bool headSent;
+		bool chunked;
+		ChunkStateEnum chunkState;
+		unsigned long chunkRemaining;
+		std::string pending;
+		bool ending;
+	} Stream;
+
+	size_t _maxBodySize;
+	size_t _prefaceReceived;
+	std::string _input;
+	size_t _inputOffset;
+	std::string _output;
+	size_t _outputOffset;
+	std::map<uint32_t, Stream*> _streams;
+	std::deque<uint32_t> _ready;
+	uint32_t _lastStreamId;
+	uint32_t _continuationStream;
+	long _sendWindow;
+	long _initialWindow;
+	bool _closing;
+	bool _goawaySent;
+	Hpack _decoder;
+
+	Http2Connection(const Http2Connection&);
+	Http2Connection& operator=(const Http2Connection&);
+
+	static const char* findHeader(const HeaderTable& headers, const char* name) {
+		for (size_t i = 0; i < headers.size(); ++i) {
+			if (std::strcmp(headers.getName(i), name) == 0) {
+				return headers.getValue(i);
+			}
+		}
+		return NULL;
+	}
+
+	static uint32_t readUint32(const unsigned char* p) {
+		return static_cast<uint32_t>(p[0]) << 24 | p[1] << 16 | p[2] << 8 | p[3];
+	}
+
+	static void appendUint32(std::string& out, uint32_t value) {
+		out += static_cast<char>(value >> 24);
+		out += static_cast<char>(value >> 16);
+		out += static_cast<char>(value >> 8);
+		out += static_cast<char>(value);
+	}
+
+	static void decodeBase64(const std::string& in, std::string& out) {
+		unsigned int buffer = 0;
+		int bits = 0;
+		for (size_t i = 0; i < in.size(); ++i) {
+			const char c = in[i];
+			int value = std::isupper(c)	  ? c - 'A'
+						: std::islower(c) ? c - 'a' + 26
+						: std::isdigit(c) ? c - '0' + 52
+						: c == '-' || c == '+' ? 62
+						: c == '_' || c == '/' ? 63
+											   : -1;
+			if (value < 0) {
+				continue;
+			}
+			buffer = buffer << 6 | value;
+			bits += 6;
+			if (bits >= 8) {
+				bits -= 8;
+				out += static_cast<char>(buffer >> bits & 0xff);
+			}
+		}
+	}
+
+	void queueFrame(unsigned char type, unsigned char flags, uint32_t streamId,
+					const std::string& payload) {
+		queueFrame(type, flags, streamId, payload.data(), payload.size());
+	}
+
+	void queueFrame(unsigned char type, unsigned char flags, uint32_t streamId,
+					const char* payload, size_t length) {
+		_output += static_cast<char>(length >> 16);
+		_output += static_cast<char>(length >> 8);
+		_output += static_cast<char>(length);
+		_output += static_cast<char>(type);
+		_output += static_cast<char>(flags);
+		appendUint32(_output, streamId);
+		_output.append(payload, length);
+	}
+
+	void queueSettings() {
+		std::string payload;
+		payload += '\0';
+		payload += static_cast<char>(HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS);
+		appendUint32(payload, HTTP2_MAX_STREAMS);
+		payload += '\0';
+		payload += static_cast<char>(HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE);
+		appendUint32(payload, MAX_HEADER_SIZE);
+		queueFrame(HTTP2_SETTINGS, 0, 0, payload);
+	}
+
+	void queueWindowUpdate(uint32_t streamId, size_t increment) {
+		std::string payload;
+		appendUint32(payload, increment);
+		queueFrame(HTTP2_WINDOW_UPDATE, 0, streamId, payload);
+	}
+
+	bool connectionError(Http2ErrorEnum error) {
+		if (!_goawaySent) {
+			std::string payload;
+			appendUint32(payload, _lastStreamId);
+			appendUint32(payload, error);
+			queueFrame(HTTP2_GOAWAY, 0, 0, payload);
+		}
+		_closing = true;
+		_goawaySent = true;
+		for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end();
+			 ++it) {
+			delete it->second;
+		}
+		_streams.clear();
+		_ready.clear();
+		return false;
+	}
+
+	bool receivePreface() {
+		while (_prefaceReceived < HTTP2_PREFACE_SIZE && _inputOffset < _input.size()) {
+			if (_input[_inputOffset++] != HTTP2_PREFACE[_prefaceReceived++]) {
+				return connectionError(HTTP2_PROTOCOL_ERROR);
+			}
+		}
+		return true;
+	}
+
+	bool handleFrame(Frame& frame) {
+		if (_continuationStream != 0 &&
+			(frame.type != HTTP2_CONTINUATION || frame.streamId != _continuationStream)) {
+			return connectionError(HTTP2_PROTOCOL_ERROR);
+		}
+		switch (frame.type) {
+		case HTTP2_DATA:
+			return handleData(frame);
+		case HTTP2_HEADERS:
+			return handleHeaders(frame);
+		case HTTP2_PRIORITY:
+			return frame.streamId != 0 && frame.payload.size() == 5
+					   ? true
+					   : connectionError(HTTP2_PROTOCOL_ERROR);
+		case HTTP2_RST_STREAM:
+			return handleRstStream(frame);
+		case HTTP2_SETTINGS:
+			return handleSettings(frame);
+		case HTTP2_PUSH_PROMISE:
+			return connectionError(HTTP2_PROTOCOL_ERROR);
+		case HTTP2_PING:
+			return handlePing(frame);
+		case HTTP2_GOAWAY:
+			_closing = true;
+			return true;
+		case HTTP2_WINDOW_UPDATE:
+			return handleWindowUpdate(frame);
+		case HTTP2_CONTINUATION:
+			return handleContinuation(frame);
+		default:
+			return true;
+		}
+	}
+
+	// strips the padding, and the priority fields of HEADERS frames
+	static bool removePadding(Frame& frame, size_t prefix) {
+		size_t padding = 0;
+		if (frame.flags & HTTP2_FLAG_PADDED) {
+			if (frame.payload.empty()) {
+				return false;
+			}
+			padding = static_cast<unsigned char>(frame.payload[0]);
+			frame.payload.erase(0, 1);
+		}
+		if (padding + prefix > frame.payload.size()) {
+			return false;
+		}
+		frame.payload.erase(frame.payload.size() - padding);
+		frame.payload.erase(0, prefix);
+		return true;
+	}
+
+	bool handleData(Frame& frame) {
+		const size_t length = frame.payload.size();
+		if (frame.streamId == 0 || !removePadding(frame, 0)) {
+			return connectionError(HTTP2_PROTOCOL_ERROR);
+		}
+		if (length != 0) {
+			queueWindowUpdate(0, length);
+		}
+		std::map<uint32_t, Stream*>::iterator it = _streams.find(frame.streamId);
+		if (it == _streams.end()) {
+			return frame.streamId <= _lastStreamId ? true : connectionError(HTTP2_PROTOCOL_ERROR);
+		}
+		Stream& stream = *it->second;
+		if (stream.remoteClosed || !stream.headersReceived) {
+			resetStream(frame.streamId, HTTP2_STREAM_CLOSED);
+			return true;
+		}
+		stream.bodyLength += frame.payload.size();
+		if (stream.bodyLength <= _maxBodySize) {
+			stream.request += frame.payload;
+		} else {
+			stream.request.resize(stream.headLength);
+		}
+		if (frame.flags & HTTP2_FLAG_END_STREAM) {
+			finishRequest(stream);
+		} else if (length != 0) {
+			queueWindowUpdate(frame.streamId, length);
+		}
+		return true;
+	}
+
+	bool handleHeaders(Frame& frame) {
+		const size_t prefix = frame.flags & HTTP2_FLAG_PRIORITY ? 5 : 0;
+		if (frame.streamId == 0 || !removePadding(frame, prefix)) {
+			return connectionError(HTTP2_PROTOCOL_ERROR);
+		}
+		std::map<uint32_t, Stream*>::iterator it = _streams.find(frame.streamId);
+		Stream* stream = it == _streams.end() ? NULL : it->second;
+		if (stream == NULL) {
+			if (frame.streamId % 2 == 0 || frame.streamId <= _lastStreamId) {
+				return connectionError(HTTP2_PROTOCOL_ERROR);
+			}
+			stream = openStream(frame.streamId);
+		} else if (stream->remoteClosed) {
+			return connectionError(HTTP2_STREAM_CLOSED);
+		}
+		stream->headerBlock = frame.payload;
+		stream->remoteClosed = frame.flags & HTTP2_FLAG_END_STREAM;
+		if (!(frame.flags & HTTP2_FLAG_END_HEADERS)) {
+			_continuationStream = frame.streamId;
+			return true;
+		}
+		return finishHeaders(*stream);
+	}
+
+	bool handleContinuation(Frame& frame) {
+		if (_continuationStream == 0 || frame.streamId != _continuationStream) {
+			return connectionError(HTTP2_PROTOCOL_ERROR);
+		}
+		Stream& stream = *_streams.find(frame.streamId)->second;
+		stream.headerBlock += frame.payload;
+		if (stream.headerBlock.size() > MAX_HEADER_SIZE * 2) {
+			return connectionError(HTTP2_ENHANCE_YOUR_CALM);
+		}
+		if (!(frame.flags & HTTP2_FLAG_END_HEADERS)) {
+			return true;
+		}
+		_continuationStream = 0;
+		return finishHeaders(stream);
+	}
+
+	bool handleRstStream(const Frame& frame) {
+		if (frame.streamId == 0 || frame.payload.size() != 4) {
+			return connectionError(HTTP2_PROTOCOL_ERROR);
+		}
+		std::map<uint32_t, Stream*>::iterator it = _streams.find(frame.streamId);
+		if (it != _streams.end()) {
+			closeStream(it);
+		}
+		return true;
+	}
+
+	bool handleSettings(const Frame& frame) {
+		if (frame.streamId != 0 || frame.payload.size() % 6 != 0 ||
+			((frame.flags & HTTP2_FLAG_ACK) && !frame.payload.empty())) {
+			return connectionError(HTTP2_PROTOCOL_ERROR);
+		}
+		if (frame.flags & HTTP2_FLAG_ACK) {
+			return true;
+		}
+		if (!applySettings(frame.payload)) {
+			return false;
+		}
+		queueFrame(HTTP2_SETTINGS, HTTP2_FLAG_ACK, 0, "");
+		return true;
+	}
+
+	// only the initial window matters: frames are never larger than the default maximum
+	// and responses are encoded without the dynamic table
+	bool applySettings(const std::string& payload) {
+		const unsigned char* p = reinterpret_cast<const unsigned char*>(payload.data());
+		for (size_t i = 0; i + 6 <= payload.size(); i += 6) {
+			const int id = p[i] << 8 | p[i + 1];
+			const uint32_t value = readUint32(p + i + 2);
+			if (id == HTTP2_SETTINGS_INITIAL_WINDOW_SIZE) {
+				if (value > HTTP2_MAX_WINDOW) {
+					return connectionError(HTTP2_FLOW_CONTROL_ERROR);
+				}
+				const long delta = static_cast<long>(value) - _initialWindow;
+				_initialWindow = value;
+				for (std::map<uint32_t, Stream*>::iterator it = _streams.begin();
+					 it != _streams.end(); ++it) {
+					it->second->sendWindow += delta;
+				}
+				sendAllData();
+			} else if (id == HTTP2_SETTINGS_ENABLE_PUSH && value > 1) {
+				return connectionError(HTTP2_PROTOCOL_ERROR);
+			} else if (id == HTTP2_SETTINGS_MAX_FRAME_SIZE &&
+					   (value < HTTP2_MAX_FRAME_SIZE || value > 16777215)) {
+				return connectionError(HTTP2_PROTOCOL_ERROR);
+			}
+		}
+		return true;
+	}
+
+	bool handlePing(const Frame& frame) {
+		if (frame.streamId != 0 || frame.payload.size() != 8) {
+			return connectionError(HTTP2_PROTOCOL_ERROR);
+		}
+		if (!(frame.flags & HTTP2_FLAG_ACK)) {
+			queueFrame(HTTP2_PING, HTTP2_FLAG_ACK, 0, frame.payload);
+		}
+		return true;
+	}
+
+	bool handleWindowUpdate(const Frame& frame) {
+		if (frame.payload.size() != 4) {
+			return connectionError(HTTP2_FRAME_SIZE_ERROR);
+		}
+		const uint32_t increment =
+			readUint32(reinterpret_cast<const unsigned char*>(frame.payload.data())) & 0x7fffffff;
+		if (frame.streamId == 0) {
+			if (increment == 0 || _sendWindow + increment > HTTP2_MAX_WINDOW) {
+				return connectionError(increment == 0 ? HTTP2_PROTOCOL_ERROR
+													  : HTTP2_FLOW_CONTROL_ERROR);
+			}
+			_sendWindow += increment;
+			sendAllData();
+			return true;
+		}
+		std::map<uint32_t, Stream*>::iterator it = _streams.find(frame.streamId);
+		if (it == _streams.end()) {
+			return true;
+		}
+		if (increment == 0 || it->second->sendWindow + increment > HTTP2_MAX_WINDOW) {
+			resetStream(frame.streamId,
+						increment == 0 ? HTTP2_PROTOCOL_ERROR : HTTP2_FLOW_CONTROL_ERROR);
+			return true;
+		}
+		it->second->sendWindow += increment;
+		sendData(*it->second);
+		return true;
+	}
+
+	Stream* openStream(uint32_t id) {
+		Stream* stream = new Stream();
+		stream->id = id;
+		stream->headersReceived = false;
+		stream->remoteClosed = false;
+		stream->headLength = 0;
+		stream->bodyLength = 0;
+		stream->sendWindow = _initialWindow;
+		stream->headSent = false;
+		stream->chunked = false;
+		stream->chunkState = CHUNK_SIZE;
+		stream->chunkRemaining = 0;
+		stream->ending = false;
+		_streams[id] = stream;
+		_lastStreamId = id;
+		return stream;
+	}
+
+	void closeStream(std::map<uint32_t, Stream*>::iterator it) {
+		delete it->second;
+		_streams.erase(it);
+	}
+
+	// the block is decoded even for refused streams, to keep the dynamic table in sync
+	bool finishHeaders(Stream& stream) {
+		Hpack::HeaderList fields;
+		if (!_decoder.decode(stream.headerBlock, fields, MAX_HEADER_SIZE)) {
+			return connectionError(HTTP2_COMPRESSION_ERROR);
+		}
+		std::string().swap(stream.headerBlock);
+		if (stream.headersReceived) {
+			if (!stream.remoteClosed) {
+				resetStream(stream.id, HTTP2_PROTOCOL_ERROR);
+			} else {
+				finishRequest(stream);
+			}
+			return true;
+		}
+		stream.headersReceived = true;
+		if (_closing || _streams.size() > HTTP2_MAX_STREAMS) {
+			resetStream(stream.id, HTTP2_REFUSED_STREAM);
+		} else if (!buildRequestHead(stream, fields)) {
+			resetStream(stream.id, HTTP2_PROTOCOL_ERROR);
+		} else if (stream.remoteClosed) {
+			finishRequest(stream);
+		}
+		return true;
+	}
+
+	static bool isValidField(const std::string& name, const std::string& value) {
+		if (name.empty() || value.find_first_of("\r\n", 0, 3) != std::string::npos) {
+			return false;
+		}
+		for (size_t i = name[0] == ':' ? 1 : 0; i < name.size(); ++i) {
+			if (!std::isgraph(name[i]) || std::isupper(name[i]) || name[i] == ':') {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// pseudo-headers become the request line and host, hop-by-hop fields are malformed
+	bool buildRequestHead(Stream& stream, const Hpack::HeaderList& fields) {
+		std::string method, path, authority, scheme, headers, cookies;
+		bool regular = false;
+		for (size_t i = 0; i < fields.size(); ++i) {
+			const std::string& name = fields[i].first;
+			const std::string& value = fields[i].second;
+			if (!isValidField(name, value)) {
+				return false;
+			}
+			if (name[0] == ':') {
+				std::string* target = name == ":method"	   ? &method
+									  : name == ":path"	   ? &path
+									  : name == ":scheme"	   ? &scheme
+									  : name == ":authority" ? &authority
+															 : NULL;
+				if (regular || target == NULL || !target->empty() || value.empty()) {
+					return false;
+				}
+				*target = value;
+				continue;
+			}
+			regular = true;
+			if (name == "connection" || name == "keep-alive" || name == "proxy-connection" ||
+				name == "transfer-encoding" || name == "upgrade" ||
+				(name == "te" && value != "trailers")) {
+				return false;
+			} else if (name == "cookie") {
+				cookies += (cookies.empty() ? "" : "; ") + value;
+				continue;
+			} else if (name == "content-length") {
+				stream.declaredLength = value;
+				continue;
+			} else if (name == "host" && !authority.empty()) {
+				continue;
+			}
+			headers += name + ": " + value + "\r\n";
+		}
+		if (method.empty() || path.empty() || scheme.empty() || method == "CONNECT") {
+			return false;
+		}
+		stream.request = method + " " + path + " " HTTP_VERSION "\r\n";
+		if (!authority.empty()) {
+			stream.request += "host: " + authority + "\r\n";
+		}
+		stream.request += headers;
+		if (!cookies.empty()) {
+			stream.request += "cookie: " + cookies + "\r\n";
+		}
+		stream.headLength = stream.request.size();
+		return true;
+	}
+
+	// bodies over the largest client_max_body_size are dropped, their length alone makes
+	// the parser answer 413
+	void finishRequest(Stream& stream) {
+		stream.remoteClosed = true;
+		if (!stream.declaredLength.empty() &&
+			stream.declaredLength != toString(stream.bodyLength)) {
+			return resetStream(stream.id, HTTP2_PROTOCOL_ERROR);
+		}
+		const std::string body = stream.request.substr(stream.headLength);
+		stream.request.resize(stream.headLength);
+		if (stream.bodyLength != 0 || stream.request.compare(0, 5, "POST ") == 0) {
+			stream.request += "content-length: " + toString(stream.bodyLength) + "\r\n";
+		}
+		stream.request += "\r\n" + body;
+		_ready.push_back(stream.id);
+	}
+
+	bool sendHead(Stream& stream) {
+		const std::string& head = stream.head;
+		size_t end = head.find("\r\n");
+		if (head.size() < 12 || head.compare(0, 5, "HTTP/") != 0) {
+			return false;
+		}
+		std::string block;
+		Hpack::encode(":status", head.substr(9, 3), block);
+		for (size_t begin = end + 2; begin < head.size(); begin = end + 2) {
+			end = head.find("\r\n", begin);
+			const std::string line = head.substr(begin, end - begin);
+			const size_t colon = line.find(':');
+			if (colon == std::string::npos) {
+				continue;
+			}
+			const std::string name = strlower(line.substr(0, colon));
+			const std::string value = strtrim(line.substr(colon + 1), SPACES);
+			if (name == "transfer-encoding") {
+				stream.chunked = strlower(value).find("chunked") != std::string::npos;
+				continue;
+			} else if (name == "connection" || name == "keep-alive" ||
+					   name == "proxy-connection" || name == "upgrade") {
+				continue;
+			}
+			Hpack::encode(name, value, block);
+		}
+		for (size_t offset = 0; offset == 0 || offset < block.size();
+			 offset += HTTP2_MAX_FRAME_SIZE) {
+			const bool last = offset + HTTP2_MAX_FRAME_SIZE >= block.size();
+			queueFrame(offset == 0 ? HTTP2_HEADERS : HTTP2_CONTINUATION,
+					   last ? HTTP2_FLAG_END_HEADERS : 0, stream.id,
+					   block.substr(offset, HTTP2_MAX_FRAME_SIZE));
+		}
+		std::string().swap(stream.head);
+		stream.headSent = true;
+		return true;
+	}
+
+	// chunked bodies from CGI or upstreams are unwrapped, HTTP/2 frames the data itself
+	bool dechunk(Stream& stream, const std::string& data, size_t pos) {
+		for (size_t i = pos; i < data.size(); ++i) {
+			const char c = data[i];
+			switch (stream.chunkState) {
+			case CHUNK_SIZE:
+				if (std::isxdigit(c)) {
+					if (stream.chunkRemaining > ULONG_MAX >> 4) {
+						return false;
+					}
+					stream.chunkRemaining = stream.chunkRemaining << 4 |
+											(std::isdigit(c) ? c - '0' : std::tolower(c) - 'a' + 10);
+					break;
+				} else if (c != '\n') {
+					stream.chunkState = CHUNK_EXTENSION;
+					break;
+				}
+				// fall through
+			case CHUNK_EXTENSION:
+				if (c == '\n') {
+					stream.chunkState = stream.chunkRemaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+				}
+				break;
+			case CHUNK_DATA: {
+				const size_t length = std::min<size_t>(stream.chunkRemaining, data.size() - i);
+				stream.pending.append(data, i, length);
+				stream.chunkRemaining -= length;
+				i += length - 1;
+				if (stream.chunkRemaining == 0) {
+					stream.chunkState = CHUNK_DATA_END;
+				}
+				break;
+			}
+			case CHUNK_DATA_END:
+				if (c == '\n') {
+					stream.chunkState = CHUNK_SIZE;
+				}
+				break;
+			case CHUNK_TRAILER:
+				break;
+			}
+		}
+		return true;
+	}
+
+	void sendAllData() {
+		std::vector<uint32_t> ids;
+		for (std::map<uint32_t, Stream*>::iterator it = _streams.begin(); it != _streams.end();
+			 ++it) {
+			ids.push_back(it->first);
+		}
+		for (size_t i = 0; i < ids.size(); ++i) {
+			std::map<uint32_t, Stream*>::iterator it = _streams.find(ids[i]);
+			if (it != _streams.end()) {
+				sendData(*it->second);
+			}
+		}
+	}
+
+	void sendData(Stream& stream) {
+		if (!stream.headSent) {
+			return;
+		}
+		size_t offset = 0;
+		while (offset < stream.pending.size()) {
+			const long window = std::min(_sendWindow, stream.sendWindow);
+			if (window <= 0) {
+				stream.pending.erase(0, offset);
+				return;
+			}
+			const size_t length = std::min(stream.pending.size() - offset,
+										   std::min<size_t>(window, HTTP2_MAX_FRAME_SIZE));
+			const bool last = stream.ending && offset + length == stream.pending.size();
+			queueFrame(HTTP2_DATA, last ? HTTP2_FLAG_END_STREAM : 0, stream.id,
+					   stream.pending.data() + offset, length);
+			offset += length;
+			_sendWindow -= length;
+			stream.sendWindow -= length;
+			if (last) {
+				return closeStream(_streams.find(stream.id));
+			}
+		}
+		stream.pending.clear();
+		if (stream.ending) {
+			queueFrame(HTTP2_DATA, HTTP2_FLAG_END_STREAM, stream.id, "");
+			closeStream(_streams.find(stream.id));
+		}
+	}
+};
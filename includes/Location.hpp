@@ -8,7 +8,16 @@ public:
 			 const std::vector<std::string>& serverIndexPages,
 			 const std::pair<long, std::string>& serverReturn)
 		: _modifier(DIRECTORY), _rootDir(rootDir), _uploadDir(""), _autoIndex(autoIndex),
-		  _return(-1, ""), _serverIndexPages(serverIndexPages), _serverReturn(serverReturn) {
+		  _return(-1, ""), _stubStatus(false), _cgiCacheTtl(0), _cgiCacheStale(0),
+		  _uploadPartSize(0),
+		  _serverIndexPages(serverIndexPages),
+		  _serverReturn(serverReturn), _requestCount(0) {
+		std::memset(&_proxy.address, 0, sizeof(_proxy.address));
+		_proxy.upstream = NULL;
+		_proxy.cache = NULL;
+		_proxy.cacheValid = 0;
+		_proxy.connectTimeout = DEFAULT_PROXY_TIMEOUT;
+		_proxy.readTimeout = DEFAULT_PROXY_TIMEOUT;
 		initKeywordMap();
 		initAllowedMethods(_allowedMethods);
 	}
@@ -59,7 +68,7 @@ public:
 				}
 				checkIndexPages();
 				checkReturn();
-				return checkUpload();
+				return getProxyConfig() != NULL || checkUpload();
 			} else {
 				try {
 					KeywordHandler handler = _keywordHandlers.at(keyword);
@@ -89,15 +98,83 @@ public:
 	}
 
 	LocationModifierEnum getModifier() const { return _modifier; }
-	std::string getUri() const { return _uri; }
-	std::string getRootDir() const { return _rootDir; }
-	std::string getUploadDir() const { return _uploadDir; }
-	std::string getCgiExec() const { return _cgiExec; }
+	std::string const& getUri() const { return _uri; }
+	std::string const& getRootDir() const { return _rootDir; }
+	std::string const& getUploadDir() const { return _uploadDir; }
+	std::string const& getCgiExec() const { return _cgiExec; }
 	bool getAutoIndex() const { return _autoIndex; }
-	std::pair<long, std::string> getReturn() const { return _return; }
+	std::pair<long, std::string> const& getReturn() const { return _return; }
 	const bool* getAllowedMethods() const { return _allowedMethods; }
 	std::map<int, std::string> const& getErrorPages() const { return _errorPages; }
 	std::vector<std::string> const& getIndexPages() const { return _indexPages; }
+	bool getStubStatus() const { return _stubStatus; }
+	unsigned long getCgiCacheTtl() const { return _cgiCacheTtl; }
+	unsigned long getCgiCacheStale() const { return _cgiCacheStale; }
+	size_t getUploadPartSize() const { return _uploadPartSize; }
+	const ProxyConfig* getProxyConfig() const { return _proxy.host.empty() ? NULL : &_proxy; }
+
+	// whether a POST here ends up written to the upload directory
+	bool storesUploads() const {
+		return !_uploadDir.empty() && _cgiExec.empty() && _allowedMethods[POST] &&
+			   _return.first == -1 && !_stubStatus && _proxy.host.empty();
+	}
+	ErrorPage& getRenderedReturn() { return _renderedReturn; }
+	unsigned long getRequestCount() const { return _requestCount; }
+
+	void countRequest() { ++_requestCount; }
+
+	ErrorPage* findErrorPage(StatusCode statusCode) {
+		std::map<int, ErrorPage>::iterator it = _renderedErrorPages.find(statusCode);
+		return it == _renderedErrorPages.end() ? NULL : &it->second;
+	}
+
+	void renderErrorPages(const std::map<int, std::string>& serverErrorPages,
+						  const std::string& serverRootDir) {
+		for (std::map<int, std::string>::const_iterator it = _errorPages.begin();
+			 it != _errorPages.end(); ++it) {
+			if (!_renderedErrorPages[it->first].render(static_cast<StatusCode>(it->first),
+													   "." + _rootDir + it->second, "")) {
+				_renderedErrorPages.erase(it->first);
+			}
+		}
+		if (_return.first != -1) {
+			const StatusCode statusCode = static_cast<StatusCode>(_return.first);
+			std::map<int, std::string>::const_iterator location = _errorPages.find(statusCode);
+			std::map<int, std::string>::const_iterator server = serverErrorPages.find(statusCode);
+			_renderedReturn.render(statusCode,
+								   location != _errorPages.end() ? "." + _rootDir + location->second
+								   : server != serverErrorPages.end()
+									   ? "." + serverRootDir + server->second
+									   : "",
+								   _return.second);
+		}
+	}
+
+	bool resolveUpstream(std::map<std::string, UpstreamGroup>& upstreams) {
+		if (_upstreamName.empty()) {
+			return true;
+		}
+		std::map<std::string, UpstreamGroup>::iterator it = upstreams.find(_upstreamName);
+		if (it == upstreams.end()) {
+			return configFileError("unknown upstream in proxy_pass: " + _upstreamName);
+		}
+		_proxy.upstream = &it->second;
+		return true;
+	}
+
+	bool resolveProxyCache(std::map<std::string, ProxyCache*>& caches) {
+		if (_proxyCacheName.empty()) {
+			return true;
+		}
+		std::map<std::string, ProxyCache*>::iterator it = caches.find(_proxyCacheName);
+		if (it == caches.end()) {
+			return configFileError("unknown keys_zone in proxy_cache: " + _proxyCacheName);
+		} else if (getProxyConfig() == NULL) {
+			return configFileError("proxy_cache without proxy_pass in location " + _uri);
+		}
+		_proxy.cache = it->second;
+		return true;
+	}
 
 private:
 	typedef bool (Location::*KeywordHandler)(std::istringstream&);
@@ -109,22 +186,40 @@ private:
 	std::string _cgiExec;
 	bool _autoIndex;
 	std::pair<long, std::string> _return;
+	bool _stubStatus;
+	unsigned long _cgiCacheTtl;
+	unsigned long _cgiCacheStale;
+	size_t _uploadPartSize;
 	bool _allowedMethods[NO_METHOD];
 	std::map<int, std::string> _errorPages;
+	std::map<int, ErrorPage> _renderedErrorPages;
+	ErrorPage _renderedReturn;
 	std::vector<std::string> _indexPages;
 	const std::vector<std::string>& _serverIndexPages;
 	const std::pair<long, std::string>& _serverReturn;
+	ProxyConfig _proxy;
+	std::string _upstreamName;
+	std::string _proxyCacheName;
 	std::map<std::string, KeywordHandler> _keywordHandlers;
+	unsigned long _requestCount;
 
 	void initKeywordMap() {
 		_keywordHandlers["root"] = &Location::parseRoot;
 		_keywordHandlers["upload_directory"] = &Location::parseUploadDir;
+		_keywordHandlers["upload_max_part_size"] = &Location::parseUploadPartSize;
 		_keywordHandlers["autoindex"] = &Location::parseAutoIndex;
 		_keywordHandlers["error_page"] = &Location::parseErrorPages;
 		_keywordHandlers["index"] = &Location::parseIndex;
 		_keywordHandlers["return"] = &Location::parseReturn;
 		_keywordHandlers["limit_except"] = &Location::parseLimitExcept;
 		_keywordHandlers["cgi"] = &Location::parseCgi;
+		_keywordHandlers["cgi_cache"] = &Location::parseCgiCache;
+		_keywordHandlers["stub_status"] = &Location::parseStubStatus;
+		_keywordHandlers["proxy_pass"] = &Location::parseProxyPass;
+		_keywordHandlers["proxy_connect_timeout"] = &Location::parseProxyConnectTimeout;
+		_keywordHandlers["proxy_read_timeout"] = &Location::parseProxyReadTimeout;
+		_keywordHandlers["proxy_cache"] = &Location::parseProxyCache;
+		_keywordHandlers["proxy_cache_valid"] = &Location::parseProxyCacheValid;
 	}
 
 	bool parseAutoIndex(std::istringstream& iss) { return ::parseAutoIndex(iss, _autoIndex); }
@@ -152,6 +247,120 @@ private:
 		return true;
 	}
 
+	bool parseCgiCache(std::istringstream& iss) {
+		std::string value;
+		if (!(iss >> value)) {
+			return configFileError("missing information after cgi_cache keyword");
+		}
+		if (!parseDuration(value, _cgiCacheTtl) || _cgiCacheTtl == 0) {
+			return configFileError("invalid duration in cgi_cache: " + value);
+		}
+		while (iss >> value) {
+			if (!startswith(value, "stale=") || !parseDuration(value.substr(6), _cgiCacheStale)) {
+				return configFileError("invalid parameter in cgi_cache: " + value);
+			}
+		}
+		return true;
+	}
+
+	bool parseStubStatus(std::istringstream& iss) {
+		std::string value;
+		if (iss >> value) {
+			return configFileError("too many arguments after stub_status keyword");
+		}
+		_stubStatus = true;
+		return true;
+	}
+
+	bool parseProxyPass(std::istringstream& iss) {
+		std::string url, extra;
+		if (!(iss >> url)) {
+			return configFileError("missing information after proxy_pass keyword");
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after proxy_pass keyword");
+		}
+		if (!startswith(url, "http://")) {
+			return configFileError("proxy_pass url must start with http://: " + url);
+		}
+		const size_t slash = url.find('/', 7);
+		const std::string hostPort = url.substr(7, slash == std::string::npos ? slash : slash - 7);
+		const size_t colon = hostPort.find(':');
+		const std::string host = hostPort.substr(0, colon);
+		long port = 80;
+		if (colon != std::string::npos) {
+			const std::string portString = hostPort.substr(colon + 1);
+			if (portString.empty() || portString.find_first_not_of("0123456789") != std::string::npos ||
+				portString.size() > 5 || (port = std::strtol(portString.c_str(), NULL, 10)) == 0 ||
+				port > MAX_PORT) {
+				return configFileError("invalid port in proxy_pass: " + url);
+			}
+		}
+		_proxy.host = hostPort;
+		if (colon == std::string::npos && !host.empty() &&
+			host.find_first_not_of("0123456789.") != std::string::npos && host != "localhost") {
+			_upstreamName = host;
+		} else if (host.empty() || host == "*" ||
+				   !getIpValue(host, _proxy.address.sin_addr.s_addr)) {
+			return configFileError("invalid IPv4 address in proxy_pass: " + url);
+		}
+		_proxy.address.sin_family = AF_INET;
+		_proxy.address.sin_port = htons(port);
+		_proxy.uri = slash == std::string::npos ? "" : url.substr(slash);
+		if (!_proxy.uri.empty() && _modifier != DIRECTORY) {
+			return configFileError("proxy_pass cannot have a uri part in a regex or exact location");
+		}
+		return true;
+	}
+
+	bool parseProxyConnectTimeout(std::istringstream& iss) {
+		return parseProxyTimeout(iss, _proxy.connectTimeout, "proxy_connect_timeout");
+	}
+
+	bool parseProxyReadTimeout(std::istringstream& iss) {
+		return parseProxyTimeout(iss, _proxy.readTimeout, "proxy_read_timeout");
+	}
+
+	bool parseProxyCache(std::istringstream& iss) {
+		std::string extra;
+		if (!(iss >> _proxyCacheName)) {
+			return configFileError("missing information after proxy_cache keyword");
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after proxy_cache keyword");
+		}
+		return true;
+	}
+
+	bool parseProxyCacheValid(std::istringstream& iss) {
+		std::string value, extra;
+		if (!(iss >> value)) {
+			return configFileError("missing information after proxy_cache_valid keyword");
+		}
+		if (!parseDuration(value, _proxy.cacheValid) || _proxy.cacheValid == 0) {
+			return configFileError("invalid duration in proxy_cache_valid: " + value);
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after proxy_cache_valid keyword");
+		}
+		return true;
+	}
+
+	static bool parseProxyTimeout(std::istringstream& iss, unsigned long& timeout,
+								  const std::string& keyword) {
+		std::string value, extra;
+		if (!(iss >> value)) {
+			return configFileError("missing information after " + keyword + " keyword");
+		}
+		if (!parseDuration(value, timeout) || timeout == 0) {
+			return configFileError("invalid duration in " + keyword + ": " + value);
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after " + keyword + " keyword");
+		}
+		return true;
+	}
+
 	bool parseRoot(std::istringstream& iss) {
 		return ::parseDirectory(iss, _rootDir, "location", "root") &&
 			   validateUri(_rootDir, "location root");
@@ -162,6 +371,20 @@ private:
 			   validateUri(_uploadDir, "location upload_directory");
 	}
 
+	bool parseUploadPartSize(std::istringstream& iss) {
+		std::string value, extra;
+		if (!(iss >> value)) {
+			return configFileError("missing information after upload_max_part_size keyword");
+		}
+		if (!parseByteSize(value, _uploadPartSize) || _uploadPartSize == 0) {
+			return configFileError("invalid size in upload_max_part_size: " + value);
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after upload_max_part_size keyword");
+		}
+		return true;
+	}
+
 	bool parseLimitExcept(std::istringstream& iss) {
 		std::string method;
 		if (!(iss >> method)) {
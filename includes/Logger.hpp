@@ -0,0 +1,260 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Entries are appended in memory and handed in batches to a writer process through a
+// non-blocking pipe, so the event loop never waits on the disk. Batches the pipe cannot
+// take yet stay buffered up to LOG_BACKLOG_BATCHES buffers, later entries are dropped
+// and counted.
+class LogFile {
+public:
+	LogFile()
+		: _pipe(-1), _writerPid(0), _bufferSize(LOG_BUFFER_SIZE),
+		  _flushInterval(LOG_FLUSH_INTERVAL), _pendingSince(0) {}
+
+	// everything written is on disk once the writer exits
+	~LogFile() {
+		if (_pipe != -1) {
+			fcntl(_pipe, F_SETFL, 0);
+			flush();
+			stopWriter();
+		}
+		for (size_t i = 0; i < _retiredPids.size(); ++i) {
+			waitpid(_retiredPids[i], NULL, 0);
+		}
+	}
+
+	bool open(const LogConfig& config) {
+		_path = config.path;
+		_bufferSize = config.bufferSize;
+		_flushInterval = config.flushInterval;
+		_buffer.reserve(_bufferSize);
+		return reopen();
+	}
+
+	// the old writer finishes the old file on its own while a new one takes over
+	bool reopen() {
+		flush();
+		int fd = ::open(_path.c_str(), O_WRONLY | O_APPEND | O_CREAT | O_CLOEXEC, 0644);
+		if (fd == -1) {
+			return false;
+		}
+		int fds[2];
+		if (pipe2(fds, O_CLOEXEC) == -1) {
+			close(fd);
+			return false;
+		}
+		const pid_t pid = fork();
+		if (pid == -1) {
+			close(fd);
+			close(fds[0]);
+			close(fds[1]);
+			return false;
+		} else if (pid == 0) {
+			runLogWriter(fds[0], fd);
+		}
+		close(fd);
+		close(fds[0]);
+		fcntl(fds[1], F_SETFL, O_NONBLOCK);
+		fcntl(fds[1], F_SETPIPE_SZ, std::max<size_t>(_bufferSize, PIPE_SIZE));
+		stopWriter();
+		_pipe = fds[1];
+		_writerPid = pid;
+		return true;
+	}
+
+	void write(const std::string& entry) {
+		if (_buffer.size() >= _bufferSize * LOG_BACKLOG_BATCHES) {
+			return countDroppedLogBytes(entry.size());
+		}
+		if (_buffer.empty()) {
+			_pendingSince = getMicroseconds() / 1000;
+		}
+		_buffer += entry;
+		if (_buffer.size() >= _bufferSize) {
+			flush();
+		}
+	}
+
+	// a full pipe keeps the rest for the next flush interval
+	void flush() {
+		size_t written = 0;
+		while (_pipe != -1 && written < _buffer.size()) {
+			ssize_t ret = ::write(_pipe, _buffer.c_str() + written, _buffer.size() - written);
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			} else if (ret < 0 && errno == EAGAIN) {
+				_pendingSince = getMicroseconds() / 1000;
+				break;
+			} else if (ret <= 0) {
+				countDroppedLogBytes(_buffer.size() - written);
+				written = _buffer.size();
+			} else {
+				written += ret;
+			}
+		}
+		_buffer.erase(0, written);
+		reapWriters();
+	}
+
+	long getFlushTimeout(unsigned long now) const {
+		if (_buffer.empty()) {
+			return -1;
+		}
+		const unsigned long deadline = _pendingSince + _flushInterval;
+		return deadline > now ? deadline - now : 0;
+	}
+
+	const std::string& getPath() const { return _path; }
+
+private:
+	int _pipe;
+	pid_t _writerPid;
+	std::vector<pid_t> _retiredPids;
+	std::string _path;
+	std::string _buffer;
+	size_t _bufferSize;
+	unsigned long _flushInterval;
+	unsigned long _pendingSince;
+
+	// closing the pipe lets the writer finish what it holds and exit
+	void stopWriter() {
+		if (_pipe != -1) {
+			close(_pipe);
+			_retiredPids.push_back(_writerPid);
+			_pipe = -1;
+		}
+	}
+
+	void reapWriters() {
+		for (size_t i = 0; i < _retiredPids.size();) {
+			if (waitpid(_retiredPids[i], NULL, WNOHANG) != 0) {
+				_retiredPids.erase(_retiredPids.begin() + i);
+			} else {
+				++i;
+			}
+		}
+	}
+};
+
+class LogFormat {
+public:
+	LogFormat(){};
+
+	~LogFormat(){};
+
+	bool compile(const std::string& format) {
+		_segments.clear();
+		size_t i = 0;
+		while (i < format.size()) {
+			size_t dollar = format.find('$', i);
+			if (dollar != i) {
+				_segments.push_back(std::make_pair(LOG_LITERAL, format.substr(i, dollar - i)));
+				if (dollar == std::string::npos) {
+					break;
+				}
+			}
+			size_t end = format.find_first_not_of("abcdefghijklmnopqrstuvwxyz_", dollar + 1);
+			const std::string name = format.substr(dollar + 1, end - dollar - 1);
+			LogVariable variable = findVariable(name);
+			if (variable == LOG_LITERAL) {
+				return configFileError("unknown variable in log_format: $" + name);
+			}
+			_segments.push_back(std::make_pair(variable, ""));
+			i = end;
+		}
+		return true;
+	}
+
+	std::string render(const AccessLogEntry& entry) const {
+		std::string line;
+		for (std::vector<Segment>::const_iterator it = _segments.begin(); it != _segments.end();
+			 ++it) {
+			switch (it->first) {
+			case LOG_LITERAL:
+				line += it->second;
+				break;
+			case LOG_REMOTE_ADDR:
+				line += getIpString(entry.remoteAddr);
+				break;
+			case LOG_TIME_LOCAL:
+				line += getLogTime();
+				break;
+			case LOG_REQUEST:
+				line += entry.method == NO_METHOD ? "-"
+												  : toString(entry.method) + " " + entry.uri +
+														(entry.query.empty() ? "" : "?" + entry.query) +
+														" " + HTTP_VERSION;
+				break;
+			case LOG_REQUEST_METHOD:
+				line += entry.method == NO_METHOD ? "-" : toString(entry.method);
+				break;
+			case LOG_URI:
+				line += orDash(entry.uri);
+				break;
+			case LOG_STATUS:
+				line += toString(entry.statusCode);
+				break;
+			case LOG_BODY_BYTES_SENT:
+				line += toString(entry.bodyBytesSent);
+				break;
+			case LOG_REQUEST_TIME:
+				line += toString(entry.requestTime / 1000) + "." +
+						toString(entry.requestTime % 1000 + 1000).substr(1);
+				break;
+			case LOG_HOST:
+				line += orDash(entry.host);
+				break;
+			case LOG_SERVER_NAME:
+				line += orDash(entry.serverName);
+				break;
+			case LOG_HTTP_REFERER:
+				line += orDash(entry.referer);
+				break;
+			case LOG_HTTP_USER_AGENT:
+				line += orDash(entry.userAgent);
+				break;
+			}
+		}
+		return line + '\n';
+	}
+
+private:
+	typedef enum LogVariable {
+		LOG_LITERAL,
+		LOG_REMOTE_ADDR,
+		LOG_TIME_LOCAL,
+		LOG_REQUEST,
+		LOG_REQUEST_METHOD,
+		LOG_URI,
+		LOG_STATUS,
+		LOG_BODY_BYTES_SENT,
+		LOG_REQUEST_TIME,
+		LOG_HOST,
+		LOG_SERVER_NAME,
+		LOG_HTTP_REFERER,
+		LOG_HTTP_USER_AGENT,
+	} LogVariable;
+
+	typedef std::pair<LogVariable, std::string> Segment;
+
+	std::vector<Segment> _segments;
+
+	static LogVariable findVariable(const std::string& name) {
+		return name == "remote_addr"		 ? LOG_REMOTE_ADDR
+			   : name == "time_local"		 ? LOG_TIME_LOCAL
+			   : name == "request"			 ? LOG_REQUEST
+			   : name == "request_method"	 ? LOG_REQUEST_METHOD
+			   : name == "uri"				 ? LOG_URI
+			   : name == "status"			 ? LOG_STATUS
+			   : name == "body_bytes_sent"	 ? LOG_BODY_BYTES_SENT
+			   : name == "request_time"		 ? LOG_REQUEST_TIME
+			   : name == "host"				 ? LOG_HOST
+			   : name == "server_name"		 ? LOG_SERVER_NAME
+			   : name == "http_referer"		 ? LOG_HTTP_REFERER
+			   : name == "http_user_agent"	 ? LOG_HTTP_USER_AGENT
+											 : LOG_LITERAL;
+	}
+
+	static std::string orDash(const std::string& s) { return s.empty() ? "-" : s; }
+};
@@ -0,0 +1,118 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Read-only shared mappings of static files. The table holds a reference of its own
+// so that idle mappings are reused, up to MAPPED_FILES_MAX of them; past that
+// acquire() returns NULL and the caller serves the file without a mapping.
+// Bytes only leave a mapping through send(), so a file truncated underneath it
+// makes send fail with EFAULT instead of raising SIGBUS in the server.
+class MappedFile {
+public:
+	static MappedFile* acquire(int fd, const std::string& path, const struct stat& buf) {
+		std::map<std::string, MappedFile*>& table = getTable();
+		std::map<std::string, MappedFile*>::iterator it = table.find(path);
+		if (it != table.end()) {
+			if (it->second->matches(buf)) {
+				++it->second->_refCount;
+				return it->second;
+			}
+			it->second->invalidate();
+		}
+		if (table.size() >= MAPPED_FILES_MAX) {
+			evictIdle();
+		}
+		// with every mapping in use the file is read instead
+		if (table.size() >= MAPPED_FILES_MAX) {
+			return NULL;
+		}
+		void* data = mmap(NULL, buf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data == MAP_FAILED) {
+			perrored("mmap");
+			return NULL;
+		}
+		madvise(data, buf.st_size, MADV_WILLNEED);
+		MappedFile* file = new MappedFile(path, static_cast<char*>(data), buf);
+		table[path] = file;
+		++file->_refCount;
+		return file;
+	}
+
+	void release() {
+		if (--_refCount == 0) {
+			delete this;
+		}
+	}
+
+	// stale mappings stay valid for current readers, new readers map the file again
+	void invalidate() {
+		std::map<std::string, MappedFile*>& table = getTable();
+		std::map<std::string, MappedFile*>::iterator it = table.find(_path);
+		if (it != table.end() && it->second == this) {
+			table.erase(it);
+			release();
+		}
+	}
+
+	// whole-file readers go front to back, the kernel then reads further ahead of them
+	void adviseSequential() {
+		if (!_sequential) {
+			madvise(_data, _size, MADV_SEQUENTIAL);
+			_sequential = true;
+		}
+	}
+
+	void willNeed(size_t offset, size_t length) const {
+		const size_t pageSize = sysconf(_SC_PAGESIZE);
+		const size_t begin = offset / pageSize * pageSize;
+		madvise(_data + begin, offset + length - begin, MADV_WILLNEED);
+	}
+
+	const char* getData() const { return _data; }
+	size_t getSize() const { return _size; }
+
+	static size_t& getThreshold() {
+		static size_t threshold = 0;
+		return threshold;
+	}
+
+private:
+	std::string _path;
+	char* _data;
+	size_t _size;
+	dev_t _device;
+	ino_t _inode;
+	struct timespec _mtime;
+	size_t _refCount;
+	bool _sequential;
+
+	MappedFile(const std::string& path, char* data, const struct stat& buf)
+		: _path(path), _data(data), _size(buf.st_size), _device(buf.st_dev), _inode(buf.st_ino),
+		  _mtime(buf.st_mtim), _refCount(1), _sequential(false) {}
+
+	~MappedFile() { munmap(_data, _size); }
+
+	MappedFile(const MappedFile&);
+	MappedFile& operator=(const MappedFile&);
+
+	bool matches(const struct stat& buf) const {
+		return _device == buf.st_dev && _inode == buf.st_ino &&
+			   _size == static_cast<size_t>(buf.st_size) && _mtime.tv_sec == buf.st_mtim.tv_sec &&
+			   _mtime.tv_nsec == buf.st_mtim.tv_nsec;
+	}
+
+	static void evictIdle() {
+		std::map<std::string, MappedFile*>& table = getTable();
+		for (std::map<std::string, MappedFile*>::iterator it = table.begin(); it != table.end();) {
+			MappedFile* file = (it++)->second;
+			if (file->_refCount == 1) {
+				file->invalidate();
+			}
+		}
+	}
+
+	static std::map<std::string, MappedFile*>& getTable() {
+		static std::map<std::string, MappedFile*> table;
+		return table;
+	}
+};
@@ -0,0 +1,187 @@
+#pragma once
+
+#include "webserv.hpp"
+
+class Histogram {
+public:
+	Histogram() : _count(0), _sum(0) { std::fill_n(_buckets, HISTOGRAM_BUCKETS, 0); }
+
+	~Histogram(){};
+
+	void record(unsigned long microseconds) {
+		size_t i = 0;
+		while (i < HISTOGRAM_BUCKETS - 1 && microseconds > HISTOGRAM_MIN_US << i) {
+			++i;
+		}
+		++_buckets[i];
+		++_count;
+		_sum += microseconds;
+	}
+
+	void render(std::ostringstream& oss, const std::string& name, const std::string& help) const {
+		oss << "# HELP " << name << ' ' << help << '\n';
+		oss << "# TYPE " << name << " histogram\n";
+		unsigned long cumulative = 0;
+		for (size_t i = 0; i < HISTOGRAM_BUCKETS - 1; ++i) {
+			cumulative += _buckets[i];
+			oss << name << "_bucket{le=\"" << std::fixed << std::setprecision(6)
+				<< (HISTOGRAM_MIN_US << i) / 1e6 << "\"} " << cumulative << '\n';
+		}
+		oss << name << "_bucket{le=\"+Inf\"} " << _count << '\n';
+		oss << name << "_sum " << std::fixed << std::setprecision(6) << _sum / 1e6 << '\n';
+		oss << name << "_count " << _count << '\n';
+	}
+
+private:
+	unsigned long _buckets[HISTOGRAM_BUCKETS];
+	unsigned long _count;
+	unsigned long _sum;
+};
+
+class Metrics {
+public:
+	Metrics()
+		: _accepted(0), _handled(0), _active(0), _reading(0), _writing(0), _requests(0),
+		  _bytesIn(0), _bytesOut(0), _cgiSpawns(0), _logDropped(0), _virtualServers(NULL) {
+		std::fill_n(_responses, MAX_STATUS_CODE + 1, 0);
+	}
+
+	~Metrics(){};
+
+	void connectionAccepted() {
+		++_accepted;
+		++_active;
+	}
+	void connectionHandled() { ++_handled; }
+	void connectionClosed() { --_active; }
+	void phaseChanged(ConnectionPhaseEnum from, ConnectionPhaseEnum to) {
+		_reading += (to == PHASE_READING) - (from == PHASE_READING);
+		_writing += (to == PHASE_WRITING) - (from == PHASE_WRITING);
+	}
+	void requestReceived() { ++_requests; }
+	void bytesReceived(size_t bytes) { _bytesIn += bytes; }
+	void bytesSent(size_t bytes) { _bytesOut += bytes; }
+	void logBytesDropped(size_t bytes) { _logDropped += bytes; }
+
+	void cgiExited(unsigned long duration) {
+		++_cgiSpawns;
+		_cgiDuration.record(duration);
+	}
+
+	void responseSent(StatusCode statusCode, unsigned long duration) {
+		if (statusCode <= MAX_STATUS_CODE) {
+			++_responses[statusCode];
+		}
+		_requestDuration.record(duration);
+	}
+
+	void setVirtualServers(const std::vector<VirtualServer>* virtualServers) {
+		_virtualServers = virtualServers;
+	}
+
+	std::string render() const {
+		std::ostringstream oss;
+		renderMetric(oss, "webserv_connections_active", "gauge", "Open client connections.",
+					 _active);
+		renderMetric(oss, "webserv_connections_reading", "gauge",
+					 "Connections reading a request.", _reading);
+		renderMetric(oss, "webserv_connections_writing", "gauge",
+					 "Connections writing a response.", _writing);
+		renderMetric(oss, "webserv_connections_accepted_total", "counter",
+					 "Accepted client connections.", _accepted);
+		renderMetric(oss, "webserv_connections_handled_total", "counter",
+					 "Handled client connections.", _handled);
+		renderMetric(oss, "webserv_requests_total", "counter", "Received requests.", _requests);
+		renderMetric(oss, "webserv_received_bytes_total", "counter", "Bytes read from clients.",
+					 _bytesIn);
+		renderMetric(oss, "webserv_sent_bytes_total", "counter", "Bytes sent to clients.",
+					 _bytesOut);
+		renderMetric(oss, "webserv_output_buffered_bytes", "gauge",
+					 "Response bytes queued in output buffers.", OutputQueue::getTotalBuffered());
+		renderMetric(oss, "webserv_cgi_spawns_total", "counter", "Spawned CGI processes.",
+					 _cgiSpawns);
+		renderMetric(oss, "webserv_log_dropped_bytes_total", "counter",
+					 "Log bytes dropped because the log writer fell behind or failed.", _logDropped);
+		renderMetric(oss, "webserv_allocations_total", "counter", "Heap allocations.",
+					 getAllocationCount());
+		oss << "# HELP webserv_responses_total Sent responses by status code.\n";
+		oss << "# TYPE webserv_responses_total counter\n";
+		for (int code = 0; code <= MAX_STATUS_CODE; ++code) {
+			if (_responses[code] != 0) {
+				oss << "webserv_responses_total{code=\"" << code << "\"} " << _responses[code]
+					<< '\n';
+			}
+		}
+		renderVirtualServers(oss);
+		_requestDuration.render(oss, "webserv_request_duration_seconds",
+								"Time from the first request byte to the last response byte.");
+		_cgiDuration.render(oss, "webserv_cgi_duration_seconds", "CGI process run time.");
+		return oss.str();
+	}
+
+private:
+	unsigned long _accepted;
+	unsigned long _handled;
+	long _active;
+	long _reading;
+	long _writing;
+	unsigned long _requests;
+	unsigned long _bytesIn;
+	unsigned long _bytesOut;
+	unsigned long _cgiSpawns;
+	unsigned long _logDropped;
+	unsigned long _responses[MAX_STATUS_CODE + 1];
+	Histogram _requestDuration;
+	Histogram _cgiDuration;
+	const std::vector<VirtualServer>* _virtualServers;
+
+	template <typename T>
+	static void renderMetric(std::ostringstream& oss, const std::string& name,
+							 const std::string& type, const std::string& help, T value) {
+		oss << "# HELP " << name << ' ' << help << '\n';
+		oss << "# TYPE " << name << ' ' << type << '\n';
+		oss << name << ' ' << value << '\n';
+	}
+
+	static std::string escapeLabel(const std::string& s) {
+		std::string res;
+		for (size_t i = 0; i < s.size(); ++i) {
+			if (s[i] == '\\' || s[i] == '"') {
+				res += '\\';
+			}
+			res += s[i] == '\n' ? 'n' : s[i];
+		}
+		return res;
+	}
+
+	static std::string serverLabel(const VirtualServer& vs) {
+		const std::vector<std::string>& serverNames = vs.getServerNames();
+		return escapeLabel(serverNames.empty() ? getIpString(vs.getAddr()) + ":" +
+													 toString(ntohs(vs.getPort()))
+											   : serverNames[0]);
+	}
+
+	void renderVirtualServers(std::ostringstream& oss) const {
+		if (_virtualServers == NULL) {
+			return;
+		}
+		oss << "# HELP webserv_server_requests_total Received requests by server.\n";
+		oss << "# TYPE webserv_server_requests_total counter\n";
+		for (size_t i = 0; i < _virtualServers->size(); ++i) {
+			const VirtualServer& vs = (*_virtualServers)[i];
+			oss << "webserv_server_requests_total{server=\"" << serverLabel(vs) << "\"} "
+				<< vs.getRequestCount() << '\n';
+		}
+		oss << "# HELP webserv_location_requests_total Received requests by location.\n";
+		oss << "# TYPE webserv_location_requests_total counter\n";
+		for (size_t i = 0; i < _virtualServers->size(); ++i) {
+			const VirtualServer& vs = (*_virtualServers)[i];
+			const std::vector<Location>& locations = vs.getLocations();
+			for (size_t j = 0; j < locations.size(); ++j) {
+				oss << "webserv_location_requests_total{server=\"" << serverLabel(vs)
+					<< "\",location=\"" << escapeLabel(locations[j].getUri()) << "\"} "
+					<< locations[j].getRequestCount() << '\n';
+			}
+		}
+	}
+};
@@ -0,0 +1,244 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Streaming multipart/form-data parser. File parts are written to the target directory
+// as their bytes arrive and only a delimiter's worth of data is held back between feeds,
+// so memory stays bounded whatever the size of the parts. Plain fields are discarded.
+class Multipart {
+public:
+	Multipart(const std::string& boundary, const std::string& directory, size_t maxPartSize)
+		: _delimiter("\r\n--" + boundary), _directory(directory), _maxPartSize(maxPartSize),
+		  _state(MULTIPART_PREAMBLE), _buffer("\r\n"), _fd(-1), _partSize(0), _partCount(0) {
+		const size_t length = _delimiter.size();
+		std::fill_n(_skip, 256, length);
+		for (size_t i = 0; i + 1 < length; ++i) {
+			_skip[static_cast<unsigned char>(_delimiter[i])] = length - 1 - i;
+		}
+	}
+
+	// files of an upload that did not complete are removed
+	~Multipart() {
+		closePart();
+		if (_state != MULTIPART_EPILOGUE) {
+			for (size_t i = 0; i < _created.size(); ++i) {
+				std::remove(_created[i].c_str());
+			}
+		}
+	}
+
+	static bool isMultipart(const char* contentType) {
+		return strncasecmp(contentType, "multipart/form-data", 19) == 0 &&
+			   std::strchr(" \t;", contentType[19]) != NULL;
+	}
+
+	// the boundary parameter of the content type, possibly quoted
+	static bool parseBoundary(const char* contentType, std::string& boundary) {
+		boundary = findParameter(contentType, "boundary");
+		return !boundary.empty() && boundary.size() <= MULTIPART_BOUNDARY_SIZE;
+	}
+
+	StatusCode feed(const char* data, size_t length) {
+		_buffer.append(data, length);
+		size_t pos = 0;
+		StatusCode status = STATUS_NONE;
+		bool progress = true;
+		while (progress && status == STATUS_NONE && pos < _buffer.size()) {
+			switch (_state) {
+			case MULTIPART_PREAMBLE:
+			case MULTIPART_DATA:
+				progress = consumeData(pos, status);
+				break;
+			case MULTIPART_DELIMITER:
+				progress = consumeDelimiter(pos, status);
+				break;
+			case MULTIPART_HEADERS:
+				progress = consumeHeaders(pos, status);
+				break;
+			case MULTIPART_EPILOGUE:
+				pos = _buffer.size();
+				break;
+			}
+		}
+		_buffer.erase(0, pos);
+		return status;
+	}
+
+	// the closing delimiter must have been seen once the whole body went through
+	StatusCode finish() { return _state == MULTIPART_EPILOGUE ? STATUS_NONE : STATUS_BAD_REQUEST; }
+
+private:
+	std::string _delimiter;
+	size_t _skip[256];
+	std::string _directory;
+	size_t _maxPartSize;
+	MultipartStateEnum _state;
+	std::string _buffer;
+	int _fd;
+	size_t _partSize;
+	size_t _partCount;
+	std::vector<std::string> _created;
+
+	// Boyer-Moore-Horspool, shifting on the last byte of the window
+	size_t search(const char* text, size_t length) const {
+		const size_t last = _delimiter.size() - 1;
+		for (size_t i = 0; i + last < length;
+			 i += _skip[static_cast<unsigned char>(text[i + last])]) {
+			if (text[i + last] == _delimiter[last] &&
+				std::memcmp(text + i, _delimiter.data(), last) == 0) {
+				return i;
+			}
+		}
+		return std::string::npos;
+	}
+
+	// the consume functions return false when they need more input, bytes that could
+	// start a delimiter split across feeds stay in the buffer
+	bool consumeData(size_t& pos, StatusCode& status) {
+		const char* text = _buffer.data() + pos;
+		const size_t available = _buffer.size() - pos;
+		const size_t found = search(text, available);
+		if (found == std::string::npos) {
+			const size_t safe = available - std::min(available, _delimiter.size() - 1);
+			pos += safe;
+			status = writePart(text, safe);
+			return false;
+		}
+		pos += found + _delimiter.size();
+		status = writePart(text, found);
+		closePart();
+		_state = MULTIPART_DELIMITER;
+		return true;
+	}
+
+	// a delimiter is followed by "--" when it closes the body, else by the next part
+	bool consumeDelimiter(size_t& pos, StatusCode& status) {
+		while (pos < _buffer.size() && (_buffer[pos] == ' ' || _buffer[pos] == '\t')) {
+			++pos;
+		}
+		if (_buffer.size() - pos < 2) {
+			return false;
+		} else if (_buffer.compare(pos, 2, "--") == 0) {
+			_state = MULTIPART_EPILOGUE;
+		} else if (_buffer.compare(pos, 2, "\r\n") == 0) {
+			_state = MULTIPART_HEADERS;
+		} else {
+			status = STATUS_BAD_REQUEST;
+		}
+		pos += 2;
+		return true;
+	}
+
+	bool consumeHeaders(size_t& pos, StatusCode& status) {
+		size_t end = pos;
+		if (_buffer.compare(pos, 2, "\r\n") != 0) {
+			end = _buffer.find("\r\n\r\n", pos);
+			if (end == std::string::npos) {
+				if (_buffer.size() - pos > MULTIPART_HEADER_SIZE) {
+					status = STATUS_BAD_REQUEST;
+				}
+				return false;
+			}
+		}
+		if (end - pos > MULTIPART_HEADER_SIZE) {
+			status = STATUS_BAD_REQUEST;
+		} else if (++_partCount > MULTIPART_MAX_PARTS) {
+			status = STATUS_PAYLOAD_TOO_LARGE;
+		} else {
+			status = startPart(_buffer.substr(pos, end - pos));
+		}
+		pos = end + (end == pos ? 2 : 4);
+		_state = MULTIPART_DATA;
+		return true;
+	}
+
+	StatusCode startPart(const std::string& headers) {
+		_partSize = 0;
+		std::istringstream iss(headers);
+		std::string line, fileName;
+		while (std::getline(iss, line)) {
+			const size_t colon = line.find(':');
+			if (colon != std::string::npos &&
+				strlower(strtrim(line.substr(0, colon), " \t")) == "content-disposition") {
+				fileName = findParameter(line.substr(colon + 1), "filename");
+			}
+		}
+		fileName = fileName.substr(fileName.find_last_of("/\\") + 1);
+		if (fileName.empty()) {
+			return STATUS_NONE;
+		} else if (fileName == "." || fileName == ".." ||
+				   fileName.find_first_of(std::string("\0\r\n", 3)) != std::string::npos) {
+			return STATUS_BAD_REQUEST;
+		}
+		const std::string path = _directory + fileName;
+		const bool existed = access(path.c_str(), F_OK) == 0;
+		_fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (_fd < 0) {
+			return STATUS_FORBIDDEN;
+		} else if (!existed) {
+			_created.push_back(path);
+		}
+		return STATUS_NONE;
+	}
+
+	StatusCode writePart(const char* data, size_t length) {
+		if (_state != MULTIPART_DATA) {
+			return STATUS_NONE;
+		}
+		_partSize += length;
+		if (_maxPartSize != 0 && _partSize > _maxPartSize) {
+			return STATUS_PAYLOAD_TOO_LARGE;
+		}
+		while (_fd != -1 && length > 0) {
+			const ssize_t written = write(_fd, data, length);
+			if (written <= 0) {
+				perrored("write");
+				return STATUS_INTERNAL_SERVER_ERROR;
+			}
+			data += written;
+			length -= written;
+		}
+		return STATUS_NONE;
+	}
+
+	void closePart() {
+		if (_fd != -1) {
+			close(_fd);
+			_fd = -1;
+		}
+	}
+
+	// value of a "; name=value" parameter, quotes and backslash escapes removed
+	static std::string findParameter(const std::string& header, const std::string& name) {
+		size_t pos = header.find(';');
+		while (pos != std::string::npos) {
+			const size_t equal = header.find('=', pos);
+			if (equal == std::string::npos) {
+				return "";
+			}
+			const std::string key =
+				strlower(strtrim(header.substr(pos + 1, equal - pos - 1), " \t"));
+			std::string value;
+			size_t end = equal + 1;
+			if (end < header.size() && header[end] == '"') {
+				for (++end; end < header.size() && header[end] != '"'; ++end) {
+					if (header[end] == '\\' && end + 1 < header.size()) {
+						++end;
+					}
+					value += header[end];
+				}
+				end = header.find(';', end);
+			} else {
+				end = header.find(';', end);
+				value = header.substr(equal + 1, end == std::string::npos ? end : end - equal - 1);
+				value.erase(0, value.find_first_not_of(" \t"));
+				value.erase(value.find_last_not_of(" \t\r") + 1);
+			}
+			if (key == name) {
+				return value;
+			}
+			pos = end;
+		}
+		return "";
+	}
+};
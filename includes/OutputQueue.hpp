@@ -0,0 +1,180 @@
+#pragma once
+
+#include "webserv.hpp"
+
+class OutputQueue {
+public:
+	OutputQueue() : _first(0), _count(0), _headOffset(0), _tailLength(0), _size(0), _paused(false) {}
+
+	~OutputQueue() { clear(); }
+
+	size_t size() const { return _size; }
+	bool empty() const { return _size == 0; }
+
+	// producers pause at the high watermark and resume once drained to the low one
+	bool hasRoom() {
+		if (_paused && _size <= OUTPUT_LOW_WATERMARK) {
+			_paused = false;
+		} else if (!_paused && _size >= OUTPUT_HIGH_WATERMARK) {
+			_paused = true;
+		}
+		return !_paused;
+	}
+
+	bool wantsData() { return hasRoom() && !isThrottled(); }
+
+	char* prepare(size_t& length) {
+		if (_count == 0 || _tailLength == OUTPUT_CHUNK_SIZE) {
+			if (_count == OUTPUT_MAX_CHUNKS) {
+				length = 0;
+				return NULL;
+			}
+			_chunks[(_first + _count++) % OUTPUT_MAX_CHUNKS] = acquireChunk();
+			_tailLength = 0;
+		}
+		length = OUTPUT_CHUNK_SIZE - _tailLength;
+		return _chunks[(_first + _count - 1) % OUTPUT_MAX_CHUNKS] + _tailLength;
+	}
+
+	void commit(size_t length) {
+		_tailLength += length;
+		_size += length;
+		getTotalBuffered() += length;
+	}
+
+	size_t append(const char* data, size_t length) {
+		size_t appended = 0;
+		while (appended < length) {
+			size_t space;
+			char* p = prepare(space);
+			if (p == NULL) {
+				break;
+			}
+			space = std::min(space, length - appended);
+			std::memcpy(p, data + appended, space);
+			commit(space);
+			appended += space;
+		}
+		return appended;
+	}
+
+	ssize_t sendTo(int fd) {
+		if (_size == 0) {
+			return 0;
+		}
+		struct iovec iov[OUTPUT_MAX_CHUNKS];
+		for (size_t i = 0; i < _count; ++i) {
+			const size_t begin = i == 0 ? _headOffset : 0;
+			const size_t end = i == _count - 1 ? _tailLength : OUTPUT_CHUNK_SIZE;
+			iov[i].iov_base = _chunks[(_first + i) % OUTPUT_MAX_CHUNKS] + begin;
+			iov[i].iov_len = end - begin;
+		}
+		struct msghdr message;
+		std::memset(&message, 0, sizeof(message));
+		message.msg_iov = iov;
+		message.msg_iovlen = _count;
+		ssize_t sent = sendmsg(fd, &message, MSG_NOSIGNAL);
+		if (sent > 0) {
+			consume(sent);
+		}
+		return sent;
+	}
+
+	size_t copyTo(std::string& out, size_t max) {
+		size_t copied = 0;
+		for (size_t i = 0; i < _count && copied < max; ++i) {
+			const size_t begin = i == 0 ? _headOffset : 0;
+			const size_t end = i == _count - 1 ? _tailLength : OUTPUT_CHUNK_SIZE;
+			const size_t length = std::min(end - begin, max - copied);
+			out.append(_chunks[(_first + i) % OUTPUT_MAX_CHUNKS] + begin, length);
+			copied += length;
+		}
+		consume(copied);
+		return copied;
+	}
+
+	void clear() {
+		for (size_t i = 0; i < _count; ++i) {
+			releaseChunk(_chunks[(_first + i) % OUTPUT_MAX_CHUNKS]);
+		}
+		getTotalBuffered() -= _size;
+		_first = _count = _headOffset = _tailLength = _size = 0;
+		_paused = false;
+	}
+
+	static size_t& getTotalBuffered() {
+		static size_t totalBuffered = 0;
+		return totalBuffered;
+	}
+
+	static size_t& getLimit() {
+		static size_t limit = DEFAULT_OUTPUT_BUFFER_LIMIT;
+		return limit;
+	}
+
+	// all producers pause at the global limit and resume once the total drains to a
+	// quarter below it, those left with nothing to send are parked by the server
+	static bool isThrottled() {
+		static bool throttled = false;
+		if (throttled && getTotalBuffered() <= getLimit() / 4 * 3) {
+			throttled = false;
+		} else if (!throttled && getTotalBuffered() >= getLimit()) {
+			throttled = true;
+		}
+		return throttled;
+	}
+
+private:
+	char* _chunks[OUTPUT_MAX_CHUNKS];
+	size_t _first;
+	size_t _count;
+	size_t _headOffset;
+	size_t _tailLength;
+	size_t _size;
+	bool _paused;
+
+	OutputQueue(const OutputQueue&);
+	OutputQueue& operator=(const OutputQueue&);
+
+	void consume(size_t length) {
+		_size -= length;
+		getTotalBuffered() -= length;
+		length += _headOffset;
+		while (_count > 0) {
+			const size_t chunkEnd = _count == 1 ? _tailLength : OUTPUT_CHUNK_SIZE;
+			if (length < chunkEnd) {
+				break;
+			}
+			releaseChunk(_chunks[_first]);
+			_first = (_first + 1) % OUTPUT_MAX_CHUNKS;
+			--_count;
+			length -= chunkEnd;
+		}
+		_headOffset = _count == 0 ? 0 : length;
+		_tailLength = _count == 0 ? 0 : _tailLength;
+	}
+
+	static std::vector<char*>& getChunkPool() {
+		static std::vector<char*> pool;
+		return pool;
+	}
+
+	static char* acquireChunk() {
+		std::vector<char*>& pool = getChunkPool();
+		if (pool.empty()) {
+			return new char[OUTPUT_CHUNK_SIZE];
+		}
+		char* chunk = pool.back();
+		pool.pop_back();
+		return chunk;
+	}
+
+	static void releaseChunk(char* chunk) {
+		std::vector<char*>& pool = getChunkPool();
+		if (pool.size() < OUTPUT_POOL_SIZE) {
+			pool.push_back(chunk);
+		} else {
+			delete[] chunk;
+		}
+	}
+};
@@ -0,0 +1,595 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// One request forwarded to an upstream over a non-blocking socket. A large request body
+// follows the head from a queue the client fills as it arrives. The response head is
+// rewritten for the client, the body is streamed into the response output queue as it
+// arrives and reading pauses while that queue is above its high watermark.
+class Proxy {
+public:
+	Proxy(const ProxyConfig& config, OutputQueue& output, RequestMethod method)
+		: _config(config), _output(output), _fd(-1), _state(PROXY_CONNECTING), _error(STATUS_NONE),
+		  _sent(0), _body(NULL), _bodyRemaining(0), _method(method), _peer(NULL), _attempts(0),
+		  _reused(false), _statusCode(STATUS_NONE), _headLength(0), _bodyMode(PROXY_BODY_NONE),
+		  _remaining(0), _chunkState(CHUNK_SIZE), _keepAlive(false), _deadline(0),
+		  _cacheStatus(NULL), _cacheFd(-1), _cacheHeadLength(0), _cacheTtl(0) {}
+
+	~Proxy() {
+		if (_fd != -1) {
+			close(_fd);
+		}
+		releasePeer(false);
+		abortCache();
+	}
+
+	// the first request to miss on a key writes the response for the ones that follow
+	void setCache(const std::string& key, ProxyCacheStatusEnum status) {
+		_cacheStatus = status == PROXY_CACHE_EXPIRED ? "EXPIRED" : "MISS";
+		if (_method == GET && _config.cache->lock(key)) {
+			_cacheKey = key;
+		}
+	}
+
+	// the length bytes after the head are taken from the queue as the client sends them
+	void streamBody(OutputQueue& body, size_t length) {
+		_body = &body;
+		_bodyRemaining = length;
+	}
+
+	bool start(const std::string& request, const std::string& key) {
+		_request = request;
+		_key = key;
+		return connectUpstream();
+	}
+
+	// idempotent requests move on to the next peer until a response head arrives, a
+	// streamed body cannot be sent twice
+	bool retry() {
+		if (_method == POST || hasStarted() || _body != NULL) {
+			return false;
+		}
+		_sent = 0;
+		_head.clear();
+		if (connectUpstream()) {
+			_error = STATUS_NONE;
+			return true;
+		}
+		_state = PROXY_FAILED;
+		return false;
+	}
+
+	void handleEvents() {
+		switch (_state) {
+		case PROXY_CONNECTING:
+			return finishConnect();
+		case PROXY_SENDING:
+			return sendRequest();
+		case PROXY_READING_HEAD:
+			return readHead();
+		case PROXY_READING_BODY:
+			return readBody();
+		default:
+			return;
+		}
+	}
+
+	void fail(StatusCode error) {
+		if (_state == PROXY_DONE || _state == PROXY_FAILED) {
+			return;
+		}
+		_state = PROXY_FAILED;
+		_error = error;
+		_keepAlive = false;
+		abortCache();
+	}
+
+	// idle connections go back to the pool, anything else is closed
+	void release() {
+		if (_fd == -1) {
+			return;
+		}
+		if (_state == PROXY_DONE && _keepAlive) {
+			releaseConnection(_address, _fd);
+		} else {
+			close(_fd);
+		}
+		_fd = -1;
+		releasePeer(_state == PROXY_FAILED && !hasStarted() && !_reused);
+	}
+
+	uint32_t getEvents() {
+		switch (_state) {
+		case PROXY_CONNECTING:
+			return EPOLLOUT;
+		case PROXY_SENDING:
+			if (_sent == _request.size() && _body != NULL && _body->empty()) {
+				return 0;
+			}
+			return EPOLLOUT;
+		case PROXY_READING_HEAD:
+			return EPOLLIN;
+		case PROXY_READING_BODY:
+			if (!_output.wantsData()) {
+				_deadline = 0;
+				return 0;
+			}
+			if (_deadline == 0) {
+				_deadline = getMicroseconds() / 1000 + _config.readTimeout;
+			}
+			return EPOLLIN;
+		default:
+			return 0;
+		}
+	}
+
+	// the read timer restarts once a slow client has drained its output
+	unsigned long getDeadline() { return getEvents() == 0 ? 0 : _deadline; }
+
+	int getFd() const { return _fd; }
+	bool isFinished() const { return _state == PROXY_DONE || _state == PROXY_FAILED; }
+	bool isReadingBody() const { return _state == PROXY_READING_BODY; }
+	bool hasStarted() const { return _statusCode != STATUS_NONE; }
+	bool hasFailed() const { return _state == PROXY_FAILED; }
+	StatusCode getError() const { return _error; }
+	StatusCode getStatusCode() const { return _statusCode; }
+	size_t getHeadLength() const { return _headLength; }
+
+	static void closeIdleConnections() {
+		std::map<std::pair<in_addr_t, in_port_t>, std::vector<int> >& pool = getPool();
+		for (std::map<std::pair<in_addr_t, in_port_t>, std::vector<int> >::iterator it =
+				 pool.begin();
+			 it != pool.end(); ++it) {
+			for (size_t i = 0; i < it->second.size(); ++i) {
+				close(it->second[i]);
+			}
+		}
+		pool.clear();
+	}
+
+private:
+	typedef enum ChunkStateEnum {
+		CHUNK_SIZE,
+		CHUNK_EXTENSION,
+		CHUNK_DATA,
+		CHUNK_DATA_END,
+		CHUNK_TRAILER,
+		CHUNK_TRAILER_LINE,
+	} ChunkStateEnum;
+
+	const ProxyConfig& _config;
+	OutputQueue& _output;
+	int _fd;
+	ProxyStateEnum _state;
+	StatusCode _error;
+	std::string _request;
+	size_t _sent;
+	OutputQueue* _body;
+	size_t _bodyRemaining;
+	RequestMethod _method;
+	std::string _key;
+	struct sockaddr_in _address;
+	UpstreamGroup::Peer* _peer;
+	std::vector<UpstreamGroup::Peer*> _tried;
+	size_t _attempts;
+	bool _reused;
+	std::string _head;
+	StatusCode _statusCode;
+	size_t _headLength;
+	ProxyBodyEnum _bodyMode;
+	unsigned long _remaining;
+	ChunkStateEnum _chunkState;
+	bool _keepAlive;
+	unsigned long _deadline;
+	const char* _cacheStatus;
+	std::string _cacheKey;
+	int _cacheFd;
+	size_t _cacheHeadLength;
+	unsigned long _cacheTtl;
+
+	Proxy(const Proxy&);
+	Proxy& operator=(const Proxy&);
+
+	// a single address gets one more attempt when a pooled connection turned out stale
+	bool selectPeer() {
+		if (_config.upstream == NULL) {
+			_address = _config.address;
+			const size_t attempt = _attempts++;
+			return attempt == 0 || (attempt == 1 && _reused);
+		}
+		_peer = _config.upstream->select(_key, _tried);
+		if (_peer == NULL) {
+			return false;
+		}
+		_tried.push_back(_peer);
+		++_peer->connections;
+		_address = _peer->address;
+		return true;
+	}
+
+	void releasePeer(bool failed) {
+		if (_peer == NULL) {
+			return;
+		}
+		--_peer->connections;
+		if (failed) {
+			UpstreamGroup::markFailed(_peer);
+		}
+		_peer = NULL;
+	}
+
+	bool connectUpstream() {
+		while (selectPeer()) {
+			if (openConnection()) {
+				return true;
+			}
+			releasePeer(true);
+		}
+		return false;
+	}
+
+	bool openConnection() {
+		_fd = acquireConnection(_address);
+		_reused = _fd != -1;
+		if (_reused) {
+			_state = PROXY_SENDING;
+			_deadline = getMicroseconds() / 1000 + _config.readTimeout;
+			return true;
+		}
+		_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (_fd < 0) {
+			perrored("socket");
+			return false;
+		}
+		if (connect(_fd, (const struct sockaddr*)&_address, sizeof(_address)) != 0 &&
+			errno != EINPROGRESS) {
+			perrored("connect");
+			close(_fd);
+			_fd = -1;
+			return false;
+		}
+		_state = PROXY_CONNECTING;
+		_deadline = getMicroseconds() / 1000 + _config.connectTimeout;
+		return true;
+	}
+
+	void finishConnect() {
+		int error = 0;
+		socklen_t length = sizeof(error);
+		if (getsockopt(_fd, SOL_SOCKET, SO_ERROR, &error, &length) != 0 || error != 0) {
+			errno = error;
+			perrored("connect");
+			return fail(STATUS_BAD_GATEWAY);
+		}
+		_state = PROXY_SENDING;
+		_deadline = getMicroseconds() / 1000 + _config.readTimeout;
+		sendRequest();
+	}
+
+	void sendRequest() {
+		while (_sent < _request.size()) {
+			ssize_t sent = send(_fd, _request.data() + _sent, _request.size() - _sent, MSG_NOSIGNAL);
+			if (sent < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return;
+				}
+				perrored("send");
+				return fail(STATUS_BAD_GATEWAY);
+			}
+			_sent += sent;
+		}
+		while (_bodyRemaining > 0 && !_body->empty()) {
+			ssize_t sent = _body->sendTo(_fd);
+			if (sent < 0) {
+				if (errno == EAGAIN || errno == EWOULDBLOCK) {
+					return;
+				}
+				perrored("sendmsg");
+				return fail(STATUS_BAD_GATEWAY);
+			}
+			_bodyRemaining -= sent;
+		}
+		if (_bodyRemaining > 0) {
+			return;
+		}
+		_state = PROXY_READING_HEAD;
+		_deadline = getMicroseconds() / 1000 + _config.readTimeout;
+	}
+
+	void readHead() {
+		char buffer[BUFFER_SIZE];
+		ssize_t bytesRead = recv(_fd, buffer, sizeof(buffer), 0);
+		if (bytesRead <= 0) {
+			if (bytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return;
+			}
+			if (bytesRead < 0) {
+				perrored("recv");
+			}
+			return fail(STATUS_BAD_GATEWAY);
+		}
+		_deadline = getMicroseconds() / 1000 + _config.readTimeout;
+		_head.append(buffer, bytesRead);
+		const size_t end = _head.find("\r\n\r\n");
+		if (end == std::string::npos) {
+			if (_head.size() > PROXY_HEAD_SIZE) {
+				fail(STATUS_BAD_GATEWAY);
+			}
+			return;
+		}
+		if (!translateHead(_head.substr(0, end + 2))) {
+			return fail(STATUS_BAD_GATEWAY);
+		}
+		const std::string rest = _head.substr(end + 4);
+		std::string().swap(_head);
+		std::string().swap(_request);
+		if (_peer != NULL) {
+			UpstreamGroup::markSucceeded(_peer);
+		}
+		_state = PROXY_READING_BODY;
+		if (_bodyMode == PROXY_BODY_NONE) {
+			return finish(rest.empty());
+		}
+		const size_t length =
+			_bodyMode == PROXY_BODY_LENGTH ? std::min<size_t>(rest.size(), _remaining) : rest.size();
+		_output.append(rest.data(), length);
+		writeCache(rest.data(), length);
+		consumeBody(rest.data(), length);
+	}
+
+	void readBody() {
+		size_t length;
+		char* buffer = _output.prepare(length);
+		if (buffer == NULL) {
+			return;
+		}
+		if (_bodyMode == PROXY_BODY_LENGTH) {
+			length = std::min<size_t>(length, _remaining);
+		}
+		ssize_t bytesRead = recv(_fd, buffer, length, 0);
+		if (bytesRead < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return;
+			}
+			perrored("recv");
+			return fail(STATUS_BAD_GATEWAY);
+		}
+		if (bytesRead == 0) {
+			return _bodyMode == PROXY_BODY_CLOSE ? finish(false) : fail(STATUS_BAD_GATEWAY);
+		}
+		_deadline = getMicroseconds() / 1000 + _config.readTimeout;
+		_output.commit(bytesRead);
+		writeCache(buffer, bytesRead);
+		consumeBody(buffer, bytesRead);
+	}
+
+	void finish(bool reusable) {
+		_state = PROXY_DONE;
+		_keepAlive = _keepAlive && reusable;
+		if (_cacheFd != -1) {
+			_config.cache->commit(_cacheKey, _cacheFd, _cacheHeadLength, _statusCode, _cacheTtl);
+			_cacheKey.clear();
+			_cacheFd = -1;
+		}
+	}
+
+	void startCache(const std::string& head, unsigned long ttl) {
+		_cacheFd = _config.cache->openTemp(_cacheKey);
+		if (_cacheFd == -1) {
+			return abortCache();
+		}
+		_cacheHeadLength = head.size();
+		_cacheTtl = ttl;
+		writeCache(head.data(), head.size());
+	}
+
+	void writeCache(const char* data, size_t length) {
+		if (_cacheFd != -1 && write(_cacheFd, data, length) != static_cast<ssize_t>(length)) {
+			perrored("write");
+			abortCache();
+		}
+	}
+
+	void abortCache() {
+		if (!_cacheKey.empty()) {
+			_config.cache->abort(_cacheKey, _cacheFd);
+			_cacheKey.clear();
+			_cacheFd = -1;
+		}
+	}
+
+	// responses setting cookies or varying per request are never stored,
+	// max-age and s-maxage override proxy_cache_valid
+	static bool isCacheable(const std::string& name, const std::string& value,
+							unsigned long& ttl) {
+		if (name == "set-cookie" || name == "vary") {
+			return false;
+		} else if (name != "cache-control") {
+			return true;
+		} else if (value.find("no-store") != std::string::npos ||
+				   value.find("no-cache") != std::string::npos ||
+				   value.find("private") != std::string::npos) {
+			return false;
+		}
+		const size_t sharedMaxAge = value.find("s-maxage=");
+		const size_t maxAge = value.find("max-age=");
+		if (sharedMaxAge != std::string::npos) {
+			ttl = std::strtoul(value.c_str() + sharedMaxAge + 9, NULL, 10) * 1000;
+		} else if (maxAge != std::string::npos) {
+			ttl = std::strtoul(value.c_str() + maxAge + 8, NULL, 10) * 1000;
+		}
+		return true;
+	}
+
+	void consumeBody(const char* data, size_t length) {
+		if (_bodyMode == PROXY_BODY_LENGTH) {
+			_remaining -= length;
+			if (_remaining == 0) {
+				finish(true);
+			}
+		} else if (_bodyMode == PROXY_BODY_CHUNKED) {
+			consumeChunks(data, length);
+		}
+	}
+
+	// the chunked body is relayed as is, it is only parsed to find where it ends
+	void consumeChunks(const char* data, size_t length) {
+		for (size_t i = 0; i < length && _state == PROXY_READING_BODY; ++i) {
+			const char c = data[i];
+			switch (_chunkState) {
+			case CHUNK_SIZE:
+				if (std::isxdigit(c)) {
+					if (_remaining > ULONG_MAX >> 4) {
+						return fail(STATUS_BAD_GATEWAY);
+					}
+					_remaining = _remaining << 4 |
+								 (std::isdigit(c) ? c - '0' : std::tolower(c) - 'a' + 10);
+				} else if (c == '\n') {
+					_chunkState = _remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+				} else if (c == ';' || c == '\r' || c == ' ' || c == '\t') {
+					_chunkState = CHUNK_EXTENSION;
+				} else {
+					return fail(STATUS_BAD_GATEWAY);
+				}
+				break;
+			case CHUNK_EXTENSION:
+				if (c == '\n') {
+					_chunkState = _remaining == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+				}
+				break;
+			case CHUNK_DATA: {
+				const size_t skipped = std::min<size_t>(_remaining, length - i);
+				_remaining -= skipped;
+				i += skipped - 1;
+				if (_remaining == 0) {
+					_chunkState = CHUNK_DATA_END;
+				}
+				break;
+			}
+			case CHUNK_DATA_END:
+				if (c == '\n') {
+					_chunkState = CHUNK_SIZE;
+				}
+				break;
+			case CHUNK_TRAILER:
+				if (c == '\n') {
+					return finish(i + 1 == length);
+				} else if (c != '\r') {
+					_chunkState = CHUNK_TRAILER_LINE;
+				}
+				break;
+			case CHUNK_TRAILER_LINE:
+				if (c == '\n') {
+					_chunkState = CHUNK_TRAILER;
+				}
+				break;
+			}
+		}
+	}
+
+	// status line and end-to-end headers are kept, the connection is closed towards the client
+	bool translateHead(const std::string& head) {
+		size_t end = head.find("\r\n");
+		const std::string statusLine = head.substr(0, end);
+		if (statusLine.size() < 12 || !startswith(statusLine, "HTTP/1.") ||
+			!std::isdigit(statusLine[9]) || !std::isdigit(statusLine[10]) ||
+			!std::isdigit(statusLine[11]) || (statusLine.size() > 12 && statusLine[12] != ' ')) {
+			return false;
+		}
+		const int code = std::atoi(statusLine.c_str() + 9);
+		if (code < 200 || code > MAX_STATUS_CODE) {
+			return false;
+		}
+		_keepAlive = statusLine[7] == '1';
+		bool chunked = false;
+		bool hasLength = false;
+		bool cacheable = !_cacheKey.empty() && code == STATUS_OK;
+		unsigned long ttl = _config.cacheValid;
+		std::string translated = statusLine + "\r\n";
+		for (size_t begin = end + 2; begin < head.size(); begin = end + 2) {
+			end = head.find("\r\n", begin);
+			const std::string line = head.substr(begin, end - begin);
+			const size_t colon = line.find(':');
+			if (colon == std::string::npos || colon == 0) {
+				return false;
+			}
+			const std::string name = strlower(line.substr(0, colon));
+			const std::string value = strlower(strtrim(line.substr(colon + 1), SPACES));
+			if (name == "connection") {
+				_keepAlive = value.find("close") == std::string::npos &&
+							 (_keepAlive || value.find("keep-alive") != std::string::npos);
+				continue;
+			} else if (name == "keep-alive" || name == "proxy-connection") {
+				continue;
+			} else if (name == "transfer-encoding") {
+				chunked = value.find("chunked") != std::string::npos;
+			} else if (name == "content-length") {
+				if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos ||
+					value.size() > 18) {
+					return false;
+				}
+				_remaining = std::strtoul(value.c_str(), NULL, 10);
+				hasLength = true;
+			}
+			cacheable = cacheable && isCacheable(name, value, ttl);
+			translated += line + "\r\n";
+		}
+		translated += "connection: close\r\n\r\n";
+		if (cacheable && ttl != 0) {
+			startCache(translated, ttl);
+		} else {
+			abortCache();
+		}
+		if (_cacheStatus != NULL) {
+			translated.insert(translated.size() - 2,
+							  std::string("x-cache-status: ") + _cacheStatus + "\r\n");
+		}
+		if (_method == HEAD || code == STATUS_NO_CONTENT || code == STATUS_NOT_MODIFIED) {
+			_bodyMode = PROXY_BODY_NONE;
+		} else if (chunked) {
+			_bodyMode = PROXY_BODY_CHUNKED;
+			_remaining = 0;
+		} else if (hasLength) {
+			_bodyMode = _remaining == 0 ? PROXY_BODY_NONE : PROXY_BODY_LENGTH;
+		} else {
+			_bodyMode = PROXY_BODY_CLOSE;
+			_keepAlive = false;
+		}
+		_output.append(translated.data(), translated.size());
+		_statusCode = static_cast<StatusCode>(code);
+		_headLength = translated.size();
+		return true;
+	}
+
+	static std::map<std::pair<in_addr_t, in_port_t>, std::vector<int> >& getPool() {
+		static std::map<std::pair<in_addr_t, in_port_t>, std::vector<int> > pool;
+		return pool;
+	}
+
+	// pooled connections the upstream has closed in the meantime read as EOF
+	static int acquireConnection(const struct sockaddr_in& address) {
+		std::vector<int>& idle =
+			getPool()[std::make_pair(address.sin_addr.s_addr, address.sin_port)];
+		while (!idle.empty()) {
+			const int fd = idle.back();
+			idle.pop_back();
+			char c;
+			if (recv(fd, &c, 1, MSG_PEEK | MSG_DONTWAIT) < 0 &&
+				(errno == EAGAIN || errno == EWOULDBLOCK)) {
+				return fd;
+			}
+			close(fd);
+		}
+		return -1;
+	}
+
+	static void releaseConnection(const struct sockaddr_in& address, int fd) {
+		std::vector<int>& idle =
+			getPool()[std::make_pair(address.sin_addr.s_addr, address.sin_port)];
+		if (idle.size() < UPSTREAM_KEEPALIVE) {
+			idle.push_back(fd);
+		} else {
+			close(fd);
+		}
+	}
+};
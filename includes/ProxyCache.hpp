@@ -0,0 +1,417 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Proxied responses stored on disk under a proxy_cache_path, one file per key holding the
+// key line, the translated head and the body. The key index is an open-addressing table in
+// a shared mapping of <path>/index, so a restarted server starts with a warm cache.
+// Expired entries keep being served while a single request per key refreshes them.
+class ProxyCache {
+public:
+	typedef struct Hit {
+		int fd;
+		std::string head;
+		size_t bodyOffset;
+		size_t bodyLength;
+		StatusCode statusCode;
+	} Hit;
+
+	ProxyCache()
+		: _levels(0), _slotCount(0), _maxSize(0), _inactive(DEFAULT_PROXY_CACHE_INACTIVE),
+		  _index(NULL), _mappedLength(0), _slots(NULL), _managedAt(0), _cursor(0) {
+		std::memset(_levelLengths, 0, sizeof(_levelLengths));
+	}
+
+	~ProxyCache() {
+		for (std::set<uint64_t>::iterator it = _fills.begin(); it != _fills.end(); ++it) {
+			unlink(getTempPath(*it).c_str());
+		}
+		if (_index != NULL) {
+			munmap(_index, _mappedLength);
+		}
+	}
+
+	bool parse(std::istringstream& iss, const std::string& path) {
+		if (!validateUri(path, "proxy_cache_path")) {
+			return false;
+		}
+		_path = "." + (path[path.size() - 1] == '/' ? path.substr(0, path.size() - 1) : path);
+		std::string value;
+		while (iss >> value) {
+			if (startswith(value, "levels=")) {
+				if (!parseLevels(value.substr(7))) {
+					return configFileError("invalid levels in proxy_cache_path: " + value);
+				}
+			} else if (startswith(value, "keys_zone=")) {
+				const size_t colon = value.find(':');
+				size_t size;
+				if (colon == std::string::npos || colon == 10 ||
+					!parseByteSize(value.substr(colon + 1), size) ||
+					size < sizeof(IndexHeader) + sizeof(Slot)) {
+					return configFileError("invalid keys_zone in proxy_cache_path: " + value);
+				}
+				_name = value.substr(10, colon - 10);
+				_slotCount = (size - sizeof(IndexHeader)) / sizeof(Slot);
+			} else if (startswith(value, "max_size=")) {
+				if (!parseByteSize(value.substr(9), _maxSize) || _maxSize == 0) {
+					return configFileError("invalid max_size in proxy_cache_path: " + value);
+				}
+			} else if (startswith(value, "inactive=")) {
+				if (!parseDuration(value.substr(9), _inactive) || _inactive == 0) {
+					return configFileError("invalid inactive in proxy_cache_path: " + value);
+				}
+			} else {
+				return configFileError("invalid parameter in proxy_cache_path: " + value);
+			}
+		}
+		if (_name.empty()) {
+			return configFileError("missing keys_zone in proxy_cache_path");
+		}
+		return true;
+	}
+
+	// an index left by a previous run is kept as long as its table has the same size
+	bool open() {
+		if (!makeDirectories(_path)) {
+			std::cerr << "Cannot create cache directory " << _path << ": " << std::strerror(errno)
+					  << '\n';
+			return false;
+		}
+		const std::string path = _path + "/index";
+		const int fd = ::open(path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+		struct stat buf;
+		_mappedLength = sizeof(IndexHeader) + _slotCount * sizeof(Slot);
+		if (fd < 0 || fstat(fd, &buf) != 0 ||
+			(static_cast<size_t>(buf.st_size) != _mappedLength &&
+			 ftruncate(fd, _mappedLength) != 0)) {
+			std::cerr << "Cannot open cache index " << path << ": " << std::strerror(errno) << '\n';
+			if (fd >= 0) {
+				close(fd);
+			}
+			return false;
+		}
+		void* data = mmap(NULL, _mappedLength, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		close(fd);
+		if (data == MAP_FAILED) {
+			std::cerr << "Cannot map cache index " << path << ": " << std::strerror(errno) << '\n';
+			return false;
+		}
+		_index = static_cast<IndexHeader*>(data);
+		_slots = reinterpret_cast<Slot*>(_index + 1);
+		if (std::memcmp(_index->magic, PROXY_CACHE_MAGIC, sizeof(_index->magic)) != 0 ||
+			_index->slotCount != _slotCount) {
+			std::memset(data, 0, _mappedLength);
+			std::memcpy(_index->magic, PROXY_CACHE_MAGIC, sizeof(_index->magic));
+			_index->slotCount = _slotCount;
+		}
+		return true;
+	}
+
+	ProxyCacheStatusEnum lookup(const std::string& key, Hit& hit) {
+		const uint64_t hash = getHash(key);
+		Slot* slot = find(hash);
+		if (slot == NULL) {
+			return PROXY_CACHE_MISS;
+		}
+		hit.fd = ::open(getPath(hash).c_str(), O_RDONLY | O_CLOEXEC);
+		if (hit.fd < 0 || !readHead(key, *slot, hit)) {
+			if (hit.fd >= 0) {
+				close(hit.fd);
+			}
+			if (_fills.count(hash) == 0) {
+				erase(hash);
+			}
+			return PROXY_CACHE_MISS;
+		}
+		const uint64_t now = getTime();
+		slot->accessed = now;
+		if (now < slot->expires) {
+			return PROXY_CACHE_HIT;
+		} else if (_fills.count(hash) != 0) {
+			return PROXY_CACHE_UPDATING;
+		}
+		close(hit.fd);
+		return PROXY_CACHE_EXPIRED;
+	}
+
+	// only one response per key is written at a time
+	bool lock(const std::string& key) { return _fills.insert(getHash(key)).second; }
+
+	int openTemp(const std::string& key) {
+		const int fd = ::open(getTempPath(getHash(key)).c_str(),
+							  O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0) {
+			perrored("open");
+			return -1;
+		}
+		const std::string line = "KEY: " + key + "\n";
+		if (write(fd, line.data(), line.size()) != static_cast<ssize_t>(line.size())) {
+			perrored("write");
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	void commit(const std::string& key, int fd, size_t headLength, StatusCode statusCode,
+				unsigned long ttl) {
+		const uint64_t hash = getHash(key);
+		struct stat buf;
+		const std::string path = getPath(hash);
+		if (fstat(fd, &buf) != 0) {
+			perrored("fstat");
+			return abort(key, fd);
+		}
+		if (close(fd) != 0 || !makeDirectories(path.substr(0, path.rfind('/'))) ||
+			rename(getTempPath(hash).c_str(), path.c_str()) != 0) {
+			perrored("proxy cache");
+			return abort(key, -1);
+		}
+		_fills.erase(hash);
+		Slot* slot = find(hash);
+		if (slot == NULL) {
+			slot = insert(hash);
+		} else {
+			_index->size -= slot->length;
+		}
+		if (slot == NULL) {
+			unlink(path.c_str());
+			return;
+		}
+		const uint64_t now = getTime();
+		slot->expires = now + ttl;
+		slot->accessed = now;
+		slot->length = buf.st_size;
+		slot->headLength = headLength;
+		slot->statusCode = statusCode;
+		_index->size += slot->length;
+	}
+
+	void abort(const std::string& key, int fd) {
+		if (fd != -1) {
+			close(fd);
+		}
+		const uint64_t hash = getHash(key);
+		if (_fills.erase(hash) != 0) {
+			unlink(getTempPath(hash).c_str());
+		}
+	}
+
+	// cache manager pass, once per PROXY_CACHE_MANAGER_INTERVAL over the next
+	// PROXY_CACHE_MANAGER_SLOTS slots: inactive entries first, then the least recently used
+	// ones of that window while the cache is over max_size
+	void manage() {
+		const unsigned long clock = getMicroseconds() / 1000;
+		if (_index == NULL || clock - _managedAt < PROXY_CACHE_MANAGER_INTERVAL) {
+			return;
+		}
+		_managedAt = clock;
+		const uint64_t now = getTime();
+		std::vector<std::pair<uint64_t, uint64_t> > entries;
+		std::vector<uint64_t> removed;
+		const size_t window = std::min<size_t>(_slotCount, PROXY_CACHE_MANAGER_SLOTS);
+		for (size_t i = 0; i < window; ++i, _cursor = (_cursor + 1) % _slotCount) {
+			const Slot& slot = _slots[_cursor];
+			if (slot.hash == 0) {
+				continue;
+			} else if (slot.accessed + _inactive <= now) {
+				removed.push_back(slot.hash);
+			} else {
+				entries.push_back(std::make_pair(slot.accessed, slot.hash));
+			}
+		}
+		if (removed.size() > PROXY_CACHE_MANAGER_FILES) {
+			removed.resize(PROXY_CACHE_MANAGER_FILES);
+		}
+		for (size_t i = 0; i < removed.size(); ++i) {
+			remove(removed[i]);
+		}
+		if (_maxSize == 0 || _index->size <= _maxSize) {
+			return;
+		}
+		const size_t count = std::min(entries.size(), PROXY_CACHE_MANAGER_FILES - removed.size());
+		std::partial_sort(entries.begin(), entries.begin() + count, entries.end());
+		for (size_t i = 0; i < count && _index->size > _maxSize; ++i) {
+			remove(entries[i].second);
+		}
+	}
+
+	const std::string& getName() const { return _name; }
+
+private:
+	typedef struct IndexHeader {
+		char magic[8];
+		uint64_t slotCount;
+		uint64_t size;
+	} IndexHeader;
+
+	// times are wall-clock milliseconds so that they remain meaningful across restarts
+	typedef struct Slot {
+		uint64_t hash;
+		uint64_t expires;
+		uint64_t accessed;
+		uint64_t length;
+		uint32_t headLength;
+		uint32_t statusCode;
+	} Slot;
+
+	std::string _path;
+	std::string _name;
+	size_t _levels;
+	size_t _levelLengths[3];
+	size_t _slotCount;
+	size_t _maxSize;
+	unsigned long _inactive;
+	IndexHeader* _index;
+	size_t _mappedLength;
+	Slot* _slots;
+	std::set<uint64_t> _fills;
+	unsigned long _managedAt;
+	size_t _cursor;
+
+	ProxyCache(const ProxyCache&);
+	ProxyCache& operator=(const ProxyCache&);
+
+	bool parseLevels(const std::string& value) {
+		_levels = 0;
+		for (size_t begin = 0; begin <= value.size(); ++_levels) {
+			const size_t end = std::min(value.find(':', begin), value.size());
+			if (_levels == 3 || end - begin != 1 || (value[begin] != '1' && value[begin] != '2')) {
+				return false;
+			}
+			_levelLengths[_levels] = value[begin] - '0';
+			begin = end + 1;
+		}
+		return true;
+	}
+
+	static bool makeDirectories(const std::string& path) {
+		for (size_t slash = path.find('/', 2);; slash = path.find('/', slash + 1)) {
+			const std::string directory = path.substr(0, slash);
+			if (mkdir(directory.c_str(), 0755) != 0 && errno != EEXIST) {
+				return false;
+			}
+			if (slash == std::string::npos) {
+				return true;
+			}
+		}
+	}
+
+	static uint64_t getHash(const std::string& key) {
+		uint64_t hash = 14695981039346656037ULL;
+		for (size_t i = 0; i < key.size(); ++i) {
+			hash = (hash ^ static_cast<unsigned char>(key[i])) * 1099511628211ULL;
+		}
+		return hash == 0 ? 1 : hash;
+	}
+
+	static uint64_t getTime() {
+		struct timespec ts;
+		clock_gettime(CLOCK_REALTIME, &ts);
+		return ts.tv_sec * 1000ULL + ts.tv_nsec / 1000000;
+	}
+
+	static std::string getName(uint64_t hash) {
+		char name[17];
+		std::snprintf(name, sizeof(name), "%016llx", static_cast<unsigned long long>(hash));
+		return name;
+	}
+
+	// levels take their directory names from the end of the name, as nginx does
+	std::string getPath(uint64_t hash) const {
+		const std::string name = getName(hash);
+		std::string path = _path;
+		size_t end = name.size();
+		for (size_t i = 0; i < _levels; ++i) {
+			end -= _levelLengths[i];
+			path += "/" + name.substr(end, _levelLengths[i]);
+		}
+		return path + "/" + name;
+	}
+
+	std::string getTempPath(uint64_t hash) const { return _path + "/" + getName(hash) + ".tmp"; }
+
+	// the key line guards against hash collisions and files replaced behind the index
+	static bool readHead(const std::string& key, const Slot& slot, Hit& hit) {
+		const std::string line = "KEY: " + key + "\n";
+		struct stat buf;
+		if (fstat(hit.fd, &buf) != 0 || static_cast<uint64_t>(buf.st_size) != slot.length ||
+			slot.length < line.size() + slot.headLength || slot.headLength < 4) {
+			return false;
+		}
+		std::string head(line.size() + slot.headLength, '\0');
+		if (pread(hit.fd, &head[0], head.size(), 0) != static_cast<ssize_t>(head.size()) ||
+			head.compare(0, line.size(), line) != 0) {
+			return false;
+		}
+		hit.head = head.substr(line.size());
+		hit.bodyOffset = head.size();
+		hit.bodyLength = slot.length - head.size();
+		hit.statusCode = static_cast<StatusCode>(slot.statusCode);
+		return true;
+	}
+
+	Slot* find(uint64_t hash) const {
+		if (_index == NULL) {
+			return NULL;
+		}
+		for (size_t i = hash % _slotCount, probes = 0; probes < _slotCount;
+			 i = (i + 1) % _slotCount, ++probes) {
+			if (_slots[i].hash == hash) {
+				return &_slots[i];
+			} else if (_slots[i].hash == 0) {
+				return NULL;
+			}
+		}
+		return NULL;
+	}
+
+	// a full table makes room by dropping the least recently used entry
+	Slot* insert(uint64_t hash) {
+		if (_index == NULL) {
+			return NULL;
+		}
+		for (int attempt = 0; attempt < 2; ++attempt) {
+			for (size_t i = hash % _slotCount, probes = 0; probes < _slotCount;
+				 i = (i + 1) % _slotCount, ++probes) {
+				if (_slots[i].hash == 0) {
+					std::memset(&_slots[i], 0, sizeof(Slot));
+					_slots[i].hash = hash;
+					return &_slots[i];
+				}
+			}
+			size_t oldest = 0;
+			for (size_t i = 1; i < _slotCount; ++i) {
+				if (_slots[i].accessed < _slots[oldest].accessed) {
+					oldest = i;
+				}
+			}
+			remove(_slots[oldest].hash);
+		}
+		return NULL;
+	}
+
+	void remove(uint64_t hash) {
+		unlink(getPath(hash).c_str());
+		erase(hash);
+	}
+
+	// backward shift deletion keeps probe sequences intact without tombstones
+	void erase(uint64_t hash) {
+		Slot* slot = find(hash);
+		if (slot == NULL) {
+			return;
+		}
+		_index->size -= slot->length;
+		size_t hole = slot - _slots;
+		for (size_t i = (hole + 1) % _slotCount, probes = 1;
+			 _slots[i].hash != 0 && probes < _slotCount; i = (i + 1) % _slotCount, ++probes) {
+			const size_t home = _slots[i].hash % _slotCount;
+			if ((i > hole && (home <= hole || home > i)) || (i < hole && home <= hole && home > i)) {
+				_slots[hole] = _slots[i];
+				hole = i;
+			}
+		}
+		std::memset(&_slots[hole], 0, sizeof(Slot));
+	}
+};
@@ -4,60 +4,67 @@
 
 class Request {
 public:
-	Request(std::vector<VirtualServer*>& associatedServers, in_addr_t& ip, in_port_t& port)
+	Request(std::vector<VirtualServer*>& associatedServers, in_addr_t& ip, in_port_t& port,
+			Arena* arena = NULL)
 		: _associatedServers(associatedServers), _ip(ip), _port(port),
 		  _maxBodySize(DEFAULT_BODY_SIZE), _matchingServer(associatedServers[0]),
-		  _matchingLocation(NULL) {
+		  _matchingLocation(NULL), _headers(arena) {
 		clear();
 	}
 
+	// bodies and runs of printable head bytes are consumed as whole ranges, only line
+	// endings and invalid bytes go through the byte by byte checks
 	RequestParsingResult parse(const char* s = NULL, size_t size = 0) {
 		for (size_t i = 0; i < size; ++i) {
-			_queue.push(s[i]);
-		}
-		while (!_queue.empty()) {
-			unsigned char c = _queue.front();
-			_queue.pop();
 			if (_isInBody) {
-				_body.push_back(c);
-				if (_body.size() == _contentLength) {
-					return parsingSuccess();
-				}
-			} else {
-				++_headerSize;
-				if (_headerSize > MAX_HEADER_SIZE) {
+				const size_t count = std::min(size - i, _contentLength - _body.size());
+				_body.insert(_body.end(), s + i, s + i + count);
+				return _body.size() == _contentLength ? parsingSuccess() : parsingProcessing();
+			}
+			const bool expectsNewline = !_line.empty() && _line[_line.size() - 1] == '\r';
+			if (!expectsNewline) {
+				const size_t run = scanPrintable(s + i, size - i);
+				if (_headerSize + run > MAX_HEADER_SIZE) {
 					return parsingFailure(STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
 				}
-				const bool expectsNewline = !_line.empty() && _line[_line.size() - 1] == '\r';
-				if (expectsNewline ? c != '\n' : c != '\r' && !std::isprint(c)) {
-					return parsingFailure(STATUS_BAD_REQUEST);
+				_line.append(s + i, run);
+				_headerSize += run;
+				i += run;
+				if (i == size) {
+					break;
+				}
+			}
+			const unsigned char c = s[i];
+			if (++_headerSize > MAX_HEADER_SIZE) {
+				return parsingFailure(STATUS_REQUEST_HEADER_FIELDS_TOO_LARGE);
+			}
+			if (expectsNewline ? c != '\n' : c != '\r') {
+				return parsingFailure(STATUS_BAD_REQUEST);
+			}
+			_line += c;
+			if (c == '\n') {
+				_line.resize(_line.size() - 2);
+				const StatusCode statusCode = _line.empty()	   ? checkHeaders()
+											  : _isRequestLine ? parseRequestLine()
+															   : parseHeaderLine();
+				if (statusCode != STATUS_NONE) {
+					return parsingFailure(statusCode);
 				}
-				_line += c;
-				if (endswith(_line, "\r\n")) {
-					_line.resize(_line.size() - 2);
-					const StatusCode statusCode = _line.empty()	   ? checkHeaders()
-												  : _isRequestLine ? parseRequestLine()
-																   : parseHeaderLine();
-					if (statusCode != STATUS_NONE) {
-						return parsingFailure(statusCode);
-					}
-					if (_line.empty() && _contentLength == 0) {
-						return parsingSuccess();
-					}
-					_line.clear();
+				if (_line.empty() && _contentLength == 0) {
+					return parsingSuccess();
 				}
+				_line.clear();
 			}
 		}
 		return parsingProcessing();
 	}
 
-private:
-	typedef enum HeaderState {
-		HEADER_KEY,
-		HEADER_SKIP,
-		HEADER_VALUE,
-	} HeaderState;
+	size_t getMissingBodySize() const { return _isInBody ? _contentLength - _body.size() : 0; }
 
+	// ends parsing once the head is complete, the rest of the body being read by the caller
+	RequestParsingResult detachHead() { return parsingSuccess(); }
+
+private:
 	std::vector<VirtualServer*>& _associatedServers;
 	in_addr_t _ip;
 	in_port_t _port;
@@ -65,7 +72,6 @@ private:
 	VirtualServer* _matchingServer;
 	Location* _matchingLocation;
 
-	std::queue<unsigned char> _queue;
 	std::string _line;
 	size_t _headerSize;
 	size_t _contentLength;
@@ -75,12 +81,10 @@ private:
 	RequestMethod _method;
 	std::string _uri;
 	std::string _query;
-	std::map<std::string, std::string> _headers;
+	HeaderTable _headers;
 	std::vector<unsigned char> _body;
 
 	void clear() {
-		std::queue<unsigned char> empty;
-		std::swap(_queue, empty);
 		_line.clear();
 		_headerSize = 0;
 		_contentLength = 0;
@@ -95,9 +99,10 @@ private:
 
 	StatusCode parseRequestLine() {
 		std::string methodString, version, check;
-		std::istringstream iss(_line);
+		size_t pos = 0;
 		_isRequestLine = false;
-		if (!(iss >> methodString >> _uri >> version) || (iss >> check) || _uri[0] != '/') {
+		if (!nextWord(pos, methodString) || !nextWord(pos, _uri) || !nextWord(pos, version) ||
+			nextWord(pos, check) || _uri[0] != '/') {
 			return STATUS_BAD_REQUEST;
 		}
 		if (methodString == "DELETE") {
@@ -122,8 +127,8 @@ private:
 		}
 		size_t queryIdx = _uri.find('?');
 		if (queryIdx != std::string::npos) {
-			_query = _uri.substr(queryIdx + 1);
-			_uri = _uri.substr(0, queryIdx);
+			_query.assign(_uri, queryIdx + 1, std::string::npos);
+			_uri.resize(queryIdx);
 		}
 		_uri = decodeUri(_uri);
 		if (_uri[_uri.size() - 1] == '/' && _uri.size() > 1) {
@@ -133,34 +138,24 @@ private:
 		return STATUS_NONE;
 	}
 
-	StatusCode parseHeaderLine() {
-		HeaderState headerState = HEADER_KEY;
-		std::string key, value;
-		for (size_t i = 0; i < _line.size(); ++i) {
-			char c = _line[i];
-			switch (headerState) {
-			case HEADER_KEY:
-				if (c == ':') {
-					headerState = HEADER_SKIP;
-				} else {
-					key += tolower(c);
-				}
-				break;
-			case HEADER_SKIP:
-				if (c != ' ') {
-					headerState = HEADER_VALUE;
-					value += c;
-				}
-				break;
-			case HEADER_VALUE:
-				value += c;
-				break;
-			}
+	bool nextWord(size_t& pos, std::string& word) const {
+		const size_t begin = _line.find_first_not_of(' ', pos);
+		if (begin == std::string::npos) {
+			return false;
 		}
-		if (key.empty() || value.empty()) {
+		pos = _line.find(' ', begin);
+		word.assign(_line, begin, pos - begin);
+		return true;
+	}
+
+	StatusCode parseHeaderLine() {
+		const size_t colon = _line.find(':');
+		const size_t valueStart =
+			colon == std::string::npos ? std::string::npos : _line.find_first_not_of(' ', colon + 1);
+		if (colon == 0 || valueStart == std::string::npos) {
 			return STATUS_BAD_REQUEST;
 		}
-		_headers[key] = value;
+		_headers.add(_line.c_str(), colon, _line.c_str() + valueStart, _line.size() - valueStart);
 		return STATUS_NONE;
 	}
 
@@ -169,21 +164,20 @@ private:
 		if (_isRequestLine) {
 			return STATUS_BAD_REQUEST;
 		}
-		std::map<std::string, std::string>::const_iterator host = _headers.find("host");
-		if (host == _headers.end()) {
+		const char* host = _headers.get(HEADER_HOST);
+		if (host == NULL) {
 			return STATUS_BAD_REQUEST;
 		}
-		findMatchingServerAndLocation(host->second);
+		findMatchingServerAndLocation(host);
 		if (_method == POST) {
-			std::map<std::string, std::string>::const_iterator it = _headers.find("content-length");
-			if (it == _headers.end()) {
+			const char* contentLength = _headers.get(HEADER_CONTENT_LENGTH);
+			if (contentLength == NULL) {
 				return STATUS_LENGTH_REQUIRED;
 			}
-			const std::string contentLengthString = it->second;
-			if (contentLengthString.find_first_not_of("0123456789") != std::string::npos) {
+			if (contentLength[std::strspn(contentLength, "0123456789")] != '\0') {
 				return STATUS_BAD_REQUEST;
 			}
-			_contentLength = std::strtol(contentLengthString.c_str(), NULL, 10);
+			_contentLength = std::strtol(contentLength, NULL, 10);
 			if (_contentLength > _maxBodySize) {
 				return STATUS_PAYLOAD_TOO_LARGE;
 			}
@@ -242,14 +236,14 @@ private:
 		rpr.virtualServer = _matchingServer;
 		rpr.location = _matchingLocation;
 		rpr.success.method = _method;
-		rpr.success.headers = _headers;
-		rpr.success.body = _body;
-		rpr.success.uri = _uri;
-		rpr.success.query = _query;
+		rpr.success.headers.swap(_headers);
+		rpr.success.body.swap(_body);
+		rpr.success.uri.swap(_uri);
+		rpr.success.query.swap(_query);
 		if (rpr.success.method == POST && rpr.success.query.empty()) {
-			std::map<std::string, std::string>::const_iterator it = _headers.find("content-type");
-			if (it != _headers.end() && it->second == "application/x-www-form-urlencoded") {
-				rpr.success.query = std::string(_body.begin(), _body.end());
+			const char* contentType = rpr.success.headers.get(HEADER_CONTENT_TYPE);
+			if (contentType && std::strcmp(contentType, "application/x-www-form-urlencoded") == 0) {
+				rpr.success.query.assign(rpr.success.body.begin(), rpr.success.body.end());
 			}
 		}
 		clear();
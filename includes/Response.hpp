@@ -5,34 +5,61 @@
 extern const std::map<StatusCode, std::string> STATUS_MESSAGES;
 extern const std::map<std::string, std::string> MIME_TYPES;
 extern const std::set<std::string> CGI_NO_TRANSMISSION;
+extern Metrics metrics;
 
 class Response {
 public:
-	Response(RequestMethod method, std::string rootDir, bool autoIndex,
+	Response(RequestMethod method, const std::string& rootDir, bool autoIndex,
 			 std::map<int, std::string> const& errorPages,
-			 std::vector<std::string> const& indexPages)
-		: _bodyPos(0), _statusCode(STATUS_NONE), _method(method), _rootDir(rootDir),
-		  _autoIndex(autoIndex), _serverErrorPages(errorPages), _indexPages(indexPages),
-		  _return(-1, "") {
+			 std::vector<std::string> const& indexPages, Arena* arena = NULL)
+		: _headers(arena), _headPos(0), _bodyPos(0), _headLength(0), _file(-1), _fileRemaining(0),
+		  _mapping(NULL), _mappingOffset(0), _mappingLength(0), _sharedBody(NULL), _arena(arena),
+		  _proxy(NULL), _proxied(false), _truncated(false), _virtualServer(NULL), _location(NULL),
+		  _sendfile(false), _wouldBlock(false), _buffered(false), _sink(NULL), _sinkRoom(0),
+		  _uploadFd(-1), _uploadPiped(0), _uploadRemaining(0), _uploadExisted(false),
+		  _multipart(NULL), _statusCode(STATUS_NONE), _method(method), _rootDir(rootDir),
+		  _autoIndex(autoIndex), _serverErrorPages(&errorPages), _errorPages(NULL),
+		  _indexPages(&indexPages), _return(-1, "") {
 		initAllowedMethods(_allowedMethods);
-		initMethodMap();
+		_uploadPipe[0] = _uploadPipe[1] = -1;
 	}
 
-	Response(RequestMethod method, std::string rootDir, std::string uploadDir, bool autoIndex,
-			 std::map<int, std::string> const& serverErrorPages,
+	Response(RequestMethod method, const std::string& rootDir, const std::string& uploadDir,
+			 bool autoIndex, std::map<int, std::string> const& serverErrorPages,
 			 std::map<int, std::string> const& errorPages,
-			 std::vector<std::string> const& indexPages, std::string locationUri,
-			 std::pair<long, std::string> redirect, const bool allowedMethods[NO_METHOD],
-			 std::string cgiExec)
-		: _bodyPos(0), _statusCode(STATUS_NONE), _method(method), _rootDir(rootDir),
-		  _uploadDir(uploadDir), _autoIndex(autoIndex), _serverErrorPages(serverErrorPages),
-		  _errorPages(errorPages), _indexPages(indexPages), _locationUri(locationUri),
+			 std::vector<std::string> const& indexPages, const std::string& locationUri,
+			 std::pair<long, std::string> const& redirect, const bool allowedMethods[NO_METHOD],
+			 const std::string& cgiExec, Arena* arena = NULL)
+		: _headers(arena), _headPos(0), _bodyPos(0), _headLength(0), _file(-1), _fileRemaining(0),
+		  _mapping(NULL), _mappingOffset(0), _mappingLength(0), _sharedBody(NULL), _arena(arena),
+		  _proxy(NULL), _proxied(false), _truncated(false), _virtualServer(NULL), _location(NULL),
+		  _sendfile(false), _wouldBlock(false), _buffered(false), _sink(NULL), _sinkRoom(0),
+		  _uploadFd(-1), _uploadPiped(0), _uploadRemaining(0), _uploadExisted(false),
+		  _multipart(NULL), _statusCode(STATUS_NONE), _method(method), _rootDir(rootDir),
+		  _uploadDir(uploadDir), _autoIndex(autoIndex), _serverErrorPages(&serverErrorPages),
+		  _errorPages(&errorPages), _indexPages(&indexPages), _locationUri(locationUri),
 		  _return(redirect), _cgiExec(cgiExec) {
 		std::copy(allowedMethods, allowedMethods + NO_METHOD, _allowedMethods);
-		initMethodMap();
+		_uploadPipe[0] = _uploadPipe[1] = -1;
 	}
 
-	~Response(){};
+	~Response() {
+		if (_file != -1) {
+			close(_file);
+		}
+		if (_mapping != NULL) {
+			_mapping->release();
+		}
+		if (_sharedBody != NULL) {
+			_sharedBody->release();
+		}
+		destroyProxy();
+		if (_uploadFd != -1 && !_uploadExisted) {
+			std::remove(_uploadPath.c_str());
+		}
+		closeUpload();
+		destroyMultipart();
+	};
 
 	void buildResponse(RequestParsingResult& request) {
 		if (request.result == REQUEST_PARSING_FAILURE) {
@@ -43,52 +70,191 @@ public:
 			buildErrorPage(request, STATUS_METHOD_NOT_ALLOWED);
 		} else if (_return.first != -1) {
 			buildRedirect(request);
+		} else if (request.location && request.location->getStubStatus()) {
+			buildStubStatus();
+		} else if (request.location && request.location->getProxyConfig()) {
+			buildProxy(request);
 		} else {
-			MethodHandler handler = _methodHandlers[request.success.method];
-			(this->*handler)(request);
+			(this->*getMethodHandler(request.success.method))(request);
+		}
+		// a detached body nothing took is read and dropped, not parsed as the next request
+		if (request.result == REQUEST_PARSING_SUCCESS && _uploadRemaining == 0) {
+			_uploadRemaining = getDetachedBodySize(request.success);
+		}
+		if (_headLength == 0 && !_proxied && _head.empty()) {
+			buildStatusLine();
+			buildHeader();
 		}
-		buildStatusLine();
-		buildHeader();
 	}
 
-	ResponseStatusEnum pushResponseToClient(int fd) {
-		std::string line;
-		if (_bodyPos == 0) {
-			if (DEBUG) {
-				std::cout << GREEN << "=== RESPONSE START ===" << RESET << '\n';
-			}
-			if (!pushStringToClient(fd, _statusLine)) {
-				return RESPONSE_FAILURE;
+	// the output is then produced into memory, never mapped nor spliced from files
+	void bufferOutput() { _buffered = true; }
+
+	// appends at most room bytes of the response, for a stream to frame them
+	ResponseStatusEnum pushResponseToBuffer(std::string& buffer, size_t room) {
+		_sink = &buffer;
+		_sinkRoom = room;
+		ResponseStatusEnum status = RESPONSE_PENDING;
+		while (status == RESPONSE_PENDING && _sinkRoom > 0) {
+			const size_t before = _sinkRoom;
+			status = pushResponseToClient(-1);
+			if (_sinkRoom == before) {
+				break;
 			}
-			for (std::map<std::string, std::string>::const_iterator it = _headers.begin();
-				 it != _headers.end(); it++) {
-				line = it->first + ": " + it->second + "\r\n";
-				if (!pushStringToClient(fd, line)) {
+		}
+		_sink = NULL;
+		return status;
+	}
+
+	bool isReceivingUpload() const { return _uploadRemaining != 0; }
+
+	// a proxied body waits while its queue to the upstream is full
+	bool wantsUpload() {
+		return _proxy == NULL || _proxy->isFinished() || _requestBody.hasRoom();
+	}
+
+	// moves the rest of an upload from the socket to its file through a pipe, the bytes
+	// never reaching user space; peers leaving midway fail the response
+	ResponseStatusEnum receiveUpload(int fd) {
+		_wouldBlock = false;
+		if (_multipart != NULL) {
+			return receiveMultipart(fd);
+		} else if (_uploadFd == -1) {
+			return receiveProxyBody(fd);
+		}
+		while (_uploadRemaining > 0) {
+			if (_uploadPiped == 0) {
+				ssize_t received = splice(fd, NULL, _uploadPipe[1], NULL,
+										  std::min<size_t>(_uploadRemaining, PIPE_SIZE),
+										  SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+				if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+					_wouldBlock = true;
+					return RESPONSE_PENDING;
+				}
+				if (received <= 0) {
 					return RESPONSE_FAILURE;
 				}
+				metrics.bytesReceived(received);
+				_uploadPiped = received;
 			}
-			for (std::vector<std::string>::const_iterator it = _setCookies.begin();
-				 it != _setCookies.end(); it++) {
-				line = "set-cookie: " + *it + "\r\n";
-				if (!pushStringToClient(fd, line)) {
-					return RESPONSE_FAILURE;
+			while (_uploadPiped > 0) {
+				ssize_t written = splice(_uploadPipe[0], NULL, _uploadFd, NULL, _uploadPiped,
+										 SPLICE_F_MOVE);
+				if (written <= 0) {
+					perrored("splice");
+					failUpload(STATUS_INTERNAL_SERVER_ERROR);
+					return receiveProxyBody(fd);
 				}
+				_uploadPiped -= written;
+				_uploadRemaining -= written;
+			}
+		}
+		closeUpload();
+		return RESPONSE_SUCCESS;
+	}
+
+	// multipart bodies have to be parsed, they go through user space one buffer at a time
+	ResponseStatusEnum receiveMultipart(int fd) {
+		char buffer[BUFFER_SIZE];
+		while (_uploadRemaining > 0) {
+			ssize_t received = EventBackend::receiveFrom(
+				fd, buffer, std::min<size_t>(_uploadRemaining, BUFFER_SIZE));
+			if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				_wouldBlock = true;
+				return RESPONSE_PENDING;
+			}
+			if (received <= 0) {
+				return RESPONSE_FAILURE;
 			}
-			line = "\r\n";
-			if (!pushStringToClient(fd, line)) {
+			metrics.bytesReceived(received);
+			_uploadRemaining -= received;
+			StatusCode status = _multipart->feed(buffer, received);
+			if (status == STATUS_NONE && _uploadRemaining == 0) {
+				status = _multipart->finish();
+			}
+			if (status != STATUS_NONE) {
+				failUpload(status);
+				return receiveProxyBody(fd);
+			}
+		}
+		return RESPONSE_SUCCESS;
+	}
+
+	static size_t getDetachedBodySize(const RequestParsingSuccess& success) {
+		const char* contentLength = success.headers.get(HEADER_CONTENT_LENGTH);
+		const size_t length = contentLength ? std::strtoul(contentLength, NULL, 10) : 0;
+		return length > success.body.size() ? length - success.body.size() : 0;
+	}
+
+	// the body of a proxied request is queued for the upstream as it arrives, once nothing
+	// takes it anymore, like after a failed upload, the rest is read and dropped so that
+	// closing the connection does not reset it before the client gets the response
+	ResponseStatusEnum receiveProxyBody(int fd) {
+		char scratch[BUFFER_SIZE];
+		while (_uploadRemaining > 0) {
+			const bool queued = _proxy != NULL && !_proxy->isFinished();
+			size_t length = sizeof(scratch);
+			char* buffer = scratch;
+			if (queued &&
+				(!_requestBody.hasRoom() || (buffer = _requestBody.prepare(length)) == NULL)) {
+				_wouldBlock = true;
+				return RESPONSE_PENDING;
+			}
+			ssize_t received =
+				EventBackend::receiveFrom(fd, buffer, std::min(length, _uploadRemaining));
+			if (received < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				_wouldBlock = true;
+				return RESPONSE_PENDING;
+			}
+			if (received <= 0) {
+				return RESPONSE_FAILURE;
+			}
+			metrics.bytesReceived(received);
+			_uploadRemaining -= received;
+			if (queued) {
+				_requestBody.commit(received);
+			}
+		}
+		return RESPONSE_SUCCESS;
+	}
+
+	ResponseStatusEnum pushResponseToClient(int fd) {
+		_wouldBlock = false;
+		if (_proxied) {
+			return pushProxyToClient(fd);
+		}
+		if (_head.empty() && _headLength == 0) {
+			if (DEBUG) {
+				std::cout << GREEN << "=== RESPONSE START ===" << RESET << '\n';
+			}
+			buildHead();
+		}
+		if (_headPos < _head.size()) {
+			if (!pushChunkToClient(fd, _head.c_str(), _headPos, _head.size())) {
 				return RESPONSE_FAILURE;
 			}
+			if (_headPos < _head.size()) {
+				return RESPONSE_PENDING;
+			}
 		}
-		if (_method == HEAD) {
+		if (_method == HEAD && _headLength == 0) {
 			if (DEBUG) {
 				std::cout << GREEN << "\n=== RESPONSE END ===" << RESET << '\n';
 			}
 			return RESPONSE_SUCCESS;
 		}
-		if (!pushBodyChunkToClient(fd)) {
+		if (_file != -1) {
+			return _sendfile && _sink == NULL ? pushSendfileToClient(fd) : pushFileToClient(fd);
+		}
+		if (_mapping != NULL) {
+			return pushMappingToClient(fd);
+		}
+		const std::string& body = _sharedBody != NULL ? _sharedBody->getData() : _body;
+		const size_t end = _method == HEAD ? _headLength : body.size();
+		if (!pushChunkToClient(fd, body.c_str(), _bodyPos, end)) {
 			return RESPONSE_FAILURE;
 		}
-		if (_bodyPos == _body.size()) {
+		if (_bodyPos == end) {
 			if (DEBUG) {
 				std::cout << GREEN << "\n=== RESPONSE END ===" << RESET << '\n';
 			}
@@ -97,32 +263,126 @@ public:
 		return RESPONSE_PENDING;
 	}
 
+	StatusCode getStatusCode() const { return _statusCode; }
+	bool wouldBlock() const { return _wouldBlock; }
+	size_t getBodyBytesSent() const {
+		return _method == HEAD || _bodyPos < _headLength ? 0 : _bodyPos - _headLength;
+	}
+	bool hasFileBody() const { return _file != -1 || _mapping != NULL; }
+	bool hasOutput() const {
+		return (!_proxied || _proxy == NULL || !_output.empty()) && !isStarved();
+	}
+
+	// a producer with nothing queued waits for the global output limit to clear
+	bool isStarved() const {
+		if (!_output.empty() || !OutputQueue::isThrottled()) {
+			return false;
+		}
+		return _proxied ? _proxy != NULL && _proxy->isReadingBody()
+						: _file != -1 && _fileRemaining > 0 && (!_sendfile || _sink != NULL);
+	}
+
+	int getUpstreamFd() const { return _proxy ? _proxy->getFd() : -1; }
+	uint32_t getUpstreamEvents() { return _proxy ? _proxy->getEvents() : 0; }
+	unsigned long getUpstreamDeadline() { return _proxy ? _proxy->getDeadline() : 0; }
+	bool isUpstreamFinished() const { return _proxy && _proxy->isFinished(); }
+
+	void handleUpstreamEvents() {
+		_proxy->handleEvents();
+		if (_proxy->hasStarted()) {
+			_statusCode = _proxy->getStatusCode();
+			_headLength = _proxy->getHeadLength();
+		}
+	}
+
+	void failUpstream(StatusCode error) { _proxy->fail(error); }
+
+	// an upstream failing before any byte of its head reached the output gets an error page
+	void releaseUpstream() {
+		_proxy->release();
+		if (_proxy->hasFailed() && !_proxy->hasStarted() && _proxy->retry()) {
+			return;
+		}
+		if (_proxy->hasFailed() && !_proxy->hasStarted()) {
+			const StatusCode error = _proxy->getError();
+			destroyProxy();
+			_proxied = false;
+			RequestParsingResult request;
+			request.result = REQUEST_PARSING_FAILURE;
+			request.statusCode = error;
+			request.virtualServer = _virtualServer;
+			request.location = _location;
+			buildErrorPage(request, error);
+			if (_head.empty()) {
+				buildStatusLine();
+				buildHeader();
+			}
+			return;
+		}
+		_truncated = _proxy->hasFailed();
+		destroyProxy();
+	}
+
 private:
+	friend class ResponseBench;
+
 	typedef void (Response::*MethodHandler)(RequestParsingResult&);
-	std::map<RequestMethod, MethodHandler> _methodHandlers;
 	std::string _statusLine;
-	std::map<std::string, std::string> _headers;
+	HeaderTable _headers;
+	std::string _head;
+	size_t _headPos;
 	std::string _body;
 	size_t _bodyPos;
+	size_t _headLength;
+	int _file;
+	size_t _fileRemaining;
+	OutputQueue _output;
+	MappedFile* _mapping;
+	size_t _mappingOffset;
+	size_t _mappingLength;
+	SharedBuffer* _sharedBody;
+	Arena* _arena;
+	Proxy* _proxy;
+	OutputQueue _requestBody;
+	bool _proxied;
+	bool _truncated;
+	VirtualServer* _virtualServer;
+	Location* _location;
+	bool _sendfile;
+	bool _wouldBlock;
+	bool _buffered;
+	std::string* _sink;
+	size_t _sinkRoom;
+	int _uploadFd;
+	int _uploadPipe[2];
+	size_t _uploadPiped;
+	size_t _uploadRemaining;
+	std::string _uploadPath;
+	bool _uploadExisted;
+	Multipart* _multipart;
 	StatusCode _statusCode;
 	RequestMethod _method;
 	std::string _rootDir;
 	std::string _uploadDir;
 	bool _autoIndex;
-	std::map<int, std::string> _serverErrorPages;
-	std::map<int, std::string> _errorPages;
-	std::vector<std::string> _indexPages;
+	const std::map<int, std::string>* _serverErrorPages;
+	const std::map<int, std::string>* _errorPages;
+	const std::vector<std::string>* _indexPages;
 	std::string _locationUri;
 	std::pair<long, std::string> _return;
 	bool _allowedMethods[NO_METHOD];
 	std::string _cgiExec;
 	std::vector<std::string> _setCookies;
 
-	void initMethodMap() {
-		_methodHandlers[GET] = &Response::buildGet;
-		_methodHandlers[POST] = &Response::buildPost;
-		_methodHandlers[DELETE] = &Response::buildDelete;
-		_methodHandlers[HEAD] = &Response::buildGet;
+	static MethodHandler getMethodHandler(RequestMethod method) {
+		switch (method) {
+		case POST:
+			return &Response::buildPost;
+		case DELETE:
+			return &Response::buildDelete;
+		default:
+			return &Response::buildGet;
+		}
 	}
 
 	void buildGet(RequestParsingResult& request) {
@@ -135,22 +395,28 @@ private:
 	}
 
 	void buildPost(RequestParsingResult& request) {
-		std::map<std::string, std::string>::const_iterator it =
-			request.success.headers.find("content-type");
-		if (it == request.success.headers.end()) {
+		const char* contentType = request.success.headers.get(HEADER_CONTENT_TYPE);
+		if (contentType == NULL) {
 			return buildErrorPage(request, STATUS_BAD_REQUEST);
-		} else if (it->second == "application/x-www-form-urlencoded" ||
-				   it->second == "multipart/form-data") {
+		} else if (std::strcmp(contentType, "application/x-www-form-urlencoded") == 0) {
 			return buildErrorPage(request, STATUS_UNSUPPORTED_MEDIA_TYPE);
 		} else if (!isDirectory("." + _uploadDir)) {
 			return buildErrorPage(request, STATUS_NOT_FOUND);
 		}
-		_headers["content-type"] = it->second;
 		const std::string fileName = getFileUri(request);
 		if (fileName.empty()) {
 			return buildErrorPage(request, STATUS_BAD_REQUEST);
 		}
+		const size_t contentLength =
+			std::strtoul(request.success.headers.get(HEADER_CONTENT_LENGTH), NULL, 10);
+		if (Multipart::isMultipart(contentType)) {
+			return startMultipart(request, contentType, fileName, contentLength);
+		}
+		_headers.set(HEADER_CONTENT_TYPE, contentType);
 		bool existed = access(fileName.c_str(), F_OK) == 0;
+		if (request.success.body.size() < contentLength) {
+			return startUpload(request, fileName, existed, contentLength);
+		}
 		std::ofstream ofs(fileName.c_str());
 		if (ofs.fail()) {
 			return buildErrorPage(request, STATUS_BAD_REQUEST);
@@ -168,6 +434,104 @@ private:
 		_statusCode = STATUS_CREATED;
 	}
 
+	// the head was detached from a large body, what arrived with it is written right away
+	void startUpload(RequestParsingResult& request, const std::string& fileName, bool existed,
+					 size_t contentLength) {
+		const std::vector<unsigned char>& body = request.success.body;
+		_uploadFd = open(fileName.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+		if (_uploadFd < 0) {
+			return buildErrorPage(request, STATUS_BAD_REQUEST);
+		}
+		_uploadPath = fileName;
+		_uploadExisted = existed;
+		_uploadRemaining = contentLength - body.size();
+		_virtualServer = request.virtualServer;
+		_location = request.location;
+		if (pipe2(_uploadPipe, O_NONBLOCK | O_CLOEXEC) != 0 ||
+			(!body.empty() && write(_uploadFd, &body[0], body.size()) !=
+								  static_cast<ssize_t>(body.size()))) {
+			perrored(_uploadPipe[0] == -1 ? "pipe2" : "write");
+			return failUpload(STATUS_INTERNAL_SERVER_ERROR);
+		}
+		_statusCode = STATUS_CREATED;
+	}
+
+	// file parts are stored in the directory the request targets, under their own name
+	void startMultipart(RequestParsingResult& request, const char* contentType,
+						const std::string& directory, size_t contentLength) {
+		std::string boundary;
+		if (!Multipart::parseBoundary(contentType, boundary)) {
+			return buildErrorPage(request, STATUS_BAD_REQUEST);
+		} else if (!isDirectory(directory)) {
+			return buildErrorPage(request, STATUS_NOT_FOUND);
+		}
+		void* storage =
+			_arena ? _arena->allocate(sizeof(Multipart)) : ::operator new(sizeof(Multipart));
+		_multipart = new (storage)
+			Multipart(boundary, directory + "/", request.location->getUploadPartSize());
+		_virtualServer = request.virtualServer;
+		_location = request.location;
+		const std::vector<unsigned char>& body = request.success.body;
+		_uploadRemaining = contentLength - body.size();
+		StatusCode status =
+			body.empty() ? STATUS_NONE
+						 : _multipart->feed(reinterpret_cast<const char*>(&body[0]), body.size());
+		if (status == STATUS_NONE && _uploadRemaining == 0) {
+			status = _multipart->finish();
+		}
+		if (status != STATUS_NONE) {
+			return failUpload(status);
+		}
+		_statusCode = STATUS_CREATED;
+	}
+
+	// the unread rest of the body is still drained, only what sat in the pipe is lost
+	void failUpload(StatusCode statusCode) {
+		if (_uploadFd != -1 && !_uploadExisted) {
+			std::remove(_uploadPath.c_str());
+		}
+		const size_t remaining = _uploadRemaining - _uploadPiped;
+		closeUpload();
+		_uploadRemaining = remaining;
+		_uploadPiped = 0;
+		destroyMultipart();
+		RequestParsingResult request;
+		request.result = REQUEST_PARSING_FAILURE;
+		request.statusCode = statusCode;
+		request.virtualServer = _virtualServer;
+		request.location = _location;
+		buildErrorPage(request, statusCode);
+		if (_head.empty()) {
+			buildStatusLine();
+			buildHeader();
+		}
+	}
+
+	void destroyMultipart() {
+		if (_multipart == NULL) {
+			return;
+		}
+		_multipart->~Multipart();
+		if (_arena == NULL) {
+			::operator delete(_multipart);
+		}
+		_multipart = NULL;
+	}
+
+	void closeUpload() {
+		for (int i = 0; i < 2; ++i) {
+			if (_uploadPipe[i] != -1) {
+				close(_uploadPipe[i]);
+				_uploadPipe[i] = -1;
+			}
+		}
+		if (_uploadFd != -1) {
+			close(_uploadFd);
+			_uploadFd = -1;
+		}
+		_uploadRemaining = 0;
+	}
+
 	void buildDelete(RequestParsingResult& request) {
 		std::string uri = getFileUri(request);
 		if (uri.empty()) {
@@ -182,121 +546,370 @@ private:
 		_statusCode = STATUS_NO_CONTENT;
 	}
 
-	bool pushStringToClient(int fd, std::string& line) {
-		if (DEBUG) {
-			std::cout << GREEN << line << RESET;
+	void buildHead() {
+		_head.reserve(RESPONSE_HEAD_SIZE);
+		_head += _statusLine;
+		_headers.serialize(_head);
+		for (std::vector<std::string>::const_iterator it = _setCookies.begin();
+			 it != _setCookies.end(); it++) {
+			_head += "set-cookie: ";
+			_head += *it;
+			_head += "\r\n";
 		}
-		size_t totalSent = 0;
-		while (totalSent < line.size()) {
-			int curSent = send(fd, line.c_str() + totalSent, line.size() - totalSent, MSG_NOSIGNAL);
-			if (curSent <= 0) {
-				perrored("send");
-				return false;
-			}
-			totalSent += curSent;
-		}
-		return true;
+		_head += "\r\n";
 	}
 
-	bool pushBodyChunkToClient(int fd) {
-		size_t toSend =
-			std::min(_body.size() - _bodyPos, static_cast<size_t>(RESPONSE_BUFFER_SIZE));
-		ssize_t sent = send(fd, _body.c_str() + _bodyPos, toSend, MSG_NOSIGNAL);
+	bool pushChunkToClient(int fd, const char* buffer, size_t& pos, size_t end) {
+		size_t toSend = std::min(end - pos, static_cast<size_t>(RESPONSE_BUFFER_SIZE));
+		if (toSend == 0) {
+			return true;
+		}
+		ssize_t sent = sendData(fd, buffer + pos, toSend);
 		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				_wouldBlock = true;
+				return true;
+			}
 			perrored("send");
 			return false;
 		}
 		if (DEBUG) {
-			std::cout << GREEN << _body.substr(_bodyPos, sent) << RESET;
+			std::cout << GREEN << std::string(buffer + pos, sent) << RESET;
 		}
-		_bodyPos += sent;
+		pos += sent;
+		metrics.bytesSent(sent);
 		return true;
 	}
 
+	ssize_t sendData(int fd, const char* data, size_t length) {
+		if (_sink == NULL) {
+			return send(fd, data, length, MSG_NOSIGNAL);
+		}
+		length = std::min(length, _sinkRoom);
+		if (length == 0) {
+			errno = EAGAIN;
+			return -1;
+		}
+		_sink->append(data, length);
+		_sinkRoom -= length;
+		return length;
+	}
+
+	ssize_t sendOutput(int fd) {
+		if (_sink == NULL) {
+			return _output.sendTo(fd);
+		}
+		if (_sinkRoom == 0 && !_output.empty()) {
+			errno = EAGAIN;
+			return -1;
+		}
+		const size_t copied = _output.copyTo(*_sink, _sinkRoom);
+		_sinkRoom -= copied;
+		return copied;
+	}
+
+	// sends are capped like the output queues so one mapping cannot hog the loop
+	ResponseStatusEnum pushMappingToClient(int fd) {
+		if (!pushChunkToClient(fd, _mapping->getData() + _mappingOffset, _bodyPos,
+							   std::min(_mappingLength, _bodyPos + OUTPUT_HIGH_WATERMARK))) {
+			if (errno == EFAULT) {
+				_mapping->invalidate();
+			}
+			return RESPONSE_FAILURE;
+		}
+		return _bodyPos == _mappingLength ? RESPONSE_SUCCESS : RESPONSE_PENDING;
+	}
+
+	ResponseStatusEnum pushFileToClient(int fd) {
+		while (_fileRemaining > 0 && _output.wantsData()) {
+			size_t length;
+			char* buffer = _output.prepare(length);
+			if (buffer == NULL) {
+				break;
+			}
+			ssize_t bytesRead = read(_file, buffer, std::min(length, _fileRemaining));
+			if (bytesRead <= 0) {
+				if (bytesRead < 0) {
+					perrored("read");
+				}
+				return RESPONSE_FAILURE;
+			}
+			_output.commit(bytesRead);
+			_fileRemaining -= bytesRead;
+		}
+		ssize_t sent = sendOutput(fd);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				_wouldBlock = true;
+				return RESPONSE_PENDING;
+			}
+			perrored("sendmsg");
+			return RESPONSE_FAILURE;
+		}
+		_bodyPos += sent;
+		metrics.bytesSent(sent);
+		return _fileRemaining == 0 && _output.empty() ? RESPONSE_SUCCESS : RESPONSE_PENDING;
+	}
+
+	ResponseStatusEnum pushSendfileToClient(int fd) {
+		ssize_t sent = sendfile(fd, _file, NULL, std::min<size_t>(_fileRemaining, OUTPUT_HIGH_WATERMARK));
+		if (sent <= 0) {
+			if (sent < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+				_wouldBlock = true;
+				return RESPONSE_PENDING;
+			}
+			perrored("sendfile");
+			return RESPONSE_FAILURE;
+		}
+		_fileRemaining -= sent;
+		_bodyPos += sent;
+		metrics.bytesSent(sent);
+		return _fileRemaining == 0 ? RESPONSE_SUCCESS : RESPONSE_PENDING;
+	}
+
+	ResponseStatusEnum pushProxyToClient(int fd) {
+		ssize_t sent = sendOutput(fd);
+		if (sent < 0) {
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				_wouldBlock = true;
+				return RESPONSE_PENDING;
+			}
+			perrored("sendmsg");
+			return RESPONSE_FAILURE;
+		}
+		_bodyPos += sent;
+		metrics.bytesSent(sent);
+		if (_proxy != NULL || !_output.empty()) {
+			return RESPONSE_PENDING;
+		}
+		return _truncated ? RESPONSE_FAILURE : RESPONSE_SUCCESS;
+	}
+
+	void buildProxy(RequestParsingResult& request) {
+		const ProxyConfig& config = *request.location->getProxyConfig();
+		const RequestParsingSuccess& success = request.success;
+		std::string uri = success.uri;
+		if (!config.uri.empty()) {
+			uri = config.uri + uri.substr(std::min(uri.size(), _locationUri.size()));
+		}
+		std::string cacheKey;
+		ProxyCacheStatusEnum cacheStatus = PROXY_CACHE_MISS;
+		if (config.cache != NULL && (success.method == GET || success.method == HEAD)) {
+			cacheKey = config.host + encodeUri(success.uri) +
+					   (success.query.empty() ? "" : "?" + success.query);
+			ProxyCache::Hit hit;
+			cacheStatus = config.cache->lookup(cacheKey, hit);
+			if (cacheStatus == PROXY_CACHE_HIT || cacheStatus == PROXY_CACHE_UPDATING) {
+				return serveCached(hit, cacheStatus);
+			}
+		}
+		std::string head = toString(success.method) + " " + encodeUri(uri);
+		const std::string body(success.body.begin(), success.body.end());
+		const size_t length = body.size() + getDetachedBodySize(success);
+		// urlencoded bodies were copied into the query by the parser
+		if (!success.query.empty() && (success.method != POST || success.query != body)) {
+			head += "?" + success.query;
+		}
+		head += " " HTTP_VERSION "\r\nhost: " + config.host + "\r\n";
+		for (size_t i = 0; i < success.headers.size(); ++i) {
+			const std::string name = success.headers.getName(i);
+			if (name == "host" || name == "connection" || name == "content-length" ||
+				name == "transfer-encoding" || name == "keep-alive" || name == "proxy-connection" ||
+				name == "te" || name == "upgrade" || name == "expect") {
+				continue;
+			}
+			head += name + ": " + success.headers.getValue(i) + "\r\n";
+		}
+		if (length != 0 || success.method == POST) {
+			head += "content-length: " + toString(length) + "\r\n";
+		}
+		head += "connection: keep-alive\r\n\r\n";
+		_virtualServer = request.virtualServer;
+		_location = request.location;
+		void* storage = _arena ? _arena->allocate(sizeof(Proxy)) : ::operator new(sizeof(Proxy));
+		_proxy = new (storage) Proxy(config, _output, success.method);
+		if (!cacheKey.empty()) {
+			_proxy->setCache(cacheKey, cacheStatus);
+		}
+		// a head detached from a large body, the rest of it is streamed from the client
+		if (body.size() < length) {
+			_requestBody.append(body.data(), body.size());
+			_uploadRemaining = length - body.size();
+			_proxy->streamBody(_requestBody, length);
+		} else {
+			head += body;
+		}
+		if (!_proxy->start(head, config.upstream ? config.upstream->getKey(success) : "")) {
+			destroyProxy();
+			return buildErrorPage(request, STATUS_BAD_GATEWAY);
+		}
+		_proxied = true;
+		_truncated = false;
+	}
+
+	// hits leave the cache file through sendfile, the stored head is sent as is
+	void serveCached(const ProxyCache::Hit& hit, ProxyCacheStatusEnum status) {
+		_statusCode = hit.statusCode;
+		_head = hit.head;
+		_head.insert(_head.size() - 2, status == PROXY_CACHE_HIT ? "x-cache-status: HIT\r\n"
+																  : "x-cache-status: UPDATING\r\n");
+		lseek(hit.fd, hit.bodyOffset, SEEK_SET);
+		_file = hit.fd;
+		_fileRemaining = hit.bodyLength;
+		_sendfile = true;
+	}
+
+	void destroyProxy() {
+		if (_proxy == NULL) {
+			return;
+		}
+		_proxy->~Proxy();
+		if (_arena == NULL) {
+			::operator delete(_proxy);
+		}
+		_proxy = NULL;
+	}
+
 	void buildStatusLine() {
-		_statusLine = std::string(HTTP_VERSION) + " " + toString(_statusCode) + " " +
-					  STATUS_MESSAGES.find(_statusCode)->second + "\r\n";
+		const std::string& message = STATUS_MESSAGES.find(_statusCode)->second;
+		char code[4];
+		code[0] = '0' + _statusCode / 100 % 10;
+		code[1] = '0' + _statusCode / 10 % 10;
+		code[2] = '0' + _statusCode % 10;
+		code[3] = '\0';
+		_statusLine.reserve(sizeof(HTTP_VERSION) + sizeof(code) + message.size() + 2);
+		_statusLine = HTTP_VERSION;
+		_statusLine += ' ';
+		_statusLine += code;
+		_statusLine += ' ';
+		_statusLine += message;
+		_statusLine += "\r\n";
 	}
 
 	void buildHeader() {
-		_headers["date"] = getDate();
-		_headers["server"] = SERVER_VERSION;
-		_headers["content-length"] = toString(_body.size());
-		if (_headers.find("content-type") == _headers.end() && _method != DELETE) {
-			_headers["content-type"] = DEFAULT_CONTENT_TYPE;
+		_headers.set(HEADER_DATE, getDate());
+		_headers.set(HEADER_SERVER, SERVER_VERSION);
+		const std::string& body = _sharedBody != NULL ? _sharedBody->getData() : _body;
+		_headers.set(HEADER_CONTENT_LENGTH, toString(_file != -1		? _fileRemaining
+													 : _mapping != NULL ? _mappingLength
+																		: body.size()));
+		if (!_headers.has(HEADER_CONTENT_TYPE) && _method != DELETE) {
+			_headers.set(HEADER_CONTENT_TYPE, DEFAULT_CONTENT_TYPE);
 		}
-		_headers["connection"] = "close";
+		_headers.set(HEADER_CONNECTION, "close");
 	}
 
 	void buildErrorPage(RequestParsingResult& request, StatusCode statusCode) {
+		if (_headers.size() == 0 && _setCookies.empty() &&
+			useErrorPage(findErrorPage(request, statusCode))) {
+			return;
+		}
 		_statusCode = statusCode;
-		std::map<int, std::string>::iterator locationIt = _errorPages.find(_statusCode);
-		std::map<int, std::string>::iterator serverIt = _serverErrorPages.find(_statusCode);
+		std::map<int, std::string>::const_iterator locationIt;
+		const bool hasLocationPage =
+			_errorPages && (locationIt = _errorPages->find(_statusCode)) != _errorPages->end();
+		std::map<int, std::string>::const_iterator serverIt = _serverErrorPages->find(_statusCode);
 		std::string errorPageUri =
-			locationIt != _errorPages.end() ? "." + _rootDir + locationIt->second
-			: serverIt != _serverErrorPages.end()
+			hasLocationPage ? "." + _rootDir + locationIt->second
+			: serverIt != _serverErrorPages->end()
 				? "." + request.virtualServer->getRootDir() + serverIt->second
 				: "";
 		if (errorPageUri.empty() || !readContent(errorPageUri, _body)) {
-			std::map<StatusCode, std::string>::const_iterator it =
-				STATUS_MESSAGES.find(_statusCode);
-			std::string codeString = toString(_statusCode);
-			std::string title = it != STATUS_MESSAGES.end() ? codeString + " " + it->second
-															: "Unknown error " + codeString;
-			_body = "<!DOCTYPE html>\n"
-					"<html lang=\"en\">\n"
-					"\n"
-					"<head>\n"
-					"\t<meta charset=\"UTF-8\">\n"
-					"\t<meta name=\"viewport\" content=\"width=device-width, initial-scale=1.0\">\n"
-					"\t<title>" +
-					title +
-					"</title>\n"
-					"\t<style>\n"
-					"\t\tbody {\n"
-					"\t\t\tbackground-color: #f0f0f0;\n"
-					"\t\t\tfont-family: Arial, sans-serif;\n"
-					"\t\t}\n"
-					"\n"
-					"\t\t.container {\n"
-					"\t\t\twidth: 80%;\n"
-					"\t\t\tmargin: auto;\n"
-					"\t\t\ttext-align: center;\n"
-					"\t\t\tpadding-top: 20%;\n"
-					"\t\t}\n"
-					"\n"
-					"\t\th1 {\n"
-					"\t\t\tcolor: #333;\n"
-					"\t\t}\n"
-					"\n"
-					"\t\tp {\n"
-					"\t\t\tcolor: #666;\n"
-					"\t\t}\n"
-					"\t</style>\n"
-					"</head>\n"
-					"\n"
-					"<body>\n"
-					"\t<div class=\"container\">\n"
-					"\t\t<h1>" +
-					title +
-					"</h1>\n"
-					"\t\t<a href=\"/\">Go back to root.</a>\n"
-					"\t</div>\n"
-					"</body>\n"
-					"\n"
-					"</html>";
-		}
-		_headers["content-type"] = "text/html";
+			_body = ErrorPage::renderBody(_statusCode);
+		}
+		_headers.set(HEADER_CONTENT_TYPE, "text/html");
+	}
+
+	static ErrorPage* findErrorPage(RequestParsingResult& request, StatusCode statusCode) {
+		ErrorPage* page = request.location ? request.location->findErrorPage(statusCode) : NULL;
+		if (page == NULL && request.virtualServer) {
+			page = request.virtualServer->findErrorPage(statusCode);
+		}
+		return page ? page : findDefaultErrorPage(statusCode);
+	}
+
+	bool useErrorPage(ErrorPage* page) {
+		if (page == NULL || !page->isRendered()) {
+			return false;
+		}
+		page->refresh();
+		_statusCode = page->getStatusCode();
+		page->copyHeadTo(_head);
+		if (_sharedBody != NULL) {
+			_sharedBody->release();
+		}
+		_sharedBody = page->acquireBody();
+		return true;
+	}
+
+	void buildStubStatus() {
+		_statusCode = STATUS_OK;
+		_headers.set(HEADER_CONTENT_TYPE, "text/plain; version=0.0.4");
+		_body = metrics.render();
 	}
 
 	void buildPage(RequestParsingResult& request) {
 		std::string uri = findFinalUri(request.success.uri, _rootDir, request.location);
-		if (!readContent(uri, _body)) {
+		struct stat buf;
+		const int fd = openFile(uri, buf);
+		if (fd < 0) {
 			return buildErrorPage(request, STATUS_NOT_FOUND);
 		}
+		const size_t size = buf.st_size;
+		size_t start = 0;
+		size_t end = size;
+		const char* range = request.success.headers.get(HEADER_RANGE);
+		if (range != NULL && !parseRange(range, size, start, end)) {
+			close(fd);
+			_headers.set("content-range", "bytes */" + toString(size));
+			return buildErrorPage(request, STATUS_RANGE_NOT_SATISFIABLE);
+		}
+		if (end - start != size) {
+			_statusCode = STATUS_PARTIAL_CONTENT;
+			_headers.set("content-range", "bytes " + toString(start) + "-" + toString(end - 1) +
+											  "/" + toString(size));
+		}
+		_headers.set("accept-ranges", "bytes");
+		serveFile(fd, uri, buf, start, end);
 		std::string extension = getExtension(uri);
 		std::map<std::string, std::string>::const_iterator it = MIME_TYPES.find(extension);
-		_headers["content-type"] = it != MIME_TYPES.end() ? it->second : DEFAULT_CONTENT_TYPE;
+		_headers.set(HEADER_CONTENT_TYPE, it != MIME_TYPES.end() ? it->second : DEFAULT_CONTENT_TYPE);
+	}
+
+	static int openFile(const std::string& uri, struct stat& buf) {
+		int fd = open(uri.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0) {
+			return -1;
+		}
+		if (fstat(fd, &buf) != 0 || !S_ISREG(buf.st_mode)) {
+			close(fd);
+			return -1;
+		}
+		return fd;
+	}
+
+	void serveFile(int fd, const std::string& uri, const struct stat& buf, size_t start,
+				   size_t end) {
+		const size_t threshold = MappedFile::getThreshold();
+		if (threshold != 0 && !_buffered && static_cast<size_t>(buf.st_size) >= threshold) {
+			_mapping = MappedFile::acquire(fd, uri, buf);
+		}
+		if (_mapping != NULL) {
+			close(fd);
+			_mappingOffset = start;
+			_mappingLength = end - start;
+			if (start == 0) {
+				_mapping->adviseSequential();
+			} else {
+				_mapping->willNeed(start, _mappingLength);
+			}
+			return;
+		}
+		if (start != 0) {
+			lseek(fd, start, SEEK_SET);
+		}
+		_file = fd;
+		_fileRemaining = end - start;
 	}
 
 	static void exportEnv(std::vector<std::string>& env, const std::string& key,
@@ -309,17 +922,15 @@ private:
 
 		std::vector<std::string> env;
 		exportEnv(env, "CONTENT_LENGTH", toString(request.success.body.size()));
-		std::map<std::string, std::string>::const_iterator it =
-			request.success.headers.find("content-type");
-		exportEnv(env, "CONTENT_TYPE",
-				  it == request.success.headers.end() ? DEFAULT_CONTENT_TYPE : it->second);
+		const HeaderTable& headers = request.success.headers;
+		const char* contentType = headers.get(HEADER_CONTENT_TYPE);
+		exportEnv(env, "CONTENT_TYPE", contentType ? contentType : DEFAULT_CONTENT_TYPE);
 		exportEnv(env, "DOCUMENT_ROOT", request.virtualServer->getRootDir());
 		exportEnv(env, "GATEWAY_INTERFACE", CGI_VERSION);
-		for (std::map<std::string, std::string>::const_iterator it =
-				 request.success.headers.begin();
-			 it != request.success.headers.end(); ++it) {
-			if (CGI_NO_TRANSMISSION.find(it->first) == CGI_NO_TRANSMISSION.end()) {
-				exportEnv(env, metavariablify(it->first), it->second);
+		for (size_t i = 0; i < headers.size(); ++i) {
+			const std::string name = headers.getName(i);
+			if (CGI_NO_TRANSMISSION.find(name) == CGI_NO_TRANSMISSION.end()) {
+				exportEnv(env, metavariablify(name), headers.getValue(i));
 			}
 		}
 		const std::string absolutePath = getAbsolutePath(finalUri);
@@ -344,6 +955,7 @@ private:
 		char** env = vectorToCharArray(createCgiEnv(request, finalUri));
 		execve(strExec, argv, env);
 		perrored("execve");
+		flushErrorLog();
 		for (size_t i = 0; env[i]; ++i) {
 			if (env[i]) {
 				delete env[i];
@@ -366,7 +978,7 @@ private:
 					_setCookies.push_back(value);
 					continue;
 				}
-				_headers[key] = value;
+				_headers.set(key, value);
 				if (key == "status") {
 					std::istringstream iss(value);
 					iss >> value;
@@ -382,7 +994,7 @@ private:
 				}
 			}
 		}
-		if (_headers.find("content-type") == _headers.end()) {
+		if (!_headers.has(HEADER_CONTENT_TYPE)) {
 			buildErrorPage(request, STATUS_INTERNAL_SERVER_ERROR);
 		} else if (_statusCode < 200 || _statusCode > 299) {
 			buildErrorPage(request, _statusCode);
@@ -405,9 +1017,29 @@ private:
 		} else if (body.size() > PIPE_SIZE) {
 			return buildErrorPage(request, STATUS_PAYLOAD_TOO_LARGE);
 		}
+		const RequestMethod method = request.success.method;
+		const unsigned long ttl = request.location ? request.location->getCgiCacheTtl() : 0;
+		std::string cacheKey;
+		if (ttl != 0 && (method == GET || method == HEAD)) {
+			cacheKey = CgiCache::makeKey(request.success);
+			CgiCacheStatusEnum cacheStatus;
+			const std::string* cached = CgiCache::get().lookup(cacheKey, cacheStatus);
+			if (cached != NULL) {
+				if (cacheStatus == CGI_CACHE_STALE) {
+					refreshCgi(request, strExec, strScript, finalUri, cacheKey);
+				}
+				translateCgiResponse(request, *cached);
+				_headers.set("x-cache-status", cacheStatus == CGI_CACHE_HIT	  ? "HIT"
+											   : cacheStatus == CGI_CACHE_STALE ? "STALE"
+																				: "UPDATING");
+				return;
+			}
+		}
 
 		int pipes[2];
 		syscall(pipe(pipes), "pipe");
+		flushErrorLog();
+		const unsigned long cgiStart = getMicroseconds();
 		pid_t pid = fork();
 		syscall(pid, "fork");
 		if (pid == 0) {
@@ -420,6 +1052,7 @@ private:
 		write(pipes[1], body.c_str(), body.size());
 		close(pipes[1]);
 		int exitCode = getExitCode(pid);
+		metrics.cgiExited(getMicroseconds() - cgiStart);
 		if (DEBUG) {
 			std::cout << strExec << ' ' << strScript << " exited with code " << exitCode << ".\n";
 		}
@@ -427,15 +1060,45 @@ private:
 		close(pipes[0]);
 		if (exitCode == 0) {
 			translateCgiResponse(request, response);
+			if (!cacheKey.empty()) {
+				CgiCache::get().store(cacheKey, response, ttl, request.location->getCgiCacheStale());
+				_headers.set("x-cache-status", "MISS");
+			}
 		} else {
 			buildErrorPage(request, STATUS_INTERNAL_SERVER_ERROR);
 		}
 	}
 
+	// the stale entry keeps being served until the script's output has been read back
+	static void refreshCgi(RequestParsingResult& request, char* strExec, char* strScript,
+						   const std::string& finalUri, const std::string& cacheKey) {
+		int pipes[2];
+		if (pipe(pipes) != 0) {
+			return perrored("pipe");
+		}
+		int childPipes[2] = {open("/dev/null", O_RDONLY | O_CLOEXEC), pipes[1]};
+		flushErrorLog();
+		pid_t pid = fork();
+		if (pid == 0) {
+			close(pipes[0]);
+			cgiChild(request, childPipes, strExec, strScript, finalUri);
+		}
+		close(pipes[1]);
+		close(childPipes[0]);
+		if (pid < 0) {
+			perrored("fork");
+			close(pipes[0]);
+			return;
+		}
+		fcntl(pipes[0], F_SETFL, O_NONBLOCK);
+		fcntl(pipes[0], F_SETFD, FD_CLOEXEC);
+		CgiCache::get().startRefresh(cacheKey, pid, pipes[0]);
+	}
+
 	std::string getFileUri(RequestParsingResult& request) {
 		Location* location = request.location;
 		LocationModifierEnum modifier = location->getModifier();
-		std::string locationUri = location->getUri();
+		const std::string& locationUri = location->getUri();
 		if (modifier == EXACT) {
 			return "";
 		} else if (modifier == REGEX) {
@@ -446,10 +1109,10 @@ private:
 	}
 
 	void handleIndex(RequestParsingResult& request) {
-		if (!_indexPages.empty()) {
+		if (!_indexPages->empty()) {
 			std::string filepath;
-			for (std::vector<std::string>::iterator it = _indexPages.begin();
-				 it != _indexPages.end(); it++) {
+			for (std::vector<std::string>::const_iterator it = _indexPages->begin();
+				 it != _indexPages->end(); it++) {
 				std::string uri = request.success.uri == "/" ? "/" : request.success.uri + "/";
 				filepath = findFinalUri(uri, _rootDir, request.location) + *it;
 				if (isValidFile(filepath)) {
@@ -472,72 +1135,132 @@ private:
 	}
 
 	void buildRedirect(RequestParsingResult& request) {
-		_headers["location"] = _return.second;
+		if (_headers.size() == 0 && _setCookies.empty() && request.location &&
+			useErrorPage(&request.location->getRenderedReturn())) {
+			return;
+		}
+		_headers.set(HEADER_LOCATION, _return.second);
 		buildErrorPage(request, static_cast<StatusCode>(_return.first));
 	}
 
-	static std::vector<std::string> ls(DIR* dir, bool dirIsRoot) {
-		struct dirent* entry;
-		std::vector<std::string> res;
-		while ((entry = readdir(dir))) {
-			if (std::strcmp(entry->d_name, ".") == 0) {
-				continue;
+	static std::string renderAutoIndexHtml(const std::string& uri,
+										   const std::vector<std::string>& entries, size_t begin,
+										   size_t end, size_t page, size_t pages) {
+		std::string html;
+		html.reserve(1024 + (end - begin) * (uri.size() + 64));
+		html += "<!DOCTYPE html>\n";
+		html += "<html>\n";
+		html += "<head>\n";
+		html += "<title>" + uri + "</title>\n";
+		html += "<meta charset=\"utf-8\">\n";
+		html += "<style>\n";
+		html += "body { font-family: Arial, sans-serif; background-color: #f5f5f5; color: #333; "
+				"margin: 40px; }\n";
+		html +=
+			"h1 { border-bottom: 1px solid #eee; padding-bottom: 0.3em; margin-bottom: 20px; }\n";
+		html += "li { margin: 10px 0; font-size: 1.2em; }\n";
+		html += "ul { list-style: none; padding-left: 0; }\n";
+		html += "a { color: #3498db; text-decoration: none; }\n";
+		html += "a:hover { color: #2980b9; }\n";
+		html += "div { width: 80%; margin: auto; max-width: 800px; }\n";
+		html += "</style>\n";
+		html += "</head>\n";
+		html += "<body>\n";
+		html += "<div>\n";
+		html += "<h1>Index of " + uri + "</h1>\n";
+		html += "<ul>\n";
+		if (uri != "/") {
+			html += "<li><a href=\"" + uri + "../\">↩</a></li>\n";
+		}
+		for (size_t i = begin; i < end; ++i) {
+			html += "<li><a href=\"";
+			html += uri;
+			html += entries[i];
+			html += "\">";
+			html += entries[i];
+			html += "</a></li>\n";
+		}
+		html += "</ul>\n";
+		if (page != 0) {
+			html += "<p>";
+			if (page > 1) {
+				html += "<a href=\"?page=" + toString(page - 1) + "\">previous</a> ";
 			}
-			bool isParent = std::strcmp(entry->d_name, "..") == 0;
-			if (isParent && dirIsRoot) {
-				continue;
+			html += "page " + toString(page) + " of " + toString(pages);
+			if (page < pages) {
+				html += " <a href=\"?page=" + toString(page + 1) + "\">next</a>";
 			}
-			std::string name = std::string(entry->d_name) + (entry->d_type == DT_DIR ? "/" : "");
-			res.push_back(name);
+			html += "</p>\n";
 		}
-		std::sort(res.begin(), res.end());
-		return res;
+		html += "</div>\n";
+		html += "</body>\n";
+		html += "</html>\n";
+		return html;
 	}
 
+	static std::string renderAutoIndexJson(const std::string& uri,
+										   const std::vector<std::string>& entries, size_t begin,
+										   size_t end, size_t page, size_t pages) {
+		std::string json;
+		json.reserve(128 + (end - begin) * 48);
+		json += "{\"path\":\"" + escapeJson(uri) + "\",";
+		if (page != 0) {
+			json += "\"page\":" + toString(page) + ",\"pages\":" + toString(pages) + ",";
+		}
+		json += "\"total\":" + toString(entries.size()) + ",\"entries\":[";
+		for (size_t i = begin; i < end; ++i) {
+			const bool isDir = entries[i][entries[i].size() - 1] == '/';
+			json += i == begin ? "{\"name\":\"" : ",{\"name\":\"";
+			json += escapeJson(isDir ? entries[i].substr(0, entries[i].size() - 1) : entries[i]);
+			json += isDir ? "\",\"type\":\"directory\"}" : "\",\"type\":\"file\"}";
+		}
+		json += "]}\n";
+		return json;
+	}
+
+	// every rendered page is cached with the listing and shared by the responses sending
+	// it, a listing longer than a page is only served a page at a time
 	void buildAutoIndexPage(RequestParsingResult& request) {
-		DIR* dir = opendir(findFinalUri(request.success.uri, _rootDir, request.location).c_str());
-		if (!dir) {
+		AutoIndexListing* listing =
+			findAutoIndexListing(findFinalUri(request.success.uri, _rootDir, request.location));
+		if (!listing) {
 			return buildErrorPage(request, STATUS_INTERNAL_SERVER_ERROR);
 		}
-		_headers["content-type"] = "text/html";
-
-		_body += "<!DOCTYPE html>\n";
-		_body += "<html>\n";
-		_body += "<head>\n";
-		_body += "<title>" + request.success.uri + "</title>\n";
-		_body += "<meta charset=\"utf-8\">\n";
-		_body += "<style>\n";
-		_body += "body { font-family: Arial, sans-serif; background-color: #f5f5f5; color: #333; "
-				 "margin: 40px; }\n";
-		_body +=
-			"h1 { border-bottom: 1px solid #eee; padding-bottom: 0.3em; margin-bottom: 20px; }\n";
-		_body += "li { margin: 10px 0; font-size: 1.2em; }\n";
-		_body += "ul { list-style: none; padding-left: 0; }\n";
-		_body += "a { color: #3498db; text-decoration: none; }\n";
-		_body += "a:hover { color: #2980b9; }\n";
-		_body += "div { width: 80%; margin: auto; max-width: 800px; }\n";
-		_body += "</style>\n";
-		_body += "</head>\n";
-		_body += "<body>\n";
-		_body += "<div>\n";
-		_body += "<h1>Index of " + request.success.uri + "</h1>\n";
-		_body += "<ul>\n";
-
-		const std::string slashedUri =
-			request.success.uri + (request.success.uri == "/" ? "" : "/");
-		std::vector<std::string> filenames = ls(dir, request.success.uri == "/");
-		for (std::vector<std::string>::iterator it = filenames.begin(); it != filenames.end();
-			 it++) {
-			std::string link = slashedUri + *it;
-			std::string name = *it == "../" ? "↩" : *it;
-			_body += "<li><a href=\"" + link + "\">" + name + "</a></li>\n";
-		}
-		closedir(dir);
-
-		_body += "</ul>\n";
-		_body += "</div>\n";
-		_body += "</body>\n";
-		_body += "</html>\n";
+		std::string uri = request.success.uri;
+		uri.erase(uri.find_last_not_of('/') + 1);
+		uri += '/';
+		const std::vector<std::string>& entries = listing->entries;
+		const std::string pageString = getQueryParameter(request.success.query, "page");
+		const bool isJson = getQueryParameter(request.success.query, "format") == "json";
+		const size_t pages = std::max<size_t>(1, (entries.size() + AUTOINDEX_PAGE_SIZE - 1) /
+													 AUTOINDEX_PAGE_SIZE);
+		size_t page = 0;
+		size_t begin = 0;
+		size_t end = entries.size();
+		if (pageString.empty() && entries.size() > AUTOINDEX_PAGE_SIZE) {
+			_headers.set(HEADER_LOCATION, uri + "?page=1" + (isJson ? "&format=json" : ""));
+			return buildErrorPage(request, STATUS_FOUND);
+		} else if (!pageString.empty()) {
+			page = std::strtoul(pageString.c_str(), NULL, 10);
+			if (pageString.find_first_not_of("0123456789") != std::string::npos || page == 0 ||
+				page > pages) {
+				return buildErrorPage(request, STATUS_NOT_FOUND);
+			}
+			begin = (page - 1) * AUTOINDEX_PAGE_SIZE;
+			end = std::min(begin + AUTOINDEX_PAGE_SIZE, entries.size());
+		}
+		_headers.set(HEADER_CONTENT_TYPE, isJson ? "application/json" : "text/html");
+		if (listing->uri != uri) {
+			releaseAutoIndexPages(*listing);
+			listing->uri = uri;
+		}
+		SharedBuffer*& rendered = listing->pages[std::make_pair(isJson, page)];
+		if (rendered == NULL) {
+			std::string body = isJson ? renderAutoIndexJson(uri, entries, begin, end, page, pages)
+									  : renderAutoIndexHtml(uri, entries, begin, end, page, pages);
+			rendered = SharedBuffer::create(body);
+		}
+		_sharedBody = rendered->acquire();
 	}
 
 	void reinitResponseVariables(RequestParsingResult& request) {
@@ -545,7 +1268,7 @@ private:
 		if (request.location == NULL) {
 			_rootDir = vs->getRootDir();
 			_autoIndex = vs->getAutoIndex();
-			_serverErrorPages = vs->getErrorPages();
+			_serverErrorPages = &vs->getErrorPages();
 			_locationUri = "";
 			_return.first = -1;
 			_return.second = "";
@@ -557,9 +1280,9 @@ private:
 			Location* location = request.location;
 			_rootDir = location->getRootDir();
 			_autoIndex = location->getAutoIndex();
-			_serverErrorPages = vs->getErrorPages();
-			_errorPages = location->getErrorPages();
-			_indexPages = location->getIndexPages();
+			_serverErrorPages = &vs->getErrorPages();
+			_errorPages = &location->getErrorPages();
+			_indexPages = &location->getIndexPages();
 			_locationUri = location->getUri();
 			_return = location->getReturn();
 			for (int i = 0; i < NO_METHOD; i++) {
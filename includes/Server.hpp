@@ -3,31 +3,84 @@
 #include "webserv.hpp"
 
 extern bool run;
+extern bool reopenLogs;
+extern bool upgradeBinary;
+extern bool drainConnections;
+extern Metrics metrics;
 
 class Server {
 public:
-	Server() : _numFds(0) {
+	Server()
+		: _numFds(0), _backend(NULL), _backendName("epoll"), _edgeTriggered(false),
+		  _tcpNoDelay(false), _tcpNoPush(false), _notSentLowat(0), _http2(true),
+		  _outputBufferLimit(DEFAULT_OUTPUT_BUFFER_LIMIT), _cgiCacheSize(DEFAULT_CGI_CACHE_SIZE),
+		  _mmapThreshold(0), _simdLevel(std::min(getSupportedSimdLevel(), SIMD_SSE2)),
+		  _argv(NULL), _upgradePid(0), _draining(false) {
 		std::memset(_eventList, 0, sizeof(_eventList));
-		syscall(_epollFd = epoll_create1(0), "epoll_create1");
+		_logFormats[DEFAULT_LOG_FORMAT].compile(COMBINED_LOG_FORMAT);
 	};
 
 	~Server() {
-		for (std::set<int>::iterator it = _listenSockets.begin(); it != _listenSockets.end();
+		for (std::map<std::string, LogFile>::iterator it = _logFiles.begin(); it != _logFiles.end();
 			 ++it) {
-			close(*it);
+			it->second.flush();
+		}
+		setErrorLog(NULL);
+		for (std::map<int, struct sockaddr_in>::iterator it = _listenSockets.begin();
+			 it != _listenSockets.end(); ++it) {
+			close(it->first);
 		}
 		for (std::map<int, Client>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
 			close(it->first);
 		}
-		close(_epollFd);
+		// clients go first, their proxies and limit_conn slots point into the server
+		_clients.clear();
+		Proxy::closeIdleConnections();
+		for (std::map<std::string, ProxyCache*>::iterator it = _proxyCaches.begin();
+			 it != _proxyCaches.end(); ++it) {
+			delete it->second;
+		}
+		EventBackend::getActive() = NULL;
+		delete _backend;
 	};
 
-	bool init(const char* filename) {
+	// argv is what a binary upgrade executes again, from the path resolved at startup
+	// since argv[0] may be relative or need a PATH lookup
+	bool init(const char* filename, char* argv[] = NULL) {
+		_argv = argv;
+		char path[PATH_MAX];
+		const ssize_t length = readlink("/proc/self/exe", path, sizeof(path) - 1);
+		if (argv != NULL) {
+			_binaryPath = length > 0 ? std::string(path, length) : argv[0];
+		}
 		if (!parseConfig(filename)) {
 			return false;
 		}
+		applySettings();
+		if (!openLogFiles()) {
+			return false;
+		}
+		for (std::map<std::string, ProxyCache*>::iterator it = _proxyCaches.begin();
+			 it != _proxyCaches.end(); ++it) {
+			if (!it->second->open()) {
+				return false;
+			}
+		}
+		renderDefaultErrorPages();
+		for (size_t i = 0; i < _virtualServers.size(); ++i) {
+			_virtualServers[i].renderErrorPages();
+		}
+		createEventBackend();
 		findVirtualServersToBind();
 		connectVirtualServers();
+		metrics.setVirtualServers(&_virtualServers);
+		const char* parent = std::getenv(UPGRADE_PARENT_ENV);
+		if (std::getenv(INHERITED_FDS_ENV) != NULL && parent != NULL &&
+			std::atoi(parent) == getppid()) {
+			kill(getppid(), SIGQUIT);
+		}
+		unsetenv(INHERITED_FDS_ENV);
+		unsetenv(UPGRADE_PARENT_ENV);
 		return true;
 	}
 
@@ -52,65 +105,158 @@ public:
 				}
 				_virtualServers.push_back(vs);
 			} else {
-				return configFileError("invalid line in config file: " + line);
+				std::istringstream iss(line);
+				std::string keyword;
+				iss >> keyword;
+				if (keyword == "log_format") {
+					if (!parseLogFormat(iss)) {
+						return false;
+					}
+				} else if (keyword == "error_log") {
+					if (!parseErrorLog(iss)) {
+						return false;
+					}
+				} else if (keyword == "event_backend") {
+					if (!parseEventBackend(iss)) {
+						return false;
+					}
+				} else if (keyword == "output_buffer_limit") {
+					if (!parseOutputBufferLimit(iss)) {
+						return false;
+					}
+				} else if (keyword == "cgi_cache_max_size") {
+					if (!parseCgiCacheMaxSize(iss)) {
+						return false;
+					}
+				} else if (keyword == "mmap_threshold") {
+					if (!parseMmapThreshold(iss)) {
+						return false;
+					}
+				} else if (startswith(keyword, "limit_")) {
+					if (!_limiter.parse(keyword, iss)) {
+						return false;
+					}
+				} else if (keyword == "proxy_cache_path") {
+					if (!parseProxyCachePath(iss)) {
+						return false;
+					}
+				} else if (keyword == "upstream") {
+					if (!parseUpstream(iss, config)) {
+						return false;
+					}
+				} else if (keyword == "edge_triggered") {
+					if (!parseSwitch(iss, _edgeTriggered, keyword)) {
+						return false;
+					}
+				} else if (keyword == "tcp_nodelay") {
+					if (!parseSwitch(iss, _tcpNoDelay, keyword)) {
+						return false;
+					}
+				} else if (keyword == "tcp_nopush") {
+					if (!parseSwitch(iss, _tcpNoPush, keyword)) {
+						return false;
+					}
+				} else if (keyword == "tcp_notsent_lowat") {
+					if (!parseNotSentLowat(iss)) {
+						return false;
+					}
+				} else if (keyword == "simd") {
+					if (!parseSimd(iss)) {
+						return false;
+					}
+				} else if (keyword == "http2") {
+					if (!parseSwitch(iss, _http2, keyword)) {
+						return false;
+					}
+				} else {
+					return configFileError("invalid line in config file: " + line);
+				}
 			}
 		}
 		if (_virtualServers.empty()) {
 			return configFileError("no server found in " + std::string(filename));
 		}
-		return checkDuplicateServers();
+		for (size_t i = 0; i < _virtualServers.size(); ++i) {
+			if (!_virtualServers[i].resolveUpstreams(_upstreamGroups) ||
+				!_virtualServers[i].resolveProxyCaches(_proxyCaches)) {
+				return false;
+			}
+		}
+		return checkDuplicateServers() && checkLogFormats();
 	}
 
 	void removeClient(int clientFd) {
+		metrics.connectionClosed();
+		std::map<int, int>::iterator upstream = _clientUpstreams.find(clientFd);
+		if (upstream != _clientUpstreams.end()) {
+			_backend->remove(upstream->second);
+			_interest.erase(upstream->second);
+			_upstreams.erase(upstream->second);
+			_clientUpstreams.erase(upstream);
+		}
+		_backend->remove(clientFd);
+		_interest.erase(clientFd);
+		_starvedClients.erase(clientFd);
 		close(clientFd);
 		_clients.erase(clientFd);
 	}
 
 	void loop() {
-		while (run) {
-			_numFds = epoll_wait(_epollFd, _eventList, MAX_EVENTS, -1);
+		while (run && !(_draining && _clients.empty())) {
+			_numFds =
+				_backend->wait(_eventList, MAX_EVENTS, _readyClients.empty() ? getTimeout() : 0);
 			if (_numFds < 0) {
 				if (!run) {
 					break;
 				}
-				throw SystemError("epoll_wait");
+				if (errno != EINTR) {
+					throw SystemError(_backend->getName());
+				}
+				_numFds = 0;
+			}
+			if (reopenLogs) {
+				reopenLogs = false;
+				reopenLogFiles();
+			}
+			if (upgradeBinary) {
+				upgradeBinary = false;
+				startUpgrade();
 			}
+			if (drainConnections) {
+				drainConnections = false;
+				startDrain();
+			}
+			checkUpgrade();
+			std::vector<int> readyClients;
+			readyClients.swap(_readyClients);
 			for (int i = 0; i < _numFds; ++i) {
-				std::set<int>::iterator it = _listenSockets.find(_eventList[i].data.fd);
+				const int fd = _eventList[i].data.fd;
+				std::map<int, struct sockaddr_in>::iterator it = _listenSockets.find(fd);
+				std::map<int, int>::iterator upstream;
 				if (it != _listenSockets.end()) {
-					Client client;
-					int clientFd = accept(*it, (struct sockaddr*)&client.getAddress(),
-										  &client.getAddressLen());
-					if (clientFd < 0) {
-						std::cerr << RED << "accept: " << std::strerror(errno) << RESET << '\n';
-						continue;
-					}
-					client.setInfo(clientFd);
-					client.findAssociatedServers(_virtualServers);
-					syscallEpoll(_epollFd, EPOLL_CTL_ADD, clientFd, EPOLLIN | EPOLLRDHUP,
-								 "EPOLL_CTL_ADD");
-					_clients[clientFd] = client;
-				} else {
-					int clientFd = _eventList[i].data.fd;
-					Client& client = _clients[clientFd];
-					ResponseStatusEnum status;
-					if (_eventList[i].events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
-						removeClient(clientFd);
-					} else if (_eventList[i].events & EPOLLIN) {
-						status = client.handleRequest();
-						if (status == RESPONSE_FAILURE) {
-							removeClient(clientFd);
-						} else if (status == RESPONSE_SUCCESS) {
-							syscallEpoll(_epollFd, EPOLL_CTL_MOD, clientFd, EPOLLOUT | EPOLLRDHUP,
-										 "EPOLL_CTL_MOD");
-						}
-					} else if (_eventList[i].events & EPOLLOUT) {
-						if (client.pushResponse() != RESPONSE_PENDING) {
-							removeClient(clientFd);
-						}
-					}
+					acceptClients(it->first, it->second);
+				} else if ((upstream = _upstreams.find(fd)) != _upstreams.end()) {
+					handleUpstreamEvents(upstream->second);
+				} else if (_clients.find(fd) != _clients.end()) {
+					handleClientEvents(fd, _eventList[i].events);
+				} else if (CgiCache::get().isRefreshing(fd)) {
+					CgiCache::get().handleRefresh(fd);
 				}
 			}
+			for (size_t i = 0; i < readyClients.size(); ++i) {
+				if (_clients.find(readyClients[i]) != _clients.end()) {
+					handleEdgeTriggeredEvents(readyClients[i], 0);
+				}
+			}
+			resumeDelayedClients();
+			resumeStarvedClients();
+			checkUpstreamTimeouts();
+			CgiCache::get().expireRefreshes();
+			for (std::map<std::string, ProxyCache*>::iterator it = _proxyCaches.begin();
+				 it != _proxyCaches.end(); ++it) {
+				it->second->manage();
+			}
+			flushDueLogFiles();
 		}
 	}
 
@@ -120,10 +266,546 @@ private:
 	std::vector<VirtualServer> _virtualServers;
 	std::vector<VirtualServer*> _virtualServersToBind;
 	int _numFds;
-	std::set<int> _listenSockets;
+	std::map<int, struct sockaddr_in> _listenSockets;
+	std::map<std::pair<in_addr_t, in_port_t>, std::vector<VirtualServer*> > _associatedServers;
 	struct epoll_event _eventList[MAX_EVENTS];
 	std::map<int, Client> _clients;
-	int _epollFd;
+	EventBackend* _backend;
+	std::string _backendName;
+	std::map<std::string, LogFormat> _logFormats;
+	std::map<std::string, LogFile> _logFiles;
+	LogConfig _errorLogConfig;
+	bool _edgeTriggered;
+	bool _tcpNoDelay;
+	bool _tcpNoPush;
+	size_t _notSentLowat;
+	bool _http2;
+	size_t _outputBufferLimit;
+	size_t _cgiCacheSize;
+	size_t _mmapThreshold;
+	SimdLevelEnum _simdLevel;
+	ClientLimiter _limiter;
+	std::vector<int> _readyClients;
+	std::multimap<unsigned long, int> _delayedClients;
+	std::set<int> _starvedClients;
+	std::map<int, int> _upstreams;
+	std::map<int, int> _clientUpstreams;
+	std::map<int, uint32_t> _interest;
+	std::map<std::string, UpstreamGroup> _upstreamGroups;
+	std::map<std::string, ProxyCache*> _proxyCaches;
+	char** _argv;
+	std::string _binaryPath;
+	pid_t _upgradePid;
+	bool _draining;
+
+	// the new binary gets the listening sockets and this pid through the environment and
+	// tells this process to drain once it serves them, an old process keeps serving if it fails
+	void startUpgrade() {
+		if (_argv == NULL || _draining || _upgradePid != 0) {
+			return;
+		}
+		std::string fds;
+		for (std::map<int, struct sockaddr_in>::iterator it = _listenSockets.begin();
+			 it != _listenSockets.end(); ++it) {
+			fds += (fds.empty() ? "" : ",") + toString(it->first);
+		}
+		const std::string parent = toString(getpid());
+		const pid_t pid = fork();
+		if (pid == -1) {
+			return perrored("fork");
+		} else if (pid == 0) {
+			for (std::map<int, struct sockaddr_in>::iterator it = _listenSockets.begin();
+				 it != _listenSockets.end(); ++it) {
+				fcntl(it->first, F_SETFD, 0);
+			}
+			setenv(INHERITED_FDS_ENV, fds.c_str(), 1);
+			setenv(UPGRADE_PARENT_ENV, parent.c_str(), 1);
+			execv(_binaryPath.c_str(), _argv);
+			perrored("execv");
+			_exit(EXIT_FAILURE);
+		}
+		std::cout << BLUE << "Upgrading to a new binary, pid " << pid << ". 🚀" << RESET << '\n';
+		_upgradePid = pid;
+	}
+
+	void checkUpgrade() {
+		if (_upgradePid != 0 && waitpid(_upgradePid, NULL, WNOHANG) == _upgradePid) {
+			logError("binary upgrade failed, the new process exited");
+			_upgradePid = 0;
+		}
+	}
+
+	// stops accepting and closes idle connections, the others end with their response
+	void startDrain() {
+		if (_draining) {
+			return;
+		}
+		std::cout << BLUE << "Draining " << _clients.size() << " connections. 🚰" << RESET << '\n';
+		_draining = true;
+		for (std::map<int, struct sockaddr_in>::iterator it = _listenSockets.begin();
+			 it != _listenSockets.end(); ++it) {
+			_backend->detach(it->first);
+			close(it->first);
+		}
+		_listenSockets.clear();
+		std::vector<int> idle;
+		for (std::map<int, Client>::iterator it = _clients.begin(); it != _clients.end(); ++it) {
+			if (it->second.drain()) {
+				idle.push_back(it->first);
+			} else if (it->second.isHttp2()) {
+				updateClient(it->first);
+				if (_edgeTriggered && it->second.isReady()) {
+					_readyClients.push_back(it->first);
+				}
+			}
+		}
+		for (size_t i = 0; i < idle.size(); ++i) {
+			removeClient(idle[i]);
+		}
+	}
+
+	bool parseLogFormat(std::istringstream& iss) {
+		std::string name, format;
+		if (!(iss >> name)) {
+			return configFileError("missing information after log_format keyword");
+		}
+		std::getline(iss, format);
+		format = strtrim(format, SPACES);
+		if (format.size() >= 2 && format[0] == '\'' && format[format.size() - 1] == '\'') {
+			format = format.substr(1, format.size() - 2);
+		}
+		if (format.empty()) {
+			return configFileError("missing format after log_format name");
+		}
+		if (name == DEFAULT_LOG_FORMAT) {
+			return configFileError("log_format " + name + " cannot be redefined");
+		}
+		return _logFormats[name].compile(format);
+	}
+
+	bool parseErrorLog(std::istringstream& iss) {
+		if (!_errorLogConfig.path.empty()) {
+			return configFileError("multiple error_log instructions");
+		}
+		if (!(iss >> _errorLogConfig.path)) {
+			return configFileError("missing information after error_log keyword");
+		}
+		return ::parseLogParameters(iss, _errorLogConfig, "error_log", false);
+	}
+
+	bool parseUpstream(std::istringstream& iss, std::istream& config) {
+		std::string name, bracket, extra;
+		if (!(iss >> name >> bracket) || bracket != "{" || (iss >> extra)) {
+			return configFileError("wrong syntax for upstream, syntax must be 'upstream name {'");
+		}
+		if (_upstreamGroups.find(name) != _upstreamGroups.end()) {
+			return configFileError("duplicate upstream: " + name);
+		}
+		return _upstreamGroups[name].parse(config, name);
+	}
+
+	// caches own their index mapping and pending files, they are never copied
+	bool parseProxyCachePath(std::istringstream& iss) {
+		std::string path;
+		if (!(iss >> path)) {
+			return configFileError("missing information after proxy_cache_path keyword");
+		}
+		ProxyCache* cache = new ProxyCache();
+		if (!cache->parse(iss, path)) {
+			delete cache;
+			return false;
+		}
+		if (_proxyCaches.find(cache->getName()) != _proxyCaches.end()) {
+			const std::string name = cache->getName();
+			delete cache;
+			return configFileError("duplicate keys_zone: " + name);
+		}
+		_proxyCaches[cache->getName()] = cache;
+		return true;
+	}
+
+	bool parseEventBackend(std::istringstream& iss) {
+		std::string extra;
+		if (!(iss >> _backendName)) {
+			return configFileError("missing information after event_backend keyword");
+		}
+		if (_backendName != "epoll" && _backendName != "io_uring") {
+			return configFileError("event_backend must be epoll or io_uring");
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after event_backend keyword");
+		}
+		return true;
+	}
+
+	// a level the cpu lacks falls back to the widest one it has
+	bool parseSimd(std::istringstream& iss) {
+		std::string level, extra;
+		if (!(iss >> level)) {
+			return configFileError("missing information after simd keyword");
+		}
+		const char* const levels[] = {"scalar", "sse2", "avx2"};
+		const char* const* found = std::find(levels, levels + 3, level);
+		if (found == levels + 3) {
+			return configFileError("simd must be scalar, sse2 or avx2");
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after simd keyword");
+		}
+		_simdLevel = static_cast<SimdLevelEnum>(found - levels);
+		if (_simdLevel > getSupportedSimdLevel()) {
+			std::cerr << YELLOW << level << " is unsupported by this cpu, falling back to "
+					  << levels[getSupportedSimdLevel()] << '.' << RESET << '\n';
+			_simdLevel = getSupportedSimdLevel();
+		}
+		return true;
+	}
+
+	bool parseOutputBufferLimit(std::istringstream& iss) {
+		std::string value, extra;
+		size_t limit;
+		if (!(iss >> value)) {
+			return configFileError("missing information after output_buffer_limit keyword");
+		}
+		if (!parseByteSize(value, limit) || limit < OUTPUT_CHUNK_SIZE) {
+			return configFileError("invalid size in output_buffer_limit: " + value);
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after output_buffer_limit keyword");
+		}
+		_outputBufferLimit = limit;
+		return true;
+	}
+
+	bool parseCgiCacheMaxSize(std::istringstream& iss) {
+		std::string value, extra;
+		size_t size;
+		if (!(iss >> value)) {
+			return configFileError("missing information after cgi_cache_max_size keyword");
+		}
+		if (!parseByteSize(value, size) || size == 0) {
+			return configFileError("invalid size in cgi_cache_max_size: " + value);
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after cgi_cache_max_size keyword");
+		}
+		_cgiCacheSize = size;
+		return true;
+	}
+
+	bool parseMmapThreshold(std::istringstream& iss) {
+		std::string value, extra;
+		size_t threshold = 0;
+		if (!(iss >> value)) {
+			return configFileError("missing information after mmap_threshold keyword");
+		}
+		if (value != "off" && (!parseByteSize(value, threshold) || threshold == 0)) {
+			return configFileError("invalid size in mmap_threshold: " + value);
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after mmap_threshold keyword");
+		}
+		_mmapThreshold = threshold;
+		return true;
+	}
+
+	bool parseNotSentLowat(std::istringstream& iss) {
+		std::string value, extra;
+		size_t lowat = 0;
+		if (!(iss >> value)) {
+			return configFileError("missing information after tcp_notsent_lowat keyword");
+		}
+		if (value != "off" && (!parseByteSize(value, lowat) || lowat == 0 || lowat > INT_MAX)) {
+			return configFileError("invalid size in tcp_notsent_lowat: " + value);
+		}
+		if (iss >> extra) {
+			return configFileError("too many arguments after tcp_notsent_lowat keyword");
+		}
+		_notSentLowat = lowat;
+		return true;
+	}
+
+	// parsing only fills the members, the subsystems read their settings from statics
+	void applySettings() const {
+		Client::getTcpNoPush() = _tcpNoPush;
+		Http2Connection::isEnabled() = _http2;
+		OutputQueue::getLimit() = _outputBufferLimit;
+		CgiCache::get().getLimit() = _cgiCacheSize;
+		MappedFile::getThreshold() = _mmapThreshold;
+		getSimdLevel() = _simdLevel;
+	}
+
+	void createEventBackend() {
+		if (_backendName == "io_uring") {
+			IoUringBackend* backend = new IoUringBackend();
+			if (backend->init()) {
+				EventBackend::getActive() = _backend = backend;
+				return;
+			}
+			perrored("io_uring_setup");
+			delete backend;
+			std::cerr << YELLOW << "io_uring is unavailable, falling back to epoll." << RESET
+					  << '\n';
+		}
+		EventBackend::getActive() = _backend = new EpollBackend();
+	}
+
+	bool checkLogFormats() const {
+		for (size_t i = 0; i < _virtualServers.size(); ++i) {
+			const LogConfig& config = _virtualServers[i].getAccessLogConfig();
+			if (!config.path.empty() && _logFormats.find(config.format) == _logFormats.end()) {
+				return configFileError("unknown log_format in access_log: " + config.format);
+			}
+		}
+		return true;
+	}
+
+	bool openLogFile(const LogConfig& config) {
+		if (_logFiles.find(config.path) != _logFiles.end()) {
+			return true;
+		}
+		if (!_logFiles[config.path].open(config)) {
+			std::cerr << "Cannot open log file " << config.path << ": " << std::strerror(errno)
+					  << '\n';
+			return false;
+		}
+		return true;
+	}
+
+	bool openLogFiles() {
+		if (!_errorLogConfig.path.empty()) {
+			if (!openLogFile(_errorLogConfig)) {
+				return false;
+			}
+			setErrorLog(&_logFiles[_errorLogConfig.path]);
+		}
+		for (size_t i = 0; i < _virtualServers.size(); ++i) {
+			const LogConfig& config = _virtualServers[i].getAccessLogConfig();
+			if (config.path.empty()) {
+				continue;
+			}
+			if (!openLogFile(config)) {
+				return false;
+			}
+			_virtualServers[i].setAccessLog(&_logFiles[config.path],
+											&_logFormats.find(config.format)->second);
+		}
+		return true;
+	}
+
+	void reopenLogFiles() {
+		for (std::map<std::string, LogFile>::iterator it = _logFiles.begin(); it != _logFiles.end();
+			 ++it) {
+			if (!it->second.reopen()) {
+				perrored(("open " + it->first).c_str());
+			}
+		}
+	}
+
+	int getLogTimeout() const {
+		const unsigned long now = getMicroseconds() / 1000;
+		long timeout = -1;
+		for (std::map<std::string, LogFile>::const_iterator it = _logFiles.begin();
+			 it != _logFiles.end(); ++it) {
+			long fileTimeout = it->second.getFlushTimeout(now);
+			if (fileTimeout != -1 && (timeout == -1 || fileTimeout < timeout)) {
+				timeout = fileTimeout;
+			}
+		}
+		return timeout;
+	}
+
+	int getTimeout() {
+		int timeout = getLogTimeout();
+		if (!_delayedClients.empty()) {
+			const unsigned long now = getMicroseconds() / 1000;
+			const unsigned long resumeTime = _delayedClients.begin()->first;
+			const int delay = resumeTime > now ? resumeTime - now : 0;
+			timeout = timeout == -1 ? delay : std::min(timeout, delay);
+		}
+		const unsigned long refreshDeadline = CgiCache::get().getRefreshDeadline();
+		if (refreshDeadline != 0) {
+			const unsigned long now = getMicroseconds() / 1000;
+			const int delay = refreshDeadline > now ? refreshDeadline - now : 0;
+			timeout = timeout == -1 ? delay : std::min(timeout, delay);
+		}
+		if (!_proxyCaches.empty()) {
+			timeout = timeout == -1 ? PROXY_CACHE_MANAGER_INTERVAL
+									: std::min(timeout, PROXY_CACHE_MANAGER_INTERVAL);
+		}
+		const unsigned long deadline = getUpstreamDeadline();
+		if (deadline != 0) {
+			const unsigned long now = getMicroseconds() / 1000;
+			const int delay = deadline > now ? deadline - now : 0;
+			timeout = timeout == -1 ? delay : std::min(timeout, delay);
+		}
+		return timeout;
+	}
+
+	unsigned long getUpstreamDeadline() {
+		unsigned long deadline = 0;
+		for (std::map<int, int>::iterator it = _clientUpstreams.begin();
+			 it != _clientUpstreams.end(); ++it) {
+			const unsigned long clientDeadline =
+				_clients.find(it->first)->second.getUpstreamDeadline();
+			if (clientDeadline != 0 && (deadline == 0 || clientDeadline < deadline)) {
+				deadline = clientDeadline;
+			}
+		}
+		return deadline;
+	}
+
+	void setInterest(int fd, uint32_t events) {
+		std::map<int, uint32_t>::iterator it = _interest.find(fd);
+		if (it == _interest.end()) {
+			_backend->add(fd, events);
+			_interest[fd] = events;
+		} else if (it->second != events) {
+			_backend->modify(fd, events);
+			it->second = events;
+		}
+	}
+
+	void delayClient(int clientFd, unsigned long resumeTime) {
+		if (!_edgeTriggered) {
+			setInterest(clientFd, EPOLLRDHUP);
+		}
+		_delayedClients.insert(std::make_pair(resumeTime, clientFd));
+	}
+
+	void resumeDelayedClients() {
+		const unsigned long now = getMicroseconds() / 1000;
+		while (!_delayedClients.empty() && _delayedClients.begin()->first <= now) {
+			const int clientFd = _delayedClients.begin()->second;
+			_delayedClients.erase(_delayedClients.begin());
+			std::map<int, Client>::iterator it = _clients.find(clientFd);
+			if (it == _clients.end() || it->second.getResumeTime() == 0 ||
+				it->second.getResumeTime() > now) {
+				continue;
+			}
+			it->second.resume();
+			if (_edgeTriggered) {
+				handleEdgeTriggeredEvents(clientFd, EPOLLOUT);
+			} else {
+				updateClient(clientFd);
+			}
+		}
+	}
+
+	// upstream connections are level-triggered whatever the client mode
+	void updateClient(int clientFd) {
+		Client& client = _clients.find(clientFd)->second;
+		std::map<int, int>::iterator it = _clientUpstreams.find(clientFd);
+		if (it != _clientUpstreams.end() && client.getUpstreamFd() != it->second) {
+			it = detachUpstream(it);
+		}
+		if (client.isUpstreamFinished()) {
+			if (it != _clientUpstreams.end()) {
+				it = detachUpstream(it);
+			}
+			client.releaseUpstream();
+		}
+		const int upstreamFd = client.getUpstreamFd();
+		if (upstreamFd != -1) {
+			if (it == _clientUpstreams.end()) {
+				_upstreams[upstreamFd] = clientFd;
+				_clientUpstreams[clientFd] = upstreamFd;
+			}
+			setInterest(upstreamFd, client.getUpstreamEvents());
+		}
+		if (!_edgeTriggered) {
+			setInterest(clientFd, client.getEvents());
+		}
+		if (client.isStarved()) {
+			_starvedClients.insert(clientFd);
+		}
+	}
+
+	void resumeStarvedClients() {
+		if (_starvedClients.empty() || OutputQueue::isThrottled()) {
+			return;
+		}
+		std::set<int> starved;
+		starved.swap(_starvedClients);
+		for (std::set<int>::iterator it = starved.begin(); it != starved.end(); ++it) {
+			std::map<int, Client>::iterator client = _clients.find(*it);
+			if (client == _clients.end()) {
+				continue;
+			}
+			updateClient(*it);
+			if (_edgeTriggered && client->second.isReady()) {
+				_readyClients.push_back(*it);
+			}
+		}
+	}
+
+	std::map<int, int>::iterator detachUpstream(std::map<int, int>::iterator it) {
+		_backend->detach(it->second);
+		_interest.erase(it->second);
+		_upstreams.erase(it->second);
+		_clientUpstreams.erase(it);
+		return _clientUpstreams.end();
+	}
+
+	void handleClientEvents(int clientFd, uint32_t events) {
+		Client& client = _clients.find(clientFd)->second;
+		if (events & (EPOLLHUP | EPOLLERR | EPOLLRDHUP)) {
+			return removeClient(clientFd);
+		} else if (_edgeTriggered) {
+			return handleEdgeTriggeredEvents(clientFd, events);
+		} else if (events & EPOLLIN) {
+			if (client.handleRequest() == RESPONSE_FAILURE) {
+				return removeClient(clientFd);
+			} else if (client.getResumeTime() != 0) {
+				return delayClient(clientFd, client.getResumeTime());
+			}
+		} else if (events & EPOLLOUT) {
+			if (client.pushResponse() != RESPONSE_PENDING) {
+				return removeClient(clientFd);
+			}
+		}
+		if (client.isWriting() || client.isHttp2()) {
+			updateClient(clientFd);
+		}
+	}
+
+	void handleUpstreamEvents(int clientFd) {
+		Client& client = _clients.find(clientFd)->second;
+		client.handleUpstreamEvents();
+		updateClient(clientFd);
+		if (_edgeTriggered && client.isReady()) {
+			_readyClients.push_back(clientFd);
+		}
+	}
+
+	void checkUpstreamTimeouts() {
+		if (_clientUpstreams.empty()) {
+			return;
+		}
+		const unsigned long now = getMicroseconds() / 1000;
+		std::vector<int> expired;
+		for (std::map<int, int>::iterator it = _clientUpstreams.begin();
+			 it != _clientUpstreams.end(); ++it) {
+			const unsigned long deadline = _clients.find(it->first)->second.getUpstreamDeadline();
+			if (deadline != 0 && deadline <= now) {
+				expired.push_back(it->first);
+			}
+		}
+		for (size_t i = 0; i < expired.size(); ++i) {
+			_clients.find(expired[i])->second.failUpstream(STATUS_GATEWAY_TIMEOUT);
+			handleUpstreamEvents(expired[i]);
+		}
+	}
+
+	void flushDueLogFiles() {
+		const unsigned long now = getMicroseconds() / 1000;
+		for (std::map<std::string, LogFile>::iterator it = _logFiles.begin(); it != _logFiles.end();
+			 ++it) {
+			if (it->second.getFlushTimeout(now) == 0) {
+				it->second.flush();
+			}
+		}
+	}
 
 	bool checkDuplicateServers() const {
 		for (size_t i = 0; i < _virtualServers.size(); ++i) {
@@ -188,20 +870,203 @@ private:
 		}
 	}
 
+	void handleEdgeTriggeredEvents(int clientFd, uint32_t events) {
+		Client& client = _clients[clientFd];
+		const unsigned long resumeTime = client.getResumeTime();
+		if (client.handleEvents(events) != RESPONSE_PENDING) {
+			return removeClient(clientFd);
+		}
+		updateClient(clientFd);
+		if (client.isReady()) {
+			_readyClients.push_back(clientFd);
+		} else if (client.getResumeTime() != resumeTime) {
+			delayClient(clientFd, client.getResumeTime());
+		}
+	}
+
+	void acceptClients(int listenFd, const struct sockaddr_in& listenAddress) {
+		for (int i = 0; i < ACCEPT_BATCH_SIZE; ++i) {
+			struct sockaddr_in address;
+			int clientFd = _backend->acceptClient(listenFd, address);
+			if (clientFd < 0) {
+				if (errno != EAGAIN && errno != EWOULDBLOCK) {
+					perrored("accept4");
+				}
+				return;
+			}
+			metrics.connectionAccepted();
+			struct sockaddr_in localAddress = listenAddress;
+			if (localAddress.sin_addr.s_addr == htonl(INADDR_ANY)) {
+				socklen_t localAddressLen = sizeof(localAddress);
+				syscall(getsockname(clientFd, (struct sockaddr*)&localAddress, &localAddressLen),
+						"getsockname");
+			}
+			std::vector<VirtualServer*>& servers = findAssociatedServers(localAddress);
+			std::vector<ClientLimiter*> limiters;
+			if (!acquireConnectionSlots(clientFd, address.sin_addr.s_addr, servers, limiters)) {
+				close(clientFd);
+				continue;
+			}
+			configureClientSocket(clientFd);
+			_backend->addReceiver(clientFd);
+			if (_edgeTriggered) {
+				_backend->add(clientFd, EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET);
+			} else {
+				setInterest(clientFd, EPOLLIN | EPOLLRDHUP);
+			}
+			_clients[clientFd].setInfo(clientFd, address, localAddress, servers, _limiter,
+									   limiters);
+			metrics.connectionHandled();
+		}
+	}
+
+	// limit_conn slots are taken at accept so that idle connections count, a refused client
+	// gets the status line of limit_conn_status before the socket is closed
+	bool acquireConnectionSlots(int clientFd, in_addr_t ip,
+								const std::vector<VirtualServer*>& servers,
+								std::vector<ClientLimiter*>& limiters) {
+		if (_limiter.limitsConnections()) {
+			limiters.push_back(&_limiter);
+		}
+		for (size_t i = 0; i < servers.size(); ++i) {
+			if (servers[i]->getLimiter().limitsConnections()) {
+				limiters.push_back(&servers[i]->getLimiter());
+			}
+		}
+		for (size_t i = 0; i < limiters.size(); ++i) {
+			const StatusCode status = limiters[i]->acquireConnection(ip);
+			if (status == STATUS_NONE) {
+				continue;
+			}
+			while (i-- > 0) {
+				limiters[i]->releaseConnection(ip);
+			}
+			std::map<StatusCode, std::string>::const_iterator it = STATUS_MESSAGES.find(status);
+			const std::string response = HTTP_VERSION " " + toString(status) + " " +
+										 (it == STATUS_MESSAGES.end() ? "" : it->second) +
+										 "\r\ncontent-length: 0\r\nconnection: close\r\n\r\n";
+			send(clientFd, response.data(), response.size(), MSG_DONTWAIT | MSG_NOSIGNAL);
+			return false;
+		}
+		return true;
+	}
+
+	// a low unsent mark keeps socket buffers short, writability is then reported later
+	void configureClientSocket(int clientFd) const {
+		const int enabled = 1;
+		const int lowat = _notSentLowat;
+		if (_tcpNoDelay) {
+			setsockopt(clientFd, IPPROTO_TCP, TCP_NODELAY, &enabled, sizeof(enabled));
+		}
+		if (lowat != 0) {
+			setsockopt(clientFd, IPPROTO_TCP, TCP_NOTSENT_LOWAT, &lowat, sizeof(lowat));
+		}
+	}
+
+	std::vector<VirtualServer*>& findAssociatedServers(const struct sockaddr_in& localAddress) {
+		const std::pair<in_addr_t, in_port_t> key(localAddress.sin_addr.s_addr,
+												  localAddress.sin_port);
+		std::map<std::pair<in_addr_t, in_port_t>, std::vector<VirtualServer*> >::iterator it =
+			_associatedServers.find(key);
+		if (it != _associatedServers.end()) {
+			return it->second;
+		}
+		std::vector<VirtualServer*>& servers = _associatedServers[key];
+		for (size_t i = 0; i < _virtualServers.size(); ++i) {
+			if (_virtualServers[i].getPort() == key.second &&
+				(_virtualServers[i].getAddr() == key.first ||
+				 _virtualServers[i].getAddr() == INADDR_ANY)) {
+				servers.push_back(&_virtualServers[i]);
+			}
+		}
+		return servers;
+	}
+
+	// sockets inherited from an upgraded binary are adopted rather than bound again, those
+	// no longer configured are closed
 	void connectVirtualServers() {
+		std::map<int, struct sockaddr_in> inherited = findInheritedSockets();
 		int reuse = 1;
 		for (size_t i = 0; i < _virtualServersToBind.size(); ++i) {
-			int socketFd;
-			syscall(socketFd = socket(AF_INET, SOCK_STREAM, 0), "socket");
-			syscall(setsockopt(socketFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)),
-					"setsockopt");
 			struct sockaddr_in addr = _virtualServersToBind[i]->getAddress();
-			std::cout << BLUE << "Listening on port " << htons(addr.sin_port) << ". 👂" << RESET
-					  << '\n';
-			syscall(bind(socketFd, (struct sockaddr*)&addr, sizeof(addr)), "bind");
-			syscall(listen(socketFd, SOMAXCONN), "listen");
-			syscallEpoll(_epollFd, EPOLL_CTL_ADD, socketFd, EPOLLIN, "EPOLL_CTL_ADD");
-			_listenSockets.insert(socketFd);
+			int socketFd = -1;
+			for (std::map<int, struct sockaddr_in>::iterator it = inherited.begin();
+				 it != inherited.end(); ++it) {
+				if (it->second.sin_addr.s_addr == addr.sin_addr.s_addr &&
+					it->second.sin_port == addr.sin_port) {
+					socketFd = it->first;
+					inherited.erase(it);
+					break;
+				}
+			}
+			std::cout << BLUE << (socketFd == -1 ? "Listening" : "Still listening") << " on port "
+					  << htons(addr.sin_port) << ". 👂" << RESET << '\n';
+			const ListenOptions& options = _virtualServersToBind[i]->getListenOptions();
+			if (socketFd == -1) {
+				syscall(socketFd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0),
+						"socket");
+				syscall(setsockopt(socketFd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse)),
+						"setsockopt");
+				setListenOptions(socketFd, options);
+				syscall(bind(socketFd, (struct sockaddr*)&addr, sizeof(addr)), "bind");
+			} else {
+				syscall(fcntl(socketFd, F_SETFD, FD_CLOEXEC), "fcntl");
+				setListenOptions(socketFd, options);
+			}
+			syscall(listen(socketFd, options.backlog), "listen");
+			_backend->addListener(socketFd);
+			_listenSockets[socketFd] = addr;
+		}
+		for (std::map<int, struct sockaddr_in>::iterator it = inherited.begin();
+			 it != inherited.end(); ++it) {
+			close(it->first);
+		}
+	}
+
+	static std::map<int, struct sockaddr_in> findInheritedSockets() {
+		std::map<int, struct sockaddr_in> sockets;
+		const char* fds = std::getenv(INHERITED_FDS_ENV);
+		if (fds == NULL) {
+			return sockets;
+		}
+		std::istringstream iss(fds);
+		for (std::string fd; std::getline(iss, fd, ',');) {
+			const int socketFd = std::atoi(fd.c_str());
+			struct sockaddr_in addr;
+			socklen_t addrLen = sizeof(addr);
+			if (getsockname(socketFd, (struct sockaddr*)&addr, &addrLen) == 0 &&
+				addr.sin_family == AF_INET) {
+				sockets[socketFd] = addr;
+			}
+		}
+		return sockets;
+	}
+
+	// buffer sizes and keepalive settings are inherited by accepted connections
+	static void setListenOptions(int socketFd, const ListenOptions& options) {
+		const int deferTimeout = 1;
+		const int keepalive = options.keepalive == 1;
+		const int values[] = {static_cast<int>(options.rcvbuf), static_cast<int>(options.sndbuf),
+							  options.keepIdle, options.keepInterval, options.keepCount,
+							  options.fastopen};
+		const int levels[] = {SOL_SOCKET, SOL_SOCKET, IPPROTO_TCP, IPPROTO_TCP, IPPROTO_TCP,
+							  IPPROTO_TCP};
+		const int names[] = {SO_RCVBUF,		SO_SNDBUF,	  TCP_KEEPIDLE,
+							 TCP_KEEPINTVL, TCP_KEEPCNT, TCP_FASTOPEN};
+		for (size_t i = 0; i < sizeof(values) / sizeof(values[0]); ++i) {
+			if (values[i] != 0) {
+				syscall(setsockopt(socketFd, levels[i], names[i], &values[i], sizeof(values[i])),
+						"setsockopt");
+			}
+		}
+		if (options.keepalive != -1) {
+			syscall(setsockopt(socketFd, SOL_SOCKET, SO_KEEPALIVE, &keepalive, sizeof(keepalive)),
+					"setsockopt");
+		}
+		if (options.deferred) {
+			syscall(setsockopt(socketFd, IPPROTO_TCP, TCP_DEFER_ACCEPT, &deferTimeout,
+							   sizeof(deferTimeout)),
+					"setsockopt");
 		}
 	}
 };
\ No newline at end of file
@@ -0,0 +1,37 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Immutable bytes handed to several responses at once, freed by the last release. The
+// owner holds a reference of its own and drops it when it renders a new version.
+class SharedBuffer {
+public:
+	static SharedBuffer* create(std::string& data) {
+		SharedBuffer* buffer = new SharedBuffer();
+		buffer->_data.swap(data);
+		return buffer;
+	}
+
+	SharedBuffer* acquire() {
+		++_refCount;
+		return this;
+	}
+
+	void release() {
+		if (--_refCount == 0) {
+			delete this;
+		}
+	}
+
+	const std::string& getData() const { return _data; }
+
+private:
+	std::string _data;
+	size_t _refCount;
+
+	SharedBuffer() : _refCount(1) {}
+	~SharedBuffer() {}
+
+	SharedBuffer(const SharedBuffer&);
+	SharedBuffer& operator=(const SharedBuffer&);
+};
@@ -0,0 +1,248 @@
+#pragma once
+
+#include "webserv.hpp"
+
+// Peers of an upstream block and the state used to balance between them. The event loop
+// is single-threaded, so consulting it is a scan over a handful of peers without locking;
+// every process keeps its own counters, like nginx upstreams without a shared zone.
+class UpstreamGroup {
+public:
+	typedef struct Peer {
+		struct sockaddr_in address;
+		unsigned long weight;
+		unsigned long maxFails;
+		unsigned long failTimeout;
+		unsigned long fails;
+		unsigned long failedAt;
+		long currentWeight;
+		unsigned long connections;
+	} Peer;
+
+	UpstreamGroup() : _method(BALANCE_ROUND_ROBIN), _next(0) {}
+
+	~UpstreamGroup(){};
+
+	bool parse(std::istream& config, const std::string& name) {
+		for (std::string line; std::getline(config, line);) {
+			std::istringstream iss(line);
+			std::string keyword, extra;
+			if (!(iss >> keyword) || keyword[0] == '#') {
+				continue;
+			} else if (keyword == "}") {
+				if (_peers.empty()) {
+					return configFileError("no server in upstream " + name);
+				}
+				buildRing();
+				return true;
+			} else if (keyword == "server") {
+				if (!parsePeer(iss)) {
+					return false;
+				}
+			} else if (keyword == "least_conn") {
+				_method = BALANCE_LEAST_CONN;
+			} else if (keyword == "hash") {
+				if (!(iss >> _hashKey)) {
+					return configFileError("missing information after hash keyword");
+				}
+				if (_hashKey != "$request_uri" &&
+					(!startswith(_hashKey, "$cookie_") || _hashKey.size() == 8)) {
+					return configFileError("hash key must be $request_uri or $cookie_<name>");
+				}
+				_method = BALANCE_HASH;
+			} else {
+				return configFileError("invalid keyword in upstream block: " + keyword);
+			}
+			if (iss >> extra) {
+				return configFileError("too many arguments after " + keyword + " keyword");
+			}
+		}
+		return configFileError("missing closing bracket for upstream block");
+	}
+
+	// peers already tried for this request are skipped, NULL when none is left
+	Peer* select(const std::string& key, const std::vector<Peer*>& tried) {
+		const unsigned long now = getMicroseconds() / 1000;
+		if (_method == BALANCE_HASH && !key.empty()) {
+			return selectHash(key, tried, now);
+		}
+		return _method == BALANCE_LEAST_CONN ? selectLeastConnections(tried, now)
+											 : selectRoundRobin(tried, now);
+	}
+
+	std::string getKey(const RequestParsingSuccess& request) const {
+		if (_hashKey == "$request_uri") {
+			return request.query.empty() ? request.uri : request.uri + "?" + request.query;
+		}
+		const char* cookies = request.headers.get(HEADER_COOKIE);
+		if (_hashKey.empty() || cookies == NULL) {
+			return "";
+		}
+		const std::string name = _hashKey.substr(8) + "=";
+		for (const char* p = cookies; *p != '\0';) {
+			p += std::strspn(p, "; ");
+			const size_t length = std::strcspn(p, ";");
+			if (std::strncmp(p, name.c_str(), name.size()) == 0) {
+				return std::string(p + name.size(), length - name.size());
+			}
+			p += length;
+		}
+		return "";
+	}
+
+	// a peer is skipped once it failed max_fails times within fail_timeout
+	static void markFailed(Peer* peer) {
+		const unsigned long now = getMicroseconds() / 1000;
+		if (now - peer->failedAt >= peer->failTimeout) {
+			peer->fails = 0;
+		}
+		++peer->fails;
+		peer->failedAt = now;
+	}
+
+	static void markSucceeded(Peer* peer) { peer->fails = 0; }
+
+private:
+	std::vector<Peer> _peers;
+	UpstreamBalanceEnum _method;
+	std::string _hashKey;
+	std::vector<std::pair<uint32_t, size_t> > _ring;
+	size_t _next;
+
+	static bool isAvailable(const Peer& peer, const std::vector<Peer*>& tried,
+							unsigned long now) {
+		if (std::find(tried.begin(), tried.end(), &peer) != tried.end()) {
+			return false;
+		}
+		return peer.maxFails == 0 || peer.fails < peer.maxFails ||
+			   now - peer.failedAt >= peer.failTimeout;
+	}
+
+	// smooth weighted round-robin, as in nginx
+	Peer* selectRoundRobin(const std::vector<Peer*>& tried, unsigned long now) {
+		Peer* best = NULL;
+		long total = 0;
+		for (size_t i = 0; i < _peers.size(); ++i) {
+			Peer& peer = _peers[i];
+			if (!isAvailable(peer, tried, now)) {
+				continue;
+			}
+			peer.currentWeight += peer.weight;
+			total += peer.weight;
+			if (best == NULL || peer.currentWeight > best->currentWeight) {
+				best = &peer;
+			}
+		}
+		if (best != NULL) {
+			best->currentWeight -= total;
+		}
+		return best;
+	}
+
+	// ties are broken by rotating the starting peer
+	Peer* selectLeastConnections(const std::vector<Peer*>& tried, unsigned long now) {
+		Peer* best = NULL;
+		const size_t start = _next++;
+		for (size_t i = 0; i < _peers.size(); ++i) {
+			Peer& peer = _peers[(start + i) % _peers.size()];
+			if (isAvailable(peer, tried, now) &&
+				(best == NULL ||
+				 peer.connections * best->weight < best->connections * peer.weight)) {
+				best = &peer;
+			}
+		}
+		return best;
+	}
+
+	// consistent hashing over UPSTREAM_HASH_POINTS points per unit of weight
+	Peer* selectHash(const std::string& key, const std::vector<Peer*>& tried,
+					 unsigned long now) {
+		const std::pair<uint32_t, size_t> point(hash(key.data(), key.size()), 0);
+		size_t index = std::lower_bound(_ring.begin(), _ring.end(), point) - _ring.begin();
+		for (size_t i = 0; i < _ring.size(); ++i, ++index) {
+			Peer& peer = _peers[_ring[index % _ring.size()].second];
+			if (isAvailable(peer, tried, now)) {
+				return &peer;
+			}
+		}
+		return NULL;
+	}
+
+	void buildRing() {
+		_ring.clear();
+		for (size_t i = 0; i < _peers.size(); ++i) {
+			const std::string name = getIpString(_peers[i].address.sin_addr.s_addr) + ":" +
+									 toString(ntohs(_peers[i].address.sin_port)) + "-";
+			for (size_t j = 0; j < _peers[i].weight * UPSTREAM_HASH_POINTS; ++j) {
+				const std::string point = name + toString(j);
+				_ring.push_back(std::make_pair(hash(point.data(), point.size()), i));
+			}
+		}
+		std::sort(_ring.begin(), _ring.end());
+	}
+
+	static uint32_t hash(const char* data, size_t length) {
+		uint32_t h = 2166136261U;
+		for (size_t i = 0; i < length; ++i) {
+			h = (h ^ static_cast<unsigned char>(data[i])) * 16777619U;
+		}
+		return h;
+	}
+
+	bool parsePeer(std::istringstream& iss) {
+		std::string address, value;
+		if (!(iss >> address)) {
+			return configFileError("missing information after server keyword in upstream");
+		}
+		Peer peer;
+		std::memset(&peer, 0, sizeof(peer));
+		peer.weight = 1;
+		peer.maxFails = 1;
+		peer.failTimeout = 10000;
+		const size_t colon = address.find(':');
+		long port = 80;
+		if (colon != std::string::npos) {
+			const std::string portString = address.substr(colon + 1);
+			if (portString.empty() ||
+				portString.find_first_not_of("0123456789") != std::string::npos ||
+				portString.size() > 5 || (port = std::strtol(portString.c_str(), NULL, 10)) == 0 ||
+				port > MAX_PORT) {
+				return configFileError("invalid port in upstream server: " + address);
+			}
+		}
+		const std::string host = address.substr(0, colon);
+		if (host.empty() || host == "*" || !getIpValue(host, peer.address.sin_addr.s_addr)) {
+			return configFileError("invalid IPv4 address in upstream server: " + address);
+		}
+		peer.address.sin_family = AF_INET;
+		peer.address.sin_port = htons(port);
+		while (iss >> value) {
+			if (startswith(value, "weight=")) {
+				if (!parseNumber(value.substr(7), peer.weight) || peer.weight == 0 ||
+					peer.weight > 100) {
+					return configFileError("invalid weight in upstream server: " + value);
+				}
+			} else if (startswith(value, "max_fails=")) {
+				if (!parseNumber(value.substr(10), peer.maxFails)) {
+					return configFileError("invalid max_fails in upstream server: " + value);
+				}
+			} else if (startswith(value, "fail_timeout=")) {
+				if (!parseDuration(value.substr(13), peer.failTimeout)) {
+					return configFileError("invalid fail_timeout in upstream server: " + value);
+				}
+			} else {
+				return configFileError("invalid parameter in upstream server: " + value);
+			}
+		}
+		_peers.push_back(peer);
+		return true;
+	}
+
+	static bool parseNumber(const std::string& value, unsigned long& number) {
+		if (value.empty() || value.find_first_not_of("0123456789") != std::string::npos ||
+			value.size() > 6) {
+			return false;
+		}
+		number = std::strtoul(value.c_str(), NULL, 10);
+		return true;
+	}
+};
@@ -9,10 +9,16 @@ public:
 		_address.sin_family = AF_INET;
 		_address.sin_port = htons(DEFAULT_PORT);
 		_address.sin_addr.s_addr = htonl(INADDR_ANY);
+		std::memset(&_listenOptions, 0, sizeof(_listenOptions));
+		_listenOptions.backlog = SOMAXCONN;
+		_listenOptions.keepalive = -1;
 		_rootDir = "/www";
 		_autoIndex = false;
 		_bodySize = DEFAULT_BODY_SIZE;
 		_return.first = -1;
+		_requestCount = 0;
+		_accessLog = NULL;
+		_logFormat = NULL;
 		initKeywordMap();
 	}
 
@@ -36,6 +42,10 @@ public:
 					return false;
 				}
 				_locations.push_back(location);
+			} else if (startswith(keyword, "limit_")) {
+				if (!_limiter.parse(keyword, iss)) {
+					return false;
+				}
 			} else {
 				try {
 					KeywordHandler handler = _keywordHandlers.at(keyword);
@@ -73,7 +83,7 @@ public:
 			try {
 				matchLevel = _locations[i].isMatching(requestPath);
 			} catch (const RegexError& e) {
-				std::cerr << RED << e.what() << RESET << '\n';
+				logError(e.what());
 				return NULL;
 			}
 			if (matchLevel == LOCATION_MATCH_EXACT) {
@@ -96,27 +106,83 @@ public:
 
 	in_port_t getPort() const { return _address.sin_port; }
 	in_addr_t getAddr() const { return _address.sin_addr.s_addr; }
-	std::string getRootDir() const { return _rootDir; }
+	std::string const& getRootDir() const { return _rootDir; }
 	bool getAutoIndex() const { return _autoIndex; }
 	size_t getBodySize() const { return _bodySize; }
 	struct sockaddr_in getAddress() const { return _address; }
+	ListenOptions const& getListenOptions() const { return _listenOptions; }
 	std::vector<std::string> const& getServerNames() const { return _serverNames; }
 	std::vector<Location> const& getLocations() const { return _locations; }
 	std::map<int, std::string> const& getErrorPages() const { return _errorPages; }
 	std::vector<std::string> const& getIndexPages() const { return _indexPages; }
+	unsigned long getRequestCount() const { return _requestCount; }
+	LogConfig const& getAccessLogConfig() const { return _accessLogConfig; }
+	LogFile* getAccessLog() const { return _accessLog; }
+	const LogFormat* getLogFormat() const { return _logFormat; }
+	ClientLimiter& getLimiter() { return _limiter; }
+
+	void countRequest() { ++_requestCount; }
+
+	ErrorPage* findErrorPage(StatusCode statusCode) {
+		std::map<int, ErrorPage>::iterator it = _renderedErrorPages.find(statusCode);
+		return it == _renderedErrorPages.end() ? NULL : &it->second;
+	}
+
+	void renderErrorPages() {
+		for (std::map<int, std::string>::const_iterator it = _errorPages.begin();
+			 it != _errorPages.end(); ++it) {
+			if (!_renderedErrorPages[it->first].render(static_cast<StatusCode>(it->first),
+													   "." + _rootDir + it->second, "")) {
+				_renderedErrorPages.erase(it->first);
+			}
+		}
+		for (size_t i = 0; i < _locations.size(); ++i) {
+			_locations[i].renderErrorPages(_errorPages, _rootDir);
+		}
+	}
+
+	bool resolveUpstreams(std::map<std::string, UpstreamGroup>& upstreams) {
+		for (size_t i = 0; i < _locations.size(); ++i) {
+			if (!_locations[i].resolveUpstream(upstreams)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	bool resolveProxyCaches(std::map<std::string, ProxyCache*>& caches) {
+		for (size_t i = 0; i < _locations.size(); ++i) {
+			if (!_locations[i].resolveProxyCache(caches)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	void setAccessLog(LogFile* accessLog, const LogFormat* logFormat) {
+		_accessLog = accessLog;
+		_logFormat = logFormat;
+	}
 
 private:
 	typedef bool (VirtualServer::*KeywordHandler)(std::istringstream&);
 	struct sockaddr_in _address;
+	ListenOptions _listenOptions;
 	std::vector<std::string> _serverNames;
 	std::string _rootDir;
 	bool _autoIndex;
 	size_t _bodySize;
 	std::map<int, std::string> _errorPages;
+	std::map<int, ErrorPage> _renderedErrorPages;
 	std::vector<std::string> _indexPages;
 	std::pair<long, std::string> _return;
 	std::vector<Location> _locations;
 	std::map<std::string, KeywordHandler> _keywordHandlers;
+	unsigned long _requestCount;
+	LogConfig _accessLogConfig;
+	LogFile* _accessLog;
+	const LogFormat* _logFormat;
+	ClientLimiter _limiter;
 
 	void initKeywordMap() {
 		_keywordHandlers["listen"] = &VirtualServer::parseListen;
@@ -127,6 +193,7 @@ private:
 		_keywordHandlers["error_page"] = &VirtualServer::parseErrorPages;
 		_keywordHandlers["index"] = &VirtualServer::parseIndex;
 		_keywordHandlers["return"] = &VirtualServer::parseReturn;
+		_keywordHandlers["access_log"] = &VirtualServer::parseAccessLog;
 	}
 
 	bool parseListen(std::istringstream& iss) {
@@ -165,12 +232,84 @@ private:
 				return configFileError(ERROR_LISTEN_FORMAT);
 			}
 		}
-		if (iss >> value) {
-			return configFileError("too many arguments after listen keyword");
+		while (iss >> value) {
+			if (!parseListenOption(value)) {
+				return false;
+			}
 		}
 		return true;
 	}
 
+	bool parseListenOption(const std::string& value) {
+		if (value == "quic") {
+			return configFileError(ERROR_QUIC);
+		} else if (value == "deferred") {
+			_listenOptions.deferred = true;
+		} else if (startswith(value, "backlog=")) {
+			if (!parseCount(value.substr(8), _listenOptions.backlog)) {
+				return configFileError("invalid backlog in listen instruction: " + value);
+			}
+		} else if (startswith(value, "fastopen=")) {
+			if (!parseCount(value.substr(9), _listenOptions.fastopen)) {
+				return configFileError("invalid fastopen in listen instruction: " + value);
+			}
+		} else if (startswith(value, "rcvbuf=") || startswith(value, "sndbuf=")) {
+			size_t& size = value[0] == 'r' ? _listenOptions.rcvbuf : _listenOptions.sndbuf;
+			if (!parseByteSize(value.substr(7), size) || size == 0 || size > INT_MAX) {
+				return configFileError("invalid buffer size in listen instruction: " + value);
+			}
+		} else if (startswith(value, "so_keepalive=")) {
+			if (!parseKeepalive(value.substr(13))) {
+				return configFileError("invalid so_keepalive in listen instruction: " + value);
+			}
+		} else {
+			return configFileError("invalid parameter in listen instruction: " + value);
+		}
+		return true;
+	}
+
+	static bool parseCount(const std::string& value, int& count) {
+		if (value.empty() || value.size() > 9 ||
+			value.find_first_not_of("0123456789") != std::string::npos) {
+			return false;
+		}
+		count = std::atoi(value.c_str());
+		return count > 0;
+	}
+
+	// on, off, or [keepidle]:[keepintvl]:[keepcnt] with the times in seconds by default
+	bool parseKeepalive(const std::string& value) {
+		if (value == "on" || value == "off") {
+			_listenOptions.keepalive = value == "on";
+			return true;
+		}
+		if (std::count(value.begin(), value.end(), ':') != 2) {
+			return false;
+		}
+		std::istringstream iss(value);
+		std::string fields[3];
+		int* targets[3] = {&_listenOptions.keepIdle, &_listenOptions.keepInterval,
+						   &_listenOptions.keepCount};
+		for (int i = 0; i < 3; ++i) {
+			std::getline(iss, fields[i], ':');
+			unsigned long milliseconds;
+			if (fields[i].empty()) {
+				continue;
+			} else if (i == 2) {
+				if (!parseCount(fields[i], *targets[i])) {
+					return false;
+				}
+			} else if (!parseDuration(fields[i], milliseconds) || milliseconds < 1000 ||
+					   milliseconds / 1000 > INT_MAX) {
+				return false;
+			} else {
+				*targets[i] = milliseconds / 1000;
+			}
+		}
+		_listenOptions.keepalive = 1;
+		return true;
+	}
+
 	bool parseServerNames(std::istringstream& iss) {
 		std::string value;
 		if (!(iss >> value)) {
@@ -188,6 +327,20 @@ private:
 	bool parseIndex(std::istringstream& iss) { return ::parseIndex(iss, _indexPages); }
 	bool parseReturn(std::istringstream& iss) { return ::parseReturn(iss, _return); }
 
+	bool parseAccessLog(std::istringstream& iss) {
+		std::string path;
+		if (!(iss >> path)) {
+			return configFileError("missing information after access_log keyword");
+		}
+		if (path == "off") {
+			_accessLogConfig.path.clear();
+			return (iss >> path) ? configFileError("too many arguments after access_log off")
+								 : true;
+		}
+		_accessLogConfig.path = path;
+		return ::parseLogParameters(iss, _accessLogConfig, "access_log", true);
+	}
+
 	bool parseRoot(std::istringstream& iss) {
 		return ::parseDirectory(iss, _rootDir, "server", "root") &&
 			   validateUri(_rootDir, "server root");
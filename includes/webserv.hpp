@@ -10,15 +10,21 @@
 #include <cstdlib>
 #include <cstring>
 #include <ctime>
+#include <deque>
 #include <dirent.h>
 #include <exception>
+#include <fcntl.h>
 #include <fstream>
 #include <iomanip>
 #include <iostream>
 #include <istream>
 #include <iterator>
+#include <list>
+#include <linux/io_uring.h>
 #include <map>
+#include <new>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <queue>
 #include <regex.h>
 #include <set>
@@ -27,8 +33,11 @@
 #include <stdlib.h>
 #include <string>
 #include <sys/epoll.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
 #include <sys/wait.h>
 #include <unistd.h>
@@ -39,16 +48,79 @@
 #define DEFAULT_PORT 8080
 #define MAX_PORT 65535
 #define MAX_EVENTS 1024
+#define ACCEPT_BATCH_SIZE 64
+#define IO_URING_ENTRIES 256
+#define IO_URING_BUFFERS 256
+#define IO_URING_BUFFER_GROUP 0
+#define IO_URING_RECV_BACKLOG 4
 #define MAX_URI_SIZE 2048
 #define SIZE_LIMIT 33554432
 #define BUFFER_SIZE 16384
 #define PIPE_SIZE 65536
+#define SPLICE_UPLOAD_THRESHOLD 65536
+#define MULTIPART_BOUNDARY_SIZE 70
+#define MULTIPART_HEADER_SIZE 8192
+#define MULTIPART_MAX_PARTS 256
 #define DEFAULT_BODY_SIZE 1048576
 #define RESPONSE_BUFFER_SIZE 1048576
+#define RESPONSE_HEAD_SIZE 512
+#define ERROR_PAGE_CHECK_INTERVAL 1000
 #define MAX_HEADER_SIZE 1048576
+#define ARENA_ALIGNMENT 16
+#define ARENA_CHUNK_SIZE 8192
+#define ARENA_MAX_CHUNKS 64
+#define ARENA_POOL_SIZE 256
+#define AUTOINDEX_CACHE_SIZE 64
+#define AUTOINDEX_PAGE_SIZE 1000
+#define HEADER_TABLE_ENTRIES 16
+#define HEADER_TABLE_SIZE 1024
+#define LIMIT_TABLE_SIZE 4096
+#define LIMIT_TABLE_WAYS 4
+#define MAPPED_FILES_MAX 64
+#define OUTPUT_CHUNK_SIZE 16384
+#define OUTPUT_HIGH_WATERMARK 262144
+#define OUTPUT_LOW_WATERMARK 65536
+#define OUTPUT_MAX_CHUNKS (OUTPUT_HIGH_WATERMARK / OUTPUT_CHUNK_SIZE + 1)
+#define OUTPUT_POOL_SIZE 64
+#define DEFAULT_OUTPUT_BUFFER_LIMIT 67108864
+#define DEFAULT_CGI_CACHE_SIZE 16777216
+#define DEFAULT_PROXY_TIMEOUT 60000
+#define PROXY_HEAD_SIZE 65536
+#define UPSTREAM_KEEPALIVE 32
+#define UPSTREAM_HASH_POINTS 160
+#define DEFAULT_PROXY_CACHE_INACTIVE 600000
+#define PROXY_CACHE_MAGIC "WSCACHE1"
+#define PROXY_CACHE_MANAGER_INTERVAL 1000
+#define PROXY_CACHE_MANAGER_FILES 100
+#define PROXY_CACHE_MANAGER_SLOTS 4096
+#define HPACK_STATIC_TABLE_SIZE 61
+#define HPACK_HUFFMAN_SYMBOLS 257
+#define HTTP2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define HTTP2_PREFACE_SIZE 24
+#define HTTP2_FRAME_HEADER_SIZE 9
+#define HTTP2_MAX_FRAME_SIZE 16384
+#define HTTP2_DEFAULT_WINDOW 65535
+#define HTTP2_MAX_WINDOW 2147483647L
+#define HTTP2_MAX_STREAMS 128
+#define HTTP2_HEADER_TABLE_SIZE 4096
+#define HTTP2_HEAD_ROOM 65536
+#define HTTP2_OUTPUT_WATERMARK 262144
+#define HISTOGRAM_BUCKETS 21
+#define HISTOGRAM_MIN_US 64UL
+#define MAX_STATUS_CODE 599
+#define LOG_BUFFER_SIZE 65536
+#define LOG_FLUSH_INTERVAL 1000
+#define LOG_BACKLOG_BATCHES 16
+#define DEFAULT_LOG_FORMAT "combined"
+#define COMBINED_LOG_FORMAT                                                                        \
+	"$remote_addr - - [$time_local] \"$request\" $status $body_bytes_sent \"$http_referer\" "     \
+	"\"$http_user_agent\""
 
 #define TIMEOUT 10.0
 
+#define INHERITED_FDS_ENV "WEBSERV_LISTEN_FDS"
+#define UPGRADE_PARENT_ENV "WEBSERV_PARENT_PID"
+
 #define CGI_VERSION "CGI/1.1"
 #define HTTP_VERSION "HTTP/1.1"
 #define SERVER_VERSION "webserv/4.2"
@@ -59,6 +131,7 @@
 #define ERROR_LOCATION_FORMAT                                                                      \
 	"wrong syntax for location, syntax must be 'location [modifier] uri {'"
 #define ERROR_PORT "invalid port number in listen instruction"
+#define ERROR_QUIC "quic listeners are not supported, they require a TLS 1.3 stack"
 
 #define RESET "\033[0m"
 #define RED "\033[31m"
@@ -73,10 +146,15 @@
 #define LOCATION_MATCH_NONE 0
 
 class Client;
+class ErrorPage;
 class Location;
+class LogFile;
+class Metrics;
+class ProxyCache;
 class Request;
 class Response;
 class Server;
+class UpstreamGroup;
 class VirtualServer;
 
 template <typename T>
@@ -162,6 +240,46 @@ typedef enum StatusCode {
 	STATUS_NETWORK_AUTHENTICATION_REQUIRED = 511,
 } StatusCode;
 
+typedef enum HeaderId {
+	HEADER_ACCEPT,
+	HEADER_ACCEPT_ENCODING,
+	HEADER_ACCEPT_LANGUAGE,
+	HEADER_AUTHORIZATION,
+	HEADER_CACHE_CONTROL,
+	HEADER_CONNECTION,
+	HEADER_CONTENT_LENGTH,
+	HEADER_CONTENT_TYPE,
+	HEADER_COOKIE,
+	HEADER_DATE,
+	HEADER_HOST,
+	HEADER_LOCATION,
+	HEADER_RANGE,
+	HEADER_REFERER,
+	HEADER_SERVER,
+	HEADER_STATUS,
+	HEADER_TRANSFER_ENCODING,
+	HEADER_USER_AGENT,
+	HEADER_OTHER,
+} HeaderId;
+
+typedef enum SimdLevelEnum {
+	SIMD_SCALAR,
+	SIMD_SSE2,
+	SIMD_AVX2,
+} SimdLevelEnum;
+
+size_t findDotDot(const char*, size_t);
+size_t findEitherByte(const char*, size_t, char, char);
+SimdLevelEnum& getSimdLevel();
+SimdLevelEnum getSupportedSimdLevel();
+void lowercaseAscii(char*, const char*, size_t);
+size_t scanPrintable(const char*, size_t);
+
+#include "Arena.hpp"
+#include "HeaderTable.hpp"
+#include "OutputQueue.hpp"
+#include "SharedBuffer.hpp"
+
 typedef enum RequestParsingEnum {
 	REQUEST_PARSING_FAILURE,
 	REQUEST_PARSING_PROCESSING,
@@ -172,7 +290,7 @@ typedef struct RequestParsingSuccess {
 	RequestMethod method;
 	std::string uri;
 	std::string query;
-	std::map<std::string, std::string> headers;
+	HeaderTable headers;
 	std::vector<unsigned char> body;
 } RequestParsingSuccess;
 
@@ -190,12 +308,166 @@ typedef enum ResponseStatusEnum {
 	RESPONSE_SUCCESS,
 } ResponseStatusEnum;
 
+typedef enum ConnectionPhaseEnum {
+	PHASE_IDLE,
+	PHASE_READING,
+	PHASE_WRITING,
+} ConnectionPhaseEnum;
+
+typedef struct AutoIndexListing {
+	struct timespec mtime;
+	time_t lastUsed;
+	std::vector<std::string> entries;
+	std::string uri;
+	std::map<std::pair<bool, size_t>, SharedBuffer*> pages;
+} AutoIndexListing;
+
+typedef struct ListenOptions {
+	int backlog;
+	bool deferred;
+	int fastopen;
+	size_t rcvbuf;
+	size_t sndbuf;
+	int keepalive;
+	int keepIdle;
+	int keepInterval;
+	int keepCount;
+} ListenOptions;
+
+typedef struct LogConfig {
+	std::string path;
+	std::string format;
+	size_t bufferSize;
+	unsigned long flushInterval;
+} LogConfig;
+
+typedef struct AccessLogEntry {
+	in_addr_t remoteAddr;
+	RequestMethod method;
+	std::string uri;
+	std::string query;
+	std::string host;
+	std::string serverName;
+	std::string referer;
+	std::string userAgent;
+	StatusCode statusCode;
+	size_t bodyBytesSent;
+	unsigned long requestTime;
+} AccessLogEntry;
+
+typedef enum CgiCacheStatusEnum {
+	CGI_CACHE_MISS,
+	CGI_CACHE_HIT,
+	CGI_CACHE_STALE,
+	CGI_CACHE_UPDATING,
+} CgiCacheStatusEnum;
+
+typedef enum ProxyCacheStatusEnum {
+	PROXY_CACHE_MISS,
+	PROXY_CACHE_HIT,
+	PROXY_CACHE_EXPIRED,
+	PROXY_CACHE_UPDATING,
+} ProxyCacheStatusEnum;
+
+typedef struct ProxyConfig {
+	struct sockaddr_in address;
+	std::string host;
+	std::string uri;
+	UpstreamGroup* upstream;
+	ProxyCache* cache;
+	unsigned long cacheValid;
+	unsigned long connectTimeout;
+	unsigned long readTimeout;
+} ProxyConfig;
+
+typedef enum ProxyStateEnum {
+	PROXY_CONNECTING,
+	PROXY_SENDING,
+	PROXY_READING_HEAD,
+	PROXY_READING_BODY,
+	PROXY_DONE,
+	PROXY_FAILED,
+} ProxyStateEnum;
+
+typedef enum ProxyBodyEnum {
+	PROXY_BODY_NONE,
+	PROXY_BODY_LENGTH,
+	PROXY_BODY_CHUNKED,
+	PROXY_BODY_CLOSE,
+} ProxyBodyEnum;
+
+typedef enum UpstreamBalanceEnum {
+	BALANCE_ROUND_ROBIN,
+	BALANCE_LEAST_CONN,
+	BALANCE_HASH,
+} UpstreamBalanceEnum;
+
+typedef struct HpackCode {
+	uint32_t code;
+	unsigned char length;
+} HpackCode;
+
+typedef enum Http2FrameEnum {
+	HTTP2_DATA = 0x0,
+	HTTP2_HEADERS = 0x1,
+	HTTP2_PRIORITY = 0x2,
+	HTTP2_RST_STREAM = 0x3,
+	HTTP2_SETTINGS = 0x4,
+	HTTP2_PUSH_PROMISE = 0x5,
+	HTTP2_PING = 0x6,
+	HTTP2_GOAWAY = 0x7,
+	HTTP2_WINDOW_UPDATE = 0x8,
+	HTTP2_CONTINUATION = 0x9,
+} Http2FrameEnum;
+
+typedef enum Http2FlagEnum {
+	HTTP2_FLAG_ACK = 0x1,
+	HTTP2_FLAG_END_STREAM = 0x1,
+	HTTP2_FLAG_END_HEADERS = 0x4,
+	HTTP2_FLAG_PADDED = 0x8,
+	HTTP2_FLAG_PRIORITY = 0x20,
+} Http2FlagEnum;
+
+typedef enum Http2SettingEnum {
+	HTTP2_SETTINGS_HEADER_TABLE_SIZE = 0x1,
+	HTTP2_SETTINGS_ENABLE_PUSH = 0x2,
+	HTTP2_SETTINGS_MAX_CONCURRENT_STREAMS = 0x3,
+	HTTP2_SETTINGS_INITIAL_WINDOW_SIZE = 0x4,
+	HTTP2_SETTINGS_MAX_FRAME_SIZE = 0x5,
+	HTTP2_SETTINGS_MAX_HEADER_LIST_SIZE = 0x6,
+} Http2SettingEnum;
+
+typedef enum Http2ErrorEnum {
+	HTTP2_NO_ERROR = 0x0,
+	HTTP2_PROTOCOL_ERROR = 0x1,
+	HTTP2_INTERNAL_ERROR = 0x2,
+	HTTP2_FLOW_CONTROL_ERROR = 0x3,
+	HTTP2_SETTINGS_TIMEOUT = 0x4,
+	HTTP2_STREAM_CLOSED = 0x5,
+	HTTP2_FRAME_SIZE_ERROR = 0x6,
+	HTTP2_REFUSED_STREAM = 0x7,
+	HTTP2_CANCEL = 0x8,
+	HTTP2_COMPRESSION_ERROR = 0x9,
+	HTTP2_CONNECT_ERROR = 0xa,
+	HTTP2_ENHANCE_YOUR_CALM = 0xb,
+	HTTP2_INADEQUATE_SECURITY = 0xc,
+	HTTP2_HTTP_1_1_REQUIRED = 0xd,
+} Http2ErrorEnum;
+
 typedef enum LocationModifierEnum {
 	DIRECTORY,
 	REGEX,
 	EXACT,
 } LocationModifierEnum;
 
+typedef enum MultipartStateEnum {
+	MULTIPART_PREAMBLE,
+	MULTIPART_HEADERS,
+	MULTIPART_DATA,
+	MULTIPART_DELIMITER,
+	MULTIPART_EPILOGUE,
+} MultipartStateEnum;
+
 class SystemError : public std::runtime_error {
 public:
 	explicit SystemError(const char* funcName) : std::runtime_error(funcName), funcName(funcName) {}
@@ -210,28 +482,43 @@ public:
 
 int comparePrefix(const std::string&, const std::string&);
 bool configFileError(const std::string&);
+void countDroppedLogBytes(size_t);
 std::string decodeUri(const std::string&);
 bool doesRegexMatch(const char*, const char*);
 bool endswith(const std::string&, const std::string&);
+std::string encodeUri(const std::string&);
+std::string escapeJson(const std::string&);
+AutoIndexListing* findAutoIndexListing(const std::string&);
+ErrorPage* findDefaultErrorPage(StatusCode);
 const std::string* findCommonString(const std::vector<std::string>&,
 									const std::vector<std::string>&);
-std::string findFinalUri(const std::string&, std::string, Location*);
+std::string findFinalUri(const std::string&, const std::string&, Location*);
+void flushErrorLog();
 std::string fullRead(int);
 std::string getAbsolutePath(const std::string&);
+unsigned long getAllocationCount();
 std::string getBasename(const std::string&);
-std::string getDate();
+const std::string& getDate();
 int getExitCode(pid_t);
 std::string getExtension(const std::string&);
 std::string getIpString(in_addr_t);
 bool getIpValue(std::string, uint32_t&);
+std::string getLogTime();
+unsigned long getMicroseconds();
+std::string getQueryParameter(const std::string&, const std::string&);
 void initAllowedMethods(bool[NO_METHOD]);
 bool isDirectory(const std::string&);
 bool isValidFile(const std::string&);
 bool isValidStatusCode(int);
+void logError(const std::string&);
 std::string metavariablify(const std::string&);
 void perrored(const char*);
 bool readContent(std::string&, std::string&);
+void releaseAutoIndexPages(AutoIndexListing&);
 std::string removeDuplicateSlashes(const std::string&);
+void renderDefaultErrorPages();
+void runLogWriter(int, int);
+void setErrorLog(LogFile*);
 bool startswith(const std::string&, const std::string&);
 std::string strlower(const std::string&);
 std::string strtrim(const std::string&, const std::string&);
@@ -239,27 +526,61 @@ std::string toString(RequestMethod);
 bool validateUri(const std::string&, const std::string& = "");
 char** vectorToCharArray(const std::vector<std::string>&);
 
+void drainSignalHandler(int);
 void mainDestructor();
+void reopenSignalHandler(int);
 void signalHandler(int);
 void syscall(long, const char*);
 void syscallEpoll(int, int, int, int, const char*);
+void upgradeSignalHandler(int);
 
 bool parseAutoIndex(std::istringstream&, bool&);
+bool parseByteSize(const std::string&, size_t&);
 bool parseDirectory(std::istringstream&, std::string&, const std::string&, const std::string&);
+bool parseDuration(const std::string&, unsigned long&);
 bool parseErrorPages(std::istringstream&, std::map<int, std::string>&);
 bool parseIndex(std::istringstream&, std::vector<std::string>&);
+bool parseLogParameters(std::istringstream&, LogConfig&, const std::string&, bool);
+bool parseRange(const char*, size_t, size_t&, size_t&);
 bool parseReturn(std::istringstream&, std::pair<long, std::string>&);
+bool parseSwitch(std::istringstream&, bool&, const std::string&);
 
 void initGlobals();
 
+#include "Logger.hpp"
+
+#include "ErrorPage.hpp"
+
+#include "MappedFile.hpp"
+
+#include "EventBackend.hpp"
+
+#include "ClientLimiter.hpp"
+
+#include "UpstreamGroup.hpp"
+
+#include "ProxyCache.hpp"
+
+#include "Proxy.hpp"
+
+#include "CgiCache.hpp"
+
 #include "Location.hpp"
 
 #include "VirtualServer.hpp"
 
+#include "Metrics.hpp"
+
+#include "Multipart.hpp"
+
 #include "Request.hpp"
 
 #include "Response.hpp"
 
+#include "Hpack.hpp"
+
+#include "Http2Connection.hpp"
+
 #include "Client.hpp"
 
 #include "Server.hpp"
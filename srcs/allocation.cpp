@@ -0,0 +1,19 @@
+#include "../includes/webserv.hpp"
+
+static unsigned long allocationCount = 0;
+
+unsigned long getAllocationCount() { return allocationCount; }
+
+static void* countedAllocate(size_t size) {
+	++allocationCount;
+	void* p = std::malloc(size ? size : 1);
+	if (!p) {
+		throw std::bad_alloc();
+	}
+	return p;
+}
+
+void* operator new(size_t size) { return countedAllocate(size); }
+void* operator new[](size_t size) { return countedAllocate(size); }
+void operator delete(void* p) throw() { std::free(p); }
+void operator delete[](void* p) throw() { std::free(p); }
@@ -0,0 +1,77 @@
+#include "../includes/webserv.hpp"
+
+static std::map<std::string, AutoIndexListing> autoIndexCache;
+
+static bool isSameTime(const struct timespec& a, const struct timespec& b) {
+	return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static bool listDirectory(const std::string& path, std::vector<std::string>& entries) {
+	DIR* dir = opendir(path.c_str());
+	if (!dir) {
+		return false;
+	}
+	struct dirent* entry;
+	while ((entry = readdir(dir))) {
+		if (std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0) {
+			continue;
+		}
+		entries.push_back(std::string(entry->d_name) + (entry->d_type == DT_DIR ? "/" : ""));
+	}
+	closedir(dir);
+	std::sort(entries.begin(), entries.end());
+	return true;
+}
+
+// rendered pages are dropped with their listing, responses still sending one keep it alive
+void releaseAutoIndexPages(AutoIndexListing& listing) {
+	for (std::map<std::pair<bool, size_t>, SharedBuffer*>::iterator it = listing.pages.begin();
+		 it != listing.pages.end(); ++it) {
+		it->second->release();
+	}
+	listing.pages.clear();
+}
+
+static void eraseAutoIndexListing(std::map<std::string, AutoIndexListing>::iterator it) {
+	releaseAutoIndexPages(it->second);
+	autoIndexCache.erase(it);
+}
+
+static void evictAutoIndexListing() {
+	std::map<std::string, AutoIndexListing>::iterator oldest = autoIndexCache.begin();
+	for (std::map<std::string, AutoIndexListing>::iterator it = autoIndexCache.begin();
+		 it != autoIndexCache.end(); ++it) {
+		if (it->second.lastUsed < oldest->second.lastUsed) {
+			oldest = it;
+		}
+	}
+	eraseAutoIndexListing(oldest);
+}
+
+AutoIndexListing* findAutoIndexListing(const std::string& path) {
+	struct stat buf;
+	if (stat(path.c_str(), &buf) != 0 || !S_ISDIR(buf.st_mode)) {
+		return NULL;
+	}
+	std::map<std::string, AutoIndexListing>::iterator it = autoIndexCache.find(path);
+	if (it != autoIndexCache.end() && isSameTime(it->second.mtime, buf.st_mtim)) {
+		it->second.lastUsed = std::time(NULL);
+		return &it->second;
+	}
+	AutoIndexListing listing;
+	listing.mtime = buf.st_mtim;
+	listing.lastUsed = std::time(NULL);
+	if (!listDirectory(path, listing.entries)) {
+		return NULL;
+	}
+	if (it != autoIndexCache.end()) {
+		eraseAutoIndexListing(it);
+	} else if (autoIndexCache.size() >= AUTOINDEX_CACHE_SIZE) {
+		evictAutoIndexListing();
+	}
+	AutoIndexListing& cached = autoIndexCache[path];
+	cached.mtime = listing.mtime;
+	cached.lastUsed = listing.lastUsed;
+	cached.entries.swap(listing.entries);
+	return &cached;
+}
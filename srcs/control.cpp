@@ -1,6 +1,19 @@
 #include "../includes/webserv.hpp"
 
 extern bool run;
+extern bool reopenLogs;
+extern bool upgradeBinary;
+extern bool drainConnections;
+
+void drainSignalHandler(int signum) {
+	(void)signum;
+	drainConnections = true;
+}
+
+void reopenSignalHandler(int signum) {
+	(void)signum;
+	reopenLogs = true;
+}
 
 void signalHandler(int signum) {
 	(void)signum;
@@ -19,3 +32,8 @@ void syscallEpoll(int epollFd, int operation, int eventFd, int flags, const char
 	event.events = flags;
 	syscall(epoll_ctl(epollFd, operation, eventFd, &event), opName);
 }
+
+void upgradeSignalHandler(int signum) {
+	(void)signum;
+	upgradeBinary = true;
+}
@@ -0,0 +1,17 @@
+#include "../includes/webserv.hpp"
+
+static std::map<StatusCode, ErrorPage> defaultErrorPages;
+
+ErrorPage* findDefaultErrorPage(StatusCode statusCode) {
+	std::map<StatusCode, ErrorPage>::iterator it = defaultErrorPages.find(statusCode);
+	return it == defaultErrorPages.end() ? NULL : &it->second;
+}
+
+void renderDefaultErrorPages() {
+	for (std::map<StatusCode, std::string>::const_iterator it = STATUS_MESSAGES.begin();
+		 it != STATUS_MESSAGES.end(); ++it) {
+		if (it->first >= STATUS_MULTIPLE_CHOICES) {
+			defaultErrorPages[it->first].render(it->first, "", "");
+		}
+	}
+}
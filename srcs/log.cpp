@@ -0,0 +1,74 @@
+#include "../includes/webserv.hpp"
+
+extern Metrics metrics;
+
+static LogFile* errorLog = NULL;
+
+void flushErrorLog() {
+	if (errorLog != NULL) {
+		errorLog->flush();
+	}
+}
+
+std::string getLogTime() {
+	static time_t cachedTime = 0;
+	static std::string cachedString;
+	std::time_t t = std::time(0);
+	if (t != cachedTime) {
+		char buffer[64];
+		std::strftime(buffer, sizeof(buffer), "%d/%b/%Y:%H:%M:%S %z", std::localtime(&t));
+		cachedTime = t;
+		cachedString = buffer;
+	}
+	return cachedString;
+}
+
+void logError(const std::string& message) {
+	if (errorLog == NULL) {
+		std::cerr << RED << message << RESET << '\n';
+	} else {
+		errorLog->write("[" + getLogTime() + "] " + message + '\n');
+	}
+}
+
+void countDroppedLogBytes(size_t bytes) { metrics.logBytesDropped(bytes); }
+
+// the writer keeps only the pipe and the file open, so connections closed by the
+// server are not held open by it
+void runLogWriter(int pipeFd, int fileFd) {
+	std::signal(SIGINT, SIG_IGN);
+	std::signal(SIGQUIT, SIG_IGN);
+	std::signal(SIGUSR1, SIG_IGN);
+	std::signal(SIGUSR2, SIG_IGN);
+	dup2(pipeFd, STDIN_FILENO);
+	dup2(fileFd, STDOUT_FILENO);
+	syscall(SYS_close_range, STDERR_FILENO + 1, ~0U, 0);
+	char buffer[BUFFER_SIZE];
+	unsigned long dropped = 0;
+	int error = 0;
+	for (ssize_t received; (received = read(STDIN_FILENO, buffer, BUFFER_SIZE)) != 0;) {
+		if (received < 0 && errno == EINTR) {
+			continue;
+		} else if (received < 0) {
+			break;
+		}
+		for (ssize_t written = 0; written < received;) {
+			ssize_t ret = write(STDOUT_FILENO, buffer + written, received - written);
+			if (ret < 0 && errno == EINTR) {
+				continue;
+			} else if (ret <= 0) {
+				dropped += received - written;
+				error = errno;
+				break;
+			}
+			written += ret;
+		}
+	}
+	if (dropped != 0) {
+		std::cerr << "log writer: " << dropped << " bytes dropped: " << std::strerror(error)
+				  << '\n';
+	}
+	_exit(EXIT_SUCCESS);
+}
+
+void setErrorLog(LogFile* logFile) { errorLog = logFile; }
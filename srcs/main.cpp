@@ -1,12 +1,19 @@
 #include "../includes/webserv.hpp"
 
 bool run = true;
+bool reopenLogs = false;
+bool upgradeBinary = false;
+bool drainConnections = false;
 const std::map<StatusCode, std::string> STATUS_MESSAGES;
 const std::map<std::string, std::string> MIME_TYPES;
 const std::set<std::string> CGI_NO_TRANSMISSION;
+Metrics metrics;
 
 int main(int argc, char* argv[]) {
 	std::signal(SIGINT, signalHandler);
+	std::signal(SIGUSR1, reopenSignalHandler);
+	std::signal(SIGUSR2, upgradeSignalHandler);
+	std::signal(SIGQUIT, drainSignalHandler);
 	const char* conf = argc == 2 ? argv[1] : "conf/valid/everything.conf";
 	if (argc > 2 || !endswith(conf, ".conf")) {
 		std::cerr << "Usage: " << argv[0] << " [filename.conf]\n";
@@ -15,7 +22,7 @@ int main(int argc, char* argv[]) {
 	initGlobals();
 	Server server;
 	try {
-		if (!server.init(conf)) {
+		if (!server.init(conf, argv)) {
 			return EXIT_FAILURE;
 		}
 		std::cout << BLUE << "Press Ctrl+C to exit." << RESET << '\n';
@@ -14,19 +14,67 @@ bool parseDirectory(std::istringstream& iss, std::string& root, const std::strin
 }
 
 bool parseAutoIndex(std::istringstream& iss, bool& autoIndex) {
+	return parseSwitch(iss, autoIndex, "autoindex");
+}
+
+bool parseSwitch(std::istringstream& iss, bool& enabled, const std::string& keyword) {
 	std::string value;
 	if (!(iss >> value)) {
-		return configFileError("missing information after autoindex keyword");
+		return configFileError("missing information after " + keyword + " keyword");
 	}
 	if (value == "on") {
-		autoIndex = true;
+		enabled = true;
 	} else if (value == "off") {
-		autoIndex = false;
+		enabled = false;
 	} else {
-		return configFileError("invalid value for autoindex keyword: " + value);
+		return configFileError("invalid value for " + keyword + " keyword: " + value);
 	}
 	if (iss >> value) {
-		return configFileError("too many arguments after autoindex keyword");
+		return configFileError("too many arguments after " + keyword + " keyword");
+	}
+	return true;
+}
+
+bool parseByteSize(const std::string& value, size_t& size) {
+	size_t idx = value.find_first_not_of("0123456789");
+	if (idx == 0 || value.size() > 10) {
+		return false;
+	}
+	size = std::strtoul(value.c_str(), NULL, 10);
+	if (idx == std::string::npos) {
+		return true;
+	}
+	if (idx + 1 != value.size()) {
+		return false;
+	}
+	switch (std::tolower(value[idx])) {
+	case 'k':
+		size <<= 10;
+		return true;
+	case 'm':
+		size <<= 20;
+		return true;
+	}
+	return false;
+}
+
+bool parseDuration(const std::string& value, unsigned long& milliseconds) {
+	size_t idx = value.find_first_not_of("0123456789");
+	if (idx == 0 || value.size() > 10) {
+		return false;
+	}
+	milliseconds = std::strtoul(value.c_str(), NULL, 10);
+	const std::string unit = idx == std::string::npos ? "s" : value.substr(idx);
+	if (unit == "ms") {
+		return true;
+	} else if (unit == "s") {
+		milliseconds *= 1000;
+	} else if (unit == "m") {
+		milliseconds *= 60 * 1000;
+	} else if (unit == "h") {
+		milliseconds *= 60 * 60 * 1000;
+	} else {
+		return false;
 	}
 	return true;
 }
@@ -118,6 +166,68 @@ bool parseIndex(std::istringstream& iss, std::vector<std::string>& indexPages) {
 	return true;
 }
 
+bool parseLogParameters(std::istringstream& iss, LogConfig& config, const std::string& keyword,
+						bool allowFormat) {
+	std::string value;
+	config.format = DEFAULT_LOG_FORMAT;
+	config.bufferSize = LOG_BUFFER_SIZE;
+	config.flushInterval = LOG_FLUSH_INTERVAL;
+	for (bool first = true; iss >> value; first = false) {
+		if (startswith(value, "buffer=")) {
+			if (!parseByteSize(value.substr(7), config.bufferSize) || config.bufferSize == 0) {
+				return configFileError("invalid buffer size in " + keyword + ": " + value);
+			}
+		} else if (startswith(value, "flush=")) {
+			if (!parseDuration(value.substr(6), config.flushInterval)) {
+				return configFileError("invalid flush time in " + keyword + ": " + value);
+			}
+		} else if (allowFormat && first) {
+			config.format = value;
+		} else {
+			return configFileError("invalid parameter in " + keyword + ": " + value);
+		}
+	}
+	return true;
+}
+
+// single byte ranges only: anything else is ignored and the whole file is sent
+bool parseRange(const char* range, size_t size, size_t& start, size_t& end) {
+	if (std::strncmp(range, "bytes=", 6) != 0 || std::strchr(range, ',') != NULL) {
+		return true;
+	}
+	const char* p = range + 6;
+	char* next;
+	if (*p == '-') {
+		const unsigned long suffix = std::strtoul(p + 1, &next, 10);
+		if (next == p + 1 || *next != '\0') {
+			return true;
+		}
+		if (suffix == 0 || size == 0) {
+			return false;
+		}
+		start = size - std::min<size_t>(suffix, size);
+		return true;
+	}
+	const unsigned long first = std::strtoul(p, &next, 10);
+	if (next == p || *next != '-') {
+		return true;
+	}
+	p = next + 1;
+	unsigned long last = size == 0 ? 0 : size - 1;
+	if (*p != '\0') {
+		last = std::strtoul(p, &next, 10);
+		if (next == p || *next != '\0' || last < first) {
+			return true;
+		}
+	}
+	if (first >= size) {
+		return false;
+	}
+	start = first;
+	end = std::min<size_t>(last + 1, size);
+	return true;
+}
+
 bool parseReturn(std::istringstream& iss, std::pair<long, std::string>& redirection) {
 	std::string value;
 	if (redirection.first != -1) {
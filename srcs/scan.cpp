@@ -0,0 +1,240 @@
+#include "../includes/webserv.hpp"
+
+#ifdef __SSE2__
+#include <immintrin.h>
+#endif
+
+// Every kernel handles whole vectors first and leaves the tail to the scalar loop, which
+// is also the only path on targets without SSE2. AVX2 is compiled per function and only
+// chosen when configured and the cpu reports it, its kernels clear the upper halves before
+// handing the tail to the SSE2 ones since legacy SSE code pays for dirty ymm registers.
+
+static size_t scanPrintableScalar(const char* s, size_t i, size_t n) {
+	while (i < n && std::isprint(static_cast<unsigned char>(s[i]))) {
+		++i;
+	}
+	return i;
+}
+
+static size_t findEitherByteScalar(const char* s, size_t i, size_t n, char a, char b) {
+	while (i < n && s[i] != a && s[i] != b) {
+		++i;
+	}
+	return i;
+}
+
+static size_t findDotDotScalar(const char* s, size_t i, size_t n) {
+	for (; i + 1 < n; ++i) {
+		if (s[i] == '.' && s[i + 1] == '.') {
+			return i;
+		}
+	}
+	return n;
+}
+
+static void lowercaseAsciiScalar(char* dst, const char* src, size_t i, size_t n) {
+	for (; i < n; ++i) {
+		dst[i] = src[i] >= 'A' && src[i] <= 'Z' ? src[i] + ('a' - 'A') : src[i];
+	}
+}
+
+#ifdef __SSE2__
+
+// printable is 0x20 to 0x7e, a signed compare also rejects every byte above 0x7f
+static size_t scanPrintableSse2(const char* s, size_t n) {
+	const __m128i space = _mm_set1_epi8(0x1f);
+	const __m128i del = _mm_set1_epi8(0x7f);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+		const __m128i valid =
+			_mm_andnot_si128(_mm_cmpeq_epi8(v, del), _mm_cmpgt_epi8(v, space));
+		const int invalid = ~_mm_movemask_epi8(valid) & 0xffff;
+		if (invalid != 0) {
+			return i + __builtin_ctz(invalid);
+		}
+	}
+	return scanPrintableScalar(s, i, n);
+}
+
+static size_t findEitherByteSse2(const char* s, size_t n, char a, char b) {
+	const __m128i va = _mm_set1_epi8(a);
+	const __m128i vb = _mm_set1_epi8(b);
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+		const int found =
+			_mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(v, va), _mm_cmpeq_epi8(v, vb)));
+		if (found != 0) {
+			return i + __builtin_ctz(found);
+		}
+	}
+	return findEitherByteScalar(s, i, n, a, b);
+}
+
+static size_t findDotDotSse2(const char* s, size_t n) {
+	const __m128i dot = _mm_set1_epi8('.');
+	size_t i = 0;
+	for (; i + 17 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i));
+		const __m128i next = _mm_loadu_si128(reinterpret_cast<const __m128i*>(s + i + 1));
+		const int found =
+			_mm_movemask_epi8(_mm_and_si128(_mm_cmpeq_epi8(v, dot), _mm_cmpeq_epi8(next, dot)));
+		if (found != 0) {
+			return i + __builtin_ctz(found);
+		}
+	}
+	return findDotDotScalar(s, i, n);
+}
+
+static void lowercaseAsciiSse2(char* dst, const char* src, size_t n) {
+	const __m128i beforeA = _mm_set1_epi8('A' - 1);
+	const __m128i afterZ = _mm_set1_epi8('Z' + 1);
+	const __m128i offset = _mm_set1_epi8('a' - 'A');
+	size_t i = 0;
+	for (; i + 16 <= n; i += 16) {
+		const __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src + i));
+		const __m128i upper =
+			_mm_and_si128(_mm_cmpgt_epi8(v, beforeA), _mm_cmplt_epi8(v, afterZ));
+		_mm_storeu_si128(reinterpret_cast<__m128i*>(dst + i),
+						 _mm_add_epi8(v, _mm_and_si128(upper, offset)));
+	}
+	lowercaseAsciiScalar(dst, src, i, n);
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+AVX2 static size_t scanPrintableAvx2(const char* s, size_t n) {
+	const __m256i space = _mm256_set1_epi8(0x1f);
+	const __m256i del = _mm256_set1_epi8(0x7f);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+		const __m256i valid =
+			_mm256_andnot_si256(_mm256_cmpeq_epi8(v, del), _mm256_cmpgt_epi8(v, space));
+		const unsigned invalid = ~static_cast<unsigned>(_mm256_movemask_epi8(valid));
+		if (invalid != 0) {
+			return i + __builtin_ctz(invalid);
+		}
+	}
+	_mm256_zeroupper();
+	return i + scanPrintableSse2(s + i, n - i);
+}
+
+AVX2 static size_t findEitherByteAvx2(const char* s, size_t n, char a, char b) {
+	const __m256i va = _mm256_set1_epi8(a);
+	const __m256i vb = _mm256_set1_epi8(b);
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+		const unsigned found = _mm256_movemask_epi8(
+			_mm256_or_si256(_mm256_cmpeq_epi8(v, va), _mm256_cmpeq_epi8(v, vb)));
+		if (found != 0) {
+			return i + __builtin_ctz(found);
+		}
+	}
+	_mm256_zeroupper();
+	return i + findEitherByteSse2(s + i, n - i, a, b);
+}
+
+AVX2 static size_t findDotDotAvx2(const char* s, size_t n) {
+	const __m256i dot = _mm256_set1_epi8('.');
+	size_t i = 0;
+	for (; i + 33 <= n; i += 32) {
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i));
+		const __m256i next = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(s + i + 1));
+		const unsigned found = _mm256_movemask_epi8(
+			_mm256_and_si256(_mm256_cmpeq_epi8(v, dot), _mm256_cmpeq_epi8(next, dot)));
+		if (found != 0) {
+			return i + __builtin_ctz(found);
+		}
+	}
+	_mm256_zeroupper();
+	return i + findDotDotSse2(s + i, n - i);
+}
+
+AVX2 static void lowercaseAsciiAvx2(char* dst, const char* src, size_t n) {
+	const __m256i beforeA = _mm256_set1_epi8('A' - 1);
+	const __m256i afterZ = _mm256_set1_epi8('Z' + 1);
+	const __m256i offset = _mm256_set1_epi8('a' - 'A');
+	size_t i = 0;
+	for (; i + 32 <= n; i += 32) {
+		const __m256i v = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src + i));
+		const __m256i upper =
+			_mm256_and_si256(_mm256_cmpgt_epi8(v, beforeA), _mm256_cmpgt_epi8(afterZ, v));
+		_mm256_storeu_si256(reinterpret_cast<__m256i*>(dst + i),
+							_mm256_add_epi8(v, _mm256_and_si256(upper, offset)));
+	}
+	_mm256_zeroupper();
+	lowercaseAsciiSse2(dst + i, src + i, n - i);
+}
+
+static SimdLevelEnum detectSimdLevel() {
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2") ? SIMD_AVX2 : SIMD_SSE2;
+}
+
+#else
+
+static SimdLevelEnum detectSimdLevel() { return SIMD_SCALAR; }
+
+#endif
+
+static const SimdLevelEnum supportedLevel = detectSimdLevel();
+static SimdLevelEnum simdLevel = std::min(supportedLevel, SIMD_SSE2);
+
+// the widest level the cpu supports
+SimdLevelEnum getSupportedSimdLevel() { return supportedLevel; }
+
+// SSE2 unless the simd directive asks for AVX2, whose gain depends on the cpu; also
+// changed by the benchmarks to compare kernels
+SimdLevelEnum& getSimdLevel() { return simdLevel; }
+
+// the dispatchers keep inputs shorter than a vector on the scalar loop
+
+// length of the leading run of printable bytes
+size_t scanPrintable(const char* s, size_t n) {
+#ifdef __SSE2__
+	if (n >= 16 && simdLevel == SIMD_AVX2) {
+		return scanPrintableAvx2(s, n);
+	} else if (n >= 16 && simdLevel == SIMD_SSE2) {
+		return scanPrintableSse2(s, n);
+	}
+#endif
+	return scanPrintableScalar(s, 0, n);
+}
+
+// index of the first a or b, n when there is none
+size_t findEitherByte(const char* s, size_t n, char a, char b) {
+#ifdef __SSE2__
+	if (n >= 16 && simdLevel == SIMD_AVX2) {
+		return findEitherByteAvx2(s, n, a, b);
+	} else if (n >= 16 && simdLevel == SIMD_SSE2) {
+		return findEitherByteSse2(s, n, a, b);
+	}
+#endif
+	return findEitherByteScalar(s, 0, n, a, b);
+}
+
+// index of the first "..", n when there is none
+size_t findDotDot(const char* s, size_t n) {
+#ifdef __SSE2__
+	if (n >= 16 && simdLevel == SIMD_AVX2) {
+		return findDotDotAvx2(s, n);
+	} else if (n >= 16 && simdLevel == SIMD_SSE2) {
+		return findDotDotSse2(s, n);
+	}
+#endif
+	return findDotDotScalar(s, 0, n);
+}
+
+void lowercaseAscii(char* dst, const char* src, size_t n) {
+#ifdef __SSE2__
+	if (n >= 16 && simdLevel == SIMD_AVX2) {
+		return lowercaseAsciiAvx2(dst, src, n);
+	} else if (n >= 16 && simdLevel == SIMD_SSE2) {
+		return lowercaseAsciiSse2(dst, src, n);
+	}
+#endif
+	lowercaseAsciiScalar(dst, src, 0, n);
+}
@@ -1,7 +1,9 @@
 #include "../includes/webserv.hpp"
 
 int comparePrefix(const std::string& locationUri, const std::string& requestPath) {
-	if (requestPath + "/" == locationUri) {
+	if (locationUri.size() == requestPath.size() + 1 &&
+		locationUri[requestPath.size()] == '/' &&
+		!locationUri.compare(0, requestPath.size(), requestPath)) {
 		return locationUri.size();
 	}
 	return startswith(requestPath, locationUri) ? locationUri.size() : 0;
@@ -16,26 +18,44 @@ static char from_hex(char ch) { return isdigit(ch) ? ch - '0' : tolower(ch) - 'a
 
 std::string decodeUri(const std::string& uri) {
 	std::string decoded;
-	for (std::string::const_iterator i = uri.begin(), end = uri.end(); i != end; ++i) {
-		if (int(*i) == '%') {
-			if (i + 2 >= end) {
+	decoded.reserve(uri.size());
+	for (size_t i = 0; i < uri.size(); ++i) {
+		const size_t run = findEitherByte(uri.data() + i, uri.size() - i, '%', '+');
+		decoded.append(uri, i, run);
+		i += run;
+		if (i == uri.size()) {
+			break;
+		} else if (uri[i] == '%') {
+			if (i + 2 >= uri.size()) {
 				throw std::runtime_error(
 					"Invalid URI encoding: not enough characters after a '%' symbol.");
 			}
-			char ch1 = *(i + 1);
-			char ch2 = *(i + 2);
-			char ch = from_hex(ch1) << 4 | from_hex(ch2);
-			decoded += ch;
+			decoded += static_cast<char>(from_hex(uri[i + 1]) << 4 | from_hex(uri[i + 2]));
 			i += 2;
-		} else if (*i == '+') {
-			decoded += ' ';
 		} else {
-			decoded += *i;
+			decoded += ' ';
 		}
 	}
 	return decoded;
 }
 
+std::string encodeUri(const std::string& uri) {
+	static const char hex[] = "0123456789ABCDEF";
+	std::string encoded;
+	encoded.reserve(uri.size());
+	for (std::string::const_iterator i = uri.begin(), end = uri.end(); i != end; ++i) {
+		const unsigned char ch = *i;
+		if (std::isalnum(ch) || (ch != '\0' && std::strchr("-._~/!$&'()*,;=:@", ch))) {
+			encoded += ch;
+		} else {
+			encoded += '%';
+			encoded += hex[ch >> 4];
+			encoded += hex[ch & 15];
+		}
+	}
+	return encoded;
+}
+
 bool doesRegexMatch(const char* regexStr, const char* matchStr) {
 	regex_t regex;
 	if (regcomp(&regex, regexStr, REG_EXTENDED) != 0) {
@@ -50,6 +70,25 @@ bool endswith(const std::string& str, const std::string& end) {
 	return str.size() >= end.size() && !str.compare(str.size() - end.size(), end.size(), end);
 }
 
+std::string escapeJson(const std::string& s) {
+	std::string res;
+	for (size_t i = 0; i < s.size(); ++i) {
+		const unsigned char c = s[i];
+		if (c == '"' || c == '\\') {
+			res += '\\';
+			res += c;
+		} else if (c < 0x20) {
+			const char* hex = "0123456789abcdef";
+			res += "\\u00";
+			res += hex[c >> 4];
+			res += hex[c & 0xF];
+		} else {
+			res += c;
+		}
+	}
+	return res;
+}
+
 const std::string* findCommonString(const std::vector<std::string>& vec1,
 									const std::vector<std::string>& vec2) {
 	std::set<std::string> set1(vec1.begin(), vec1.end());
@@ -61,22 +100,21 @@ const std::string* findCommonString(const std::vector<std::string>& vec1,
 	return NULL;
 }
 
-std::string findFinalUri(const std::string& uri, std::string rootDir, Location* location) {
-	if (rootDir[rootDir.size() - 1] == '/') {
-		rootDir = rootDir.substr(0, rootDir.size() - 1);
-	}
-	if (!location) {
-		return "." + rootDir + uri;
-	}
-	LocationModifierEnum modifier = location->getModifier();
-	std::string locationUri = location->getUri();
-	if (modifier == DIRECTORY) {
-		return "." + rootDir + uri.substr(locationUri.size() - 1);
-	} else if (modifier == REGEX) {
-		return "." + rootDir + uri;
+std::string findFinalUri(const std::string& uri, const std::string& rootDir, Location* location) {
+	const size_t rootSize = rootDir.size() - (rootDir[rootDir.size() - 1] == '/');
+	std::string finalUri;
+	finalUri.reserve(rootSize + uri.size() + 2);
+	finalUri += '.';
+	finalUri.append(rootDir, 0, rootSize);
+	if (!location || location->getModifier() == REGEX) {
+		finalUri += uri;
+	} else if (location->getModifier() == DIRECTORY) {
+		finalUri.append(uri, location->getUri().size() - 1, std::string::npos);
 	} else {
-		return "." + rootDir + "/" + getBasename(uri);
+		finalUri += '/';
+		finalUri += getBasename(uri);
 	}
+	return finalUri;
 }
 
 std::string fullRead(int fd) {
@@ -104,12 +142,17 @@ std::string getAbsolutePath(const std::string& path) {
 
 std::string getBasename(const std::string& path) { return path.substr(path.find_last_of("/") + 1); }
 
-std::string getDate() {
+const std::string& getDate() {
+	static time_t cachedTime = 0;
+	static std::string cachedString;
 	std::time_t t = std::time(0);
-	std::tm* now = std::localtime(&t);
-	char buffer[256];
-	std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", now);
-	return std::string(buffer);
+	if (t != cachedTime) {
+		char buffer[256];
+		std::strftime(buffer, sizeof(buffer), "%a, %d %b %Y %H:%M:%S GMT", std::localtime(&t));
+		cachedTime = t;
+		cachedString = buffer;
+	}
+	return cachedString;
 }
 
 int getExitCode(pid_t pid) {
@@ -170,6 +213,32 @@ bool getIpValue(std::string ip, uint32_t& res) {
 	return true;
 }
 
+unsigned long getMicroseconds() {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000UL + ts.tv_nsec / 1000;
+}
+
+std::string getQueryParameter(const std::string& query, const std::string& key) {
+	size_t start = 0;
+	while (start <= query.size()) {
+		size_t end = query.find('&', start);
+		if (end == std::string::npos) {
+			end = query.size();
+		}
+		const size_t equal = query.find('=', start);
+		if (equal < end && query.compare(start, equal - start, key) == 0) {
+			try {
+				return decodeUri(query.substr(equal + 1, end - equal - 1));
+			} catch (const std::runtime_error& e) {
+				return "";
+			}
+		}
+		start = end + 1;
+	}
+	return "";
+}
+
 void initAllowedMethods(bool allowedMethods[NO_METHOD]) {
 	std::fill_n(allowedMethods, NO_METHOD, false);
 	allowedMethods[GET] = true;
@@ -196,9 +265,7 @@ std::string metavariablify(const std::string& s) {
 	return res;
 }
 
-void perrored(const char* funcName) {
-	std::cerr << RED << funcName << ": " << strerror(errno) << RESET << '\n';
-}
+void perrored(const char* funcName) { logError(std::string(funcName) + ": " + strerror(errno)); }
 
 bool readContent(std::string& uri, std::string& content) {
 	if (isDirectory(uri)) {
@@ -243,9 +310,10 @@ std::string toString(RequestMethod method) {
 }
 
 bool validateUri(const std::string& uri, const std::string& keyword) {
-	return !uri.empty() && uri[0] == '/' && uri.find("..") == std::string::npos ? true
-		   : keyword.empty()													? false
-							 : configFileError("invalid path for " + keyword + ": " + uri);
+	if (!uri.empty() && uri[0] == '/' && findDotDot(uri.data(), uri.size()) == uri.size()) {
+		return true;
+	}
+	return keyword.empty() ? false : configFileError("invalid path for " + keyword + ": " + uri);
 }
 
 char** vectorToCharArray(const std::vector<std::string>& envec) {
@@ -0,0 +1,108 @@
+#include "webtest.hpp"
+
+#define CGI_OUTPUT "Content-Type: text/plain\r\n\r\n"
+
+static CgiCacheStatusEnum lookupStatus(CgiCache& cache, const std::string& key,
+									   const std::string& expected = "") {
+	CgiCacheStatusEnum status;
+	const std::string* output = cache.lookup(key, status);
+	if (output != NULL && !expected.empty() && *output != expected) {
+		return CGI_CACHE_MISS;
+	}
+	return status;
+}
+
+static void testCgiCacheStore() {
+	displayTitle("CGI CACHE STORE");
+	CgiCache cache;
+	cache.store("plain", CGI_OUTPUT "a", 60000, 0);
+	displayResult("hit", lookupStatus(cache, "plain", CGI_OUTPUT "a") == CGI_CACHE_HIT);
+	displayResult("miss", lookupStatus(cache, "other") == CGI_CACHE_MISS);
+	cache.store("cookie", "Set-Cookie: id=1\r\n" CGI_OUTPUT "a", 60000, 0);
+	displayResult("set-cookie not stored", lookupStatus(cache, "cookie") == CGI_CACHE_MISS);
+	cache.store("nostore", "Cache-Control: no-store\r\n" CGI_OUTPUT "a", 60000, 0);
+	displayResult("no-store not stored", lookupStatus(cache, "nostore") == CGI_CACHE_MISS);
+	cache.store("private", "cache-control: Private\r\n" CGI_OUTPUT "a", 60000, 0);
+	displayResult("private not stored", lookupStatus(cache, "private") == CGI_CACHE_MISS);
+	cache.store("status", "Status: 404 Not Found\r\n" CGI_OUTPUT "a", 60000, 0);
+	displayResult("error status not stored", lookupStatus(cache, "status") == CGI_CACHE_MISS);
+	cache.store("plain", "Set-Cookie: id=1\r\n" CGI_OUTPUT "b", 60000, 0);
+	displayResult("uncacheable output drops the entry",
+				  lookupStatus(cache, "plain") == CGI_CACHE_MISS);
+	cache.store("body", CGI_OUTPUT "Set-Cookie: id=1\r\n", 60000, 0);
+	displayResult("headers end at the blank line",
+				  lookupStatus(cache, "body") == CGI_CACHE_HIT);
+
+	cache.store("maxage", "Cache-Control: public, max-age=60\r\n" CGI_OUTPUT "a", 0, 0);
+	displayResult("max-age without a ttl", lookupStatus(cache, "maxage") == CGI_CACHE_HIT);
+	cache.store("zero", "Cache-Control: max-age=0\r\n" CGI_OUTPUT "a", 60000, 0);
+	displayResult("max-age=0 over a ttl", lookupStatus(cache, "zero") == CGI_CACHE_MISS);
+}
+
+// each entry is a few bytes under an eighth of the limit, the ninth one evicts
+static void testCgiCacheEviction() {
+	displayTitle("CGI CACHE EVICTION");
+	CgiCache cache;
+	cache.getLimit() = 800;
+	const std::string output = CGI_OUTPUT + std::string(60, 'x');
+	for (int i = 0; i < 8; ++i) {
+		cache.store("k" + toString(i), output, 60000, 0);
+	}
+	bool kept = true;
+	for (int i = 0; i < 8; ++i) {
+		kept = kept && lookupStatus(cache, "k" + toString(i)) == CGI_CACHE_HIT;
+	}
+	displayResult("entries within the limit", kept);
+	lookupStatus(cache, "k0");
+	cache.store("k8", output, 60000, 0);
+	displayResult("least recently used evicted", lookupStatus(cache, "k1") == CGI_CACHE_MISS);
+	displayResult("recently used kept", lookupStatus(cache, "k0") == CGI_CACHE_HIT &&
+											lookupStatus(cache, "k8") == CGI_CACHE_HIT);
+	cache.store("k2", output + "y", 60000, 0);
+	cache.store("k9", output, 60000, 0);
+	displayResult("replaced entry refreshed", lookupStatus(cache, "k2") == CGI_CACHE_HIT &&
+												  lookupStatus(cache, "k3") == CGI_CACHE_MISS);
+	cache.store("huge", CGI_OUTPUT + std::string(100, 'x'), 60000, 0);
+	displayResult("entry over an eighth not stored",
+				  lookupStatus(cache, "huge") == CGI_CACHE_MISS);
+}
+
+// a refresh is a child writing to a pipe, as the cgi runs started by Response are
+static void testCgiCacheStale() {
+	displayTitle("CGI CACHE STALE");
+	CgiCache cache;
+	cache.store("stale", CGI_OUTPUT "old", 50, 300);
+	usleep(80000);
+	displayResult("stale after the ttl", lookupStatus(cache, "stale") == CGI_CACHE_STALE);
+
+	EpollBackend backend;
+	EventBackend::getActive() = &backend;
+	int fds[2];
+	pipe(fds);
+	const pid_t pid = fork();
+	if (pid == 0) {
+		_exit(EXIT_SUCCESS);
+	}
+	cache.startRefresh("stale", pid, fds[0]);
+	displayResult("updating while refreshed",
+				  cache.isRefreshing(fds[0]) &&
+					  lookupStatus(cache, "stale", CGI_OUTPUT "old") == CGI_CACHE_UPDATING);
+	const std::string fresh = CGI_OUTPUT "new";
+	write(fds[1], fresh.data(), fresh.size());
+	close(fds[1]);
+	cache.handleRefresh(fds[0]);
+	displayResult("refreshed output stored",
+				  !cache.isRefreshing(fds[0]) &&
+					  lookupStatus(cache, "stale", fresh) == CGI_CACHE_HIT);
+	EventBackend::getActive() = NULL;
+
+	cache.store("gone", CGI_OUTPUT "old", 20, 30);
+	usleep(80000);
+	displayResult("miss after the stale window", lookupStatus(cache, "gone") == CGI_CACHE_MISS);
+}
+
+void testCgiCache() {
+	testCgiCacheStore();
+	testCgiCacheEviction();
+	testCgiCacheStale();
+}
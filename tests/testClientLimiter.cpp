@@ -0,0 +1,134 @@
+#include "webtest.hpp"
+
+#define LIMITS_CONF "conf/valid/limits.conf"
+#define LIMITED_PORT 8081
+#define LIMITED_CONNECTIONS 1
+
+static int connectTo(int port) {
+	struct sockaddr_in addr;
+	std::memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_port = htons(port);
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	for (int attempt = 0; attempt < 50; ++attempt) {
+		const int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+		if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)) == 0) {
+			return fd;
+		}
+		close(fd);
+		usleep(20000);
+	}
+	return -1;
+}
+
+// true when the server closed the connection within the timeout
+static bool isClosed(int fd, int timeout) {
+	struct pollfd pfd = {fd, POLLIN, 0};
+	char buffer[256];
+	while (poll(&pfd, 1, timeout) == 1) {
+		const ssize_t bytes = recv(fd, buffer, sizeof(buffer), 0);
+		if (bytes <= 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+// a server runs in a child process, the extra idle connection must be refused at accept
+static void testConnectionLimit() {
+	displayTitle("LIMIT CONN");
+	const pid_t pid = fork();
+	if (pid == 0) {
+		const int null = open("/dev/null", O_WRONLY);
+		dup2(null, STDOUT_FILENO);
+		dup2(null, STDERR_FILENO);
+		Server server;
+		if (server.init(LIMITS_CONF)) {
+			server.loop();
+		}
+		_exit(EXIT_SUCCESS);
+	}
+	std::vector<int> fds;
+	for (int i = 0; i <= LIMITED_CONNECTIONS; ++i) {
+		fds.push_back(connectTo(LIMITED_PORT));
+		usleep(50000);
+	}
+	bool kept = fds.front() != -1;
+	for (int i = 0; i < LIMITED_CONNECTIONS; ++i) {
+		kept = kept && fds[i] != -1 && !isClosed(fds[i], 200);
+	}
+	displayResult("idle connections within the limit", kept);
+	displayResult("idle connection over the limit",
+				  fds.back() != -1 && isClosed(fds.back(), 1000));
+	for (size_t i = 0; i < fds.size(); ++i) {
+		close(fds[i]);
+	}
+	usleep(100000);
+	const int again = connectTo(LIMITED_PORT);
+	displayResult("slot released on close", again != -1 && !isClosed(again, 200));
+	close(again);
+	kill(pid, SIGKILL);
+	waitpid(pid, NULL, 0);
+}
+
+static ClientLimiter makeLimiter(const std::string& arguments) {
+	ClientLimiter limiter;
+	std::istringstream iss(arguments);
+	limiter.parse("limit_req", iss);
+	return limiter;
+}
+
+// the delays of a request sent right after the previous ones, -1 once one is refused
+static std::vector<long> sendRequests(ClientLimiter& limiter, in_addr_t ip, int count) {
+	std::vector<long> delays;
+	for (int i = 0; i < count; ++i) {
+		unsigned long delay;
+		const StatusCode status = limiter.checkRequest(ip, delay);
+		delays.push_back(status == STATUS_NONE ? static_cast<long>(delay) : -1);
+	}
+	return delays;
+}
+
+// a delay is the time the excess takes to drain, give or take the millisecond elapsed
+static bool isDelay(long delay, long expected) {
+	return delay <= expected && delay + 10 >= expected;
+}
+
+// 10r/s drains one request of excess every 100ms, burst is how much excess is allowed
+static void testRequestLimit() {
+	displayTitle("LIMIT REQ");
+	const in_addr_t ip = htonl(INADDR_LOOPBACK);
+	ClientLimiter strict = makeLimiter("rate=10r/s");
+	std::vector<long> delays = sendRequests(strict, ip, 2);
+	displayResult("no burst", delays[0] == 0 && delays[1] == -1);
+
+	ClientLimiter delayed = makeLimiter("rate=10r/s burst=2");
+	delays = sendRequests(delayed, ip, 4);
+	displayResult("burst delays", delays[0] == 0 && isDelay(delays[1], 100) &&
+									  isDelay(delays[2], 200) && delays[3] == -1);
+	displayResult("other ips apart", sendRequests(delayed, htonl(INADDR_LOOPBACK + 1), 1)[0] == 0);
+	usleep(110000);
+	delays = sendRequests(delayed, ip, 2);
+	displayResult("excess drains at the rate",
+				  delays[0] > 0 && delays[0] < 200 && delays[1] == -1);
+
+	ClientLimiter nodelay = makeLimiter("rate=10r/s burst=2 nodelay");
+	delays = sendRequests(nodelay, ip, 4);
+	displayResult("nodelay", delays[0] == 0 && delays[1] == 0 && delays[2] == 0 && delays[3] == -1);
+
+	ClientLimiter perMinute = makeLimiter("rate=60r/m burst=1");
+	delays = sendRequests(perMinute, ip, 3);
+	displayResult("rate per minute", delays[0] == 0 && isDelay(delays[1], 1000) && delays[2] == -1);
+
+	ClientLimiter status = makeLimiter("rate=1r/s");
+	std::istringstream code("429");
+	status.parse("limit_req_status", code);
+	unsigned long delay;
+	status.checkRequest(ip, delay);
+	displayResult("limit_req_status", status.checkRequest(ip, delay) == STATUS_TOO_MANY_REQUESTS);
+}
+
+void testClientLimiter() {
+	testRequestLimit();
+	testConnectionLimit();
+}
@@ -0,0 +1,134 @@
+#include "webtest.hpp"
+
+static std::string fromHex(const std::string& hex) {
+	std::string bytes;
+	for (size_t i = 0; i + 1 < hex.size(); i += 2) {
+		bytes += static_cast<char>(std::strtol(hex.substr(i, 2).c_str(), NULL, 16));
+	}
+	return bytes;
+}
+
+static bool decodes(Hpack& hpack, const std::string& hex, const std::string& name = "",
+					const std::string& value = "") {
+	Hpack::HeaderList fields;
+	if (!hpack.decode(fromHex(hex), fields, MAX_HEADER_SIZE)) {
+		return false;
+	}
+	return name.empty() || (!fields.empty() && fields.back().first == name &&
+							fields.back().second == value);
+}
+
+static bool rejects(const std::string& hex) {
+	Hpack hpack;
+	return !decodes(hpack, hex);
+}
+
+static void testHuffman() {
+	displayTitle("HPACK HUFFMAN");
+	Hpack hpack;
+	displayResult("rfc 7541 c.4.1", decodes(hpack, "828684418cf1e3c2e5f23a6ba0ab90f4ff",
+											":authority", "www.example.com"));
+	Hpack padded;
+	displayResult("padding of ones", decodes(padded, "0081" "1f" "81" "1f", "a", "a"));
+	displayResult("padding of zeros", rejects("0081" "18" "81" "1f"));
+	displayResult("padding of 8 bits", rejects("0082" "1fff" "81" "1f"));
+	displayResult("padding alone of 8 bits", rejects("0081" "ff" "81" "1f"));
+	displayResult("eos symbol", rejects("0084" "ffffffff" "81" "1f"));
+}
+
+static void testDynamicTable() {
+	displayTitle("HPACK DYNAMIC TABLE");
+	Hpack hpack;
+	decodes(hpack, "828684418cf1e3c2e5f23a6ba0ab90f4ff");
+	displayResult("indexed entry", decodes(hpack, "be", ":authority", "www.example.com"));
+	displayResult("entry past the table", !decodes(hpack, "bf"));
+
+	Hpack small;
+	displayResult("size update", decodes(small, "3f21"));
+	decodes(small, "4001610162");
+	decodes(small, "4001630164");
+	displayResult("newest entry kept", decodes(small, "be", "c", "d"));
+	displayResult("oldest entry evicted", !decodes(small, "bf"));
+	displayResult("size update to zero", decodes(small, "20") && !decodes(small, "be"));
+	displayResult("entry larger than the table", decodes(small, "4001650166", "e", "f") &&
+													 !decodes(small, "be"));
+	displayResult("size update after a field", rejects("82" "20"));
+	displayResult("size update above the limit", rejects("3fe21f"));
+}
+
+static void testIntegers() {
+	displayTitle("HPACK INTEGERS");
+	displayResult("multi-byte index", rejects("ff8001"));
+	displayResult("truncated integer", rejects("ff80"));
+	displayResult("overflowing integer", rejects("ffffffffff0f"));
+	displayResult("overflowing string length", rejects("007fffffffff0f"));
+	displayResult("string past the block", rejects("0005616263"));
+	std::string block;
+	Hpack::encode("content-type", std::string(200, 'x'), block);
+	Hpack hpack;
+	Hpack::HeaderList fields;
+	displayResult("encoded long value",
+				  hpack.decode(block, fields, MAX_HEADER_SIZE) && fields.size() == 1 &&
+					  fields[0].first == "content-type" && fields[0].second.size() == 200);
+}
+
+static std::string frame(unsigned char type, unsigned char flags, uint32_t id,
+						 const std::string& payload) {
+	std::string out;
+	out += static_cast<char>(payload.size() >> 16);
+	out += static_cast<char>(payload.size() >> 8);
+	out += static_cast<char>(payload.size());
+	out += static_cast<char>(type);
+	out += static_cast<char>(flags);
+	for (int shift = 24; shift >= 0; shift -= 8) {
+		out += static_cast<char>(id >> shift);
+	}
+	return out + payload;
+}
+
+static bool receives(const std::string& frames, std::string& request) {
+	Http2Connection connection(MAX_HEADER_SIZE);
+	const std::string input = HTTP2_PREFACE + frame(HTTP2_SETTINGS, 0, 0, "") + frames;
+	uint32_t id;
+	return connection.receive(input.data(), input.size()) && connection.popRequest(id, request);
+}
+
+static void testContinuation() {
+	displayTitle("HPACK CONTINUATION");
+	const std::string block = fromHex("828684418cf1e3c2e5f23a6ba0ab90f4ff");
+	const std::string expected = "GET / " HTTP_VERSION "\r\nhost: www.example.com\r\n\r\n";
+	std::string request;
+	displayResult("single frame",
+				  receives(frame(HTTP2_HEADERS, HTTP2_FLAG_END_STREAM | HTTP2_FLAG_END_HEADERS,
+								 1, block),
+						   request) &&
+					  request == expected);
+	request.clear();
+	displayResult("split inside a string",
+				  receives(frame(HTTP2_HEADERS, HTTP2_FLAG_END_STREAM, 1, block.substr(0, 9)) +
+							   frame(HTTP2_CONTINUATION, 0, 1, block.substr(9, 4)) +
+							   frame(HTTP2_CONTINUATION, HTTP2_FLAG_END_HEADERS, 1,
+									 block.substr(13)),
+						   request) &&
+					  request == expected);
+	displayResult("continuation of another stream",
+				  !receives(frame(HTTP2_HEADERS, HTTP2_FLAG_END_STREAM, 1, block.substr(0, 9)) +
+								frame(HTTP2_CONTINUATION, HTTP2_FLAG_END_HEADERS, 3,
+									  block.substr(9)),
+							request));
+	displayResult("frame between continuations",
+				  !receives(frame(HTTP2_HEADERS, HTTP2_FLAG_END_STREAM, 1, block.substr(0, 9)) +
+								frame(HTTP2_PING, 0, 0, std::string(8, '\0')) +
+								frame(HTTP2_CONTINUATION, HTTP2_FLAG_END_HEADERS, 1,
+									  block.substr(9)),
+							request));
+	displayResult("continuation without headers",
+				  !receives(frame(HTTP2_CONTINUATION, HTTP2_FLAG_END_HEADERS, 1, block), request));
+}
+
+void testHpack() {
+	testHuffman();
+	testDynamicTable();
+	testIntegers();
+	testContinuation();
+}
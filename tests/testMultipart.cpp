@@ -0,0 +1,76 @@
+#include "webtest.hpp"
+
+#define BOUNDARY "XyZ"
+
+static std::string part(const std::string& fileName, const std::string& data) {
+	return "--" BOUNDARY "\r\ncontent-disposition: form-data; name=\"f\"; filename=\"" +
+		   fileName + "\"\r\n\r\n" + data + "\r\n";
+}
+
+static std::string readFile(const std::string& path) {
+	std::ifstream file(path.c_str(), std::ios::binary);
+	return std::string(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+}
+
+// feeds the body in pieces cut at the given offsets, then checks what the part became
+static bool uploads(const std::string& directory, const std::string& body,
+					const std::vector<size_t>& cuts, const std::string& expected,
+					size_t maxPartSize = 0) {
+	const std::string path = directory + "part";
+	std::remove(path.c_str());
+	StatusCode status = STATUS_NONE;
+	{
+		Multipart multipart(BOUNDARY, directory, maxPartSize);
+		size_t begin = 0;
+		for (size_t i = 0; i <= cuts.size() && status == STATUS_NONE; ++i) {
+			const size_t end = i < cuts.size() ? cuts[i] : body.size();
+			status = multipart.feed(body.data() + begin, end - begin);
+			begin = end;
+		}
+		if (status == STATUS_NONE) {
+			status = multipart.finish();
+		}
+	}
+	if (status != STATUS_NONE) {
+		return expected == toString(status) && access(path.c_str(), F_OK) != 0;
+	}
+	return readFile(path) == expected;
+}
+
+void testMultipart() {
+	char directory[] = "/tmp/webtestXXXXXX";
+	if (mkdtemp(directory) == NULL) {
+		std::cerr << "Cannot create a directory for testing multipart\n";
+		return;
+	}
+	const std::string dir = std::string(directory) + '/';
+	const std::string closing = "--" BOUNDARY "--\r\n";
+	const std::string body = part("part", "hello") + closing;
+	const std::string delimiter = "\r\n--" BOUNDARY;
+	const size_t split = body.find(delimiter, body.find("hello"));
+	std::vector<size_t> cuts;
+
+	displayTitle("MULTIPART");
+	displayResult("single feed", uploads(dir, body, cuts, "hello"));
+	cuts.push_back(split + 3);
+	displayResult("delimiter split across feeds", uploads(dir, body, cuts, "hello"));
+	cuts.clear();
+	for (size_t i = 1; i < body.size(); ++i) {
+		cuts.push_back(i);
+	}
+	displayResult("one byte per feed", uploads(dir, body, cuts, "hello"));
+	cuts.clear();
+	const std::string dashes = "a--b\r\n--\r\n--Xy--";
+	displayResult("dashes inside the data",
+				  uploads(dir, part("part", dashes) + closing, cuts, dashes));
+	cuts.push_back(split + 1);
+	displayResult("missing closing delimiter",
+				  uploads(dir, part("part", "hello"), cuts, toString(STATUS_BAD_REQUEST)));
+	displayResult("truncated closing delimiter",
+				  uploads(dir, body.substr(0, split + delimiter.size()), cuts,
+						  toString(STATUS_BAD_REQUEST)));
+	displayResult("part at the limit", uploads(dir, body, cuts, "hello", 5));
+	displayResult("part over the limit",
+				  uploads(dir, body, cuts, toString(STATUS_PAYLOAD_TOO_LARGE), 4));
+	rmdir(directory);
+}
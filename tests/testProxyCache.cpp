@@ -0,0 +1,126 @@
+#include "webtest.hpp"
+
+#include <dirent.h>
+
+// the index header and 8 slots of 40 bytes, keys then share probe chains
+#define SMALL_KEYS_ZONE "keys_zone=test:344"
+#define LARGE_KEYS_ZONE "keys_zone=test:384"
+// the low bits of an FNV-1a hash only depend on those of each byte, "aiqy" share a home
+// slot and wrap around the table, "c" and "f" then land past their own
+#define CACHED_KEYS "aiqycfb"
+#define CACHED_HEAD "x-test: 1\r\n\r\n"
+
+static bool openCache(ProxyCache& cache, const std::string& path, const std::string& zone) {
+	std::istringstream iss(zone);
+	return cache.parse(iss, path) && cache.open();
+}
+
+static void fill(ProxyCache& cache, const std::string& key) {
+	cache.lock(key);
+	const int fd = cache.openTemp(key);
+	const std::string data = CACHED_HEAD + key;
+	if (fd == -1 || write(fd, data.data(), data.size()) != static_cast<ssize_t>(data.size())) {
+		return cache.abort(key, fd);
+	}
+	cache.commit(key, fd, std::strlen(CACHED_HEAD), STATUS_OK, 60000);
+}
+
+static bool hits(ProxyCache& cache, const std::string& key) {
+	ProxyCache::Hit hit;
+	const ProxyCacheStatusEnum status = cache.lookup(key, hit);
+	if (status != PROXY_CACHE_HIT) {
+		return false;
+	}
+	close(hit.fd);
+	return hit.head == CACHED_HEAD && hit.bodyLength == key.size();
+}
+
+// the files of the cache directory, found by the key line they start with
+static std::map<std::string, std::string> listFiles(const std::string& directory) {
+	std::map<std::string, std::string> files;
+	DIR* dir = opendir(directory.c_str());
+	for (struct dirent* entry; dir != NULL && (entry = readdir(dir)) != NULL;) {
+		const std::string path = directory + "/" + entry->d_name;
+		std::ifstream file(path.c_str());
+		std::string line;
+		if (entry->d_name[0] != '.' && std::getline(file, line) && startswith(line, "KEY: ")) {
+			files[line.substr(5)] = path;
+		}
+	}
+	if (dir != NULL) {
+		closedir(dir);
+	}
+	return files;
+}
+
+static void removeDirectory(const std::string& directory) {
+	DIR* dir = opendir(directory.c_str());
+	for (struct dirent* entry; dir != NULL && (entry = readdir(dir)) != NULL;) {
+		if (entry->d_name[0] != '.') {
+			unlink((directory + "/" + entry->d_name).c_str());
+		}
+	}
+	if (dir != NULL) {
+		closedir(dir);
+	}
+	rmdir(directory.c_str());
+}
+
+// a key whose file is gone is erased on lookup, every other key must still be found
+// through the probe chains the backward shift rearranged
+static void testErase(const std::string& path) {
+	displayTitle("PROXY CACHE ERASE");
+	ProxyCache cache;
+	if (!openCache(cache, path, SMALL_KEYS_ZONE)) {
+		return displayResult("open", false);
+	}
+	std::vector<std::string> keys;
+	for (const char* c = CACHED_KEYS; *c != '\0'; ++c) {
+		keys.push_back(std::string("GET /") + *c);
+		fill(cache, keys.back());
+	}
+	bool found = true;
+	for (size_t i = 0; i < keys.size(); ++i) {
+		found = found && hits(cache, keys[i]);
+	}
+	displayResult("full chains", found);
+	const std::map<std::string, std::string> files = listFiles("." + path);
+	bool erased = files.size() == keys.size();
+	bool intact = true;
+	while (!keys.empty()) {
+		const std::string key = keys[keys.size() / 2];
+		keys.erase(keys.begin() + keys.size() / 2);
+		unlink(files.find(key)->second.c_str());
+		erased = erased && !hits(cache, key);
+		for (size_t i = 0; i < keys.size(); ++i) {
+			intact = intact && hits(cache, keys[i]);
+		}
+	}
+	displayResult("missing file erased", erased);
+	displayResult("chains intact after each erase", intact);
+}
+
+static void testReopen(const std::string& path) {
+	displayTitle("PROXY CACHE REOPEN");
+	{
+		ProxyCache cache;
+		openCache(cache, path, SMALL_KEYS_ZONE);
+		fill(cache, "GET /kept");
+	}
+	{
+		ProxyCache cache;
+		displayResult("index survives reopen",
+					  openCache(cache, path, SMALL_KEYS_ZONE) && hits(cache, "GET /kept"));
+	}
+	ProxyCache resized;
+	displayResult("resized index starts empty",
+				  openCache(resized, path, LARGE_KEYS_ZONE) && !hits(resized, "GET /kept"));
+}
+
+void testProxyCache() {
+	const std::string path = "/.webtest-cache-" + toString(getpid());
+	testErase(path);
+	removeDirectory("." + path);
+	testReopen(path);
+	removeDirectory("." + path);
+}
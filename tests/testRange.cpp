@@ -0,0 +1,33 @@
+#include "webtest.hpp"
+
+#define RANGE_FILE_SIZE 1000
+
+// "start-end" once parsed, "416" when unsatisfiable, the whole file when ignored
+static std::string range(const char* header, size_t size = RANGE_FILE_SIZE) {
+	size_t start = 0;
+	size_t end = size;
+	if (!parseRange(header, size, start, end)) {
+		return "416";
+	}
+	return toString(start) + "-" + toString(end);
+}
+
+void testRange() {
+	displayTitle("RANGE");
+	displayResult("closed range", range("bytes=0-99") == "0-100");
+	displayResult("single byte", range("bytes=999-999") == "999-1000");
+	displayResult("end past the file", range("bytes=500-2000") == "500-1000");
+	displayResult("open-ended", range("bytes=100-") == "100-1000");
+	displayResult("suffix", range("bytes=-100") == "900-1000");
+	displayResult("suffix longer than the file", range("bytes=-2000") == "0-1000");
+	displayResult("start past the file", range("bytes=1000-") == "416");
+	displayResult("closed range past the file", range("bytes=1000-1999") == "416");
+	displayResult("empty suffix", range("bytes=-0") == "416");
+	displayResult("empty file", range("bytes=0-", 0) == "416" && range("bytes=-1", 0) == "416");
+	displayResult("last before first ignored", range("bytes=5-1") == "0-1000");
+	displayResult("several ranges ignored", range("bytes=0-1,5-6") == "0-1000");
+	displayResult("other unit ignored", range("items=0-1") == "0-1000");
+	displayResult("malformed ignored", range("bytes=abc") == "0-1000" &&
+										   range("bytes=-") == "0-1000" &&
+										   range("bytes=1-2x") == "0-1000");
+}
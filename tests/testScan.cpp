@@ -0,0 +1,125 @@
+#include "webtest.hpp"
+
+#define SCAN_SEED 42
+#define SCAN_MAX_LENGTH 64
+#define SCAN_RANDOM_INPUTS 20
+
+typedef std::string (*ScanProbe)(const std::string&);
+
+// the kernels also run from the next few bytes, their loads then start unaligned
+static std::string probeScanPrintable(const std::string& s) {
+	std::string result;
+	for (size_t skip = 0; skip < 4 && skip <= s.size(); ++skip) {
+		result += toString(scanPrintable(s.data() + skip, s.size() - skip)) + ' ';
+	}
+	return result;
+}
+
+static std::string probeFindEitherByte(const std::string& s) {
+	std::string result;
+	for (size_t skip = 0; skip < 4 && skip <= s.size(); ++skip) {
+		result += toString(findEitherByte(s.data() + skip, s.size() - skip, '%', '+')) + ' ';
+	}
+	return result;
+}
+
+static std::string probeFindDotDot(const std::string& s) {
+	std::string result;
+	for (size_t skip = 0; skip < 4 && skip <= s.size(); ++skip) {
+		result += toString(findDotDot(s.data() + skip, s.size() - skip)) + ' ';
+	}
+	return result;
+}
+
+static std::string probeLowercaseAscii(const std::string& s) {
+	std::string result;
+	for (size_t skip = 0; skip < 4 && skip <= s.size(); ++skip) {
+		std::vector<char> lowered(s.size() + 1);
+		lowercaseAscii(&lowered[0], s.data() + skip, s.size() - skip);
+		result += std::string(&lowered[0], s.size() - skip) + ' ';
+	}
+	return result;
+}
+
+static std::string probeDecodeUri(const std::string& s) {
+	try {
+		return decodeUri(s);
+	} catch (const std::exception& e) {
+		return e.what();
+	}
+}
+
+static std::string probeValidateUri(const std::string& s) {
+	return validateUri('/' + s) ? "valid" : "invalid";
+}
+
+// every length around the 16 and 32 byte vectors, with each special byte, "..", or a
+// %-escape at every offset, then random bytes of the whole range and of a dense alphabet
+static std::vector<std::string> makeScanInputs() {
+	const char specials[] = {'.', '%', '+', '/', 'A', 'Z', '@', '[', 0x1f, 0x7f,
+							 static_cast<char>(0x80), static_cast<char>(0xff)};
+	const char dense[] = "aZ.%+/4\x80";
+	std::vector<std::string> inputs;
+	std::srand(SCAN_SEED);
+	for (size_t length = 0; length <= SCAN_MAX_LENGTH; ++length) {
+		const std::string plain(length, 'a');
+		inputs.push_back(plain);
+		for (size_t i = 0; i < length; ++i) {
+			for (size_t j = 0; j < sizeof(specials); ++j) {
+				inputs.push_back(plain);
+				inputs.back()[i] = specials[j];
+			}
+			if (i + 1 < length) {
+				inputs.push_back(plain);
+				inputs.back().replace(i, 2, "..");
+			}
+			if (i + 2 < length) {
+				inputs.push_back(plain);
+				inputs.back().replace(i, 3, "%4A");
+			}
+		}
+		for (int n = 0; n < SCAN_RANDOM_INPUTS; ++n) {
+			std::string any(length, '\0');
+			std::string close(length, '\0');
+			for (size_t i = 0; i < length; ++i) {
+				any[i] = static_cast<char>(std::rand() & 0xff);
+				close[i] = dense[std::rand() % (sizeof(dense) - 1)];
+			}
+			inputs.push_back(any);
+			inputs.push_back(close);
+		}
+	}
+	return inputs;
+}
+
+static bool matchesScalar(SimdLevelEnum level, ScanProbe probe,
+						  const std::vector<std::string>& inputs) {
+	const SimdLevelEnum configured = getSimdLevel();
+	bool same = true;
+	for (size_t i = 0; i < inputs.size() && same; ++i) {
+		getSimdLevel() = SIMD_SCALAR;
+		const std::string expected = probe(inputs[i]);
+		getSimdLevel() = level;
+		same = probe(inputs[i]) == expected;
+	}
+	getSimdLevel() = configured;
+	return same;
+}
+
+// each level the cpu has must give the results of the scalar loops
+void testScan() {
+	const char* const levels[] = {"scalar", "sse2", "avx2"};
+	const char* const names[] = {"scanPrintable", "findEitherByte", "findDotDot",
+								 "lowercaseAscii", "decodeUri", "validateUri"};
+	const ScanProbe probes[] = {probeScanPrintable, probeFindEitherByte, probeFindDotDot,
+								probeLowercaseAscii, probeDecodeUri, probeValidateUri};
+	const std::vector<std::string> inputs = makeScanInputs();
+
+	displayTitle("SIMD KERNELS");
+	for (int level = SIMD_SSE2; level <= getSupportedSimdLevel(); ++level) {
+		for (size_t i = 0; i < sizeof(probes) / sizeof(probes[0]); ++i) {
+			displayResult(std::string(levels[level]) + " " + names[i],
+						  matchesScalar(static_cast<SimdLevelEnum>(level), probes[i], inputs));
+		}
+	}
+}
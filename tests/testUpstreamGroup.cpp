@@ -0,0 +1,139 @@
+#include "webtest.hpp"
+
+#define HASH_KEYS 1000
+
+static bool makeGroup(UpstreamGroup& group, const std::string& block) {
+	std::istringstream config(block + "}\n");
+	return group.parse(config, "test");
+}
+
+// peers are told apart by the last digit of their port
+static char pick(UpstreamGroup& group, const std::string& key = "",
+				 const std::vector<UpstreamGroup::Peer*>& tried =
+					 std::vector<UpstreamGroup::Peer*>()) {
+	UpstreamGroup::Peer* peer = group.select(key, tried);
+	return peer ? '0' + ntohs(peer->address.sin_port) % 10 : '-';
+}
+
+static std::string picks(UpstreamGroup& group, size_t count) {
+	std::string sequence;
+	for (size_t i = 0; i < count; ++i) {
+		sequence += pick(group);
+	}
+	return sequence;
+}
+
+static void testRoundRobin() {
+	displayTitle("UPSTREAM ROUND ROBIN");
+	UpstreamGroup group;
+	makeGroup(group, "server 127.0.0.1:8001 weight=5\n"
+					 "server 127.0.0.1:8002\n"
+					 "server 127.0.0.1:8003\n");
+	displayResult("smooth weighted order", picks(group, 7) == "1121311");
+	const std::string sequence = picks(group, 700);
+	displayResult("weighted ratios", std::count(sequence.begin(), sequence.end(), '1') == 500 &&
+										 std::count(sequence.begin(), sequence.end(), '2') == 100);
+	UpstreamGroup even;
+	makeGroup(even, "server 127.0.0.1:8001\nserver 127.0.0.1:8002\n");
+	displayResult("equal weights alternate", picks(even, 4) == "1212");
+}
+
+static void testLeastConnections() {
+	displayTitle("UPSTREAM LEAST CONN");
+	UpstreamGroup group;
+	makeGroup(group, "least_conn\n"
+					 "server 127.0.0.1:8001\n"
+					 "server 127.0.0.1:8002\n"
+					 "server 127.0.0.1:8003\n");
+	const std::string ties = picks(group, 3);
+	displayResult("ties rotate", ties.find('1') != std::string::npos &&
+									 ties.find('2') != std::string::npos &&
+									 ties.find('3') != std::string::npos);
+	std::vector<UpstreamGroup::Peer*> none;
+	group.select("", none)->connections = 2;
+	group.select("", none)->connections = 1;
+	const std::string idle = picks(group, 3);
+	displayResult("fewest connections",
+				  idle.size() == 3 && idle[0] == idle[1] && idle[1] == idle[2]);
+
+	UpstreamGroup weighted;
+	makeGroup(weighted, "least_conn\n"
+						"server 127.0.0.1:8001 weight=3\n"
+						"server 127.0.0.1:8002\n");
+	weighted.select("", none)->connections = 2;
+	weighted.select("", none)->connections = 1;
+	displayResult("connections per weight", picks(weighted, 2) == "11");
+}
+
+static void testHash() {
+	displayTitle("UPSTREAM HASH");
+	UpstreamGroup group;
+	makeGroup(group, "hash $request_uri\n"
+					 "server 127.0.0.1:8001\n"
+					 "server 127.0.0.1:8002\n"
+					 "server 127.0.0.1:8003 weight=2\n");
+	std::vector<UpstreamGroup::Peer*> tried;
+	std::string owners;
+	for (int i = 0; i < HASH_KEYS; ++i) {
+		owners += pick(group, "/key" + toString(i));
+	}
+	bool stable = true;
+	for (int i = 0; i < HASH_KEYS && stable; ++i) {
+		stable = pick(group, "/key" + toString(i)) == owners[i];
+	}
+	displayResult("same key same peer", stable);
+	const long heavy = std::count(owners.begin(), owners.end(), '3');
+	displayResult("keys follow weights",
+				  heavy > HASH_KEYS * 4 / 10 && heavy < HASH_KEYS * 6 / 10 &&
+					  std::count(owners.begin(), owners.end(), '1') > HASH_KEYS / 10);
+	tried.push_back(group.select("/key0", tried));
+	bool kept = true;
+	bool moved = true;
+	for (int i = 0; i < HASH_KEYS; ++i) {
+		const char owner = pick(group, "/key" + toString(i), tried);
+		if (owners[i] == owners[0]) {
+			moved = moved && owner != owners[0] && owner != '-';
+		} else {
+			kept = kept && owner == owners[i];
+		}
+	}
+	displayResult("other keys keep their peer", kept);
+	displayResult("keys of a skipped peer move", moved);
+	UpstreamGroup::Peer* any = group.select("", tried);
+	displayResult("empty key falls back", any != NULL && any != tried[0]);
+}
+
+static void testFailures() {
+	displayTitle("UPSTREAM FAILURES");
+	UpstreamGroup group;
+	makeGroup(group, "server 127.0.0.1:8001 max_fails=2 fail_timeout=100ms\n"
+					 "server 127.0.0.1:8002 max_fails=0\n");
+	std::vector<UpstreamGroup::Peer*> none;
+	UpstreamGroup::Peer* first = group.select("", none);
+	group.select("", none);
+	UpstreamGroup::markFailed(first);
+	displayResult("below max_fails", picks(group, 2) == "12");
+	UpstreamGroup::markFailed(first);
+	displayResult("skipped at max_fails", picks(group, 4) == "2222");
+	usleep(150000);
+	displayResult("back after fail_timeout", picks(group, 4).find('1') != std::string::npos);
+	UpstreamGroup::markFailed(first);
+	UpstreamGroup::markSucceeded(first);
+	UpstreamGroup::markFailed(first);
+	displayResult("success resets fails", picks(group, 4).find('1') != std::string::npos);
+	std::vector<UpstreamGroup::Peer*> tried(1, first);
+	UpstreamGroup::Peer* second = group.select("", tried);
+	for (int i = 0; i < 5; ++i) {
+		UpstreamGroup::markFailed(second);
+	}
+	displayResult("max_fails=0 never skips", picks(group, 4).find('2') != std::string::npos);
+	tried.push_back(second);
+	displayResult("all peers tried", group.select("", tried) == NULL);
+}
+
+void testUpstreamGroup() {
+	testRoundRobin();
+	testLeastConnections();
+	testHash();
+	testFailures();
+}
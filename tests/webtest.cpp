@@ -1,11 +1,15 @@
 #include "webtest.hpp"
 
 bool run = true;
+bool reopenLogs = false;
+bool upgradeBinary = false;
+bool drainConnections = false;
 int epollFd = -1;
 std::set<pid_t> pids;
 const std::map<StatusCode, std::string> STATUS_MESSAGES;
 const std::map<std::string, std::string> MIME_TYPES;
 const std::set<std::string> CGI_NO_TRANSMISSION;
+Metrics metrics;
 
 int status = EXIT_SUCCESS;
 
@@ -23,6 +27,14 @@ void displayResult(const std::string& testName, bool result) {
 
 int main() {
 	testParseConfig();
+	testHpack();
+	testMultipart();
+	testClientLimiter();
+	testScan();
+	testUpstreamGroup();
+	testCgiCache();
+	testProxyCache();
+	testRange();
 	testServer();
 	testLocation();
 	testFinalUri();
@@ -2,6 +2,8 @@
 
 #include "../includes/webserv.hpp"
 
+#include <poll.h>
+
 #define RESET "\033[0m"
 #define BOLDBLUE "\033[1m\033[34m"
 #define RED "\033[31m"
@@ -18,3 +20,11 @@ void testParseConfig();
 void testServer();
 void testLocation();
 void testFinalUri();
+void testHpack();
+void testMultipart();
+void testClientLimiter();
+void testScan();
+void testUpstreamGroup();
+void testCgiCache();
+void testProxyCache();
+void testRange();